@@ -0,0 +1,275 @@
+#include "structure/bptree.hpp"
+#include "structure/hashtable.hpp"
+#include "algo/crc64.hpp"
+#include "common.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <malloc.h>
+
+using namespace structure;
+
+/*
+ * Heap accounting to report memory per key, B+ tree arenas are mapped
+ * directly and added from tree stats.
+ */
+static std::atomic<size_t> heap_bytes{0};
+
+void* operator new(size_t size) {
+  void* ptr = malloc(size ? size : 1);
+  if (!ptr)
+    throw std::bad_alloc();
+  heap_bytes += malloc_usable_size(ptr);
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+  if (ptr)
+    heap_bytes -= malloc_usable_size(ptr);
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  operator delete(ptr);
+}
+
+static uint64_t mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+template <typename K>
+K make_key(uint64_t n);
+
+template <>
+uint64_t make_key<uint64_t>(uint64_t n) {
+  return n;
+}
+
+template <>
+std::string make_key<std::string>(uint64_t n) {
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "https://example.com/users/%020llu/profile", (unsigned long long) n);
+  return buffer;
+}
+
+template <typename K>
+const char* key_name();
+
+template <>
+const char* key_name<uint64_t>() {
+  return "u64";
+}
+
+template <>
+const char* key_name<std::string>() {
+  return "string";
+}
+
+template <typename K, uint8_t b_factor>
+struct TreeAdapter {
+  static constexpr bool ordered = true;
+  bptree::BPTree<K, uint64_t, b_factor> container;
+
+  static std::string name() {
+    return "bptree/" + std::to_string(b_factor);
+  }
+
+  void insert(const K& key, uint64_t value) {
+    container.insert(key, value);
+  }
+
+  uint64_t find(const K& key) {
+    return container.get(key);
+  }
+
+  uint64_t scan(const K& from, const K& to) {
+    uint64_t sum = 0;
+    container.scan(from, to, [&sum](const K&, uint64_t value) {
+      sum += value;
+    });
+    return sum;
+  }
+
+  void erase(const K& key) {
+    container.erase(key);
+  }
+
+  size_t mapped() const {
+    return container.stats().bytes;
+  }
+};
+
+template <typename K>
+struct MapAdapter {
+  static constexpr bool ordered = true;
+  std::map<K, uint64_t> container;
+
+  static std::string name() {
+    return "std::map";
+  }
+
+  void insert(const K& key, uint64_t value) {
+    container[key] = value;
+  }
+
+  uint64_t find(const K& key) {
+    return container.at(key);
+  }
+
+  uint64_t scan(const K& from, const K& to) {
+    uint64_t sum = 0;
+    for (auto it = container.lower_bound(from); it != container.end() && it->first < to; ++it)
+      sum += it->second;
+    return sum;
+  }
+
+  void erase(const K& key) {
+    container.erase(key);
+  }
+
+  size_t mapped() const {
+    return 0;
+  }
+};
+
+template <typename K>
+struct HashAdapter {
+  static constexpr bool ordered = false;
+  hashtable::HashTable<K, uint64_t, algo::hash::crc64> container;
+
+  static std::string name() {
+    return "hashtable";
+  }
+
+  void insert(const K& key, uint64_t value) {
+    container[key] = value;
+  }
+
+  uint64_t find(const K& key) {
+    return container.at(key);
+  }
+
+  uint64_t scan(const K&, const K&) {
+    return 0;
+  }
+
+  void erase(const K& key) {
+    container.erase(key);
+  }
+
+  size_t mapped() const {
+    return 0;
+  }
+};
+
+static void report(const std::string& name, const char* key, size_t size, const char* op,
+                   size_t ops, uint64_t ns, bench::Latencies& latencies, double per_key) {
+  printf("%-12s %-7s %9zu %-12s %10.3f %8lu %8lu %10.1f\n", name.c_str(), key, size, op,
+         ns ? ops * 1e3 / ns : 0.0,
+         (unsigned long) latencies.percentile(50), (unsigned long) latencies.percentile(99), per_key);
+  latencies.clear();
+}
+
+template <typename Adapter, typename Op>
+uint64_t measure(Adapter& adapter, size_t ops, bench::Latencies& latencies, Op op) {
+  bench::Timer total;
+  for (size_t i = 0; i < ops; i++) {
+    bench::Timer timer;
+    op(adapter, i);
+    latencies.add(timer.elapsed());
+  }
+  return total.elapsed();
+}
+
+template <typename Adapter, typename K>
+void run(size_t size) {
+  const auto name = Adapter::name();
+  const auto key = key_name<K>();
+  bench::Latencies latencies;
+  latencies.reserve(size);
+
+  std::vector<K> keys;
+  keys.reserve(size);
+  for (size_t i = 0; i < size; i++)
+    keys.push_back(make_key<K>(i));
+  std::vector<size_t> order(size);
+  for (size_t i = 0; i < size; i++)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), [](size_t a, size_t b) {
+    return mix(a) < mix(b);
+  });
+
+  size_t before = heap_bytes;
+  {
+    auto adapter = std::make_unique<Adapter>();
+    auto ns = measure(*adapter, size, latencies, [&keys](Adapter& a, size_t i) {
+      a.insert(keys[i], i);
+    });
+    const double per_key = double(heap_bytes - before + adapter->mapped()) / size;
+    report(name, key, size, "insert-seq", size, ns, latencies, per_key);
+  }
+
+  before = heap_bytes;
+  auto adapter = std::make_unique<Adapter>();
+  auto ns = measure(*adapter, size, latencies, [&keys, &order](Adapter& a, size_t i) {
+    a.insert(keys[order[i]], order[i]);
+  });
+  const double per_key = double(heap_bytes - before + adapter->mapped()) / size;
+  report(name, key, size, "insert-rand", size, ns, latencies, per_key);
+
+  uint64_t checksum = 0;
+  ns = measure(*adapter, size, latencies, [&](Adapter& a, size_t i) {
+    checksum += a.find(keys[order[(i * 7) % size]]);
+  });
+  report(name, key, size, "lookup", size, ns, latencies, per_key);
+
+  if constexpr (Adapter::ordered) {
+    constexpr size_t range = 100;
+    const size_t scans = std::min<size_t>(size / 10, 10000);
+    ns = measure(*adapter, scans, latencies, [&](Adapter& a, size_t i) {
+      const size_t from = mix(i) % (size - range);
+      checksum += a.scan(keys[from], keys[from + range]);
+    });
+    report(name, key, size, "scan-100", scans * range, ns, latencies, per_key);
+  }
+
+  ns = measure(*adapter, size, latencies, [&keys, &order, size](Adapter& a, size_t i) {
+    a.erase(keys[order[size - 1 - i]]);
+  });
+  report(name, key, size, "erase", size, ns, latencies, per_key);
+  bench::keep(checksum);
+}
+
+template <typename K>
+void run_all(size_t size) {
+  run<TreeAdapter<K, 8>, K>(size);
+  run<TreeAdapter<K, 32>, K>(size);
+  run<TreeAdapter<K, 128>, K>(size);
+  run<MapAdapter<K>, K>(size);
+  run<HashAdapter<K>, K>(size);
+}
+
+/**
+ * B+ tree against std::map and HashTable
+
+   Reports throughput in millions of operations per second (keys per
+   second for scans), per-operation latency percentiles in nanoseconds
+   and memory per key measured after inserts.
+
+   Usage: bptree_bench [max size]
+ */
+int main(int argc, char** argv) {
+  const size_t max_size = bench::arg(argc, argv, 1, 1000000);
+  printf("%-12s %-7s %9s %-12s %10s %8s %8s %10s\n", "container", "key", "size", "operation",
+         "Mops/s", "p50 ns", "p99 ns", "bytes/key");
+  for (size_t size = 10000; size <= max_size; size *= 10) {
+    run_all<uint64_t>(size);
+    run_all<std::string>(size);
+  }
+  return 0;
+}
@@ -0,0 +1,61 @@
+#include "structure/bptree.hpp"
+#include "common.hpp"
+
+#include <cinttypes>
+#include <random>
+
+using namespace structure::bptree;
+
+/**
+ * Steady state insert/erase churn
+
+   Tree is filled with \c keys entries, then every round erases \c rate
+   random live keys and inserts as many new ones, so the number of keys
+   stays the same. Memory taken by nodes should stay flat over rounds.
+
+   Usage: bptree_churn_bench [keys] [rounds] [rate]
+ */
+template <uint8_t b_factor>
+void churn(Underflow underflow, size_t keys, size_t rounds, size_t rate) {
+  BPTree<uint64_t, uint64_t, b_factor> tree{underflow};
+  std::mt19937_64 gen{42};
+  std::vector<uint64_t> live;
+  live.reserve(keys);
+  for (size_t i = 0; i < keys; i++) {
+    const auto key = gen();
+    tree.insert(key, i);
+    live.push_back(key);
+  }
+
+  const char* mode = underflow == Underflow::Eager ? "eager" : "lazy";
+  printf("%-6s %4u %6s %10s %10s %10s %8s %12s %12s %10s\n", "mode", b_factor, "round", "keys",
+         "leaves", "layers", "pooled", "node bytes", "rss bytes", "ns/op");
+  for (size_t round = 0; round <= rounds; round++) {
+    bench::Timer timer;
+    for (size_t i = 0; i < rate; i++) {
+      const size_t victim = gen() % live.size();
+      tree.erase(live[victim]);
+      live[victim] = gen();
+      tree.insert(live[victim], i);
+    }
+    if (underflow == Underflow::Lazy)
+      tree.compact();
+    const auto elapsed = timer.elapsed();
+    const auto stats = tree.stats();
+    printf("%-6s %4u %6zu %10zu %10zu %10zu %8zu %12zu %12zu %10.1f\n", mode, b_factor, round,
+           tree.size(), stats.leaves, stats.layers, stats.pooled, stats.bytes,
+           bench::rss_bytes(), double(elapsed) / (2 * rate));
+  }
+}
+
+int main(int argc, char** argv) {
+  const size_t keys = bench::arg(argc, argv, 1, 1000000);
+  const size_t rounds = bench::arg(argc, argv, 2, 10);
+  const size_t rate = bench::arg(argc, argv, 3, keys / 4);
+
+  churn<32>(Underflow::Eager, keys, rounds, rate);
+  churn<32>(Underflow::Lazy, keys, rounds, rate);
+  churn<128>(Underflow::Eager, keys, rounds, rate);
+  churn<128>(Underflow::Lazy, keys, rounds, rate);
+  return 0;
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <unistd.h>
+
+namespace bench {
+
+  /** Resident set size of current process in bytes */
+  inline size_t rss_bytes() {
+    size_t pages = 0, resident = 0;
+    if (FILE* statm = fopen("/proc/self/statm", "r")) {
+      if (fscanf(statm, "%zu %zu", &pages, &resident) != 2)
+        resident = 0;
+      fclose(statm);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+  }
+
+  /** Numeric command line argument \c index or \c fallback */
+  inline size_t arg(int argc, char** argv, int index, size_t fallback) {
+    return index < argc ? std::strtoull(argv[index], nullptr, 10) : fallback;
+  }
+
+  /** Value of command line option \c --name=value or \c fallback */
+  inline std::string option(int argc, char** argv, const std::string& name, const std::string& fallback) {
+    const std::string prefix = "--" + name + "=";
+    for (int i = 1; i < argc; i++)
+      if (std::string(argv[i]).compare(0, prefix.size(), prefix) == 0)
+        return argv[i] + prefix.size();
+    return fallback;
+  }
+
+  class Timer {
+    using clock = std::chrono::steady_clock;
+    clock::time_point _start = clock::now();
+
+  public:
+    /** Nanoseconds since construction or last \c reset */
+    uint64_t elapsed() const {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - _start).count();
+    }
+
+    void reset() {
+      _start = clock::now();
+    }
+  };
+
+  /** Collects per-operation latencies to report percentiles */
+  class Latencies {
+    std::vector<uint32_t> _samples;
+
+  public:
+    void reserve(size_t count) {
+      _samples.reserve(count);
+    }
+
+    void add(uint64_t ns) {
+      _samples.push_back(ns > UINT32_MAX ? UINT32_MAX : ns);
+    }
+
+    /** Percentile \c p in [0, 100], reorders samples */
+    uint64_t percentile(double p) {
+      if (_samples.empty())
+        return 0;
+      const size_t index = std::min(_samples.size() - 1, size_t(p / 100 * _samples.size()));
+      std::nth_element(_samples.begin(), _samples.begin() + index, _samples.end());
+      return _samples[index];
+    }
+
+    size_t size() const {
+      return _samples.size();
+    }
+
+    void clear() {
+      _samples.clear();
+    }
+  };
+
+  /** Prevents compiler from optimizing away \c value */
+  template <typename T>
+  inline void keep(const T& value) {
+    asm volatile ("" : : "r,m" (value) : "memory");
+  }
+}
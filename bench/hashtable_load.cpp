@@ -0,0 +1,56 @@
+#include "structure/hashtable.hpp"
+#include "algo/crc64.hpp"
+#include "common.hpp"
+
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace structure::hashtable;
+
+using table_t = HashTable<std::string, uint64_t, algo::hash::crc64>;
+
+static void report(const char* name, size_t workers, size_t size, uint64_t ns, const table_t& table) {
+  printf("%-12s %8zu %10zu %10.1f %12.1f %12zu\n", name, workers, size, ns / 1e6, size * 1e3 / ns,
+         table.node_bytes());
+}
+
+/**
+ * Loading HashTable sequentially and with bulk_load
+
+   Loads \c size string keys with \c operator[] and then with bulk_load
+   and rebuild on pools of 1 up to \c threads workers. Reports time in
+   milliseconds, throughput in million pairs per second and node memory.
+
+   Usage: hashtable_load_bench [size] [threads]
+ */
+int main(int argc, char** argv) {
+  const size_t size = bench::arg(argc, argv, 1, 4000000);
+  const size_t threads = bench::arg(argc, argv, 2, std::thread::hardware_concurrency());
+
+  std::vector<std::pair<std::string, uint64_t> > pairs;
+  pairs.reserve(size);
+  for (size_t i = 0; i < size; i++)
+    pairs.emplace_back("key" + std::to_string(i * 2654435761u % size), i);
+
+  printf("%-12s %8s %10s %10s %12s %12s\n", "method", "workers", "size", "ms", "Mpairs/s", "node bytes");
+  {
+    bench::Timer timer;
+    table_t table;
+    for (const auto& [key, value] : pairs)
+      table[key] = value;
+    report("sequential", 1, size, timer.elapsed(), table);
+  }
+  for (size_t count = 1; count <= threads; count *= 2) {
+    tools::ThreadPool workers(count);
+    bench::Timer timer;
+    table_t table;
+    table.bulk_load(workers, pairs);
+    report("bulk_load", count, size, timer.elapsed(), table);
+    timer.reset();
+    table.rebuild(workers);
+    report("rebuild", count, size, timer.elapsed(), table);
+  }
+  return 0;
+}
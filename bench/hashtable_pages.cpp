@@ -0,0 +1,97 @@
+#include "structure/hashtable.hpp"
+#include "algo/crc64.hpp"
+#include "common.hpp"
+
+#include <random>
+#include <system_error>
+
+using namespace structure::hashtable;
+using namespace tools::memory;
+
+static const char* pages_name(Pages pages) {
+  switch (pages) {
+  case Pages::Normal:
+    return "normal";
+  case Pages::Transparent:
+    return "thp";
+  case Pages::Huge:
+    return "huge-2m";
+  default:
+    return "huge-1g";
+  }
+}
+
+static const char* numa_name(Numa numa) {
+  switch (numa) {
+  case Numa::Local:
+    return "local";
+  case Numa::Bind:
+    return "bind";
+  default:
+    return "interleave";
+  }
+}
+
+static void run(const Policy& policy, size_t size, size_t lookups) {
+  bench::Timer timer;
+  HashTable<uint64_t, uint64_t, algo::hash::crc64> table(policy, size);
+  for (uint64_t i = 0; i < size; i++)
+    table.try_emplace(i, i);
+  const auto build = timer.elapsed();
+
+  std::mt19937_64 gen{42};
+  std::vector<uint64_t> keys(lookups);
+  for (auto& key : keys)
+    key = gen() % size;
+
+  // Warm up caches and fault in anything not prefaulted
+  uint64_t checksum = 0;
+  for (size_t i = 0; i < lookups / 10; i++)
+    checksum += *table.find(keys[i]);
+
+  bench::Latencies latencies;
+  latencies.reserve(lookups);
+  timer.reset();
+  for (auto key : keys) {
+    bench::Timer lookup;
+    checksum += *table.find(key);
+    latencies.add(lookup.elapsed());
+  }
+  const auto total = timer.elapsed();
+  bench::keep(checksum);
+
+  printf("%-8s %-10s %-8s %10zu %10.1f %10.1f %8lu %8lu %12zu\n", pages_name(policy.pages),
+         numa_name(policy.numa), policy.prefault ? "yes" : "no", size, build / 1e6,
+         double(total) / lookups, (unsigned long) latencies.percentile(50),
+         (unsigned long) latencies.percentile(99), bench::rss_bytes());
+}
+
+/**
+ * Random lookup latency of HashTable under memory policies
+
+   Every policy builds a table of \c size integer keys and looks up
+   \c lookups random keys. Reports build time in milliseconds, mean and
+   percentile lookup latency in nanoseconds and resident memory. Explicit
+   huge pages need reserved pages (vm.nr_hugepages), without them the
+   table falls back to transparent huge pages. NUMA placement refused by
+   the system is reported and skipped.
+
+   Usage: hashtable_pages_bench [size] [lookups]
+ */
+int main(int argc, char** argv) {
+  const size_t size = bench::arg(argc, argv, 1, 4000000);
+  const size_t lookups = bench::arg(argc, argv, 2, 2000000);
+  printf("%-8s %-10s %-8s %10s %10s %10s %8s %8s %12s\n", "pages", "numa", "prefault", "size",
+         "build ms", "mean ns", "p50 ns", "p99 ns", "rss bytes");
+  for (auto pages : {Pages::Normal, Pages::Transparent, Pages::Huge, Pages::Gigantic})
+    for (bool prefault : {false, true})
+      run({pages, Numa::Local, 0, prefault}, size, lookups);
+  for (auto numa : {Numa::Bind, Numa::Interleave}) {
+    try {
+      run({Pages::Transparent, numa, 0, true}, size, lookups);
+    } catch (const std::system_error& e) {
+      printf("%-8s %-10s skipped: %s\n", pages_name(Pages::Transparent), numa_name(numa), e.what());
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,515 @@
+#include "structure/bptree.hpp"
+#include "structure/hashtable.hpp"
+#include "algo/crc32.hpp"
+#include "algo/crc64.hpp"
+#include "algo/hash_append.hpp"
+#include "tools/metrics.hpp"
+#include "common.hpp"
+
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using tools::metrics::Histogram;
+
+namespace {
+  enum Op {
+    Read,
+    Update,
+    Insert,
+    Scan,
+    ReadModifyWrite,
+    ops
+  };
+
+  const char* const op_names[ops] = {"read", "update", "insert", "scan", "read_modify_write"};
+
+  /** Operation mix of a YCSB core workload */
+  struct Workload {
+    double mix[ops];
+    const char* distribution;
+  };
+
+  Workload workload(const std::string& name) {
+    if (name == "a")
+      return {{0.5, 0.5, 0, 0, 0}, "zipfian"};
+    if (name == "b")
+      return {{0.95, 0.05, 0, 0, 0}, "zipfian"};
+    if (name == "c")
+      return {{1, 0, 0, 0, 0}, "zipfian"};
+    if (name == "d")
+      return {{0.95, 0, 0.05, 0, 0}, "latest"};
+    if (name == "e")
+      return {{0, 0, 0.05, 0.95, 0}, "zipfian"};
+    if (name == "f")
+      return {{0.5, 0, 0, 0, 0.5}, "zipfian"};
+    throw std::invalid_argument("Unknown workload " + name + ", expected a to f");
+  }
+
+  uint64_t fnv64(uint64_t value) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (int i = 0; i < 8; i++) {
+      hash ^= value & 0xFF;
+      hash *= 0x100000001b3ull;
+      value >>= 8;
+    }
+    return hash;
+  }
+
+  /** Zipfian ranks in [0, items), 0 the most popular, as generated by YCSB (Gray et al.) */
+  class Zipfian {
+    uint64_t _items;
+    double _theta;
+    double _zetan;
+    double _alpha;
+    double _eta;
+
+    static double zeta(uint64_t items, double theta) {
+      double sum = 0;
+      for (uint64_t i = 1; i <= items; i++)
+        sum += 1 / std::pow(double(i), theta);
+      return sum;
+    }
+
+  public:
+    explicit Zipfian(uint64_t items, double theta = 0.99) :
+      _items(std::max<uint64_t>(items, 2)), _theta(theta), _zetan(zeta(_items, theta)), _alpha(1 / (1 - theta)),
+      _eta((1 - std::pow(2.0 / _items, 1 - theta)) / (1 - zeta(2, theta) / _zetan)) {}
+
+    template <typename Random>
+    uint64_t next(Random& random) const {
+      const double u = std::uniform_real_distribution<double>(0, 1)(random);
+      const double uz = u * _zetan;
+      if (uz < 1)
+        return 0;
+      if (uz < 1 + std::pow(0.5, _theta))
+        return 1;
+      return std::min<uint64_t>(_items - 1, _items * std::pow(_eta * u - _eta + 1, _alpha));
+    }
+  };
+
+  /** Picks keys among \c count inserted so far */
+  class Keys {
+    enum { Uniform, Zipfian, Latest } _kind;
+    ::Zipfian _zipfian;
+
+  public:
+    Keys(const std::string& kind, uint64_t records) :
+      _zipfian(records) {
+      if (kind == "uniform")
+        _kind = Uniform;
+      else if (kind == "zipfian")
+        _kind = Zipfian;
+      else if (kind == "latest")
+        _kind = Latest;
+      else
+        throw std::invalid_argument("Unknown distribution " + kind);
+    }
+
+    template <typename Random>
+    uint64_t next(Random& random, uint64_t count) const {
+      switch (_kind) {
+      case Uniform:
+        return random() % count;
+      case Zipfian:
+        // Scrambled so that popular keys are spread over the key space
+        return fnv64(_zipfian.next(random)) % count;
+      case Latest:
+      default:
+        return count - 1 - _zipfian.next(random) % count;
+      }
+    }
+  };
+
+  /** Sizes given as "N", "fixed:N", "uniform:MIN:MAX" or "zipfian:MIN:MAX" with MIN the most popular */
+  class Sizes {
+    enum { Fixed, Uniform, Zipfian } _kind = Fixed;
+    size_t _min;
+    size_t _max;
+    std::unique_ptr<::Zipfian> _zipfian;
+
+  public:
+    explicit Sizes(const std::string& spec) {
+      const auto first = spec.find(':');
+      const auto kind = spec.substr(0, first);
+      const auto second = first == std::string::npos ? first : spec.find(':', first + 1);
+      try {
+        if (first == std::string::npos) {
+          _min = _max = std::stoull(spec);
+        } else if (kind == "fixed") {
+          _min = _max = std::stoull(spec.substr(first + 1));
+        } else if ((kind == "uniform" || kind == "zipfian") && second != std::string::npos) {
+          _kind = kind == "uniform" ? Uniform : Zipfian;
+          _min = std::stoull(spec.substr(first + 1, second - first - 1));
+          _max = std::stoull(spec.substr(second + 1));
+        } else {
+          throw std::invalid_argument(spec);
+        }
+      } catch (const std::logic_error&) {
+        throw std::invalid_argument("Bad size distribution " + spec);
+      }
+      if (_min > _max)
+        throw std::invalid_argument("Bad size distribution " + spec);
+      if (_kind == Zipfian)
+        _zipfian = std::make_unique<::Zipfian>(_max - _min + 1);
+    }
+
+    template <typename Random>
+    size_t next(Random& random) const {
+      switch (_kind) {
+      case Uniform:
+        return _min + random() % (_max - _min + 1);
+      case Zipfian:
+        return std::min(_max, _min + _zipfian->next(random));
+      case Fixed:
+      default:
+        return _min;
+      }
+    }
+
+    size_t max() const {
+      return _max;
+    }
+  };
+
+  /** Store under test, safe to use from many threads */
+  class Store {
+  public:
+    virtual ~Store() = default;
+    virtual bool read(const std::string& key, std::string& value) const = 0;
+    virtual void write(const std::string& key, std::string value) = 0;
+    /** Reads up to \c count entries from \c key on, returns how many there were */
+    virtual size_t scan(const std::string& key, size_t count) const = 0;
+  };
+
+  /** HashTables sharded by key, each behind its own lock */
+  template <auto hash>
+  class HashStore : public Store {
+    struct Shard {
+      mutable std::shared_mutex lock;
+      structure::hashtable::HashTable<std::string, std::string, hash> table;
+    };
+
+    std::vector<std::unique_ptr<Shard> > _shards;
+
+    Shard& shard(const std::string& key) const {
+      return *_shards[std::hash<std::string>()(key) % _shards.size()];
+    }
+
+  public:
+    explicit HashStore(size_t shards) {
+      for (size_t i = 0; i < std::max<size_t>(shards, 1); i++)
+        _shards.push_back(std::make_unique<Shard>());
+    }
+
+    bool read(const std::string& key, std::string& value) const override {
+      auto& found = shard(key);
+      std::shared_lock<std::shared_mutex> guard(found.lock);
+      if (const auto result = found.table.find(key)) {
+        value = *result;
+        return true;
+      }
+      return false;
+    }
+
+    void write(const std::string& key, std::string value) override {
+      auto& found = shard(key);
+      std::unique_lock<std::shared_mutex> guard(found.lock);
+      found.table.insert_or_assign(key, std::move(value));
+    }
+
+    size_t scan(const std::string&, size_t) const override {
+      throw std::logic_error("HashTable can't scan, use --store=bptree");
+    }
+  };
+
+  class TreeStore : public Store {
+    mutable std::shared_mutex _lock;
+    structure::bptree::BPTree<std::string, std::string, 32> _tree;
+
+  public:
+    bool read(const std::string& key, std::string& value) const override {
+      std::shared_lock<std::shared_mutex> guard(_lock);
+      try {
+        value = _tree.get(key);
+        return true;
+      } catch (const std::out_of_range&) {
+        return false;
+      }
+    }
+
+    void write(const std::string& key, std::string value) override {
+      std::unique_lock<std::shared_mutex> guard(_lock);
+      _tree.insert(key, std::move(value));
+    }
+
+    size_t scan(const std::string& key, size_t count) const override {
+      std::shared_lock<std::shared_mutex> guard(_lock);
+      size_t seen = 0;
+      _tree.scan_n(key, count, [&seen](const std::string&, const std::string& value) {
+        bench::keep(value.size());
+        seen++;
+      });
+      return seen;
+    }
+  };
+
+  std::unique_ptr<Store> store(const std::string& kind, const std::string& hash, size_t shards) {
+    if (kind == "bptree")
+      return std::make_unique<TreeStore>();
+    if (kind != "hashtable")
+      throw std::invalid_argument("Unknown store " + kind + ", expected hashtable or bptree");
+    if (hash == "crc64")
+      return std::make_unique<HashStore<algo::hash::crc64> >(shards);
+    if (hash == "crc32")
+      return std::make_unique<HashStore<algo::hash::crc32> >(shards);
+    if (hash == "highway")
+      return std::make_unique<HashStore<algo::hash::highway64> >(shards);
+    throw std::invalid_argument("Unknown hash " + hash + ", expected crc64, crc32 or highway");
+  }
+
+  struct Config {
+    Workload mix;
+    std::string distribution;
+    uint64_t records;
+    uint64_t operations;                /**< Per thread, 0 runs for \c duration */
+    double duration;
+    size_t threads;
+    uint64_t interval;                  /**< Milliseconds between timeline samples */
+    uint64_t seed;
+  };
+
+  /** Key \c id padded to a length drawn for it, so a key always has the same length */
+  std::string key_name(uint64_t id, const Sizes& sizes) {
+    std::string key = "user" + std::to_string(fnv64(id));
+    std::mt19937_64 random(id);
+    const size_t size = sizes.next(random);
+    if (key.size() < size)
+      key.resize(size, 'x');
+    return key;
+  }
+
+  struct Sample {
+    double seconds;
+    uint64_t operations;
+    size_t rss;
+  };
+
+  /** Per-thread results, written by its thread only */
+  struct Worker {
+    Histogram latencies[ops];
+    std::atomic<uint64_t> done{0};
+    uint64_t misses = 0;
+    uint64_t scanned = 0;
+  };
+
+  void print_histogram(const char* name, const Histogram& histogram, bool last) {
+    printf("      \"%s\": {\"count\": %lu, \"mean_ns\": %.1f, \"min_ns\": %lu, \"p50_ns\": %lu, \"p90_ns\": %lu, "
+           "\"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu}%s\n",
+           name, histogram.count(), histogram.mean(), histogram.min(), histogram.percentile(50),
+           histogram.percentile(90), histogram.percentile(99), histogram.percentile(99.9), histogram.max(),
+           last ? "" : ",");
+  }
+}
+
+/**
+ * YCSB core workloads against csdb structures in-process
+
+   Loads \c --records keys on \c --threads threads, then runs one of the
+   YCSB workloads a to f for \c --duration seconds or \c --operations per
+   thread. Everything is seeded from \c --seed, so the operation stream of
+   each thread is the same from run to run. Reports throughput, latency
+   percentiles per operation and a timeline of throughput and RSS every
+   \c --interval milliseconds as JSON on stdout.
+
+   Usage: ycsb_bench [--workload=a] [--store=hashtable|bptree] [--hash=crc64|crc32|highway]
+                     [--shards=64] [--distribution=uniform|zipfian|latest] [--records=100000]
+                     [--operations=0] [--duration=10] [--threads=N] [--key-size=24]
+                     [--value-size=100] [--scan-length=uniform:1:100] [--interval=1000] [--seed=1]
+
+   Sizes take "N", "fixed:N", "uniform:MIN:MAX" or "zipfian:MIN:MAX".
+   Hash stores are sharded behind reader-writer locks, the tree is behind
+   a single one, so hash functions and structures are compared as used.
+ */
+int main(int argc, char** argv) {
+  const auto option = [argc, argv](const std::string& name, const std::string& fallback) {
+    return bench::option(argc, argv, name, fallback);
+  };
+
+  try {
+    Config config;
+    const auto workload_name = option("workload", "a");
+    config.mix = workload(workload_name);
+    config.distribution = option("distribution", config.mix.distribution);
+    config.records = std::max<uint64_t>(std::stoull(option("records", "100000")), 1);
+    config.operations = std::stoull(option("operations", "0"));
+    config.duration = std::stod(option("duration", "10"));
+    config.threads = std::max<size_t>(std::stoull(option("threads", std::to_string(std::thread::hardware_concurrency()))), 1);
+    config.interval = std::max<uint64_t>(std::stoull(option("interval", "1000")), 1);
+    config.seed = std::stoull(option("seed", "1"));
+    const Sizes key_sizes(option("key-size", "24"));
+    const Sizes value_sizes(option("value-size", "100"));
+    const Sizes scan_lengths(option("scan-length", "uniform:1:100"));
+    const Keys keys(config.distribution, config.records);
+    const auto store_name = option("store", "hashtable");
+    const auto hash_name = option("hash", "crc64");
+    auto table = store(store_name, hash_name, std::stoull(option("shards", "64")));
+    if (config.mix.mix[Scan] > 0 && store_name != "bptree")
+      throw std::invalid_argument("Workload e scans, use --store=bptree");
+
+    const std::string pattern(value_sizes.max(), 'v');
+    const size_t rss_before = bench::rss_bytes();
+
+    // Load phase
+    bench::Timer timer;
+    {
+      std::vector<std::thread> loaders;
+      for (size_t t = 0; t < config.threads; t++)
+        loaders.emplace_back([&, t] {
+          std::mt19937_64 random(config.seed ^ fnv64(t));
+          for (uint64_t id = t; id < config.records; id += config.threads)
+            table->write(key_name(id, key_sizes), pattern.substr(0, value_sizes.next(random)));
+        });
+      for (auto& loader : loaders)
+        loader.join();
+    }
+    const double load_seconds = timer.elapsed() / 1e9;
+    const size_t rss_loaded = bench::rss_bytes();
+
+    // Run phase
+    std::atomic<uint64_t> inserted{config.records};
+    std::atomic<bool> stop{false};
+    std::vector<std::unique_ptr<Worker> > workers;
+    for (size_t t = 0; t < config.threads; t++)
+      workers.push_back(std::make_unique<Worker>());
+
+    const auto run = [&](size_t t) {
+      auto& worker = *workers[t];
+      std::mt19937_64 random(config.seed + 1 + t);
+      std::uniform_real_distribution<double> choice(0, 1);
+      std::string value;
+      for (uint64_t done = 0; !config.operations || done < config.operations; done++) {
+        if (!config.operations && !(done & 63) && stop.load(std::memory_order_relaxed))
+          break;
+        double pick = choice(random);
+        int op = 0;
+        while (op < ops - 1 && pick >= config.mix.mix[op])
+          pick -= config.mix.mix[op++];
+
+        bench::Timer latency;
+        if (op == Insert) {
+          const uint64_t id = inserted.fetch_add(1, std::memory_order_relaxed);
+          table->write(key_name(id, key_sizes), pattern.substr(0, value_sizes.next(random)));
+        } else {
+          const auto key = key_name(keys.next(random, inserted.load(std::memory_order_relaxed)), key_sizes);
+          switch (op) {
+          case Read:
+            worker.misses += !table->read(key, value);
+            break;
+          case Update:
+            table->write(key, pattern.substr(0, value_sizes.next(random)));
+            break;
+          case Scan:
+            worker.scanned += table->scan(key, scan_lengths.next(random));
+            break;
+          case ReadModifyWrite:
+            worker.misses += !table->read(key, value);
+            table->write(key, pattern.substr(0, value_sizes.next(random)));
+            break;
+          }
+        }
+        worker.latencies[op].record(latency.elapsed());
+        worker.done.store(done + 1, std::memory_order_relaxed);
+      }
+    };
+
+    std::vector<Sample> timeline;
+    timer.reset();
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < config.threads; t++)
+      threads.emplace_back(run, t);
+
+    // Timeline is sampled here until workers are done
+    std::atomic<size_t> running{config.threads};
+    std::thread finisher([&] {
+      for (auto& thread : threads)
+        thread.join();
+      running.store(0, std::memory_order_release);
+    });
+    const auto total = [&workers] {
+      uint64_t sum = 0;
+      for (const auto& worker : workers)
+        sum += worker->done.load(std::memory_order_relaxed);
+      return sum;
+    };
+    for (uint64_t tick = 1; running.load(std::memory_order_acquire); ) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(std::min<uint64_t>(config.interval, 10)));
+      const double seconds = timer.elapsed() / 1e9;
+      if (!config.operations && seconds >= config.duration)
+        stop.store(true, std::memory_order_relaxed);
+      if (seconds * 1000 >= tick * config.interval) {
+        timeline.push_back({seconds, total(), bench::rss_bytes()});
+        tick = seconds * 1000 / config.interval + 1;
+      }
+    }
+    finisher.join();
+    const double run_seconds = timer.elapsed() / 1e9;
+    timeline.push_back({run_seconds, total(), bench::rss_bytes()});
+
+    Histogram all, by_op[ops];
+    uint64_t misses = 0, scanned = 0;
+    for (const auto& worker : workers) {
+      for (int op = 0; op < ops; op++) {
+        by_op[op].merge(worker->latencies[op]);
+        all.merge(worker->latencies[op]);
+      }
+      misses += worker->misses;
+      scanned += worker->scanned;
+    }
+
+    printf("{\n");
+    printf("  \"config\": {\"workload\": \"%s\", \"store\": \"%s\", \"hash\": \"%s\", \"distribution\": \"%s\", "
+           "\"records\": %lu, \"threads\": %zu, \"operations\": %lu, \"duration_s\": %.3f, \"seed\": %lu},\n",
+           workload_name.c_str(), store_name.c_str(), hash_name.c_str(), config.distribution.c_str(), config.records,
+           config.threads, config.operations, config.duration, config.seed);
+    printf("  \"load\": {\"records\": %lu, \"seconds\": %.3f, \"ops_per_s\": %.1f, \"rss_bytes\": %zu, "
+           "\"rss_growth_bytes\": %zu},\n",
+           config.records, load_seconds, config.records / load_seconds, rss_loaded,
+           rss_loaded > rss_before ? rss_loaded - rss_before : 0);
+    printf("  \"run\": {\"operations\": %lu, \"seconds\": %.3f, \"ops_per_s\": %.1f, \"misses\": %lu, "
+           "\"scanned\": %lu, \"rss_bytes\": %zu,\n",
+           all.count(), run_seconds, all.count() / run_seconds, misses, scanned, timeline.back().rss);
+    printf("    \"latency\": {\n");
+    print_histogram("all", all, false);
+    int last = ops - 1;
+    while (last > 0 && !by_op[last].count())
+      last--;
+    for (int op = 0; op <= last; op++)
+      if (by_op[op].count())
+        print_histogram(op_names[op], by_op[op], op == last);
+    printf("    }\n  },\n");
+    printf("  \"timeline\": [\n");
+    for (size_t i = 0; i < timeline.size(); i++) {
+      const uint64_t previous_ops = i ? timeline[i - 1].operations : 0;
+      const double previous_seconds = i ? timeline[i - 1].seconds : 0;
+      const double span = timeline[i].seconds - previous_seconds;
+      printf("    {\"seconds\": %.3f, \"operations\": %lu, \"ops_per_s\": %.1f, \"rss_bytes\": %zu}%s\n",
+             timeline[i].seconds, timeline[i].operations,
+             span > 0 ? (timeline[i].operations - previous_ops) / span : 0.0, timeline[i].rss,
+             i + 1 < timeline.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+  } catch (const std::exception& e) {
+    fprintf(stderr, "ycsb_bench: %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
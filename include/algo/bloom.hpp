@@ -0,0 +1,161 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <cstring>
+#include <numbers>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "algo/highwayhash.hpp"
+#include "tools/serialize.hpp"
+
+namespace algo {
+  namespace bloom {
+    constexpr size_t words = 16;
+    constexpr uint32_t max_probes = 16;
+
+    /** One cache line of filter */
+    struct alignas(64) Block {
+      uint32_t words[bloom::words];
+    };
+
+    static_assert(sizeof(Block) == 64, "Block should be exactly one cache line");
+
+    /** Key hash used by filters, HighwayHash64 with a fixed key */
+    inline uint64_t hash(std::string_view key) {
+      static const uint64_t seed[4] = {0x6373646220626c6full, 0x6f6d2066696c7465ull,
+                                       0x722062792068776full, 0x6861736820736565ull};
+      return HighwayHash64(reinterpret_cast<const uint8_t *>(key.data()), key.size(), seed);
+    }
+
+    /**
+     * Cache-line blocked Bloom filter
+
+       Upper half of the key hash selects a 512 bit block, bits inside it
+       come from double hashing of the lower half: probe \c i takes
+       \c g = h1 + i * h2 and sets bit \c (g >> 23) & 31 of word \c g >> 28.
+       So a lookup touches a single cache line, and with AVX2 all probes
+       are checked at once with two gathers.
+
+       Number of probes follows from bits per key.
+     */
+    class Blocked {
+      std::vector<Block> _blocks;
+      uint32_t _probes = 1;
+
+      Block& block(uint64_t hash) {
+        return _blocks[(uint64_t(uint32_t(hash >> 32)) * _blocks.size()) >> 32];
+      }
+
+      const Block& block(uint64_t hash) const {
+        return const_cast<Blocked&>(*this).block(hash);
+      }
+
+      static uint32_t step(uint64_t hash) {
+        return uint32_t((hash * 0x9e3779b97f4a7c15ull) >> 32) | 1;
+      }
+
+    public:
+      /** Empty filter, contains nothing */
+      Blocked() :
+        _blocks(1) {}
+
+      /** Filter sized for \c keys keys with \c bits_per_key bits each */
+      Blocked(size_t keys, double bits_per_key) :
+        _blocks(std::max<size_t>(1, std::ceil(keys * bits_per_key / (sizeof(Block) * 8)))),
+        _probes(std::clamp<uint32_t>(std::lround(bits_per_key * std::numbers::ln2), 1, max_probes)) {}
+
+      void add(uint64_t hash) {
+        auto& target = block(hash);
+        const uint32_t first = hash, step = Blocked::step(hash);
+        for (uint32_t i = 0; i < _probes; i++) {
+          const uint32_t g = first + i * step;
+          target.words[g >> 28] |= uint32_t(1) << ((g >> 23) & 31);
+        }
+      }
+
+      /** False means the key was definitely never added */
+      bool contains(uint64_t hash) const {
+        const auto& target = block(hash);
+#if defined(__AVX2__)
+        const __m256i first = _mm256_set1_epi32(uint32_t(hash));
+        const __m256i step = _mm256_set1_epi32(Blocked::step(hash));
+        const __m256i probes = _mm256_set1_epi32(_probes);
+        const auto present = [&](__m256i index) {
+          const __m256i g = _mm256_add_epi32(first, _mm256_mullo_epi32(index, step));
+          const __m256i bits = _mm256_and_si256(_mm256_srli_epi32(g, 23), _mm256_set1_epi32(31));
+          const __m256i mask = _mm256_and_si256(_mm256_sllv_epi32(_mm256_set1_epi32(1), bits),
+                                                _mm256_cmpgt_epi32(probes, index));
+          const __m256i data = _mm256_i32gather_epi32(reinterpret_cast<const int *>(target.words),
+                                                      _mm256_srli_epi32(g, 28), 4);
+          const __m256i missing = _mm256_andnot_si256(data, mask);
+          return _mm256_testz_si256(missing, missing);
+        };
+        return present(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)) &&
+               (_probes <= 8 || present(_mm256_setr_epi32(8, 9, 10, 11, 12, 13, 14, 15)));
+#else
+        const uint32_t first = hash, step = Blocked::step(hash);
+        for (uint32_t i = 0; i < _probes; i++) {
+          const uint32_t g = first + i * step;
+          if (!(target.words[g >> 28] & (uint32_t(1) << ((g >> 23) & 31))))
+            return false;
+        }
+        return true;
+#endif
+      }
+
+      void add(std::string_view key) {
+        add(bloom::hash(key));
+      }
+
+      bool contains(std::string_view key) const {
+        return contains(bloom::hash(key));
+      }
+
+      uint32_t probes() const {
+        return _probes;
+      }
+
+      size_t bytes() const {
+        return _blocks.size() * sizeof(Block);
+      }
+
+      friend struct tools::serialize::Codec<Blocked>;
+    };
+  }
+}
+
+namespace tools {
+  namespace serialize {
+    /** Probe count, block count and raw blocks, words are in host byte order */
+    template <>
+    struct Codec<algo::bloom::Blocked> {
+      static void write(std::string& out, const algo::bloom::Blocked& filter) {
+        Codec<uint32_t>::write(out, filter._probes);
+        Codec<uint64_t>::write(out, filter._blocks.size());
+        out.append(reinterpret_cast<const char *>(filter._blocks.data()), filter.bytes());
+      }
+
+      static bool read(std::string_view& in, algo::bloom::Blocked& filter) {
+        uint32_t probes;
+        uint64_t blocks;
+        if (!Codec<uint32_t>::read(in, probes) || !Codec<uint64_t>::read(in, blocks) ||
+            probes == 0 || probes > algo::bloom::max_probes || blocks == 0 ||
+            in.size() / sizeof(algo::bloom::Block) < blocks)
+          return false;
+        filter._probes = probes;
+        filter._blocks.resize(blocks);
+        std::memcpy(filter._blocks.data(), in.data(), filter.bytes());
+        in.remove_prefix(filter.bytes());
+        return true;
+      }
+    };
+  }
+}
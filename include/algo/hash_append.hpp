@@ -0,0 +1,262 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <array>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "algo/crc32.hpp"
+#include "algo/crc64.hpp"
+#include "algo/highwayhash.hpp"
+#include "tools/tmpl.hpp"
+
+/**
+ * Streaming hashing of composite keys
+
+   A key type takes part by providing, next to it for ADL,
+
+     template <typename H>
+     void hash_append(H& h, const Key& key) {
+       algo::hash::hash_append(h, key.name, key.id);
+     }
+
+   which feeds every field into the hasher \c h, a callable taking
+   \c (const void* data, size_t size). Hashers keep the running state of a
+   hash function, so fields of any size are hashed where they are with
+   nothing concatenated. Strings and containers append their length
+   after the content, so ("ab", "c") and ("a", "bc") hash differently.
+ */
+namespace algo {
+  namespace hash {
+
+    /** HighwayHash key with \c init as its first word */
+    struct HighwayKey {
+      uint64_t words[4];
+
+      explicit HighwayKey(uint64_t init) :
+        words{init, 0x6373646220686173ull, 0x6820617070656e64ull, 0x2073747265616d73ull} {}
+    };
+
+    /** HighwayHash64 seeded by \c init, usable as HashTable hash */
+    inline uint64_t highway64(const uint8_t* data, size_t size, uint64_t init = 0) {
+      return HighwayHash64(data, size, HighwayKey(init).words);
+    }
+
+    /**
+     * Running state of \c hash, same as one call on all appended bytes
+
+       Hash functions without a specialization are chained: every append
+       is hashed with the previous result as \c init.
+     */
+    template <auto hash, class Ret = decltype(tmpl::ret(hash))>
+    class Stream {
+      Ret _state;
+
+    public:
+      using result_type = Ret;
+
+      explicit Stream(Ret init = 0) :
+        _state(init) {}
+
+      void operator()(const void* data, size_t size) {
+        _state = hash(static_cast<const uint8_t *>(data), size, _state);
+      }
+
+      Ret finish() const {
+        return _state;
+      }
+    };
+
+    /** crc32 inverts its result, so the state is kept inverted back */
+    template <>
+    class Stream<crc32, uint32_t> {
+      uint32_t _state;
+
+    public:
+      using result_type = uint32_t;
+
+      explicit Stream(uint32_t init = 0) :
+        _state(init) {}
+
+      void operator()(const void* data, size_t size) {
+        _state = ~crc32(static_cast<const uint8_t *>(data), size, _state);
+      }
+
+      uint32_t finish() const {
+        return ~_state;
+      }
+    };
+
+    template <>
+    class Stream<highway64, uint64_t> {
+      HighwayHashCat _state;
+
+    public:
+      using result_type = uint64_t;
+
+      explicit Stream(uint64_t init = 0) {
+        HighwayHashCatStart(HighwayKey(init).words, &_state);
+      }
+
+      void operator()(const void* data, size_t size) {
+        HighwayHashCatAppend(static_cast<const uint8_t *>(data), size, &_state);
+      }
+
+      uint64_t finish() const {
+        return HighwayHashCatFinish64(&_state);
+      }
+    };
+
+    /** Types hashed as their object representation */
+    template <typename T>
+    constexpr bool is_contiguous_v = std::is_integral_v<T> || std::is_enum_v<T> ||
+                                     (std::is_pointer_v<T> && !std::is_convertible_v<T, const char *>);
+
+    template <typename H, typename T, std::enable_if_t<is_contiguous_v<T> > * = nullptr>
+    void hash_append(H& h, const T& value) {
+      h(&value, sizeof(value));
+    }
+
+    /** Zeroes compare equal and have to hash the same */
+    template <typename H, typename T, std::enable_if_t<std::is_floating_point_v<T> > * = nullptr>
+    void hash_append(H& h, T value) {
+      if (value == 0)
+        value = 0;
+      h(&value, sizeof(value));
+    }
+
+    template <typename H>
+    void hash_append(H& h, std::string_view value) {
+      h(value.data(), value.size());
+      const size_t size = value.size();
+      h(&size, sizeof(size));
+    }
+
+    template <typename H>
+    void hash_append(H& h, const std::string& value) {
+      hash_append(h, std::string_view(value));
+    }
+
+    template <typename H>
+    void hash_append(H& h, const char* value) {
+      hash_append(h, std::string_view(value));
+    }
+
+    /* Composite overloads are declared first so that they find each other */
+    template <typename H, typename A, typename B>
+    void hash_append(H& h, const std::pair<A, B>& value);
+    template <typename H, typename... T>
+    void hash_append(H& h, const std::tuple<T...>& value);
+    template <typename H, typename T, size_t N>
+    void hash_append(H& h, const std::array<T, N>& value);
+    template <typename H, typename T, typename A>
+    void hash_append(H& h, const std::vector<T, A>& value);
+    template <typename H, typename T>
+    void hash_append(H& h, const std::optional<T>& value);
+
+    /** Appends every argument in turn */
+    template <typename H, typename T, typename U, typename... Rest>
+    void hash_append(H& h, const T& first, const U& second, const Rest&... rest) {
+      hash_append(h, first);
+      hash_append(h, second);
+      (hash_append(h, rest), ...);
+    }
+
+    template <typename H, typename A, typename B>
+    void hash_append(H& h, const std::pair<A, B>& value) {
+      hash_append(h, value.first, value.second);
+    }
+
+    template <typename H, typename... T>
+    void hash_append(H& h, const std::tuple<T...>& value) {
+      std::apply([&h](const auto&... fields) {
+        (hash_append(h, fields), ...);
+      }, value);
+    }
+
+    template <typename H, typename T, size_t N>
+    void hash_append(H& h, const std::array<T, N>& value) {
+      if constexpr (is_contiguous_v<T>)
+        h(value.data(), sizeof(T) * N);
+      else
+        for (const auto& item : value)
+          hash_append(h, item);
+    }
+
+    template <typename H, typename T, typename A>
+    void hash_append(H& h, const std::vector<T, A>& value) {
+      if constexpr (is_contiguous_v<T>)
+        h(value.data(), sizeof(T) * value.size());
+      else
+        for (const auto& item : value)
+          hash_append(h, item);
+      const size_t size = value.size();
+      h(&size, sizeof(size));
+    }
+
+    template <typename H, typename T>
+    void hash_append(H& h, const std::optional<T>& value) {
+      if (value)
+        hash_append(h, *value);
+      const bool present = value.has_value();
+      h(&present, sizeof(present));
+    }
+
+    namespace detail {
+      struct Probe {
+        void operator()(const void*, size_t) {}
+      };
+
+      template <typename T, typename = void>
+      struct has_hash_append : std::false_type {};
+
+      template <typename T>
+      struct has_hash_append<T, std::void_t<decltype(hash_append(std::declval<Probe&>(), std::declval<const T&>()))> >
+        : std::true_type {};
+    }
+
+    /**
+     * Keys hashed field by field through \c hash_append
+
+       Scalars, strings and C strings are left out: tables hash them as
+       one contiguous block, which keeps their hashes as they were.
+     */
+    template <typename T>
+    constexpr bool is_streamed_v = detail::has_hash_append<T>::value && !std::is_arithmetic_v<T> &&
+                                   !std::is_enum_v<T> && !std::is_pointer_v<T> &&
+                                   !std::is_same_v<T, std::string> && !std::is_convertible_v<T, const char *>;
+
+    /** Hash of \c value by \c hash run over all its fields */
+    template <auto hash, typename T, class Ret = decltype(tmpl::ret(hash))>
+    Ret streamed(const T& value, Ret init = 0) {
+      Stream<hash> stream(init);
+      hash_append(stream, value);
+      return stream.finish();
+    }
+
+    /**
+     * Hash of \c key as tables compute it
+
+       Scalars are hashed as their bytes, strings and C strings as their
+       characters and composite keys field by field.
+     */
+    template <auto hash, typename T, class Ret = decltype(tmpl::ret(hash))>
+    Ret hash_value(const T& key, Ret init = 0) {
+      if constexpr (is_streamed_v<T>) {
+        return streamed<hash>(key, init);
+      } else if constexpr (std::is_same_v<T, std::string>) {
+        return hash(reinterpret_cast<const uint8_t *>(key.data()), key.size(), init);
+      } else if constexpr (std::is_convertible_v<T, const char *>) {
+        return hash(reinterpret_cast<const uint8_t *>(static_cast<const char *>(key)), strlen(key), init);
+      } else {
+        return hash(reinterpret_cast<const uint8_t *>(&key), sizeof(key), init);
+      }
+    }
+  }
+}
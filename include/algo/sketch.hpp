@@ -0,0 +1,495 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "algo/hash_append.hpp"
+#include "tools/serialize.hpp"
+
+namespace algo {
+  namespace sketch {
+
+    /** 64-bit key hash sketches are fed with, \c highway64 unless given another */
+    template <typename key_t, auto hash_fn = algo::hash::highway64>
+    uint64_t hash_key(const key_t& key) {
+      if constexpr (std::is_same_v<key_t, std::string_view>)
+        return hash_fn(reinterpret_cast<const uint8_t *>(key.data()), key.size(), 0);
+      else
+        return algo::hash::hash_value<hash_fn>(key, uint64_t(0));
+    }
+
+    inline uint64_t mix(uint64_t x) {
+      x ^= x >> 33;
+      x *= 0xff51afd7ed558ccdull;
+      x ^= x >> 33;
+      x *= 0xc4ceb9fe1a85ec53ull;
+      return x ^ (x >> 33);
+    }
+
+    /**
+     * HyperLogLog distinct counter
+
+       Top \c precision bits of a hash select one of 2^precision registers,
+       which keeps the longest run of leading zeros seen in the remaining
+       bits. Standard error is 1.04 / sqrt(2^precision), 0.8% at default 14.
+
+       Small sketches are sparse: a sorted list of (register, rank) pairs
+       that gives exact linear counting and takes memory proportional to
+       the keys seen. It turns dense once the list would outgrow the
+       register array. Sketches of equal precision merge into the union of
+       their keys; dense registers are merged with SIMD max.
+
+       Not thread-safe, keep one per thread or shard and merge them.
+     */
+    class HyperLogLog {
+    public:
+      static constexpr uint8_t min_precision = 4;
+      static constexpr uint8_t max_precision = 18;
+
+    private:
+      uint8_t _precision;
+      bool _dense = false;
+      std::vector<uint8_t> _registers;
+      std::vector<uint32_t> _sparse;          /**< register << 8 | rank, sorted by register */
+
+      size_t registers() const {
+        return size_t(1) << _precision;
+      }
+
+      uint32_t index(uint64_t hash) const {
+        return hash >> (64 - _precision);
+      }
+
+      uint8_t rank(uint64_t hash) const {
+        const uint64_t rest = hash << _precision;
+        return rest ? __builtin_clzll(rest) + 1 : 64 - _precision + 1;
+      }
+
+      void set_sparse(uint32_t reg, uint8_t value) {
+        const uint32_t entry = reg << 8 | value;
+        auto found = std::lower_bound(_sparse.begin(), _sparse.end(), reg << 8);
+        if (found != _sparse.end() && (*found >> 8) == reg) {
+          if ((*found & 0xff) < value)
+            *found = entry;
+          return;
+        }
+        _sparse.insert(found, entry);
+        if (_sparse.size() * sizeof(uint32_t) >= registers())
+          densify();
+      }
+
+      void densify() {
+        _registers.assign(registers(), 0);
+        for (auto entry : _sparse)
+          _registers[entry >> 8] = entry & 0xff;
+        _sparse.clear();
+        _sparse.shrink_to_fit();
+        _dense = true;
+      }
+
+      static void max_registers(uint8_t* target, const uint8_t* source, size_t size) {
+        size_t i = 0;
+#if defined(__AVX2__)
+        for (; i + 32 <= size; i += 32) {
+          const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(target + i));
+          const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(source + i));
+          _mm256_storeu_si256(reinterpret_cast<__m256i *>(target + i), _mm256_max_epu8(a, b));
+        }
+#elif defined(__SSE2__)
+        for (; i + 16 <= size; i += 16) {
+          const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(target + i));
+          const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + i));
+          _mm_storeu_si128(reinterpret_cast<__m128i *>(target + i), _mm_max_epu8(a, b));
+        }
+#endif
+        for (; i < size; i++)
+          target[i] = std::max(target[i], source[i]);
+      }
+
+      friend struct tools::serialize::Codec<HyperLogLog>;
+
+    public:
+      explicit HyperLogLog(uint8_t precision = 14) :
+        _precision(precision) {
+        if (precision < min_precision || precision > max_precision)
+          throw std::invalid_argument("HyperLogLog precision should be in 4..18");
+      }
+
+      void add(uint64_t hash) {
+        const auto reg = index(hash);
+        const auto value = rank(hash);
+        if (_dense)
+          _registers[reg] = std::max(_registers[reg], value);
+        else
+          set_sparse(reg, value);
+      }
+
+      void add(std::string_view key) {
+        add(hash_key(key));
+      }
+
+      /** Estimated number of distinct hashes added */
+      double estimate() const {
+        const double m = registers();
+        if (!_dense)
+          return m * std::log(m / (m - _sparse.size()));
+
+        double sum = 0;
+        size_t zeros = 0;
+        for (auto value : _registers) {
+          sum += std::ldexp(1.0, -value);
+          zeros += value == 0;
+        }
+        const double alpha = m == 16 ? 0.673 : m == 32 ? 0.697 : m == 64 ? 0.709 : 0.7213 / (1 + 1.079 / m);
+        const double raw = alpha * m * m / sum;
+        // Linear counting is more precise while many registers are empty
+        if (raw <= 2.5 * m && zeros)
+          return m * std::log(m / zeros);
+        return raw;
+      }
+
+      /** Adds keys of \c other, which must be of the same precision */
+      void merge(const HyperLogLog& other) {
+        if (other._precision != _precision)
+          throw std::invalid_argument("Can't merge HyperLogLog of different precision");
+        if (!other._dense) {
+          for (auto entry : other._sparse) {
+            if (_dense)
+              _registers[entry >> 8] = std::max<uint8_t>(_registers[entry >> 8], entry & 0xff);
+            else
+              set_sparse(entry >> 8, entry & 0xff);
+          }
+          return;
+        }
+        if (!_dense)
+          densify();
+        max_registers(_registers.data(), other._registers.data(), registers());
+      }
+
+      uint8_t precision() const {
+        return _precision;
+      }
+
+      bool dense() const {
+        return _dense;
+      }
+
+      size_t bytes() const {
+        return _dense ? _registers.size() : _sparse.size() * sizeof(uint32_t);
+      }
+    };
+
+    /**
+     * Count-Min frequency sketch
+
+       \c depth rows of \c width counters, a key adds to one counter per
+       row and its estimate is the smallest of them. Estimates never go
+       below the true count and exceed it by at most e / width of the total
+       with probability 1 - exp(-depth). Rows are indexed by double hashing
+       of a single 64-bit hash. Sketches of equal shape merge by summing.
+     */
+    class CountMin {
+      uint32_t _width;
+      uint32_t _depth;
+      uint64_t _total = 0;
+      std::vector<uint64_t> _counters;
+
+      template <typename F>
+      void each(uint64_t hash, F&& fn) const {
+        const uint64_t step = mix(hash) | 1;
+        for (uint32_t row = 0; row < _depth; row++) {
+          const uint32_t g = (hash + row * step) >> 32;
+          fn(size_t(row) * _width + ((uint64_t(g) * _width) >> 32));
+        }
+      }
+
+      friend struct tools::serialize::Codec<CountMin>;
+
+    public:
+      CountMin(uint32_t width = 2048, uint32_t depth = 4) :
+        _width(width), _depth(depth), _counters(size_t(width) * depth, 0) {
+        if (!width || !depth)
+          throw std::invalid_argument("Count-Min sketch can't be empty");
+      }
+
+      /** Sketch overestimating by at most \c error of the total with probability 1 - \c failure */
+      static CountMin with_error(double error, double failure) {
+        return CountMin(uint32_t(std::max(1.0, std::ceil(std::exp(1.0) / error))),
+                        uint32_t(std::max(1.0, std::ceil(std::log(1 / failure)))));
+      }
+
+      void add(uint64_t hash, uint64_t count = 1) {
+        each(hash, [this, count](size_t counter) {
+          _counters[counter] += count;
+        });
+        _total += count;
+      }
+
+      uint64_t estimate(uint64_t hash) const {
+        uint64_t result = UINT64_MAX;
+        each(hash, [this, &result](size_t counter) {
+          result = std::min(result, _counters[counter]);
+        });
+        return result;
+      }
+
+      void add(std::string_view key, uint64_t count = 1) {
+        add(hash_key(key), count);
+      }
+
+      uint64_t estimate(std::string_view key) const {
+        return estimate(hash_key(key));
+      }
+
+      /** Adds counts of \c other, which must be of the same shape */
+      void merge(const CountMin& other) {
+        if (other._width != _width || other._depth != _depth)
+          throw std::invalid_argument("Can't merge Count-Min sketches of different shape");
+        for (size_t i = 0; i < _counters.size(); i++)
+          _counters[i] += other._counters[i];
+        _total += other._total;
+      }
+
+      /** Sum of all counts added */
+      uint64_t total() const {
+        return _total;
+      }
+
+      uint32_t width() const {
+        return _width;
+      }
+
+      uint32_t depth() const {
+        return _depth;
+      }
+
+      size_t bytes() const {
+        return _counters.size() * sizeof(uint64_t);
+      }
+    };
+
+    /**
+     * Most frequent keys by a Count-Min sketch
+
+       Keeps \c k keys with the highest estimates seen so far. A key is
+       compared to the tracked ones only when its estimate reaches the
+       smallest of them, so keys of the cold tail cost one sketch update.
+       Merging merges sketches and re-ranks the union of tracked keys.
+     */
+    template <typename key_t, auto hash_fn = algo::hash::highway64>
+    class TopK {
+    public:
+      struct Entry {
+        key_t key;
+        uint64_t count;
+      };
+
+    private:
+      size_t _k;
+      CountMin _counts;
+      std::vector<Entry> _top;
+      uint64_t _floor = 0;                   /**< Smallest tracked count once \c k keys are tracked */
+
+      void track(const key_t& key, uint64_t count) {
+        for (auto& entry : _top)
+          if (entry.key == key) {
+            entry.count = count;
+            update_floor();
+            return;
+          }
+        if (_top.size() < _k) {
+          _top.push_back({key, count});
+        } else {
+          auto smallest = std::min_element(_top.begin(), _top.end(), [](const Entry& a, const Entry& b) {
+            return a.count < b.count;
+          });
+          if (smallest->count >= count)
+            return;
+          *smallest = {key, count};
+        }
+        update_floor();
+      }
+
+      void update_floor() {
+        _floor = 0;
+        if (_top.size() == _k)
+          _floor = std::min_element(_top.begin(), _top.end(), [](const Entry& a, const Entry& b) {
+            return a.count < b.count;
+          })->count;
+      }
+
+      template <typename, typename>
+      friend struct tools::serialize::Codec;
+
+    public:
+      explicit TopK(size_t k = 16, CountMin counts = CountMin()) :
+        _k(k), _counts(std::move(counts)) {
+        if (!k)
+          throw std::invalid_argument("TopK needs room for a key");
+      }
+
+      void add(const key_t& key, uint64_t count = 1) {
+        add_hashed(key, hash_key<key_t, hash_fn>(key), count);
+      }
+
+      /** Same as \c add for a key already hashed by \c hash_key */
+      void add_hashed(const key_t& key, uint64_t hashed, uint64_t count = 1) {
+        _counts.add(hashed, count);
+        const auto estimate = _counts.estimate(hashed);
+        if (estimate >= _floor)
+          track(key, estimate);
+      }
+
+      uint64_t estimate(const key_t& key) const {
+        return _counts.estimate(hash_key<key_t, hash_fn>(key));
+      }
+
+      /** Tracked keys by estimated count, most frequent first */
+      std::vector<Entry> top() const {
+        auto result = _top;
+        std::sort(result.begin(), result.end(), [](const Entry& a, const Entry& b) {
+          return a.count > b.count;
+        });
+        return result;
+      }
+
+      void merge(const TopK& other) {
+        _counts.merge(other._counts);
+        auto candidates = std::move(_top);
+        candidates.insert(candidates.end(), other._top.begin(), other._top.end());
+        _top.clear();
+        _floor = 0;
+        for (const auto& entry : candidates)
+          track(entry.key, estimate(entry.key));
+      }
+
+      const CountMin& counts() const {
+        return _counts;
+      }
+
+      size_t k() const {
+        return _k;
+      }
+    };
+  }
+}
+
+namespace tools {
+  namespace serialize {
+    /** Precision, representation and registers or sparse entries */
+    template <>
+    struct Codec<algo::sketch::HyperLogLog> {
+      static void write(std::string& out, const algo::sketch::HyperLogLog& sketch) {
+        Codec<uint8_t>::write(out, sketch._precision);
+        Codec<uint8_t>::write(out, sketch._dense);
+        if (sketch._dense) {
+          out.append(reinterpret_cast<const char *>(sketch._registers.data()), sketch._registers.size());
+        } else {
+          Codec<uint32_t>::write(out, sketch._sparse.size());
+          out.append(reinterpret_cast<const char *>(sketch._sparse.data()), sketch.bytes());
+        }
+      }
+
+      static bool read(std::string_view& in, algo::sketch::HyperLogLog& sketch) {
+        uint8_t precision, dense;
+        if (!Codec<uint8_t>::read(in, precision) || !Codec<uint8_t>::read(in, dense) ||
+            precision < algo::sketch::HyperLogLog::min_precision ||
+            precision > algo::sketch::HyperLogLog::max_precision)
+          return false;
+        algo::sketch::HyperLogLog result(precision);
+        if (dense) {
+          if (in.size() < result.registers())
+            return false;
+          result._registers.assign(in.begin(), in.begin() + result.registers());
+          result._dense = true;
+          in.remove_prefix(result.registers());
+        } else {
+          uint32_t size;
+          if (!Codec<uint32_t>::read(in, size) || in.size() / sizeof(uint32_t) < size)
+            return false;
+          result._sparse.resize(size);
+          std::memcpy(result._sparse.data(), in.data(), size * sizeof(uint32_t));
+          in.remove_prefix(size * sizeof(uint32_t));
+          if (!std::is_sorted(result._sparse.begin(), result._sparse.end()))
+            return false;
+          for (auto entry : result._sparse)
+            if ((entry >> 8) >= result.registers())
+              return false;
+        }
+        sketch = std::move(result);
+        return true;
+      }
+    };
+
+    /** Shape, total and counters, all in host byte order */
+    template <>
+    struct Codec<algo::sketch::CountMin> {
+      static void write(std::string& out, const algo::sketch::CountMin& sketch) {
+        Codec<uint32_t>::write(out, sketch._width);
+        Codec<uint32_t>::write(out, sketch._depth);
+        Codec<uint64_t>::write(out, sketch._total);
+        out.append(reinterpret_cast<const char *>(sketch._counters.data()), sketch.bytes());
+      }
+
+      static bool read(std::string_view& in, algo::sketch::CountMin& sketch) {
+        uint32_t width, depth;
+        uint64_t total;
+        if (!Codec<uint32_t>::read(in, width) || !Codec<uint32_t>::read(in, depth) ||
+            !Codec<uint64_t>::read(in, total) || !width || !depth ||
+            in.size() / sizeof(uint64_t) / width < depth)
+          return false;
+        algo::sketch::CountMin result(width, depth);
+        result._total = total;
+        std::memcpy(result._counters.data(), in.data(), result.bytes());
+        in.remove_prefix(result.bytes());
+        sketch = std::move(result);
+        return true;
+      }
+    };
+
+    /** Sketch, k and tracked keys with their counts */
+    template <typename key_t, auto hash_fn>
+    struct Codec<algo::sketch::TopK<key_t, hash_fn> > {
+      static void write(std::string& out, const algo::sketch::TopK<key_t, hash_fn>& top) {
+        Codec<algo::sketch::CountMin>::write(out, top._counts);
+        Codec<uint64_t>::write(out, top._k);
+        Codec<uint64_t>::write(out, top._top.size());
+        for (const auto& entry : top._top) {
+          Codec<key_t>::write(out, entry.key);
+          Codec<uint64_t>::write(out, entry.count);
+        }
+      }
+
+      static bool read(std::string_view& in, algo::sketch::TopK<key_t, hash_fn>& top) {
+        algo::sketch::CountMin counts;
+        uint64_t k, size;
+        if (!Codec<algo::sketch::CountMin>::read(in, counts) || !Codec<uint64_t>::read(in, k) ||
+            !Codec<uint64_t>::read(in, size) || !k || size > k)
+          return false;
+        algo::sketch::TopK<key_t, hash_fn> result(k, std::move(counts));
+        for (uint64_t i = 0; i < size; i++) {
+          typename algo::sketch::TopK<key_t, hash_fn>::Entry entry;
+          if (!Codec<key_t>::read(in, entry.key) || !Codec<uint64_t>::read(in, entry.count))
+            return false;
+          result._top.push_back(std::move(entry));
+        }
+        result.update_floor();
+        top = std::move(result);
+        return true;
+      }
+    };
+  }
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include <cstddef>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "storage/wal.hpp"
+#include "tools/memory.hpp"
+
+namespace csdb {
+
+  /** Sets up default logging, the library does nothing on load */
+  void init();
+
+  /** Hash function of in-memory and logged tables */
+  enum class Hash {
+    Crc64,
+    Crc32,
+    Highway
+  };
+
+  /** Where table contents live */
+  enum class Durability {
+    Memory,                 /**< HashTable only, lost on close */
+    Logged,                 /**< HashTable with every mutation in a write-ahead log, replayed on open */
+    Persistent              /**< LSM storage, contents larger than memory */
+  };
+
+  struct Options {
+    std::string dir;                        /**< Directory of logged and persistent tables */
+    Durability durability = Durability::Memory;
+    Hash hash = Hash::Crc64;
+    storage::wal::Sync sync = storage::wal::Sync::Group;
+    size_t expected = 0;                    /**< Entries per in-memory table mapped upfront */
+    tools::memory::Policy memory = {};      /**< Mapping of in-memory tables */
+    /**
+     * Memory for table contents in bytes, 0 is unlimited
+
+       Caps entries mapped upfront for in-memory tables and memtables of
+       persistent ones, split evenly between the preloaded tables.
+     */
+    size_t memory_budget = 0;
+    size_t threads = 0;                     /**< Workers opening tables in parallel, 0 for one per core */
+    std::vector<std::string> preload;       /**< Tables opened along with the database */
+  };
+
+  /** Table of string keys and values, see \c Database::table */
+  class Table {
+  public:
+    virtual ~Table() = default;
+
+    virtual std::optional<std::string> get(const std::string& key) const = 0;
+    virtual void put(const std::string& key, const std::string& value) = 0;
+    virtual void erase(const std::string& key) = 0;
+
+    /** Waits until writes are as durable as the table gets */
+    virtual void flush() = 0;
+  };
+
+  /**
+   * Named tables opened on first use
+
+     Nothing is set up until it is needed: a table is created or recovered
+     from disk when it is first asked for, and worker threads exist only
+     while tables are opened in parallel by \c warm. Tables listed in
+     \c Options::preload are warmed by the constructor. Logged and persistent
+     tables are safe to use from many threads, in-memory ones aren't.
+   */
+  class Database {
+    struct Slot {
+      std::once_flag opened;
+      std::unique_ptr<Table> table;
+      std::atomic<bool> ready{false};
+    };
+
+    Options _options;
+    mutable std::mutex _lock;
+    std::map<std::string, std::unique_ptr<Slot> > _slots;
+
+    Slot& slot(const std::string& name);
+    std::unique_ptr<Table> create(const std::string& name) const;
+
+  public:
+    /** Throws std::invalid_argument when options are inconsistent */
+    explicit Database(Options options = {});
+    ~Database();
+
+    Database(const Database&) = delete;
+    Database& operator=(const Database&) = delete;
+
+    /** Table \c name, opened or created on first call */
+    Table& table(const std::string& name);
+
+    /** Opens tables \c names not opened yet on \c Options::threads workers */
+    void warm(const std::vector<std::string>& names);
+
+    /** Whether table \c name is open */
+    bool opened(const std::string& name) const;
+
+    /** Flushes all open tables */
+    void flush();
+
+    const Options& options() const {
+      return _options;
+    }
+  };
+}
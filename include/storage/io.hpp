@@ -0,0 +1,417 @@
+#pragma once
+#include <cstdint>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace storage {
+  namespace io {
+
+    template <typename T>
+    class Task;
+
+    namespace detail {
+      /** Resumes whoever awaits the finished coroutine */
+      struct Final {
+        bool await_ready() noexcept {
+          return false;
+        }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+          if (auto continuation = handle.promise().continuation)
+            return continuation;
+          return std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+      };
+
+      struct PromiseBase {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+
+        std::suspend_always initial_suspend() noexcept {
+          return {};
+        }
+
+        Final final_suspend() noexcept {
+          return {};
+        }
+
+        void unhandled_exception() {
+          error = std::current_exception();
+        }
+      };
+
+      template <typename T>
+      struct Promise : PromiseBase {
+        std::optional<T> value;
+
+        void return_value(T result) {
+          value = std::move(result);
+        }
+
+        T result() {
+          if (error)
+            std::rethrow_exception(error);
+          return std::move(*value);
+        }
+      };
+
+      template <>
+      struct Promise<void> : PromiseBase {
+        void return_void() {}
+
+        void result() {
+          if (error)
+            std::rethrow_exception(error);
+        }
+      };
+    }
+
+    /**
+     * Lazily started coroutine producing \c T
+
+       Runs when awaited, or when given to \c Ring::run or \c Ring::spawn,
+       and resumes its awaiter right when it finishes. Exceptions are
+       rethrown to the awaiter.
+     */
+    template <typename T = void>
+    class Task {
+    public:
+      struct promise_type : detail::Promise<T> {
+        Task get_return_object() {
+          return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+      };
+
+    private:
+      std::coroutine_handle<promise_type> _handle;
+
+      explicit Task(std::coroutine_handle<promise_type> handle) :
+        _handle(handle) {}
+
+      friend class Ring;
+
+    public:
+      Task(Task&& other) noexcept :
+        _handle(std::exchange(other._handle, nullptr)) {}
+
+      Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+          if (_handle)
+            _handle.destroy();
+          _handle = std::exchange(other._handle, nullptr);
+        }
+        return *this;
+      }
+
+      Task(const Task&) = delete;
+      Task& operator=(const Task&) = delete;
+
+      ~Task() {
+        if (_handle)
+          _handle.destroy();
+      }
+
+      bool await_ready() const noexcept {
+        return false;
+      }
+
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        _handle.promise().continuation = awaiter;
+        return _handle;
+      }
+
+      T await_resume() {
+        return _handle.promise().result();
+      }
+    };
+
+    /** How I/O is performed */
+    enum class Backend {
+      Auto,                   /**< io_uring when the kernel allows it, Sync otherwise */
+      Uring,                  /**< io_uring or an exception */
+      Sync                    /**< Blocking calls made right when an operation is awaited */
+    };
+
+    struct Options {
+      unsigned entries = 256;               /**< Submission queue size, operations beyond it wait in line */
+      Backend backend = Backend::Auto;
+      unsigned buffers = 0;                 /**< Buffers registered with the kernel */
+      size_t buffer_size = 0;
+    };
+
+    class Ring;
+
+    /** Registered buffer leased from a \c Ring, goes back on destruction */
+    class Buffer {
+      Ring* _ring = nullptr;
+      int _index = -1;
+      char* _data = nullptr;
+      size_t _size = 0;
+
+      friend class Ring;
+
+      Buffer(Ring& ring, int index, char* data, size_t size) :
+        _ring(&ring), _index(index), _data(data), _size(size) {}
+
+    public:
+      Buffer(Buffer&& other) noexcept :
+        _ring(std::exchange(other._ring, nullptr)),
+        _index(other._index),
+        _data(other._data),
+        _size(other._size) {}
+
+      Buffer(const Buffer&) = delete;
+      Buffer& operator=(const Buffer&) = delete;
+      Buffer& operator=(Buffer&&) = delete;
+      ~Buffer();
+
+      char* data() const {
+        return _data;
+      }
+
+      size_t size() const {
+        return _size;
+      }
+
+      int index() const {
+        return _index;
+      }
+    };
+
+    /**
+     * Single-threaded event loop over io_uring
+
+       Operations are awaitables: awaiting one puts a request into the
+       submission queue and suspends the coroutine. Requests are handed to
+       the kernel in batches with one system call whenever the loop polls,
+       and completions resume their coroutines from the loop thread. So a
+       thread keeps as many operations in flight as it has coroutines
+       waiting, limited only by the completion queue. Results are those of
+       the corresponding system calls: byte counts or negative errno.
+
+       With the Sync backend (or Auto on kernels without io_uring) the same
+       awaitables run the blocking call at once and don't suspend.
+
+       Work finished by other threads resumes coroutines through \c defer,
+       which wakes the loop with an eventfd.
+     */
+    class Ring {
+    public:
+      /** Awaitable operation, see \c read, \c write and \c fsync */
+      class Op {
+        Ring* _ring;
+        uint8_t _opcode;
+        int _fd;
+        void* _addr;
+        uint32_t _len;
+        uint64_t _offset;
+        int _buffer;
+        uint32_t _flags;
+        int _result = 0;
+        std::coroutine_handle<> _handle;
+
+        friend class Ring;
+
+        Op(Ring& ring, uint8_t opcode, int fd, void* addr, uint32_t len, uint64_t offset, int buffer, uint32_t flags) :
+          _ring(&ring), _opcode(opcode), _fd(fd), _addr(addr), _len(len), _offset(offset), _buffer(buffer), _flags(flags) {}
+
+      public:
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> handle);
+
+        int await_resume() const {
+          return _result;
+        }
+      };
+
+      using done_fn = std::function<void(int)>;
+
+      /** Awaitable completed by whoever calls the function passed to its starter */
+      class Deferred {
+        Ring* _ring;
+        std::function<void(done_fn)> _start;
+        int _result = 0;
+
+        friend class Ring;
+
+        Deferred(Ring& ring, std::function<void(done_fn)> start) :
+          _ring(&ring), _start(std::move(start)) {}
+
+      public:
+        bool await_ready() const noexcept {
+          return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+          _start([this, handle](int result) {
+            _result = result;
+            _ring->post(handle);
+          });
+        }
+
+        int await_resume() const noexcept {
+          return _result;
+        }
+      };
+
+    private:
+      struct Detached {
+        struct promise_type {
+          Detached get_return_object() noexcept {
+            return {};
+          }
+
+          std::suspend_never initial_suspend() noexcept {
+            return {};
+          }
+
+          std::suspend_never final_suspend() noexcept {
+            return {};
+          }
+
+          void return_void() noexcept {}
+
+          void unhandled_exception() noexcept {
+            std::terminate();
+          }
+        };
+      };
+
+      Options _options;
+      int _fd = -1;
+      int _event = -1;                      /**< Eventfd posting wakes the loop with */
+      uint64_t _event_value = 0;
+
+      void* _sq_ring = nullptr;
+      size_t _sq_ring_size = 0;
+      void* _cq_ring = nullptr;
+      size_t _cq_ring_size = 0;
+      void* _sqes = nullptr;
+      size_t _sqes_size = 0;
+      unsigned* _sq_head = nullptr;
+      unsigned* _sq_tail = nullptr;
+      unsigned* _sq_array = nullptr;
+      unsigned _sq_mask = 0;
+      unsigned _sq_entries = 0;
+      unsigned* _cq_head = nullptr;
+      unsigned* _cq_tail = nullptr;
+      unsigned _cq_mask = 0;
+      unsigned _cq_entries = 0;
+      void* _cqes = nullptr;
+
+      unsigned _queued = 0;                 /**< Requests in the submission queue not yet submitted */
+      size_t _in_flight = 0;                /**< Requests taken by the kernel or queued */
+      std::deque<Op*> _waiting;             /**< Requests over the completion queue capacity */
+
+      char* _buffers = nullptr;
+      size_t _buffers_size = 0;
+      std::vector<int> _free_buffers;
+      bool _registered = false;
+
+      std::mutex _posted_lock;
+      std::vector<std::coroutine_handle<> > _posted;
+
+      size_t _spawned = 0;
+      std::exception_ptr _error;
+
+      bool setup();
+      void teardown();
+      void queue(Op* op);
+      void push(Op* op);
+      void arm_event();
+      void enter(unsigned submit, unsigned wait);
+      size_t reap();
+      size_t resume_posted();
+      static int perform(const Op& op);
+
+      static Detached detach(Ring& ring, Task<void> task);
+
+      friend class Buffer;
+
+    public:
+      explicit Ring(Options options = {});
+      ~Ring();
+
+      Ring(const Ring&) = delete;
+      Ring& operator=(const Ring&) = delete;
+
+      /** True when backed by io_uring, false for the synchronous fallback */
+      bool uring() const {
+        return _fd >= 0;
+      }
+
+      /** True when buffers are registered with the kernel and read or written without mapping */
+      bool registered() const {
+        return _registered;
+      }
+
+      /** Leases a registered buffer, none when all are taken */
+      std::optional<Buffer> buffer();
+
+      size_t buffer_size() const {
+        return _options.buffer_size;
+      }
+
+      Op read(int fd, void* data, uint32_t size, uint64_t offset);
+      /** Reads into \c buffer starting \c at bytes into it */
+      Op read(int fd, Buffer& buffer, uint32_t size, uint64_t offset, size_t at = 0);
+      Op write(int fd, const void* data, uint32_t size, uint64_t offset);
+      Op write(int fd, Buffer& buffer, uint32_t size, uint64_t offset);
+      Op fsync(int fd, bool datasync = false);
+
+      /**
+       * Suspends until work finished elsewhere
+
+         \c start gets a function to call with the result once the work is
+         done, from any thread or right away.
+       */
+      Deferred defer(std::function<void(done_fn)> start) {
+        return Deferred(*this, std::move(start));
+      }
+
+      /** Schedules \c handle to be resumed by the loop, safe from any thread */
+      void post(std::coroutine_handle<> handle);
+
+      /**
+       * Submits queued requests and resumes coroutines whose work is done
+
+         With \c wait blocks until at least one completes when nothing is
+         ready. Returns number of resumed coroutines.
+       */
+      size_t poll(bool wait);
+
+      /** Runs the loop until \c task finishes, returns its result */
+      template <typename T>
+      T run(Task<T> task) {
+        auto handle = task._handle;
+        handle.resume();
+        while (!handle.done())
+          poll(true);
+        return handle.promise().result();
+      }
+
+      /** Starts \c task without waiting for it, see \c drain */
+      void spawn(Task<void> task) {
+        _spawned++;
+        detach(*this, std::move(task));
+      }
+
+      /** Runs the loop until all spawned tasks finish, rethrows the first of their exceptions */
+      void drain();
+
+      /** Requests the kernel works on or holds in line */
+      size_t in_flight() const {
+        return _in_flight;
+      }
+    };
+  }
+}
@@ -0,0 +1,199 @@
+#pragma once
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <stdexcept>
+
+#include "structure/hashtable.hpp"
+#include "storage/wal.hpp"
+#include "tools/serialize.hpp"
+
+namespace storage {
+
+  /**
+   * HashTable with mutations recorded in a write-ahead log
+
+     Contents of the log are replayed into the table on construction.
+     Assignment through \c operator[] and \c erase are logged before they
+     are applied; with \c wal::Sync::Group they return once the record is
+     on disk. Mutations and \c get are safe to call from many threads:
+     records are queued and applied under the table lock and synced
+     outside of it, so concurrent writers share a sync.
+   */
+  template <typename key_t, typename value_t, auto hash>
+  class LoggedTable {
+    using table_t = structure::hashtable::HashTable<key_t, value_t, hash>;
+    using batch_t = structure::WriteBatch<key_t, value_t>;
+
+    table_t _table;
+    wal::Log _log;
+    mutable std::shared_mutex _lock;
+
+    static std::string encode(const key_t& key) {
+      std::string payload;
+      tools::serialize::write(payload, key);
+      return payload;
+    }
+
+    static std::string encode(const key_t& key, const value_t& value) {
+      auto payload = encode(key);
+      tools::serialize::write(payload, value);
+      return payload;
+    }
+
+    /** Batch record is op count followed by ops, each with its type and Set or Erase payload */
+    static std::string encode(const batch_t& batch) {
+      std::string payload;
+      tools::serialize::write<uint32_t>(payload, batch.size());
+      for (const auto& op : batch.ops()) {
+        const auto type = op.value ? wal::Record::Set : wal::Record::Erase;
+        tools::serialize::write<uint8_t>(payload, static_cast<uint8_t>(type));
+        tools::serialize::write(payload, op.key);
+        if (op.value)
+          tools::serialize::write(payload, *op.value);
+      }
+      return payload;
+    }
+
+    static batch_t decode(std::string_view payload) {
+      batch_t batch;
+      uint32_t count;
+      if (!tools::serialize::read(payload, count))
+        throw std::runtime_error("Malformed WAL record");
+      batch.reserve(count);
+      for (uint32_t i = 0; i < count; i++) {
+        uint8_t type;
+        key_t key;
+        if (!tools::serialize::read(payload, type) || !tools::serialize::read(payload, key))
+          throw std::runtime_error("Malformed WAL record");
+        if (static_cast<wal::Record>(type) == wal::Record::Set) {
+          value_t value;
+          if (!tools::serialize::read(payload, value))
+            throw std::runtime_error("Malformed WAL record");
+          batch.put(std::move(key), std::move(value));
+        } else {
+          batch.erase(std::move(key));
+        }
+      }
+      return batch;
+    }
+
+    void apply(wal::Record type, std::string_view payload) {
+      if (type == wal::Record::Batch) {
+        _table.apply(decode(payload));
+        return;
+      }
+      key_t key;
+      if (!tools::serialize::read(payload, key))
+        throw std::runtime_error("Malformed WAL record");
+      if (type == wal::Record::Set) {
+        value_t value;
+        if (!tools::serialize::read(payload, value))
+          throw std::runtime_error("Malformed WAL record");
+        _table.insert_or_assign(std::move(key), std::move(value));
+      } else if (type == wal::Record::Erase) {
+        _table.erase(key);
+      }
+    }
+
+    const std::string& recover(const std::string& path) {
+      wal::Log::replay(path, [this](wal::Record type, std::string_view payload) {
+        apply(type, payload);
+      });
+      return path;
+    }
+
+  public:
+    /** Reference to a value, logs assignments */
+    class Ref {
+      LoggedTable& _owner;
+      key_t _key;
+
+    public:
+      Ref(LoggedTable& owner, key_t key) :
+        _owner(owner),
+        _key(std::move(key)) {}
+
+      Ref& operator=(value_t value) {
+        _owner.set(_key, std::move(value));
+        return *this;
+      }
+
+      operator const value_t&() const {
+        return _owner.at(_key);
+      }
+    };
+
+    LoggedTable(const std::string& path, wal::Options options = {}) :
+      _log(recover(path), options) {}
+
+    Ref operator[] (const key_t& key) {
+      return Ref(*this, key);
+    }
+
+    /** References into the table, not safe against concurrent mutations */
+    const value_t& operator[] (const key_t& key) const {
+      return _table[key];
+    }
+
+    const value_t& at(const key_t& key) const {
+      return _table.at(key);
+    }
+
+    /** Copy of the value of \c key */
+    std::optional<value_t> get(const key_t& key) const {
+      std::shared_lock<std::shared_mutex> guard(_lock);
+      if (const auto found = _table.find(key))
+        return *found;
+      return std::nullopt;
+    }
+
+    void set(const key_t& key, value_t value) {
+      const auto payload = encode(key, value);
+      uint64_t sequence;
+      {
+        std::unique_lock<std::shared_mutex> guard(_lock);
+        sequence = _log.submit(wal::Record::Set, payload);
+        _table.insert_or_assign(key, std::move(value));
+      }
+      _log.wait(sequence);
+    }
+
+    void erase(const key_t& key) {
+      const auto payload = encode(key);
+      uint64_t sequence;
+      {
+        std::unique_lock<std::shared_mutex> guard(_lock);
+        sequence = _log.submit(wal::Record::Erase, payload);
+        _table.erase(key);
+      }
+      _log.wait(sequence);
+    }
+
+    /** Logs \c batch as one record and applies it, on recovery it is replayed whole or not at all */
+    void apply(batch_t batch) {
+      if (batch.empty())
+        return;
+      const auto payload = encode(batch);
+      uint64_t sequence;
+      {
+        std::unique_lock<std::shared_mutex> guard(_lock);
+        sequence = _log.submit(wal::Record::Batch, payload);
+        _table.apply(std::move(batch));
+      }
+      _log.wait(sequence);
+    }
+
+    /** Waits until all logged mutations are on disk */
+    void flush() {
+      _log.flush();
+    }
+
+    /** Underlying table, not safe against concurrent mutations */
+    const table_t& table() const {
+      return _table;
+    }
+  };
+}
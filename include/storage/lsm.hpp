@@ -0,0 +1,161 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "structure/bptree.hpp"
+#include "storage/io.hpp"
+#include "storage/sstable.hpp"
+#include "storage/wal.hpp"
+
+namespace storage {
+  namespace lsm {
+
+    /** How tables are merged in the background */
+    enum class Compaction {
+      Leveled,                /**< Levels below 0 are sorted runs of disjoint tables, each \c level_ratio times bigger */
+      Tiered                  /**< Every level collects \c fanout overlapping runs, which are merged into one on the next level */
+    };
+
+    struct Options {
+      size_t memtable_bytes = 4 << 20;      /**< Memtable size triggering a flush */
+      uint32_t block_size = 4096;           /**< Table block size */
+      double bloom_bits = 10;               /**< Bloom filter bits per key in tables, 0 disables filters */
+      Compaction compaction = Compaction::Leveled;
+      size_t fanout = 4;                    /**< Tables on level 0 (or any level when tiered) triggering compaction */
+      uint64_t table_bytes = 8 << 20;       /**< Output table size for leveled compaction */
+      uint64_t level_bytes = 32 << 20;      /**< Size limit of level 1 for leveled compaction */
+      size_t level_ratio = 10;              /**< Size ratio between adjacent levels */
+      wal::Options wal = {};
+    };
+
+    /** Tables and their sizes per level */
+    struct Stats {
+      std::vector<size_t> tables;
+      std::vector<uint64_t> bytes;
+      size_t memtable_bytes;
+      uint64_t flushes;
+      uint64_t compactions;
+    };
+
+    /**
+     * Log-structured merge storage of string keys and values
+
+       Writes go to the write-ahead log and to an in-memory B+ tree. A full
+       memtable is frozen and written by the background thread to a sorted
+       table on level 0 while writes continue into a fresh one. The same
+       thread merges tables down the levels, so every write is sequential.
+
+       Lookups check the memtables first and then tables from newest to
+       oldest; deletions are recorded as tombstones until compaction
+       reaches the last level. Set of live tables is kept in the MANIFEST
+       file in the storage directory, which is replaced atomically.
+
+       Asynchronous variants of the calls run on an \c io::Ring: table
+       blocks are read through it and waits for the log sync or for the
+       background thread suspend the coroutine instead of the thread. The
+       engine must outlive coroutines waiting on it.
+     */
+    class Engine {
+      using memtable_t = structure::bptree::BPTree<std::string, std::optional<std::string>, 64>;
+
+      struct Table {
+        uint64_t number;
+        std::shared_ptr<const sstable::Reader> reader;
+      };
+
+      /** Immutable set of tables, replaced as a whole */
+      struct Version {
+        std::vector<std::vector<Table> > levels;    /**< Newest tables first on overlapping levels */
+      };
+
+      struct Memtable {
+        memtable_t tree;
+        size_t bytes = 0;
+        uint64_t log_number = 0;
+      };
+
+      /** Merge of some tables into the next level */
+      struct Job {
+        size_t level;
+        std::vector<Table> inputs;                  /**< Newest first */
+        size_t output_level;
+        bool drop_tombstones;
+      };
+
+      std::string _dir;
+      Options _options;
+
+      mutable std::shared_mutex _lock;
+      std::condition_variable_any _work;            /**< Wakes the background thread */
+      std::condition_variable_any _done;            /**< Wakes threads waiting for background work */
+      std::unique_ptr<Memtable> _memtable;
+      std::unique_ptr<Memtable> _immutable;         /**< Frozen memtable being flushed */
+      std::shared_ptr<wal::Log> _log;
+      std::shared_ptr<const Version> _version;
+      std::atomic<uint64_t> _next_number{1};      /**< Shared by logs and tables */
+      std::vector<std::string> _cursors;            /**< Last compacted key per level */
+      uint64_t _flushes = 0;
+      uint64_t _compactions = 0;
+      bool _busy = false;
+      bool _stop = false;
+      std::exception_ptr _error;
+      std::vector<std::function<void(int)> > _waiters;  /**< Coroutines waiting for background work */
+      std::thread _worker;
+
+      std::string file(uint64_t number, const char* extension) const;
+      void check() const;
+      void recover();
+      void save_manifest(const Version& version) const;
+      Table write_table(const memtable_t& tree, uint64_t number) const;
+      bool apply(wal::Record type, const std::string& key, const std::string* value, const std::string& payload,
+                 std::shared_ptr<wal::Log>& log, uint64_t& sequence);
+      void write(wal::Record type, const std::string& key, const std::string* value);
+      io::Task<void> async_write(io::Ring& ring, wal::Record type, std::string key, std::optional<std::string> value);
+      io::Ring::Deferred settled(io::Ring& ring);
+      void finished();
+      std::vector<const sstable::Reader*> candidates(const Version& version, const std::string& key) const;
+      void rotate();
+      std::optional<size_t> due(const Version& version) const;
+      std::optional<Job> pick(const Version& version);
+      std::vector<Table> merge(const Job& job);
+      std::shared_ptr<Version> install(const Job& job, const std::vector<Table>& outputs) const;
+      void work();
+
+    public:
+      /** Opens storage in \c dir, creating it when missing, and replays its logs */
+      explicit Engine(const std::string& dir, Options options = {});
+      ~Engine();
+
+      Engine(const Engine&) = delete;
+      Engine& operator=(const Engine&) = delete;
+
+      void put(const std::string& key, const std::string& value);
+      void erase(const std::string& key);
+      std::optional<std::string> get(const std::string& key) const;
+
+      /** Writes memtable to a table and waits for it */
+      void flush();
+
+      /** Same as \c get, table blocks are read through \c ring */
+      io::Task<std::optional<std::string> > async_get(io::Ring& ring, std::string key) const;
+      /** Same as \c put, completes once the record is synced */
+      io::Task<void> async_put(io::Ring& ring, std::string key, std::string value);
+      /** Same as \c flush without blocking the thread */
+      io::Task<void> async_flush(io::Ring& ring);
+
+      /** Waits until no compaction is due */
+      void compact();
+
+      Stats stats() const;
+    };
+  }
+}
@@ -0,0 +1,392 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <bit>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#include <algorithm>
+
+#include "structure/hashtable.hpp"
+#include "structure/frozen.hpp"
+
+namespace storage {
+  namespace snapshot {
+
+    /** Layout of index section */
+    enum class Kind : uint32_t {
+      Buckets = 1,            /**< Bucket offsets, entries grouped by bucket */
+      Frozen = 2              /**< Seed, perfect hash pilots and entry offsets, entries in slot order */
+    };
+
+    /**
+     * File header
+
+       All offsets are from the start of file, so the file can be mapped
+       anywhere. Everything between header and checksum section is split
+       into blocks of \c block_size, each with its own crc32.
+     */
+    struct Header {
+      char magic[8];
+      uint32_t version;
+      uint32_t kind;
+      uint64_t hash_check;        /**< Hash of \c hash_probe, catches loading with another hash */
+      uint64_t entries;
+      uint64_t buckets;
+      uint64_t index_offset;
+      uint64_t data_offset;
+      uint64_t checksums_offset;
+      uint64_t file_size;
+      uint32_t block_size;
+      uint32_t header_crc;        /**< crc32 of header with this field zeroed */
+    };
+
+    static_assert(std::is_trivially_copyable_v<Header>, "Header is written as is");
+
+    constexpr std::string_view hash_probe = "csdb snapshot";
+    constexpr size_t header_size = 128;
+    constexpr size_t entry_alignment = 8;
+
+    /**
+     * Sequential snapshot file writer
+
+       Content goes to a temporary file which replaces \c path atomically
+       in \c finish, after everything is synced.
+     */
+    class Writer {
+      std::string _path;
+      std::string _temp;
+      int _fd = -1;
+      uint32_t _block_size;
+      std::string _buffer;
+      std::string _block;               /**< Current incomplete block */
+      std::vector<uint32_t> _checksums;
+      uint64_t _offset = header_size;
+
+      void write(const char* data, size_t size);
+
+    public:
+      Writer(const std::string& path, uint32_t block_size = 1 << 16);
+      ~Writer();
+
+      Writer(const Writer&) = delete;
+      Writer& operator=(const Writer&) = delete;
+
+      /** Offset in file where next appended byte goes */
+      uint64_t offset() const {
+        return _offset;
+      }
+
+      void append(const void* data, size_t size);
+
+      /** Appends zeroes up to the next multiple of \c alignment */
+      void pad(size_t alignment);
+
+      /** Stores checksums and \c header, then publishes the file */
+      void finish(Header header);
+    };
+
+    /**
+     * Read-only mapping of a snapshot file
+
+       Pages are faulted in by access, nothing is read at open except the
+       header. Blocks are verified against their checksums the first time
+       they are accessed through \c data.
+     */
+    class Mapping {
+      const char* _base = nullptr;
+      size_t _size = 0;
+      Header _header;
+      std::unique_ptr<std::atomic<bool>[]> _verified;
+
+      void verify(uint64_t block) const;
+
+    public:
+      Mapping(const std::string& path, Kind kind, uint64_t hash_check);
+      ~Mapping();
+
+      Mapping(const Mapping&) = delete;
+      Mapping& operator=(const Mapping&) = delete;
+
+      const Header& header() const {
+        return _header;
+      }
+
+      /** Pointer to \c size bytes at \c offset, verifying blocks they span */
+      const char* data(uint64_t offset, uint64_t size) const;
+    };
+
+    /** How keys and values are stored in a snapshot and viewed from it */
+    template <typename T, typename = void>
+    struct Flat {
+      static_assert(std::is_trivially_copyable_v<T> && !std::is_pointer_v<T>,
+                    "Only plain values and strings can be stored in a snapshot");
+      static_assert(alignof(T) <= entry_alignment, "Value is aligned stronger than entries");
+      using view_t = const T&;
+      using found_t = const T*;
+
+      static std::string_view bytes(const T& value) {
+        return {reinterpret_cast<const char *>(&value), sizeof(T)};
+      }
+
+      static found_t view(const char* data, size_t) {
+        return reinterpret_cast<const T*>(data);
+      }
+    };
+
+    template <>
+    struct Flat<std::string> {
+      using view_t = std::string_view;
+      using found_t = std::optional<std::string_view>;
+
+      static std::string_view bytes(const std::string& value) {
+        return value;
+      }
+
+      static found_t view(const char* data, size_t size) {
+        return std::string_view(data, size);
+      }
+    };
+
+    /** Entry header preceding key and value bytes */
+    struct Entry {
+      uint32_t key_size;
+      uint32_t value_size;
+    };
+
+    inline uint64_t aligned(uint64_t size) {
+      return (size + entry_alignment - 1) / entry_alignment * entry_alignment;
+    }
+
+    inline uint64_t entry_size(const Entry& entry) {
+      return sizeof(Entry) + aligned(entry.key_size) + aligned(entry.value_size);
+    }
+
+    template <auto hash>
+    uint64_t hash_of(std::string_view bytes) {
+      return hash(reinterpret_cast<const uint8_t *>(bytes.data()), bytes.size(), 0);
+    }
+
+    /** Appends one entry in snapshot layout */
+    inline void write_entry(Writer& out, std::string_view key, std::string_view value) {
+      const Entry entry{uint32_t(key.size()), uint32_t(value.size())};
+      out.append(&entry, sizeof(entry));
+      out.append(key.data(), key.size());
+      out.pad(entry_alignment);
+      out.append(value.data(), value.size());
+      out.pad(entry_alignment);
+    }
+
+    /**
+     * Writes all entries of \c table to snapshot at \c path
+
+       \c table is anything with \c for_each(fn(key, value)), entries are
+       placed into buckets by the same \c hash the loader is going to use.
+     */
+    template <auto hash, typename Table>
+    void write(const Table& table, const std::string& path) {
+      struct Item {
+        uint64_t bucket;
+        std::string_view key;
+        std::string_view value;
+      };
+      std::vector<Item> items;
+      table.for_each([&items](const auto& key, const auto& value) {
+        using key_t = std::decay_t<decltype(key)>;
+        using value_t = std::decay_t<decltype(value)>;
+        items.push_back({0, Flat<key_t>::bytes(key), Flat<value_t>::bytes(value)});
+      });
+
+      const uint64_t buckets = std::max<uint64_t>(1, std::bit_ceil(items.size()));
+      for (auto& item : items)
+        item.bucket = hash_of<hash>(item.key) % buckets;
+      std::sort(items.begin(), items.end(), [](const Item& a, const Item& b) {
+        return a.bucket < b.bucket;
+      });
+
+      Writer out(path);
+      Header header = {};
+      header.kind = static_cast<uint32_t>(Kind::Buckets);
+      header.hash_check = hash_of<hash>(hash_probe);
+      header.entries = items.size();
+      header.buckets = buckets;
+      header.index_offset = out.offset();
+
+      uint64_t offset = 0;
+      auto item = items.cbegin();
+      for (uint64_t bucket = 0; bucket <= buckets; bucket++) {
+        out.append(&offset, sizeof(offset));
+        for (; item != items.cend() && item->bucket == bucket; ++item)
+          offset += entry_size({uint32_t(item->key.size()), uint32_t(item->value.size())});
+      }
+
+      out.pad(entry_alignment);
+      header.data_offset = out.offset();
+      for (const auto& entry : items)
+        write_entry(out, entry.key, entry.value);
+      out.finish(header);
+    }
+
+    /** Writes \c table to snapshot at \c path, see \c Table for loading */
+    template <typename key_t, typename value_t, auto hash, class Ret>
+    void save(const structure::hashtable::HashTable<key_t, value_t, hash, Ret>& table, const std::string& path) {
+      write<hash>(table, path);
+    }
+
+    /**
+     * Read-only table served straight from a mapped snapshot
+
+       Lookups hash the key, read bucket bounds from the index and compare
+       keys in place; values are returned as references (or string views)
+       into the mapping, so nothing is allocated or copied.
+     */
+    template <typename key_t, typename value_t, auto hash>
+    class Table {
+      using view_t = typename Flat<value_t>::view_t;
+      using found_t = typename Flat<value_t>::found_t;
+
+      Mapping _mapping;
+
+    public:
+      explicit Table(const std::string& path) :
+        _mapping(path, Kind::Buckets, hash_of<hash>(hash_probe)) {}
+
+      size_t size() const {
+        return _mapping.header().entries;
+      }
+
+      /** Pointer to value (optional string view for strings), empty when missing */
+      found_t find(const key_t& key) const {
+        const auto& header = _mapping.header();
+        const auto bytes = Flat<key_t>::bytes(key);
+        const uint64_t bucket = hash_of<hash>(bytes) % header.buckets;
+
+        uint64_t bounds[2];
+        std::memcpy(bounds, _mapping.data(header.index_offset + bucket * sizeof(uint64_t), sizeof(bounds)),
+                    sizeof(bounds));
+        const char* data = _mapping.data(header.data_offset + bounds[0], bounds[1] - bounds[0]);
+        const char* end = data + (bounds[1] - bounds[0]);
+        while (data < end) {
+          Entry entry;
+          std::memcpy(&entry, data, sizeof(entry));
+          const char* stored = data + sizeof(Entry);
+          if (entry.key_size == bytes.size() && std::memcmp(stored, bytes.data(), bytes.size()) == 0)
+            return Flat<value_t>::view(stored + aligned(entry.key_size), entry.value_size);
+          data += entry_size(entry);
+        }
+        return {};
+      }
+
+      view_t at(const key_t& key) const {
+        if (auto value = find(key))
+          return *value;
+        throw std::out_of_range("Not found");
+      }
+
+      view_t operator[] (const key_t& key) const {
+        return at(key);
+      }
+    };
+
+    /**
+     * Writes frozen \c table to snapshot at \c path, see \c Frozen for loading
+
+       Index section holds the hash seed, bucket pilots and offsets of
+       entries, which follow in slot order.
+     */
+    template <typename key_t, typename value_t, auto hash>
+    void save(const structure::frozen::Table<key_t, value_t, hash>& table, const std::string& path) {
+      Writer out(path);
+      Header header = {};
+      header.kind = static_cast<uint32_t>(Kind::Frozen);
+      header.hash_check = hash_of<hash>(hash_probe);
+      header.entries = table.size();
+      header.buckets = table.pilots().size();
+      header.index_offset = out.offset();
+
+      const uint64_t seed = table.seed();
+      out.append(&seed, sizeof(seed));
+      out.append(table.pilots().data(), table.pilots().size() * sizeof(uint32_t));
+      out.pad(entry_alignment);
+      uint64_t offset = 0;
+      for (const auto& entry : table.entries()) {
+        out.append(&offset, sizeof(offset));
+        offset += entry_size({uint32_t(Flat<key_t>::bytes(entry.key).size()),
+                              uint32_t(Flat<value_t>::bytes(entry.value).size())});
+      }
+      out.append(&offset, sizeof(offset));
+
+      header.data_offset = out.offset();
+      for (const auto& entry : table.entries())
+        write_entry(out, Flat<key_t>::bytes(entry.key), Flat<value_t>::bytes(entry.value));
+      out.finish(header);
+    }
+
+    /**
+     * Frozen table served straight from a mapped snapshot
+
+       A lookup hashes the key once and reads its pilot, the offset of its
+       slot and the entry there, so it touches at most three pages.
+     */
+    template <typename key_t, typename value_t, auto hash>
+    class Frozen {
+      using view_t = typename Flat<value_t>::view_t;
+      using found_t = typename Flat<value_t>::found_t;
+
+      Mapping _mapping;
+      uint64_t _seed;
+      uint64_t _pilots_offset;
+      uint64_t _offsets_offset;
+
+    public:
+      explicit Frozen(const std::string& path) :
+        _mapping(path, Kind::Frozen, hash_of<hash>(hash_probe)) {
+        const auto& header = _mapping.header();
+        std::memcpy(&_seed, _mapping.data(header.index_offset, sizeof(_seed)), sizeof(_seed));
+        _pilots_offset = header.index_offset + sizeof(_seed);
+        _offsets_offset = _pilots_offset + aligned(header.buckets * sizeof(uint32_t));
+      }
+
+      size_t size() const {
+        return _mapping.header().entries;
+      }
+
+      /** Pointer to value (optional string view for strings), empty when missing */
+      found_t find(const key_t& key) const {
+        const auto& header = _mapping.header();
+        if (!header.entries)
+          return {};
+        const uint64_t hashed = structure::frozen::hash_key<hash>(key, _seed);
+        uint32_t pilot;
+        std::memcpy(&pilot, _mapping.data(_pilots_offset + structure::frozen::bucket(hashed, header.buckets) * sizeof(pilot),
+                                          sizeof(pilot)), sizeof(pilot));
+        const uint64_t slot = structure::frozen::slot(hashed, pilot, header.entries);
+
+        uint64_t offset;
+        std::memcpy(&offset, _mapping.data(_offsets_offset + slot * sizeof(offset), sizeof(offset)), sizeof(offset));
+        Entry entry;
+        std::memcpy(&entry, _mapping.data(header.data_offset + offset, sizeof(entry)), sizeof(entry));
+        const char* stored = _mapping.data(header.data_offset + offset, entry_size(entry)) + sizeof(Entry);
+        const auto bytes = Flat<key_t>::bytes(key);
+        if (entry.key_size != bytes.size() || std::memcmp(stored, bytes.data(), bytes.size()))
+          return {};
+        return Flat<value_t>::view(stored + aligned(entry.key_size), entry.value_size);
+      }
+
+      view_t at(const key_t& key) const {
+        if (auto value = find(key))
+          return *value;
+        throw std::out_of_range("Not found");
+      }
+
+      view_t operator[] (const key_t& key) const {
+        return at(key);
+      }
+    };
+  }
+}
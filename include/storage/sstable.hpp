@@ -0,0 +1,200 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "algo/bloom.hpp"
+
+namespace storage {
+  namespace sstable {
+
+    /**
+     * Writer of an immutable sorted table
+
+       Entries are packed into blocks of about \c block_size bytes, every
+       block is indexed by its first key and protected by crc32. Keys must
+       be added in strictly increasing order, a missing value is stored as
+       a tombstone which hides older values of the key. With non-zero
+       \c bloom_bits a Bloom filter of all keys is stored with the index.
+     */
+    class Builder {
+      std::string _path;
+      int _fd = -1;
+      uint32_t _block_size;
+      double _bloom_bits;
+      std::vector<uint64_t> _hashes;        /**< Key hashes for the filter */
+      std::string _block;
+      std::string _first;                   /**< First key of current block */
+      std::string _last;                    /**< Last added key */
+      std::string _index;
+      uint64_t _offset = 0;
+      uint64_t _entries = 0;
+      uint32_t _blocks = 0;
+      bool _finished = false;
+
+      void flush_block();
+      void write(const std::string& data);
+
+    public:
+      Builder(const std::string& path, uint32_t block_size = 4096, double bloom_bits = 10);
+      ~Builder();
+
+      Builder(const Builder&) = delete;
+      Builder& operator=(const Builder&) = delete;
+
+      void add(std::string_view key, std::optional<std::string_view> value);
+
+      uint64_t entries() const {
+        return _entries;
+      }
+
+      /** Bytes written so far */
+      uint64_t bytes() const {
+        return _offset + _block.size();
+      }
+
+      /** Writes index and syncs the file, table is removed if never finished */
+      void finish();
+    };
+
+    /**
+     * Read access to a table built by \c Builder
+
+       Block index and Bloom filter are kept in memory, so a point lookup
+       costs at most one block read, and most lookups of absent keys none.
+       Marking the table obsolete removes its file once the last user
+       closes it.
+     */
+    class Reader {
+      struct Block {
+        std::string first;
+        uint64_t offset;
+        uint32_t size;
+        uint32_t checksum;
+      };
+
+      std::string _path;
+      int _fd = -1;
+      std::vector<Block> _index;
+      std::string _last;
+      std::optional<algo::bloom::Blocked> _filter;
+      uint64_t _entries = 0;
+      uint64_t _bytes = 0;
+      mutable std::atomic<bool> _obsolete{false};
+
+      /** Reads block, verifying it unless the caller does */
+      std::string read_block(size_t block, bool verify = true) const;
+
+    public:
+      explicit Reader(const std::string& path);
+      ~Reader();
+
+      Reader(const Reader&) = delete;
+      Reader& operator=(const Reader&) = delete;
+
+      /**
+       * Looks \c key up
+
+         Returns false when the table knows nothing about \c key, otherwise
+         sets \c value to the stored value or to nullopt for a tombstone.
+       */
+      bool get(std::string_view key, std::optional<std::string>& value) const {
+        return get(key, algo::bloom::hash(key), value);
+      }
+
+      /** Same, with \c hash of the key from \c algo::bloom::hash computed once for many tables */
+      bool get(std::string_view key, uint64_t hash, std::optional<std::string>& value) const;
+
+      /** False when \c key is definitely absent */
+      bool may_contain(std::string_view key, uint64_t hash) const;
+
+      /** Block of the file that may hold a key */
+      struct Location {
+        size_t block;
+        uint64_t offset;
+        uint32_t size;
+      };
+
+      /** Block to read for \c key, none when the table knows nothing about it */
+      std::optional<Location> locate(std::string_view key, uint64_t hash) const;
+
+      /**
+       * Looks \c key up in \c data read from \c location by the caller
+
+         Verifies the block and returns as \c get does, for callers doing
+         their own I/O on \c fd.
+       */
+      bool search(const Location& location, std::string_view data, std::string_view key,
+                  std::optional<std::string>& value) const;
+
+      /** Descriptor the table is read through, open as long as the reader */
+      int fd() const {
+        return _fd;
+      }
+
+      /** Smallest key, tables are never empty */
+      const std::string& first() const {
+        return _index.front().first;
+      }
+
+      /** Largest key */
+      const std::string& last() const {
+        return _last;
+      }
+
+      uint64_t entries() const {
+        return _entries;
+      }
+
+      /** Size of the file */
+      uint64_t bytes() const {
+        return _bytes;
+      }
+
+      const std::string& path() const {
+        return _path;
+      }
+
+      void mark_obsolete() const {
+        _obsolete = true;
+      }
+
+      /** Sequential reader of all entries in key order */
+      class Iterator {
+        const Reader* _reader;
+        size_t _block = 0;
+        std::unique_ptr<std::string> _data;   /**< Stays in place when iterator moves */
+        std::string_view _rest;
+        std::string_view _key;
+        std::optional<std::string_view> _value;
+        bool _valid = true;
+
+      public:
+        explicit Iterator(const Reader& reader);
+
+        bool valid() const {
+          return _valid;
+        }
+
+        std::string_view key() const {
+          return _key;
+        }
+
+        /** Value of current entry, nullopt for a tombstone */
+        std::optional<std::string_view> value() const {
+          return _value;
+        }
+
+        void next();
+      };
+
+      Iterator begin() const {
+        return Iterator(*this);
+      }
+    };
+  }
+}
@@ -0,0 +1,112 @@
+#pragma once
+#include <cstdint>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace storage {
+  namespace wal {
+
+    /** Kind of logged mutation */
+    enum class Record : uint8_t {
+      Set = 1,
+      Erase = 2,
+      Batch = 3               /**< Several sets and erases applied together */
+    };
+
+    /** When appended records reach the disk */
+    enum class Sync {
+      Group,                  /**< Append returns after its batch is synced */
+      Periodic,               /**< Append returns at once, batches are synced every \c interval */
+      Never                   /**< Records are written, syncing is left to the OS */
+    };
+
+    struct Options {
+      Sync sync = Sync::Group;
+      std::chrono::milliseconds interval{10};
+    };
+
+    /**
+     * Append-only log of mutations
+
+       Every record is stored as length and crc32 of its body followed by
+       the body itself: record type and payload. Appending threads only
+       copy records into a shared buffer; a single writer thread takes
+       everything gathered so far and stores it with one write and,
+       depending on sync policy, one fdatasync. So with many concurrent
+       writers a single sync covers many records.
+     */
+    class Log {
+      int _fd = -1;
+      Options _options;
+
+      std::mutex _lock;
+      std::condition_variable _wake;        /**< Wakes the writer thread */
+      std::condition_variable _done;        /**< Wakes appenders waiting for sync */
+      std::string _pending;                 /**< Encoded records not written yet */
+      uint64_t _appended = 0;               /**< Sequence number of last appended record */
+      uint64_t _written = 0;                /**< ... of last record written to file */
+      uint64_t _synced = 0;                 /**< ... of last record synced to disk */
+      bool _force = false;                  /**< Sync requested by flush */
+      std::vector<std::pair<uint64_t, std::function<void(int)> > > _callbacks;  /**< Waiting for sync by sequence */
+      bool _stop = false;
+      int _error = 0;
+      std::thread _writer;
+
+      void write_loop();
+      void check() const;
+
+    public:
+      /** Opens log at \c path for appending, creating it when missing */
+      Log(const std::string& path, Options options = {});
+      ~Log();
+
+      Log(const Log&) = delete;
+      Log& operator=(const Log&) = delete;
+
+      /** Appends record, returns its sequence number */
+      uint64_t append(Record type, std::string_view payload);
+
+      /**
+       * Queues record without waiting, returns its sequence number
+
+         Lets callers order records under their own lock and wait for
+         the sync outside of it.
+       */
+      uint64_t submit(Record type, std::string_view payload);
+
+      /** Waits as \c append would for record \c sequence to reach disk */
+      void wait(uint64_t sequence);
+
+      /**
+       * Calls \c done(error) when \c wait for \c sequence would return
+
+         Called right away when there is nothing to wait for, otherwise
+         from the writer thread, so it must not block.
+       */
+      void when_synced(uint64_t sequence, std::function<void(int)> done);
+
+      /** Waits until all appended records are synced to disk */
+      void flush();
+
+      /** Drops all records, for use after the state was saved elsewhere */
+      void reset();
+
+      /**
+       * Feeds records of log at \c path to \c apply
+
+         Stops at the first torn or corrupted record and cuts the file
+         there, so new records go right after the last valid one.
+         Returns number of applied records.
+       */
+      static size_t replay(const std::string& path,
+                           const std::function<void(Record, std::string_view)>& apply);
+    };
+  }
+}
@@ -1,38 +1,62 @@
 #pragma once
 #include <cstdint>
 #include <array>
+#include <memory>
 #include <type_traits>
 #include <variant>
 #include <algorithm>
 #include <exception>
+#include <stdexcept>
+#include <vector>
+#include <limits>
+#include <optional>
 
-#include "logging.hpp"
+#include "structure/log.hpp"
 #include "tools/tmpl.hpp"
+#include "tools/arena.hpp"
+#include "tools/thread_pool.hpp"
+#include "structure/bptree_keys.hpp"
 
 namespace structure {
   namespace bptree {
+    /**
+     * Node reference
+
+       Nodes live in per-kind arenas, the highest bit tells leaf ids from
+       inner node ids.
+     */
+    using node_id = uint32_t;
+    constexpr node_id nil = std::numeric_limits<node_id>::max();
+    constexpr node_id leaf_tag = node_id(1) << 31;
+
     template <typename key_t, uint8_t b_factor>
     struct Node {
       struct {
         bool isLeaf : 1;
-        bool isEmpty : 1;
+        bool isUnderfull : 1;                    /**< Waits for lazy rebalancing */
         uint8_t count : 8;
-      } flags;
-      std::array<key_t, b_factor> _keys = {};    /**< Keys stored in the node */
-      Node* _next = nullptr;                     /**< Link to right node */
-      Node* _parent = nullptr;                   /**< Link to parent node (for splitting) */
-
-      virtual ~Node() {};
+      } flags = {false, false, 0};
+      KeyArray<key_t, b_factor> _keys = {};     /**< Keys stored in the node */
+      node_id _next = nil;                       /**< Link to right node on the same level */
+      node_id _parent = nil;                     /**< Link to parent node (for splitting) */
     };
 
     template <typename key_t, uint8_t b_factor>
     struct LayerNode: public Node<key_t, b_factor> {
       /** Links for next nodes
 
-          One for right link from biggest key
+          Link \c i leads to keys less than \c _keys[i], one extra link
+          is for right link from biggest key
        */
-      std::array<std::unique_ptr<Node<key_t, b_factor> >, b_factor + 1> _links = {};
-      virtual ~LayerNode() {};
+      std::array<node_id, b_factor + 1> _links = {};
+
+      /** Position of \c child among the links */
+      uint8_t index_of(node_id child) const {
+        for (unsigned i = 0; i <= this->flags.count; i++)
+          if (_links[i] == child)
+            return i;
+        throw std::logic_error("Child is not linked to its parent");
+      }
     };
 
     template <typename key_t, typename value_t, uint8_t b_factor>
@@ -42,162 +66,658 @@ namespace structure {
 
       Leaf() {
         this->flags.isLeaf = true;
-        this->flags.isEmpty = true;
-        this->flags.count = 0;
       }
+    };
 
-      value_t& getValue(key_t key) {
-        const auto& location = std::find(this->_keys.cbegin(), this->_keys.cend(), key);
-        if (location != this->_keys.cend()) {
-          const auto index = std::distance(this->_keys.cbegin(), location);
-          return _data[index];
-        } else {
-          throw std::out_of_range("Not such value in node");
-        }
-      }
+    /** What to do with a node which has less keys than half of its capacity */
+    enum class Underflow {
+      Eager,                  /**< Borrow from or merge with sibling immediately */
+      Lazy                    /**< Mark the node and rebalance it in \c compact() */
+    };
 
-      virtual ~Leaf() {};
+    /** Node usage of a tree */
+    struct Stats {
+      size_t leaves;          /**< Leaves linked into tree */
+      size_t layers;          /**< Inner nodes linked into tree */
+      size_t pooled;          /**< Freed node slots waiting for reuse */
+      size_t underfull;       /**< Nodes waiting for lazy rebalancing */
+      size_t bytes;           /**< Memory mapped for nodes */
     };
 
     template <typename key_t, typename value_t, uint8_t b_factor>
     class BPTree {
-      LayerNode<key_t, b_factor> _root = {};
+      static_assert(b_factor >= 3, "B+ tree node should fit at least 3 keys");
+
+      using node_t = Node<key_t, b_factor>;
+      using layer_t = LayerNode<key_t, b_factor>;
+      using leaf_t = Leaf<key_t, value_t, b_factor>;
+
+      static constexpr uint8_t min_leaf = b_factor / 2;
+      static constexpr uint8_t min_layer = (b_factor - 1) / 2;
+
+      Underflow _underflow;
+      tools::Arena<leaf_t> _leaf_arena;
+      tools::Arena<layer_t> _layer_arena;
+      node_id _root = make_leaf();
+      std::vector<node_id> _underfull;       /**< Marked nodes, may hold stale entries */
+      size_t _size = 0;
+
+      node_id make_leaf() {
+        const auto id = _leaf_arena.create();
+        if (id >= leaf_tag) {
+          _leaf_arena.destroy(id);
+          throw std::length_error("Too many leaves in tree");
+        }
+        return id | leaf_tag;
+      }
+
+      node_id make_layer() {
+        const auto id = _layer_arena.create();
+        if (id >= leaf_tag) {
+          _layer_arena.destroy(id);
+          throw std::length_error("Too many layers in tree");
+        }
+        return id;
+      }
+
+      void release(node_id id) {
+        if (id & leaf_tag)
+          _leaf_arena.destroy(id & ~leaf_tag);
+        else
+          _layer_arena.destroy(id);
+      }
+
+      bool live(node_id id) const {
+        return id & leaf_tag ? _leaf_arena.live(id & ~leaf_tag) : _layer_arena.live(id);
+      }
+
+      node_t& node(node_id id) {
+        if (id & leaf_tag)
+          return _leaf_arena[id & ~leaf_tag];
+        return _layer_arena[id];
+      }
+
+      const node_t& node(node_id id) const {
+        return const_cast<BPTree&>(*this).node(id);
+      }
+
+      leaf_t& leaf(node_id id) {
+        return _leaf_arena[id & ~leaf_tag];
+      }
+
+      const leaf_t& leaf(node_id id) const {
+        return _leaf_arena[id & ~leaf_tag];
+      }
+
+      layer_t& layer(node_id id) {
+        return _layer_arena[id];
+      }
 
-      Leaf<key_t, value_t, b_factor>& find_node(key_t key,
-                                                Node<key_t, b_factor>& start) {
-        if (start.flags.isLeaf)
-          return static_cast<Leaf<key_t, value_t, b_factor>&>(start);
+      const layer_t& layer(node_id id) const {
+        return _layer_arena[id];
+      }
+
+      static uint8_t min_keys(const node_t& node) {
+        return node.flags.isLeaf ? min_leaf : min_layer;
+      }
 
-        auto& node = static_cast<LayerNode<key_t, b_factor>&>(start);
+      void mark_underfull(node_id id) {
+        auto& marked = node(id);
+        if (!marked.flags.isUnderfull && marked._parent != nil) {
+          marked.flags.isUnderfull = true;
+          _underfull.push_back(id);
+        }
+      }
+
+      node_id find_leaf(const key_t& key) const {
+        auto id = _root;
+        while (!(id & leaf_tag)) {
+          const auto& inner = layer(id);
+          id = inner._links[inner._keys.upper_bound(inner.flags.count, key)];
+        }
+        return id;
+      }
 
-        for (uint8_t ind = 0; ind < b_factor; ind++) {
+      /** Calls \c fn for up to \c limit keys from \c from (inclusive) to \c to (exclusive), nullptr is unbounded */
+      template <typename F>
+      void scan_range(const key_t* from, const key_t* to, F&& fn, size_t limit = SIZE_MAX) const {
+        auto id = _root;
+        while (!(id & leaf_tag)) {
+          const auto& inner = layer(id);
+          id = inner._links[from ? inner._keys.upper_bound(inner.flags.count, *from) : 0];
+        }
 
-	  /* This key is last in this node */
-          if (ind == node.flags.count) {
-            auto& right_node = *node._links[ind + 1];
-            return find_node(key, right_node);
+        uint8_t index = from ? leaf(id)._keys.lower_bound(leaf(id).flags.count, *from) : 0;
+        while (id != nil) {
+          const auto& current = leaf(id);
+          for (; index < current.flags.count; index++) {
+            if ((to && current._keys.compare(index, *to) >= 0) || !limit--)
+              return;
+            fn(current._keys.key(index), current._data[index]);
           }
+          id = current._next;
+          index = 0;
+        }
+      }
 
-	  /* This key is in the left subnode */
-          if (key < node._keys[ind]) {
-            auto& left_node = *node._links[ind];
-            return find_node(key, left_node);
+      /** Subtree of node \c id limited to keys in [lower, upper) */
+      struct ScanTask {
+        node_id id;
+        std::optional<key_t> lower;
+        std::optional<key_t> upper;
+      };
+
+      /**
+       * Scans \c task, splitting it into subtrees while there are idle workers
+
+         Children of an inner node cover ranges between its separator keys,
+         so each spawned task is a subtree clamped to the scanned range.
+       */
+      template <typename acc_t, typename Visit>
+      void scan_task(tools::ThreadPool& pool, tools::TaskGroup& group,
+                     std::vector<acc_t>& partial, ScanTask task, Visit& visit) const {
+        const bool starving = pool.idle() > 0 || pool.queued() < pool.size();
+        if (!(task.id & leaf_tag) && starving) {
+          const auto& inner = layer(task.id);
+          const uint8_t count = inner.flags.count;
+          const uint8_t first = task.lower ? inner._keys.upper_bound(count, *task.lower) : 0;
+          const uint8_t last = task.upper ? inner._keys.lower_bound(count, *task.upper) : count;
+          for (unsigned i = first; i <= last; i++) {
+            ScanTask child = {inner._links[i], task.lower, task.upper};
+            if (i > first)
+              child.lower = inner._keys.key(i - 1);
+            if (i < last)
+              child.upper = inner._keys.key(i);
+            pool.run(group, [this, &pool, &group, &partial, child = std::move(child), &visit] {
+              scan_task(pool, group, partial, std::move(child), visit);
+            });
           }
+          return;
+        }
+
+        auto& acc = partial[pool.worker()];
+        scan_range(task.lower ? &*task.lower : nullptr, task.upper ? &*task.upper : nullptr,
+                   [&acc, &visit](const key_t& key, const value_t& value) {
+          visit(acc, key, value);
+        });
+      }
+
+      /** Links \c right next to \c left in the parent, growing the tree when needed */
+      void insert_into_parent(node_id left, key_t separator, node_id right) {
+        if (node(left)._parent == nil) {
+          const auto root_id = make_layer();
+          auto& root = layer(root_id);
+          root._keys.insert(0, 0, std::move(separator));
+          root.flags.count = 1;
+          root._links[0] = left;
+          root._links[1] = right;
+          node(left)._parent = node(right)._parent = root_id;
+          _root = root_id;
+          return;
+        }
+
+        if (node(node(left)._parent).flags.count == b_factor)
+          split_layer(node(left)._parent);
+
+        const auto parent_id = node(left)._parent;
+        auto& parent = layer(parent_id);
+        const uint8_t count = parent.flags.count;
+        const uint8_t index = parent.index_of(left);
+        parent._keys.insert(count, index, std::move(separator));
+        std::move_backward(parent._links.begin() + index + 1,
+                           parent._links.begin() + count + 1,
+                           parent._links.begin() + count + 2);
+        parent._links[index + 1] = right;
+        parent.flags.count++;
+        node(right)._parent = parent_id;
+      }
 
-	  /* This key should be in thid node */
-          if (key > node._keys[ind] && key < node._keys[ind + 1]) {
-            auto& right_node = *node._links[ind + 1];
-            return find_node(key, right_node);
+      /** Splits full layer \c id into two and links the new one to the parent */
+      void split_layer(node_id id) {
+        const auto right_id = make_layer();
+        auto& full = layer(id);
+        auto& right = layer(right_id);
+        const uint8_t middle = b_factor / 2;
+        auto separator = full._keys.key(middle);
+
+        full._keys.move_tail(b_factor, middle + 1, right._keys);
+        full._keys.erase(middle + 1, middle);
+        for (uint8_t i = middle + 1; i <= b_factor; i++) {
+          right._links[i - middle - 1] = full._links[i];
+          node(full._links[i])._parent = right_id;
+        }
+        right.flags.count = b_factor - middle - 1;
+        full.flags.count = middle;
+
+        right._next = full._next;
+        full._next = right_id;
+        insert_into_parent(id, std::move(separator), right_id);
+      }
+
+      /** Splits full leaf \c id into two halves, returns the right one */
+      node_id split_leaf(node_id id) {
+        const auto right_id = make_leaf();
+        auto& full = leaf(id);
+        auto& right = leaf(right_id);
+        const uint8_t middle = (b_factor + 1) / 2;
+
+        full._keys.move_tail(b_factor, middle, right._keys);
+        std::move(full._data.begin() + middle, full._data.end(), right._data.begin());
+        std::fill(full._data.begin() + middle, full._data.end(), value_t{});
+        right.flags.count = b_factor - middle;
+        full.flags.count = middle;
+
+        right._next = full._next;
+        full._next = right_id;
+        insert_into_parent(id, right._keys.key(0), right_id);
+        return right_id;
+      }
+
+      /** Moves one key from \c parent link \c index - 1 to link \c index */
+      void borrow_left(layer_t& parent, uint8_t index) {
+        const auto to_id = parent._links[index];
+        auto& left = node(parent._links[index - 1]);
+        auto& to_node = node(to_id);
+        const uint8_t lcount = left.flags.count;
+        const uint8_t count = to_node.flags.count;
+
+        if (to_node.flags.isLeaf) {
+          auto& from = static_cast<leaf_t&>(left);
+          auto& to = static_cast<leaf_t&>(to_node);
+          to._keys.insert(count, 0, from._keys.key(lcount - 1));
+          std::move_backward(to._data.begin(), to._data.begin() + count, to._data.begin() + count + 1);
+          to._data[0] = std::move(from._data[lcount - 1]);
+          from._data[lcount - 1] = value_t{};
+          from._keys.erase(lcount, lcount - 1);
+          parent._keys.set(parent.flags.count, index - 1, to._keys.key(0));
+        } else {
+          auto& from = static_cast<layer_t&>(left);
+          auto& to = static_cast<layer_t&>(to_node);
+          to._keys.insert(count, 0, parent._keys.key(index - 1));
+          std::move_backward(to._links.begin(), to._links.begin() + count + 1, to._links.begin() + count + 2);
+          to._links[0] = from._links[lcount];
+          node(to._links[0])._parent = to_id;
+          parent._keys.set(parent.flags.count, index - 1, from._keys.key(lcount - 1));
+          from._keys.erase(lcount, lcount - 1);
+        }
+        left.flags.count--;
+        to_node.flags.count++;
+      }
+
+      /** Moves one key from \c parent link \c index + 1 to link \c index */
+      void borrow_right(layer_t& parent, uint8_t index) {
+        const auto to_id = parent._links[index];
+        auto& to_node = node(to_id);
+        auto& right = node(parent._links[index + 1]);
+        const uint8_t count = to_node.flags.count;
+        const uint8_t rcount = right.flags.count;
+
+        if (to_node.flags.isLeaf) {
+          auto& from = static_cast<leaf_t&>(right);
+          auto& to = static_cast<leaf_t&>(to_node);
+          to._keys.insert(count, count, from._keys.key(0));
+          to._data[count] = std::move(from._data[0]);
+          std::move(from._data.begin() + 1, from._data.begin() + rcount, from._data.begin());
+          from._data[rcount - 1] = value_t{};
+          from._keys.erase(rcount, 0);
+          parent._keys.set(parent.flags.count, index, from._keys.key(0));
+        } else {
+          auto& from = static_cast<layer_t&>(right);
+          auto& to = static_cast<layer_t&>(to_node);
+          to._keys.insert(count, count, parent._keys.key(index));
+          to._links[count + 1] = from._links[0];
+          node(to._links[count + 1])._parent = to_id;
+          parent._keys.set(parent.flags.count, index, from._keys.key(0));
+          from._keys.erase(rcount, 0);
+          std::move(from._links.begin() + 1, from._links.begin() + rcount + 1, from._links.begin());
+        }
+        right.flags.count--;
+        to_node.flags.count++;
+      }
+
+      /** Merges \c parent link \c index + 1 into link \c index, returns the survivor */
+      node_id merge(layer_t& parent, uint8_t index) {
+        const auto left_id = parent._links[index];
+        const auto right_id = parent._links[index + 1];
+        auto& left = node(left_id);
+        auto& right = node(right_id);
+        uint8_t count = left.flags.count;
+        const uint8_t rcount = right.flags.count;
+
+        if (left.flags.isLeaf) {
+          auto& to = static_cast<leaf_t&>(left);
+          auto& from = static_cast<leaf_t&>(right);
+          for (uint8_t i = 0; i < rcount; i++, count++) {
+            to._keys.insert(count, count, from._keys.key(i));
+            to._data[count] = std::move(from._data[i]);
           }
+        } else {
+          auto& to = static_cast<layer_t&>(left);
+          auto& from = static_cast<layer_t&>(right);
+          to._keys.insert(count, count, parent._keys.key(index));
+          count++;
+          for (uint8_t i = 0; i <= rcount; i++) {
+            if (i < rcount)
+              to._keys.insert(count + i, count + i, from._keys.key(i));
+            node(from._links[i])._parent = left_id;
+            to._links[count + i] = from._links[i];
+          }
+          count += rcount;
+        }
+        left.flags.count = count;
+        left._next = right._next;
+
+        const uint8_t pcount = parent.flags.count;
+        parent._keys.erase(pcount, index);
+        std::move(parent._links.begin() + index + 2, parent._links.begin() + pcount + 1,
+                  parent._links.begin() + index + 1);
+        parent.flags.count--;
+        release(right_id);
+        return left_id;
+      }
+
+      /** Restores minimal fill of node \c id, cascading up to the root */
+      void rebalance(node_id id) {
+        auto& current = node(id);
+        current.flags.isUnderfull = false;
+        if (current._parent == nil) {
+          if (!current.flags.isLeaf && current.flags.count == 0) {
+            _root = layer(id)._links[0];
+            node(_root)._parent = nil;
+            release(id);
+          }
+          return;
+        }
+        if (current.flags.count >= min_keys(current))
+          return;
+
+        const auto parent_id = current._parent;
+        auto& parent = layer(parent_id);
+        const uint8_t index = parent.index_of(id);
+        const auto* left = index > 0 ? &node(parent._links[index - 1]) : nullptr;
+        const auto* right = index < parent.flags.count ? &node(parent._links[index + 1]) : nullptr;
+
+        if (left && left->flags.count > min_keys(*left)) {
+          borrow_left(parent, index);
+          return;
+        }
+        if (right && right->flags.count > min_keys(*right)) {
+          borrow_right(parent, index);
+          return;
         }
 
-        throw std::logic_error("Implementation error in Tree");
+        const auto survivor = left ? merge(parent, index - 1) : merge(parent, index);
+        if (node(survivor).flags.count < min_keys(node(survivor)))
+          mark_underfull(survivor);
+        rebalance(parent_id);
       }
 
     public:
-      BPTree() {
-        for (int link_ind = b_factor - 1; link_ind >= 0; link_ind--) {
-          auto& current = _root._links[link_ind];
-          current = std::move(std::make_unique<Leaf<key_t, value_t, b_factor> >());
-	  current->_parent = &_root;
-          current->_next = link_ind < b_factor - 1 ?
-                           _root._links[link_ind + 1].get() :
-                           nullptr;
-        }
-      }
-
-      value_t& get(key_t key) {
-        auto& result_node = find_node(key, _root);
-        for (int i = 0; i < b_factor; i++)
-          if (result_node._keys[i] == key)
-            return result_node._data[i];
+      using key_type = key_t;
+      using mapped_type = value_t;
+
+      /**
+       * Creates empty tree
+
+         Nodes are allocated from arenas backed by \c pages, huge pages
+         help with TLB misses on big trees.
+       */
+      BPTree(Underflow underflow = Underflow::Eager,
+             tools::memory::Pages pages = tools::memory::Pages::Normal) :
+        _underflow(underflow),
+        _leaf_arena(pages),
+        _layer_arena(pages) {}
+
+      BPTree(const BPTree&) = delete;
+      BPTree& operator=(const BPTree&) = delete;
+
+      size_t size() const {
+        return _size;
+      }
+
+      value_t& get(const key_t& key) {
+        auto& found = leaf(find_leaf(key));
+        const auto index = found._keys.lower_bound(found.flags.count, key);
+        if (index < found.flags.count && found._keys.compare(index, key) == 0)
+          return found._data[index];
         throw std::out_of_range("Key not found");
       }
 
-      void split(LayerNode<key_t, b_factor>& node,
-		 std::unique_ptr<Leaf<key_t, value_t, b_factor>> newLeaf) {
-	if (node.flags.count < b_factor + 1) {
-	  // We have place for one more node, just need to find place
-	  int newNodeIndex = 0;
-	  for (; newNodeIndex < b_factor; newNodeIndex++)
-	    if (node._keys[newNodeIndex] > newLeaf->_keys[0])
-	      break;
+      const value_t& get(const key_t& key) const {
+        return const_cast<BPTree&>(*this).get(key);
+      }
 
-	  // Move rest of keys to find a place
-	  for (int i = node.flags.count; i >= newNodeIndex; i--) {
-	    node._keys[i] = std::move(node._keys[i-1]);
-	    node._values[i] = std::move(node._values[i-1]);
-	  }
+      /** Calls \c fn(key, value) for keys in [from, to) in order */
+      template <typename F>
+      void scan(const key_t& from, const key_t& to, F&& fn) const {
+        scan_range(&from, &to, fn);
+      }
 
-	  node._keys[newNodeIndex] = newLeaf->_keys[0];
-	  newLeaf->_parent = node;
-	  node._values[newNodeIndex] = std::move(newLeaf);
-	} else {
-	  // Split the layernode too
-	}
+      /** Calls \c fn(key, value) for the first \c count keys not below \c from in order */
+      template <typename F>
+      void scan_n(const key_t& from, size_t count, F&& fn) const {
+        scan_range(&from, nullptr, fn, count);
       }
 
-      /** Splits the \c oldLeaf from \c index */
-      void split(Leaf<key_t, value_t, b_factor>& oldLeaf, int index) {
-	// Create new leaf to keep data
-        auto &newLeaf = std::make_unique<Leaf<key_t, value_t, b_factor>>();
+      /** Calls \c fn(key, value) for all keys in order */
+      template <typename F>
+      void for_each(F&& fn) const {
+        scan_range(nullptr, nullptr, fn);
+      }
 
-        if (index == 0) {
-	  // Just create new node to the left
-        } else if (index == b_factor - 1) {
-	  // Just create new node to the right
-	} else {
-	  // Move data from index to count
-	  for (int i = 0; i < index; ++i) {
-	    newLeaf->_data[i] = std::move(oldLeaf->_data[i]);
-	  }
-	  // Correct count of data in old node
-	  oldLeaf.flags.count -= (b_factor - index);
+      /**
+       * Aggregates keys in [from, to) on \c pool
+
+         Every worker folds the keys it visits into its own copy of \c init
+         with \c visit(acc, key, value), partial results are combined with
+         \c reduce(acc, acc) at the end, so \c init should be neutral for
+         \c reduce. Missing bound means the range is open from that side.
+         Tree must not be modified during the scan.
+       */
+      template <typename acc_t, typename Visit, typename Reduce>
+      acc_t parallel_scan(tools::ThreadPool& pool,
+                          std::optional<key_t> from, std::optional<key_t> to,
+                          acc_t init, Visit visit, Reduce reduce) const {
+        std::vector<acc_t> partial(pool.size() + 1, init);
+        tools::TaskGroup group;
+        pool.run(group, [&, task = ScanTask{_root, std::move(from), std::move(to)}] {
+          scan_task(pool, group, partial, task, visit);
+        });
+        pool.wait(group);
+
+        auto result = std::move(partial[0]);
+        for (size_t i = 1; i < partial.size(); i++)
+          result = reduce(std::move(result), std::move(partial[i]));
+        return result;
+      }
 
-	  // Set up data in new node
-	  newLeaf->flags.count = (b_factor - index);
-	  newLeaf->flags.isEmpty = false;
+      /** Inserts \c value for \c key or replaces the existing one */
+      void insert(key_t key, value_t value) {
+        auto id = find_leaf(key);
+        auto* target = &leaf(id);
+        auto index = target->_keys.lower_bound(target->flags.count, key);
+        if (index < target->flags.count && target->_keys.compare(index, key) == 0) {
+          target->_data[index] = std::move(value);
+          return;
+        }
+
+        if (target->flags.count == b_factor) {
+          const auto right = split_leaf(id);
+          if (leaf(right)._keys.compare(0, key) <= 0)
+            target = &leaf(right);
+          index = target->_keys.lower_bound(target->flags.count, key);
         }
 
-	// Now process the parent nodes
-	split(*oldLeaf._parent, std::move(newLeaf));
+        const uint8_t count = target->flags.count;
+        target->_keys.insert(count, index, std::move(key));
+        std::move_backward(target->_data.begin() + index,
+                           target->_data.begin() + count,
+                           target->_data.begin() + count + 1);
+        target->_data[index] = std::move(value);
+        target->flags.count++;
+        _size++;
       }
 
-      void insert(key_t key, value_t value) {
-        auto& result_node = find_node(key, _root);
-	// This key is in tree already, so we know where to place key
-        for (int i = 0; i < b_factor; i++)
-          if (result_node._keys[i] == key) {
-            result_node._data[i] = value;
-	  }
-
-	if (result_node._keys[0] > key) {
-	  // Key should be first in this node
-
-	  // And there's place for new one
-	  if (result_node.flags.count < b_factor - 1) {
-	    for (int i = result_node.flags.count; i >= 0; i--)
-	      result_node._keys[i] = result_node._keys[i-1];
-	    result_node._keys[0] = key;
-	    result_node.flags.count++;
-	  }
-
-	  // TODO: split from 0
-
-	} else if (result_node._keys[b_factor - 1] < key) {
-	  // Key should be last in the node
-
-	  // And there's place for new one
-	  if (result_node.flags.count < b_factor - 1) {
-	    result_node._keys[result_node.flags.count] = key;
-	    result_node.flags.count++;
-	  }
-
-	  // TODO: split from last
-	} else {
-	  // Key should be somewhere in the middle
-
-	}
+      /**
+       * Fills empty tree from pairs in [first, last) sorted by increasing key
+
+         Leaves are packed to about \c fill of their capacity and inner
+         levels are built bottom-up over them, so nothing is searched or
+         split on the way. Pairs are spread evenly, so no node is left under
+         its minimal fill. Throws std::logic_error when the tree isn't
+         empty or keys are not strictly increasing, the tree is left empty.
+       */
+      template <typename It>
+      void bulk_load(It first, It last, double fill = 1.0) {
+        if (_size)
+          throw std::logic_error("Bulk load needs an empty tree");
+        // Lazy erases may have left inner nodes and leaves behind
+        clear();
+        const size_t count = std::distance(first, last);
+        if (!count)
+          return;
+
+        const size_t per_leaf = std::clamp<size_t>(b_factor * fill + 0.5, 1, b_factor);
+        const size_t leaves = std::max<size_t>(1, std::min((count + per_leaf - 1) / per_leaf, count / min_leaf));
+        std::vector<node_id> level;
+        std::vector<key_t> firsts;
+        level.reserve(leaves);
+        firsts.reserve(leaves);
+        try {
+          auto pair = first;
+          for (size_t n = 0; n < leaves; n++) {
+            const auto id = n ? make_leaf() : _root;
+            if (n)
+              leaf(level.back())._next = id;
+            level.push_back(id);
+            auto& target = leaf(id);
+            const size_t size = count / leaves + (n < count % leaves);
+            for (size_t i = 0; i < size; i++, ++pair) {
+              auto&& item = *pair;
+              const key_t& key = item.first;
+              const bool ordered = i ? target._keys.compare(i - 1, key) < 0 :
+                                   !n || leaf(level[n - 1])._keys.compare(leaf(level[n - 1]).flags.count - 1, key) < 0;
+              if (!ordered)
+                throw std::logic_error("Bulk loaded keys are not sorted");
+              if (!i)
+                firsts.push_back(key);
+              target._keys.insert(i, i, std::forward<decltype(item)>(item).first);
+              target._data[i] = std::forward<decltype(item)>(item).second;
+              target.flags.count = i + 1;
+            }
+          }
+        } catch (...) {
+          clear();
+          throw;
+        }
+
+        // Every inner node takes up to b_factor + 1 children, first keys of all but first are separators
+        while (level.size() > 1) {
+          const size_t parents = (level.size() + b_factor) / (b_factor + 1);
+          std::vector<node_id> upper;
+          std::vector<key_t> upper_firsts;
+          size_t child = 0;
+          for (size_t n = 0; n < parents; n++) {
+            const auto id = make_layer();
+            if (n)
+              layer(upper.back())._next = id;
+            upper.push_back(id);
+            upper_firsts.push_back(std::move(firsts[child]));
+            auto& target = layer(id);
+            const size_t size = level.size() / parents + (n < level.size() % parents);
+            for (size_t i = 0; i < size; i++, child++) {
+              target._links[i] = level[child];
+              node(level[child])._parent = id;
+              if (i)
+                target._keys.insert(i - 1, i - 1, std::move(firsts[child]));
+            }
+            target.flags.count = size - 1;
+          }
+          level = std::move(upper);
+          firsts = std::move(upper_firsts);
+        }
+        _root = level.front();
+        _size = count;
+      }
+
+      /**
+       * Removes \c key from the tree
+
+         Returns false when there was no such key. Under-full leaf is
+         either fixed right away or left for \c compact(), depending on
+         underflow policy.
+       */
+      bool erase(const key_t& key) {
+        const auto id = find_leaf(key);
+        auto& target = leaf(id);
+        const uint8_t count = target.flags.count;
+        const auto index = target._keys.lower_bound(count, key);
+        if (index >= count || target._keys.compare(index, key) != 0)
+          return false;
+
+        target._keys.erase(count, index);
+        std::move(target._data.begin() + index + 1, target._data.begin() + count, target._data.begin() + index);
+        target._data[count - 1] = value_t{};
+        target.flags.count--;
+        _size--;
+
+        if (target.flags.count < min_leaf) {
+          if (_underflow == Underflow::Eager)
+            rebalance(id);
+          else
+            mark_underfull(id);
+        }
+        return true;
+      }
+
+      /**
+       * Rebalances up to \c budget nodes marked by lazy erase
+
+         Meant to be called periodically from a maintenance pass, small
+         budget keeps each call short. Returns number of processed nodes.
+       */
+      size_t compact(size_t budget = std::numeric_limits<size_t>::max()) {
+        size_t processed = 0;
+        while (!_underfull.empty() && processed < budget) {
+          const auto id = _underfull.back();
+          _underfull.pop_back();
+          if (!live(id) || !node(id).flags.isUnderfull)
+            continue;
+          rebalance(id);
+          processed++;
+        }
+        return processed;
+      }
+
+      /** Drops all keys, releasing node memory in one go */
+      void clear() {
+        _underfull.clear();
+        _leaf_arena.clear();
+        _layer_arena.clear();
+        _root = make_leaf();
+        _size = 0;
+      }
+
+      /** Returns memory of freed nodes when possible */
+      void shrink_to_fit() {
+        compact();
+        _underfull.shrink_to_fit();
+        _leaf_arena.shrink_to_fit();
+        _layer_arena.shrink_to_fit();
+      }
+
+      Stats stats() const {
+        const size_t underfull = std::count_if(_underfull.cbegin(), _underfull.cend(),
+                                               [this](node_id id) {
+          return live(id) && node(id).flags.isUnderfull;
+        });
+        return {
+                 _leaf_arena.size(),
+                 _layer_arena.size(),
+                 _leaf_arena.available() + _layer_arena.available(),
+                 underfull,
+                 _leaf_arena.bytes() + _layer_arena.bytes()
+        };
       }
     };
   }
@@ -0,0 +1,305 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <bit>
+
+namespace structure {
+  namespace bptree {
+
+    /**
+     * Appends memcmp-comparable representation of an integer to \c out
+
+       Integers are written big-endian with the sign bit flipped, so
+       byte-wise comparison of the result matches numeric order.
+     */
+    template <typename T,
+              std::enable_if_t<std::is_integral_v<T> > * = nullptr>
+    void append_normalized(std::string& out, T value) {
+      using unsigned_t = std::make_unsigned_t<T>;
+      auto bits = static_cast<unsigned_t>(value);
+      if constexpr (std::is_signed_v<T>)
+        bits ^= unsigned_t(1) << (sizeof(T) * 8 - 1);
+      for (int shift = (sizeof(T) - 1) * 8; shift >= 0; shift -= 8)
+        out.push_back(static_cast<char>((bits >> shift) & 0xFF));
+    }
+
+    /**
+     * Appends memcmp-comparable representation of a string to \c out
+
+       Zero bytes are escaped as 0x00 0xFF and the string is terminated
+       with 0x00 0x00, so composite keys built from several fields keep
+       field-by-field ordering.
+     */
+    inline void append_normalized(std::string& out, std::string_view value) {
+      for (const char c : value) {
+        out.push_back(c);
+        if (c == '\0')
+          out.push_back('\xFF');
+      }
+      out.push_back('\0');
+      out.push_back('\0');
+    }
+
+    /** Builds a normalized composite key from \c fields */
+    template <typename ... Fields>
+    std::string normalized_key(const Fields& ... fields) {
+      std::string result;
+      (append_normalized(result, fields), ...);
+      return result;
+    }
+
+    /**
+     * Sorted key storage of a single tree node
+
+       Generic version keeps full keys in place. Every method gets the
+       current number of keys in node as \c count, since the node owns it.
+     */
+    template <typename key_t, uint8_t b_factor>
+    class KeyArray {
+      std::array<key_t, b_factor> _keys = {};
+
+    public:
+      key_t key(uint8_t idx) const {
+        return _keys[idx];
+      }
+
+      /** Three-way comparison of stored key \c idx against \c key */
+      int compare(uint8_t idx, const key_t& key) const {
+        if (_keys[idx] < key)
+          return -1;
+        return key < _keys[idx] ? 1 : 0;
+      }
+
+      /** Index of first key not less than \c key */
+      uint8_t lower_bound(uint8_t count, const key_t& key) const {
+        return std::lower_bound(_keys.cbegin(), _keys.cbegin() + count, key) - _keys.cbegin();
+      }
+
+      /** Index of first key greater than \c key */
+      uint8_t upper_bound(uint8_t count, const key_t& key) const {
+        return std::upper_bound(_keys.cbegin(), _keys.cbegin() + count, key) - _keys.cbegin();
+      }
+
+      void insert(uint8_t count, uint8_t idx, key_t key) {
+        std::move_backward(_keys.begin() + idx, _keys.begin() + count, _keys.begin() + count + 1);
+        _keys[idx] = std::move(key);
+      }
+
+      void erase(uint8_t count, uint8_t idx) {
+        std::move(_keys.begin() + idx + 1, _keys.begin() + count, _keys.begin() + idx);
+        _keys[count - 1] = key_t{};
+      }
+
+      void set(uint8_t count, uint8_t idx, key_t key) {
+        _keys[idx] = std::move(key);
+      }
+
+      /** Moves keys from \c from to \c count into empty \c dst */
+      void move_tail(uint8_t count, uint8_t from, KeyArray& dst) {
+        std::move(_keys.begin() + from, _keys.begin() + count, dst._keys.begin());
+        std::fill(_keys.begin() + from, _keys.begin() + count, key_t{});
+      }
+    };
+
+    /**
+     * Prefix-compressed storage for string keys
+
+       Keys are compared as unsigned byte strings, which is the order of
+       \c std::string itself. The prefix common to all keys in node is
+       stored once, then first \c head_len bytes of every key remainder
+       are kept inline as a big-endian integer, so most comparisons during
+       search are plain integer compares over a dense array. Remaining
+       bytes live out of line in a single per-node buffer.
+     */
+    template <uint8_t b_factor>
+    class KeyArray<std::string, b_factor> {
+      static constexpr size_t head_len = sizeof(uint64_t);
+
+      std::string _prefix;                          /**< Prefix shared by all keys in node */
+      std::array<uint64_t, b_factor> _heads = {};   /**< Inline key heads after prefix */
+      std::array<uint32_t, b_factor> _lengths = {}; /**< Key lengths without prefix */
+      std::array<uint32_t, b_factor> _tails = {};   /**< Offsets of key tails in _suffixes */
+      std::string _suffixes;                        /**< Out of line key tails */
+      size_t _live = 0;                             /**< Bytes of _suffixes still referenced */
+
+      static uint64_t head_of(const char* data, size_t len) {
+        uint8_t bytes[head_len] = {};
+        std::memcpy(bytes, data, std::min(len, head_len));
+        uint64_t head;
+        std::memcpy(&head, bytes, head_len);
+        if constexpr (std::endian::native == std::endian::little)
+          head = __builtin_bswap64(head);
+        return head;
+      }
+
+      static size_t tail_len(size_t len) {
+        return len > head_len ? len - head_len : 0;
+      }
+
+      /** Search key preprocessed against node prefix once per node */
+      struct Probe {
+        int order;            /**< Nonzero when key is outside of the node prefix */
+        uint64_t head;
+        const char* tail;
+        size_t length;
+      };
+
+      Probe probe(const std::string& key) const {
+        const size_t common = std::min(key.size(), _prefix.size());
+        int order = std::memcmp(key.data(), _prefix.data(), common);
+        if (!order && key.size() < _prefix.size())
+          order = -1;
+        if (order)
+          return {order, 0, nullptr, 0};
+
+        const size_t length = key.size() - _prefix.size();
+        const char* rest = key.data() + _prefix.size();
+        return {0, head_of(rest, length), rest + std::min(length, head_len), length};
+      }
+
+      int compare(uint8_t idx, const Probe& p) const {
+        if (p.order)
+          return p.order < 0 ? 1 : -1;
+        if (_heads[idx] != p.head)
+          return _heads[idx] < p.head ? -1 : 1;
+        const auto stored = _lengths[idx];
+        const int result = std::memcmp(_suffixes.data() + _tails[idx], p.tail,
+                                       std::min(tail_len(stored), tail_len(p.length)));
+        if (result)
+          return result;
+        return stored < p.length ? -1 : stored > p.length;
+      }
+
+      void encode(uint8_t idx, const char* rest, size_t length) {
+        _heads[idx] = head_of(rest, length);
+        _lengths[idx] = length;
+        _tails[idx] = _suffixes.size();
+        if (length > head_len) {
+          _suffixes.append(rest + head_len, length - head_len);
+          _live += length - head_len;
+        }
+      }
+
+      /** Re-encodes sorted \c keys from scratch with their longest common prefix */
+      void assign(const std::vector<std::string>& keys) {
+        _prefix.clear();
+        _suffixes.clear();
+        _live = 0;
+        if (!keys.empty()) {
+          const auto& first = keys.front();
+          const auto& last = keys.back();
+          const auto mismatch = std::mismatch(first.cbegin(), first.cend(),
+                                              last.cbegin(), last.cend());
+          _prefix.assign(first.cbegin(), mismatch.first);
+        }
+        for (size_t i = 0; i < keys.size(); i++)
+          encode(i, keys[i].data() + _prefix.size(), keys[i].size() - _prefix.size());
+        for (size_t i = keys.size(); i < b_factor; i++)
+          _heads[i] = _lengths[i] = _tails[i] = 0;
+      }
+
+      std::vector<std::string> keys(uint8_t from, uint8_t to) const {
+        std::vector<std::string> result;
+        result.reserve(to - from);
+        for (uint8_t i = from; i < to; i++)
+          result.push_back(key(i));
+        return result;
+      }
+
+    public:
+      std::string key(uint8_t idx) const {
+        std::string result;
+        const auto length = _lengths[idx];
+        result.reserve(_prefix.size() + length);
+        result.append(_prefix);
+        for (size_t i = 0; i < std::min<size_t>(length, head_len); i++)
+          result.push_back(static_cast<char>(_heads[idx] >> (56 - 8 * i)));
+        result.append(_suffixes, _tails[idx], tail_len(length));
+        return result;
+      }
+
+      int compare(uint8_t idx, const std::string& key) const {
+        return compare(idx, probe(key));
+      }
+
+      uint8_t lower_bound(uint8_t count, const std::string& key) const {
+        const auto p = probe(key);
+        uint8_t low = 0, high = count;
+        while (low < high) {
+          const uint8_t mid = (low + high) / 2;
+          if (compare(mid, p) < 0)
+            low = mid + 1;
+          else
+            high = mid;
+        }
+        return low;
+      }
+
+      uint8_t upper_bound(uint8_t count, const std::string& key) const {
+        const auto p = probe(key);
+        uint8_t low = 0, high = count;
+        while (low < high) {
+          const uint8_t mid = (low + high) / 2;
+          if (compare(mid, p) <= 0)
+            low = mid + 1;
+          else
+            high = mid;
+        }
+        return low;
+      }
+
+      void insert(uint8_t count, uint8_t idx, std::string key) {
+        if (count == 0) {
+          assign({std::move(key)});
+          return;
+        }
+        if (key.size() < _prefix.size() || key.compare(0, _prefix.size(), _prefix) != 0) {
+          // New key does not share whole prefix, node has to be re-encoded
+          auto all = keys(0, count);
+          all.insert(all.begin() + idx, std::move(key));
+          assign(all);
+          return;
+        }
+        for (int i = count; i > idx; i--) {
+          _heads[i] = _heads[i - 1];
+          _lengths[i] = _lengths[i - 1];
+          _tails[i] = _tails[i - 1];
+        }
+        encode(idx, key.data() + _prefix.size(), key.size() - _prefix.size());
+      }
+
+      void erase(uint8_t count, uint8_t idx) {
+        _live -= tail_len(_lengths[idx]);
+        for (int i = idx; i < count - 1; i++) {
+          _heads[i] = _heads[i + 1];
+          _lengths[i] = _lengths[i + 1];
+          _tails[i] = _tails[i + 1];
+        }
+        _heads[count - 1] = _lengths[count - 1] = _tails[count - 1] = 0;
+        if (count == 1 || _suffixes.size() > 2 * _live + 64)
+          assign(keys(0, count - 1));
+      }
+
+      void set(uint8_t count, uint8_t idx, std::string key) {
+        erase(count, idx);
+        insert(count - 1, idx, std::move(key));
+      }
+
+      void move_tail(uint8_t count, uint8_t from, KeyArray& dst) {
+        dst.assign(keys(from, count));
+        assign(keys(0, from));
+      }
+
+      /** Shared prefix of keys in node, exposed for diagnostics */
+      const std::string& prefix() const {
+        return _prefix;
+      }
+    };
+  }
+}
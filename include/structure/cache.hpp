@@ -0,0 +1,193 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "structure/hashtable.hpp"
+
+namespace structure {
+  namespace hashtable {
+
+    /** Bounds of a \c Cache, whichever is reached first triggers eviction, \c entries can't be 0 */
+    struct Limits {
+      size_t entries = std::numeric_limits<size_t>::max();
+      size_t bytes = std::numeric_limits<size_t>::max();
+    };
+
+    struct Counters {
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t evictions;
+    };
+
+    /**
+     * HashTable bounded by entry count and memory, evicting with CLOCK
+
+       Every entry has a slot in a ring with a reference bit. A hit only
+       sets the bit, so lookups never reorder anything. When an insert
+       doesn't fit, the clock hand walks the ring clearing bits and evicts
+       the first entry not referenced since the previous pass. New entries
+       start unreferenced, so keys seen once go before keys seen twice.
+     */
+    template <typename key_t, typename value_t, auto hash>
+    class Cache {
+    public:
+      /** Called with every evicted entry before it is dropped, e.g. to write it back */
+      using evict_fn = std::function<void(const key_t&, value_t&)>;
+
+    private:
+      struct Slot {
+        value_t value;
+        uint32_t index;                     /**< Position in the ring */
+      };
+
+      struct Entry {
+        key_t key;
+        size_t bytes;
+        bool referenced;
+        bool live;
+      };
+
+      HashTable<key_t, Slot, hash> _table;
+      std::vector<Entry> _ring;
+      std::vector<uint32_t> _free;          /**< Ring positions of dropped entries */
+      size_t _hand = 0;
+      size_t _size = 0;
+      size_t _bytes = 0;
+      Limits _limits;
+      evict_fn _on_evict;
+      Counters _counters = {};
+
+      template <typename T>
+      static size_t dynamic(const T& value) {
+        if constexpr (std::is_same_v<T, std::string>) {
+          // Short strings keep characters in the object itself
+          const auto data = reinterpret_cast<uintptr_t>(value.data());
+          const auto self = reinterpret_cast<uintptr_t>(&value);
+          return data >= self && data < self + sizeof(value) ? 0 : value.capacity() + 1;
+        } else {
+          return 0;
+        }
+      }
+
+      /** Approximate memory of an entry: node, ring slot and heap parts of key and value */
+      static size_t weight(const key_t& key, const value_t& value) {
+        return sizeof(Node<key_t, Slot>) + sizeof(Entry) + 2 * dynamic(key) + dynamic(value);
+      }
+
+      void drop(uint32_t index) {
+        auto& entry = _ring[index];
+        _table.erase(entry.key);
+        entry.live = false;
+        entry.key = key_t{};
+        _free.push_back(index);
+        _size--;
+        _bytes -= entry.bytes;
+      }
+
+      /** Evicts one entry, never the one at \c keep */
+      void evict(size_t keep = std::numeric_limits<size_t>::max()) {
+        while (true) {
+          if (_hand == _ring.size())
+            _hand = 0;
+          auto& entry = _ring[_hand];
+          const auto index = _hand++;
+          if (!entry.live || index == keep)
+            continue;
+          if (entry.referenced) {
+            entry.referenced = false;
+            continue;
+          }
+          if (_on_evict)
+            _on_evict(entry.key, _table.find(entry.key)->value);
+          drop(index);
+          _counters.evictions++;
+          return;
+        }
+      }
+
+    public:
+      Cache(Limits limits, evict_fn on_evict = nullptr) :
+        _limits(limits),
+        _on_evict(std::move(on_evict)) {
+        if (!_limits.entries)
+          throw std::invalid_argument("Cache can't be limited to 0 entries");
+      }
+
+      /** Cached value of \c key or nullptr, a hit marks the entry as referenced */
+      value_t* find(const key_t& key) {
+        auto slot = _table.find(key);
+        if (!slot) {
+          _counters.misses++;
+          return nullptr;
+        }
+        _counters.hits++;
+        _ring[slot->index].referenced = true;
+        return &slot->value;
+      }
+
+      /** Stores \c value for \c key, evicting other entries when over limits */
+      void put(const key_t& key, value_t value) {
+        const auto bytes = weight(key, value);
+        if (auto slot = _table.find(key)) {
+          auto& entry = _ring[slot->index];
+          _bytes += bytes - entry.bytes;
+          entry.bytes = bytes;
+          entry.referenced = true;
+          slot->value = std::move(value);
+          // Grown entry makes room for itself by evicting others
+          const auto index = slot->index;
+          while (_bytes > _limits.bytes && _size > 1)
+            evict(index);
+          return;
+        }
+
+        while (_size && (_size >= _limits.entries || _bytes + bytes > _limits.bytes))
+          evict();
+
+        uint32_t index;
+        if (_free.empty()) {
+          index = _ring.size();
+          _ring.push_back({key, bytes, false, true});
+        } else {
+          index = _free.back();
+          _free.pop_back();
+          _ring[index] = {key, bytes, false, true};
+        }
+        _table.try_emplace(key, Slot{std::move(value), index});
+        _size++;
+        _bytes += bytes;
+      }
+
+      /** Drops \c key without calling the eviction callback */
+      bool erase(const key_t& key) {
+        auto slot = _table.find(key);
+        if (!slot)
+          return false;
+        drop(slot->index);
+        return true;
+      }
+
+      size_t size() const {
+        return _size;
+      }
+
+      /** Approximate memory held by entries */
+      size_t bytes() const {
+        return _bytes;
+      }
+
+      const Limits& limits() const {
+        return _limits;
+      }
+
+      const Counters& counters() const {
+        return _counters;
+      }
+    };
+  }
+}
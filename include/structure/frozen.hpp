@@ -0,0 +1,303 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "structure/log.hpp"
+#include "algo/hash_append.hpp"
+#include "tools/tmpl.hpp"
+#include "structure/hashtable.hpp"
+
+namespace structure {
+  namespace frozen {
+
+    /** Keys per index bucket on average */
+    constexpr size_t bucket_load = 4;
+
+    /** Pilot with this bit set stores the slot of a single-key bucket directly */
+    constexpr uint32_t direct = 1u << 31;
+
+    inline uint64_t mix(uint64_t x) {
+      x ^= x >> 33;
+      x *= 0xff51afd7ed558ccdull;
+      x ^= x >> 33;
+      x *= 0xc4ceb9fe1a85ec53ull;
+      return x ^ (x >> 33);
+    }
+
+    inline uint64_t bucket(uint64_t hash, uint64_t buckets) {
+      return mix(hash) % buckets;
+    }
+
+    /** Slot of a key with \c hash in a bucket with \c pilot, one of \c slots */
+    inline uint64_t slot(uint64_t hash, uint32_t pilot, uint64_t slots) {
+      if (pilot & direct)
+        return pilot & ~direct;
+      return mix(hash ^ (pilot * 0x9e3779b97f4a7c15ull)) % slots;
+    }
+
+    /**
+     * 64-bit hash of \c key under \c seed
+
+       Narrower hash functions are replaced by \c highway64 keyed by the
+       seed: no function of a 32-bit hash tells apart more keys than that,
+       and seeding CRC through its init value only XORs all hashes with the
+       same constant, so keys colliding once collide under every seed.
+     */
+    template <auto hash, typename key_t>
+    uint64_t hash_key(const key_t& key, uint64_t seed) {
+      using Ret = decltype(tmpl::ret(hash));
+      if constexpr (sizeof(Ret) >= sizeof(uint64_t))
+        return algo::hash::hash_value<hash>(key, Ret(seed));
+      else
+        return algo::hash::hash_value<algo::hash::highway64>(key, seed);
+    }
+
+    template <typename key_t>
+    bool same(const key_t& a, const key_t& b) {
+      if constexpr (std::is_convertible_v<key_t, const char *> && !std::is_same_v<key_t, std::string>)
+        return strcmp(a, b) == 0;
+      else
+        return a == b;
+    }
+
+    /**
+     * Immutable table indexed by a minimal perfect hash
+
+       Keys are hashed once into buckets of about \c bucket_load keys and
+       each bucket gets a pilot that maps its keys to distinct slots of a
+       dense array of exactly \c size entries (hash and displace, as CHD).
+       A lookup is one hash, a read of the pilot and a read of the slot,
+       where the key is compared to reject keys that were never added.
+       Built by \c Builder or \c freeze.
+     */
+    template <typename key_t, typename value_t, auto hash>
+    class Table {
+    public:
+      struct Entry {
+        key_t key;
+        value_t value;
+      };
+
+    private:
+      uint64_t _seed = 0;
+      std::vector<uint32_t> _pilots;
+      std::vector<Entry> _entries;
+
+      template <typename, typename, auto>
+      friend class Builder;
+
+    public:
+      Table() = default;
+
+      /** Entry of \c key or nullptr */
+      const Entry* entry(const key_t& key) const {
+        if (_entries.empty())
+          return nullptr;
+        const auto hashed = hash_key<hash>(key, _seed);
+        const auto pilot = _pilots[bucket(hashed, _pilots.size())];
+        const auto& found = _entries[slot(hashed, pilot, _entries.size())];
+        return same(found.key, key) ? &found : nullptr;
+      }
+
+      /** Value of \c key or nullptr */
+      const value_t* find(const key_t& key) const {
+        const auto found = entry(key);
+        return found ? &found->value : nullptr;
+      }
+
+      const value_t& at(const key_t& key) const {
+        if (auto value = find(key))
+          return *value;
+        throw std::out_of_range("Not found");
+      }
+
+      const value_t& operator[] (const key_t& key) const {
+        return at(key);
+      }
+
+      size_t size() const {
+        return _entries.size();
+      }
+
+      /** Calls \c fn(key, value) for every entry in slot order */
+      template <typename F>
+      void for_each(F&& fn) const {
+        for (const auto& entry : _entries)
+          fn(entry.key, entry.value);
+      }
+
+      /** Seed the hash function was run with */
+      uint64_t seed() const {
+        return _seed;
+      }
+
+      const std::vector<uint32_t>& pilots() const {
+        return _pilots;
+      }
+
+      /** Entries in slot order */
+      const std::vector<Entry>& entries() const {
+        return _entries;
+      }
+
+      /** Memory taken by index and entries, without heap parts of keys and values */
+      size_t bytes() const {
+        return _pilots.size() * sizeof(uint32_t) + _entries.size() * sizeof(Entry);
+      }
+    };
+
+    /**
+     * Collects entries and builds a frozen \c Table of them
+
+       Throws std::invalid_argument when a key was added twice.
+     */
+    template <typename key_t, typename value_t, auto hash>
+    class Builder {
+      using table_t = Table<key_t, value_t, hash>;
+      using entry_t = typename table_t::Entry;
+
+      static constexpr uint32_t max_pilot = 1 << 20;
+      static constexpr uint64_t max_seeds = 64;
+
+      std::vector<entry_t> _entries;
+
+      /** Finds pilots for \c seed, false when the seed doesn't work out */
+      bool place(uint64_t seed, std::vector<uint32_t>& pilots, std::vector<uint32_t>& order) const {
+        const size_t count = _entries.size();
+        std::vector<uint64_t> hashes(count);
+        for (size_t i = 0; i < count; i++)
+          hashes[i] = hash_key<hash>(_entries[i].key, seed);
+
+        // Entry indices grouped by bucket, larger buckets are placed first
+        const size_t buckets = pilots.size();
+        std::vector<uint32_t> starts(buckets + 1, 0);
+        for (auto hashed : hashes)
+          starts[bucket(hashed, buckets) + 1]++;
+        std::partial_sum(starts.begin(), starts.end(), starts.begin());
+        std::vector<uint32_t> members(count);
+        {
+          auto fill = starts;
+          for (size_t i = 0; i < count; i++)
+            members[fill[bucket(hashes[i], buckets)]++] = i;
+        }
+        std::vector<uint32_t> by_size(buckets);
+        std::iota(by_size.begin(), by_size.end(), 0);
+        std::stable_sort(by_size.begin(), by_size.end(), [&starts](uint32_t a, uint32_t b) {
+          return starts[a + 1] - starts[a] > starts[b + 1] - starts[b];
+        });
+
+        std::vector<bool> taken(count, false);
+        std::vector<uint64_t> slots;
+        size_t free_slot = 0;
+        for (auto b : by_size) {
+          const auto first = members.begin() + starts[b];
+          const auto last = members.begin() + starts[b + 1];
+          const size_t size = last - first;
+          if (!size)
+            break;
+
+          if (size == 1) {
+            while (taken[free_slot])
+              free_slot++;
+            pilots[b] = direct | free_slot;
+            taken[free_slot] = true;
+            order[free_slot] = *first;
+            continue;
+          }
+
+          for (auto i = first; i != last; ++i)
+            for (auto j = first; j != i; ++j)
+              if (hashes[*i] == hashes[*j]) {
+                if (same(_entries[*i].key, _entries[*j].key))
+                  throw std::invalid_argument("Duplicate key in frozen table");
+                return false;
+              }
+
+          uint32_t pilot = 0;
+          for (; pilot < max_pilot; pilot++) {
+            slots.clear();
+            bool fits = true;
+            for (auto i = first; fits && i != last; ++i) {
+              const auto position = slot(hashes[*i], pilot, count);
+              fits = !taken[position] && std::find(slots.begin(), slots.end(), position) == slots.end();
+              slots.push_back(position);
+            }
+            if (fits)
+              break;
+          }
+          if (pilot == max_pilot)
+            return false;
+
+          pilots[b] = pilot;
+          for (size_t i = 0; i < size; i++) {
+            taken[slots[i]] = true;
+            order[slots[i]] = first[i];
+          }
+        }
+        return true;
+      }
+
+    public:
+      void reserve(size_t count) {
+        _entries.reserve(count);
+      }
+
+      void add(key_t key, value_t value) {
+        _entries.push_back({std::move(key), std::move(value)});
+      }
+
+      size_t size() const {
+        return _entries.size();
+      }
+
+      /** Builds the table, entries are moved into it and the builder is left empty */
+      table_t build() {
+        if (_entries.size() >= direct)
+          throw std::length_error("Too many entries for a frozen table");
+
+        table_t table;
+        if (_entries.empty())
+          return table;
+
+        std::vector<uint32_t> pilots(_entries.size() / bucket_load + 1);
+        std::vector<uint32_t> order(_entries.size());
+        uint64_t seed = 0;
+        for (; seed < max_seeds; seed++) {
+          std::fill(pilots.begin(), pilots.end(), 0);
+          if (place(seed, pilots, order))
+            break;
+          STRUCTURE_DEBUG << "Frozen table seed " << seed << " failed, retrying";
+        }
+        if (seed == max_seeds)
+          throw std::runtime_error("Can't build perfect hash for frozen table");
+
+        table._seed = seed;
+        table._pilots = std::move(pilots);
+        table._entries.reserve(_entries.size());
+        for (auto index : order)
+          table._entries.push_back(std::move(_entries[index]));
+        _entries.clear();
+        STRUCTURE_TRACE << "Frozen table of " << table.size() << " entries built with seed " << seed;
+        return table;
+      }
+    };
+
+    /** Frozen copy of \c table */
+    template <typename key_t, typename value_t, auto hash, class Ret>
+    Table<key_t, value_t, hash> freeze(const hashtable::HashTable<key_t, value_t, hash, Ret>& table) {
+      Builder<key_t, value_t, hash> builder;
+      table.for_each([&builder](const key_t& key, const value_t& value) {
+        builder.add(key, value);
+      });
+      return builder.build();
+    }
+  }
+}
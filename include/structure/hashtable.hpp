@@ -7,26 +7,40 @@
 #include <exception>
 #include <type_traits>
 #include <cstring>
-
-#include "logging.hpp"
+#include <algorithm>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "structure/log.hpp"
+#include "algo/hash_append.hpp"
+#include "tools/memory.hpp"
+#include "tools/metrics.hpp"
+#include "tools/thread_pool.hpp"
 #include "tools/tmpl.hpp"
+#include "structure/write_batch.hpp"
 
 namespace structure {
   namespace hashtable {
 
+    using tools::memory::Pool;
+
+    /** Nodes live in the pool of their table, so links know how to free them */
+    template <typename node_t>
+    using NodePtr = std::unique_ptr<node_t, tools::memory::Pooled<node_t> >;
+
     template <typename key_t, typename value_t>
     class Node {
       key_t _key;
       value_t _value = {};
-      std::unique_ptr<Node<key_t, value_t> > _next = nullptr;
+      NodePtr<Node<key_t, value_t> > _next = nullptr;
 
     public:
-      Node(const key_t& key, const value_t& value) :
-        _key(key),
-        _value(value) {};
-
-      Node(const key_t& key) :
-        _key(key) {};
+      /** Node for \c key with value constructed in place from \c args */
+      template <typename K, typename... Args>
+      explicit Node(K&& key, Args&&... args) :
+        _key(std::forward<K>(key)),
+        _value(std::forward<Args>(args)...) {}
 
       value_t& value() {
         return _value;
@@ -46,8 +60,15 @@ namespace structure {
         return std::nullopt;
       }
 
-      value_t& insert(const key_t& key) {
-        auto node = std::unique_ptr<Node<key_t, value_t> >(new Node(key));
+      template <typename F>
+      void for_each(F&& fn) const {
+        for (auto node = this; node; node = node->_next.get())
+          fn(node->_key, node->_value);
+      }
+
+      template <typename K, typename... Args>
+      value_t& insert(Pool& pool, K&& key, Args&&... args) {
+        auto node = NodePtr<Node>(pool.create<Node>(std::forward<K>(key), std::forward<Args>(args)...));
         node->_next = std::move(_next);
         _next = std::move(node);
         return _next->value();
@@ -90,26 +111,47 @@ namespace structure {
       };
 
       Type _type = Type::Nothing;
-      std::unique_ptr<Node<key_t, value_t> > _first_node = nullptr;
+      NodePtr<Node<key_t, value_t> > _first_node = nullptr;
     public:
 
       Bucket() {}
 
-      value_t& set(const key_t& key) {
+      /**
+       * Constructs value from \c args unless \c key is present
+
+         Returns the value and whether it was inserted. Neither the key nor
+         the arguments are touched when the key is already there.
+       */
+      template <typename K, typename... Args>
+      std::pair<value_t*, bool> try_emplace(Pool& pool, K&& key, Args&&... args) {
         switch (_type) {
         case Type::Nothing:
-          _first_node = std::unique_ptr<Node<key_t, value_t> >(new Node<key_t, value_t>(key));
+          _first_node.reset(pool.create<Node<key_t, value_t> >(std::forward<K>(key), std::forward<Args>(args)...));
           _type = Type::List;
-          return _first_node->value();
+          return {&_first_node->value(), true};
         case Type::List:
         default:
           if (auto&& val = _first_node->find(key))
-            return val->get();
+            return {&val->get(), false};
           else
-            return _first_node->insert(key);
+            return {&_first_node->insert(pool, std::forward<K>(key), std::forward<Args>(args)...), true};
         }
       }
 
+      template <typename K, typename V>
+      std::pair<value_t*, bool> insert_or_assign(Pool& pool, K&& key, V&& value) {
+        if (auto found = find(key)) {
+          *found = std::forward<V>(value);
+          return {found, false};
+        }
+        return try_emplace(pool, std::forward<K>(key), std::forward<V>(value));
+      }
+
+      template <typename K>
+      value_t& set(Pool& pool, K&& key) {
+        return *try_emplace(pool, std::forward<K>(key)).first;
+      }
+
       value_t const& get(const key_t& key) const {
         switch (_type) {
         case Type::Nothing:
@@ -123,7 +165,23 @@ namespace structure {
         }
       }
 
+      value_t* find(const key_t& key) const {
+        if (_type == Type::Nothing)
+          return nullptr;
+        if (auto&& val = _first_node->find(key))
+          return &val->get();
+        return nullptr;
+      }
+
+      template <typename F>
+      void for_each(F&& fn) const {
+        if (_type == Type::List)
+          _first_node->for_each(fn);
+      }
+
       void erase(const key_t& key) {
+        if (_type == Type::Nothing)
+          return;
         if (_first_node->erase(key)) {
           _first_node = nullptr;
           _type = Type::Nothing;
@@ -131,32 +189,153 @@ namespace structure {
       }
     };
 
+    /**
+     * Buckets and nodes of a table, mapped according to a memory policy
+
+       Bucket array is one mapping and nodes come from a pool of the same
+       policy, so with huge pages lookups take few TLB entries and NUMA
+       placement covers all of the table. Parallel loads create nodes in
+       pools of their workers, which are kept along with the main one.
+     */
     template <typename key_t, typename value_t, size_t size>
     class Storage {
-      std::unique_ptr<std::array<Bucket<key_t, value_t>, size> > _array = std::make_unique<std::array<Bucket<key_t, value_t>, size> > ();
+      using array_t = std::array<Bucket<key_t, value_t>, size>;
+
+      struct Unmap {
+        tools::memory::Pages pages;
+
+        void operator()(array_t* array) const {
+          array->~array_t();
+          tools::memory::unmap(array, sizeof(array_t), pages);
+        }
+      };
+
+      // Declared first to outlive nodes that are freed into them
+      std::unique_ptr<Pool> _pool;
+      std::vector<std::unique_ptr<Pool> > _loaded;
+      std::unique_ptr<array_t, Unmap> _array;
+
+      /** Bucket array fits a 2MB page, a gigantic one would be mostly wasted */
+      static tools::memory::Policy array_policy(tools::memory::Policy policy) {
+        if (policy.pages == tools::memory::Pages::Gigantic)
+          policy.pages = tools::memory::Pages::Huge;
+        return policy;
+      }
 
     public:
-      Storage()
+      /** Storage for about \c expected entries which are mapped upfront */
+      explicit Storage(const tools::memory::Policy& policy = {}, size_t expected = 0) :
+        _pool(std::make_unique<Pool>(sizeof(Node<key_t, value_t>), alignof(Node<key_t, value_t>), policy)),
+        _array(new (tools::memory::map(sizeof(array_t), array_policy(policy))) array_t(),
+               Unmap{array_policy(policy).pages})
       {
-        TRACE << "DB Storage of " << size << " created";
+        _pool->reserve(expected);
+        STRUCTURE_TRACE << "DB Storage of " << size << " created";
+      }
+
+      template <typename K>
+      value_t& set(size_t idx, K&& key) {
+        return (*_array)[idx].set(*_pool, std::forward<K>(key));
       }
 
-      value_t& set(size_t idx, key_t key) {
-        return (*_array)[idx].set(key);
+      template <typename K, typename... Args>
+      std::pair<value_t*, bool> try_emplace(size_t idx, K&& key, Args&&... args) {
+        return (*_array)[idx].try_emplace(*_pool, std::forward<K>(key), std::forward<Args>(args)...);
       }
 
-      const value_t& get(size_t idx, key_t key) const {
+      template <typename K, typename V>
+      std::pair<value_t*, bool> insert_or_assign(size_t idx, K&& key, V&& value) {
+        return (*_array)[idx].insert_or_assign(*_pool, std::forward<K>(key), std::forward<V>(value));
+      }
+
+      /** Same as \c insert_or_assign with new nodes taken from \c nodes, see \c pools */
+      template <typename K, typename V>
+      std::pair<value_t*, bool> insert_or_assign(Pool& nodes, size_t idx, K&& key, V&& value) {
+        return (*_array)[idx].insert_or_assign(nodes, std::forward<K>(key), std::forward<V>(value));
+      }
+
+      const value_t& get(size_t idx, const key_t& key) const {
         return (*_array)[idx].get(key);
       }
 
-      void erase(size_t idx, key_t key) {
+      void erase(size_t idx, const key_t& key) {
         return (*_array)[idx].erase(key);
       }
 
+      value_t* find(size_t idx, const key_t& key) const {
+        return (*_array)[idx].find(key);
+      }
+
+      template <typename F>
+      void for_each(F&& fn) const {
+        for (const auto& bucket : *_array)
+          bucket.for_each(fn);
+      }
+
+      /** Calls \c fn(key, value) for entries of bucket \c idx */
+      template <typename F>
+      void for_each(size_t idx, F&& fn) const {
+        (*_array)[idx].for_each(fn);
+      }
+
+      /** Empty pools of the storage policy, one per thread filling buckets at once */
+      std::vector<std::unique_ptr<Pool> > pools(size_t count) const {
+        std::vector<std::unique_ptr<Pool> > result;
+        for (size_t i = 0; i < count; i++)
+          result.push_back(std::make_unique<Pool>(sizeof(Node<key_t, value_t>), alignof(Node<key_t, value_t>), policy()));
+        return result;
+      }
+
+      /** Keeps pools with nodes linked into buckets */
+      void adopt(std::vector<std::unique_ptr<Pool> > pools) {
+        for (auto& pool : pools)
+          if (pool->bytes())
+            _loaded.push_back(std::move(pool));
+      }
+
+      void swap(Storage& other) {
+        std::swap(_pool, other._pool);
+        std::swap(_loaded, other._loaded);
+        std::swap(_array, other._array);
+      }
+
+      const Pool& pool() const {
+        return *_pool;
+      }
+
+      const tools::memory::Policy& policy() const {
+        return _pool->policy();
+      }
+
+      /** Memory mapped for nodes by all pools */
+      size_t bytes() const {
+        size_t total = _pool->bytes();
+        for (const auto& pool : _loaded)
+          total += pool->bytes();
+        return total;
+      }
+
     };
 
     constexpr size_t storage_len = 1 << 14;
 
+#ifdef CSDB_METRICS
+    /** Latencies of all hash tables, see tools/metrics.hpp */
+    inline tools::metrics::Latency get_latency{"hashtable.get"};
+    inline tools::metrics::Latency set_latency{"hashtable.set"};
+    inline tools::metrics::Latency erase_latency{"hashtable.erase"};
+#endif
+
+    /** Receives keys a table is accessed with, see \c HashTable::observe */
+    template <typename key_t>
+    struct Observer {
+      virtual ~Observer() = default;
+
+      /** Key was written, whether it was new or not */
+      virtual void inserted(const key_t& key) = 0;
+      virtual void looked_up(const key_t& key) = 0;
+    };
+
     template <typename key_t,
               typename value_t,
               auto hash, class Ret = decltype(tmpl::ret(hash))>
@@ -165,10 +344,21 @@ namespace structure {
       std::function<Ret(const uint8_t * data,
                         size_t size,
                         const Ret init)> hashFunc = tmpl::toFunction(hash);
+      Observer<key_t>* _observer = nullptr;
+
+      void notifyInsert(const key_t& key) const {
+        if (_observer)
+          _observer->inserted(key);
+      }
+
+      void notifyLookup(const key_t& key) const {
+        if (_observer)
+          _observer->looked_up(key);
+      }
 
       template <typename T>
-      Ret doHash(T key, tmpl::rank<0>) const {
-        const uint8_t* data = &key;
+      Ret doHash(const T& key, tmpl::rank<0>) const {
+        const uint8_t* data = reinterpret_cast<const uint8_t *>(&key);
         size_t size = sizeof(key);
         return hashFunc(data, size, 0);
       }
@@ -189,33 +379,282 @@ namespace structure {
         return hashFunc(data, size, 0);
       }
 
+      /** Composite keys are fed field by field into a running hash */
+      template <typename T,
+                std::enable_if_t<algo::hash::is_streamed_v<T> > * = nullptr>
+      Ret doHash(const T& key, tmpl::rank<2>) const {
+        return algo::hash::streamed<hash>(key, Ret(0));
+      }
+
       template <typename T>
-      Ret doHash(T t) const {
-        return doHash(t, tmpl::rank<1>{});
+      Ret doHash(const T& t) const {
+        return doHash(t, tmpl::rank<2>{});
+      }
+
+      /** Pairs hashed by one task of \c bulk_load */
+      static constexpr size_t bulk_chunk = 1 << 14;
+
+      /** Bucket ranges parallel work is split into, several per worker to even out skew */
+      static size_t partitions(const tools::ThreadPool& workers) {
+        size_t parts = 1;
+        while (parts < (workers.size() + 1) * 8 && parts < storage_len)
+          parts <<= 1;
+        return parts;
       }
 
     public:
       HashTable() {}
+
+      /** Table mapped according to \c policy with room for \c expected entries reserved */
+      explicit HashTable(const tools::memory::Policy& policy, size_t expected = 0) :
+        _storage(policy, expected) {}
+
       ~HashTable() {
-        DEBUG << "Destroying hash table";
+        STRUCTURE_DEBUG << "Destroying hash table";
       }
 
       const value_t& operator[] (const key_t& key) const {
+        CSDB_SPAN(get_latency);
+        notifyLookup(key);
         return _storage.get(doHash(key) % storage_len, key);
       }
 
       const value_t& at(const key_t& key) const {
+        CSDB_SPAN(get_latency);
+        notifyLookup(key);
         return _storage.get(doHash(key) % storage_len, key);
       }
 
       value_t& operator[] (const key_t& key) {
+        CSDB_SPAN(set_latency);
+        notifyInsert(key);
         return _storage.set(doHash(key) % storage_len, key);
       }
 
+      value_t& operator[] (key_t&& key) {
+        CSDB_SPAN(set_latency);
+        notifyInsert(key);
+        const auto idx = doHash(key) % storage_len;
+        return _storage.set(idx, std::move(key));
+      }
+
+      /**
+       * Inserts value constructed in place from \c args unless \c key is present
+
+         Returns pointer to the value of \c key and whether it was inserted.
+         A key passed as rvalue is moved into the table only on insertion.
+       */
+      template <typename... Args>
+      std::pair<value_t*, bool> try_emplace(const key_t& key, Args&&... args) {
+        CSDB_SPAN(set_latency);
+        notifyInsert(key);
+        return _storage.try_emplace(doHash(key) % storage_len, key, std::forward<Args>(args)...);
+      }
+
+      template <typename... Args>
+      std::pair<value_t*, bool> try_emplace(key_t&& key, Args&&... args) {
+        CSDB_SPAN(set_latency);
+        notifyInsert(key);
+        const auto idx = doHash(key) % storage_len;
+        return _storage.try_emplace(idx, std::move(key), std::forward<Args>(args)...);
+      }
+
+      /** Same as \c try_emplace, an existing value is left as is */
+      template <typename K, typename... Args>
+      std::pair<value_t*, bool> emplace(K&& key, Args&&... args) {
+        return try_emplace(std::forward<K>(key), std::forward<Args>(args)...);
+      }
+
+      /** Assigns \c value to \c key, inserting it when absent; returns whether it was inserted */
+      template <typename V>
+      std::pair<value_t*, bool> insert_or_assign(const key_t& key, V&& value) {
+        CSDB_SPAN(set_latency);
+        notifyInsert(key);
+        return _storage.insert_or_assign(doHash(key) % storage_len, key, std::forward<V>(value));
+      }
+
+      template <typename V>
+      std::pair<value_t*, bool> insert_or_assign(key_t&& key, V&& value) {
+        CSDB_SPAN(set_latency);
+        notifyInsert(key);
+        const auto idx = doHash(key) % storage_len;
+        return _storage.insert_or_assign(idx, std::move(key), std::forward<V>(value));
+      }
+
       void erase(const key_t& key) {
+        CSDB_SPAN(erase_latency);
         return _storage.erase(doHash(key) % storage_len, key);
       }
 
+      /** Value of \c key or nullptr, unlike \c at a miss doesn't throw */
+      value_t* find(const key_t& key) {
+        CSDB_SPAN(get_latency);
+        notifyLookup(key);
+        return _storage.find(doHash(key) % storage_len, key);
+      }
+
+      const value_t* find(const key_t& key) const {
+        CSDB_SPAN(get_latency);
+        notifyLookup(key);
+        return _storage.find(doHash(key) % storage_len, key);
+      }
+
+      /** Applies all updates of \c batch going over buckets in order */
+      void apply(WriteBatch<key_t, value_t> batch) {
+        auto& ops = batch.ops();
+        const auto order = batch.grouped([this](const key_t& key) {
+          return doHash(key) % storage_len;
+        });
+        for (const auto& [idx, op] : order) {
+          if (ops[op].value) {
+            notifyInsert(ops[op].key);
+            _storage.insert_or_assign(idx, std::move(ops[op].key), std::move(*ops[op].value));
+          } else {
+            _storage.erase(idx, ops[op].key);
+          }
+        }
+      }
+
+      /**
+       * Assigns values of key/value pairs in [first, last) hashing them on \c workers
+
+         Pairs are hashed in chunks and radix-partitioned on the high bits
+         of their bucket index, so every partition is a contiguous range of
+         buckets. Each partition is then filled by one task with nodes from
+         the pool of its worker: tasks never touch the same bucket or pool
+         and need no locks. A key present more than once gets its last
+         value, as with sequential assignment. The table must not be used
+         by other threads until the call returns. Pairs are taken from
+         move iterators by moving.
+       */
+      template <typename It>
+      void bulk_load(tools::ThreadPool& workers, It first, It last) {
+        static_assert(std::is_base_of_v<std::random_access_iterator_tag,
+                                        typename std::iterator_traits<It>::iterator_category>,
+                      "Bulk load needs random access to pairs");
+        const size_t count = last - first;
+        if (!count)
+          return;
+
+        const size_t parts = partitions(workers);
+        const size_t chunks = std::clamp<size_t>(count / bulk_chunk, 1, (workers.size() + 1) * 4);
+        const size_t per_chunk = (count + chunks - 1) / chunks;
+        std::vector<uint32_t> buckets(count);
+        std::vector<size_t> offsets(chunks * parts, 0);       // Per chunk and partition
+        tools::TaskGroup group;
+
+        for (size_t chunk = 0; chunk < chunks; chunk++)
+          workers.run(group, [&, chunk] {
+            auto counts = &offsets[chunk * parts];
+            for (size_t i = chunk * per_chunk; i < std::min(count, (chunk + 1) * per_chunk); i++) {
+              buckets[i] = doHash(first[i].first) % storage_len;
+              counts[buckets[i] * parts / storage_len]++;
+            }
+          });
+        workers.wait(group);
+
+        if (_observer)
+          for (size_t i = 0; i < count; i++)
+            notifyInsert(first[i].first);
+
+        // Partition-major prefix sums, so chunks keep input order inside a partition
+        std::vector<size_t> starts(parts + 1, count);
+        size_t offset = 0;
+        for (size_t part = 0; part < parts; part++) {
+          starts[part] = offset;
+          for (size_t chunk = 0; chunk < chunks; chunk++)
+            offset += std::exchange(offsets[chunk * parts + part], offset);
+        }
+
+        std::vector<size_t> order(count);
+        for (size_t chunk = 0; chunk < chunks; chunk++)
+          workers.run(group, [&, chunk] {
+            auto next = &offsets[chunk * parts];
+            for (size_t i = chunk * per_chunk; i < std::min(count, (chunk + 1) * per_chunk); i++)
+              order[next[buckets[i] * parts / storage_len]++] = i;
+          });
+        workers.wait(group);
+
+        auto pools = _storage.pools(workers.size() + 1);
+        for (size_t part = 0; part < parts; part++)
+          workers.run(group, [&, part] {
+            auto& nodes = *pools[workers.worker()];
+            for (size_t at = starts[part]; at < starts[part + 1]; at++) {
+              const size_t i = order[at];
+              auto&& pair = first[i];
+              _storage.insert_or_assign(nodes, buckets[i], std::forward<decltype(pair)>(pair).first,
+                                        std::forward<decltype(pair)>(pair).second);
+            }
+          });
+        try {
+          workers.wait(group);
+        } catch (...) {
+          _storage.adopt(std::move(pools));
+          throw;
+        }
+        _storage.adopt(std::move(pools));
+      }
+
+      template <typename Range>
+      void bulk_load(tools::ThreadPool& workers, Range&& pairs) {
+        bulk_load(workers, std::begin(pairs), std::end(pairs));
+      }
+
+      /**
+       * Copies all entries to freshly mapped storage on \c workers
+
+         Every task copies a range of buckets into nodes of its worker's
+         pool, so nodes of neighbouring buckets end up together and memory
+         of erased entries is given back. The new storage replaces the old
+         one only when all tasks succeeded, so a throw leaves the table as
+         it was. The table must not be used by other threads until the
+         call returns.
+       */
+      void rebuild(tools::ThreadPool& workers) {
+        Storage<key_t, value_t, storage_len> fresh(_storage.policy());
+        auto pools = fresh.pools(workers.size() + 1);
+        const size_t parts = partitions(workers);
+        tools::TaskGroup group;
+        for (size_t part = 0; part < parts; part++)
+          workers.run(group, [&, part] {
+            auto& nodes = *pools[workers.worker()];
+            for (size_t idx = part * storage_len / parts; idx < (part + 1) * storage_len / parts; idx++)
+              _storage.for_each(idx, [&](const key_t& key, const value_t& value) {
+                fresh.insert_or_assign(nodes, idx, key, value);
+              });
+          });
+        try {
+          workers.wait(group);
+        } catch (...) {
+          // Nodes already linked into fresh buckets live in these pools
+          fresh.adopt(std::move(pools));
+          throw;
+        }
+        fresh.adopt(std::move(pools));
+        _storage.swap(fresh);
+      }
+
+      /** Calls \c fn(key, value) for every entry in unspecified order */
+      template <typename F>
+      void for_each(F&& fn) const {
+        _storage.for_each(fn);
+      }
+
+      /** Memory mapped for nodes */
+      size_t node_bytes() const {
+        return _storage.bytes();
+      }
+
+      /**
+       * Reports keys of writes and lookups to \c observer, nullptr stops it
+
+         Observer must outlive the table or be replaced before it's gone.
+         Without one the only cost is a pointer check.
+       */
+      void observe(Observer<key_t>* observer) {
+        _observer = observer;
+      }
+
     };
   }
 }
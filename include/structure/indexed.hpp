@@ -0,0 +1,272 @@
+#pragma once
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "structure/bptree.hpp"
+#include "structure/hashtable.hpp"
+#include "tools/arena.hpp"
+#include "tools/thread_pool.hpp"
+
+namespace structure {
+  namespace indexed {
+
+    /** Reference to a row, stable for its lifetime */
+    using row_id = tools::Arena<int>::id_t;
+
+    /**
+     * HashTable of rows with ordered secondary indexes on their fields
+
+       Rows live in an arena and are referenced by 32-bit ids: the primary
+       HashTable maps keys to ids and every index is a B+ tree over the
+       normalized field followed by the id, so a row is stored once
+       whatever the number of indexes and rows sharing a field value stay
+       apart. Writes go through the table and update all indexes in the
+       same call; values are only handed out as const.
+
+       Fields are anything \c bptree::normalized_key takes: integers and
+       strings. Index entries sort by field and then by row id.
+     */
+    template <typename key_t, typename value_t, auto hash, uint8_t b_factor = 32>
+    class IndexedTable {
+      struct Row {
+        key_t key;
+        value_t value;
+      };
+
+      using tree_t = bptree::BPTree<std::string, row_id, b_factor>;
+      using extract_t = std::function<std::string(const value_t&)>;
+
+      struct Index {
+        std::string name;
+        extract_t extract;                    /**< Normalized field of a value */
+        std::unique_ptr<tree_t> tree;
+      };
+
+      /** Rows hashed for index entries by one task of \c add_index */
+      static constexpr size_t build_chunk = 1 << 14;
+
+      tools::Arena<Row> _rows;
+      hashtable::HashTable<key_t, row_id, hash> _primary;
+      std::vector<Index> _indexes;
+
+      static std::string entry(std::string field, row_id id) {
+        bptree::append_normalized(field, id);
+        return field;
+      }
+
+      const Index& index(const std::string& name) const {
+        for (const auto& index : _indexes)
+          if (index.name == name)
+            return index;
+        throw std::out_of_range("No index " + name);
+      }
+
+      template <typename F>
+      void visit(const Index& index, const std::string& from, const std::string& to, F&& fn) const {
+        index.tree->scan(from, to, [this, &fn](const std::string&, row_id id) {
+          const auto& row = _rows[id];
+          fn(row.key, row.value);
+        });
+      }
+
+      /** Sorted entries of \c rows for \c extract, chunks are built and merged on \c workers */
+      std::vector<std::pair<std::string, row_id> > entries(const extract_t& extract, const std::vector<row_id>& rows,
+                                                           tools::ThreadPool* workers) const {
+        using entry_t = std::pair<std::string, row_id>;
+        std::vector<entry_t> result(rows.size());
+        const size_t chunks = workers ? std::clamp<size_t>(rows.size() / build_chunk, 1, (workers->size() + 1) * 2) : 1;
+        const size_t per_chunk = (rows.size() + chunks - 1) / chunks;
+        const auto fill = [&](size_t chunk) {
+          const size_t from = std::min(rows.size(), chunk * per_chunk);
+          const size_t to = std::min(rows.size(), from + per_chunk);
+          for (size_t i = from; i < to; i++)
+            result[i] = {entry(extract(_rows[rows[i]].value), rows[i]), rows[i]};
+          std::sort(result.begin() + from, result.begin() + to);
+        };
+        if (chunks == 1) {
+          fill(0);
+          return result;
+        }
+
+        tools::TaskGroup group;
+        for (size_t chunk = 0; chunk < chunks; chunk++)
+          workers->run(group, [&fill, chunk] { fill(chunk); });
+        workers->wait(group);
+
+        // Sorted runs are merged pairwise, every round in parallel
+        for (size_t run = per_chunk; run < rows.size(); run *= 2) {
+          for (size_t from = 0; from + run < rows.size(); from += 2 * run)
+            workers->run(group, [&result, from, run] {
+              const auto middle = result.begin() + from + run;
+              const auto last = result.begin() + std::min(result.size(), from + 2 * run);
+              std::inplace_merge(result.begin() + from, middle, last);
+            });
+          workers->wait(group);
+        }
+        return result;
+      }
+
+      template <typename F>
+      void add(const std::string& name, F&& extract, tools::ThreadPool* workers) {
+        if (std::any_of(_indexes.begin(), _indexes.end(), [&name](const Index& index) { return index.name == name; }))
+          throw std::invalid_argument("Index " + name + " exists");
+
+        extract_t normalized = [extract = std::forward<F>(extract)](const value_t& value) {
+          return bptree::normalized_key(extract(value));
+        };
+        std::vector<row_id> rows;
+        rows.reserve(size());
+        _primary.for_each([&rows](const key_t&, row_id id) {
+          rows.push_back(id);
+        });
+        auto sorted = entries(normalized, rows, workers);
+
+        auto tree = std::make_unique<tree_t>();
+        tree->bulk_load(std::make_move_iterator(sorted.begin()), std::make_move_iterator(sorted.end()));
+        _indexes.push_back({name, std::move(normalized), std::move(tree)});
+      }
+
+    public:
+      IndexedTable() = default;
+
+      IndexedTable(const IndexedTable&) = delete;
+      IndexedTable& operator=(const IndexedTable&) = delete;
+
+      /**
+       * Adds index \c name on \c extract(value) and fills it with existing rows
+
+         Throws std::invalid_argument when there is an index of that name.
+       */
+      template <typename F>
+      void add_index(const std::string& name, F&& extract) {
+        add(name, std::forward<F>(extract), nullptr);
+      }
+
+      /**
+       * Same as \c add_index, fields of existing rows are extracted and sorted on \c workers
+
+         \c extract is called from worker threads and must be safe to call
+         concurrently.
+       */
+      template <typename F>
+      void add_index(const std::string& name, F&& extract, tools::ThreadPool& workers) {
+        add(name, std::forward<F>(extract), &workers);
+      }
+
+      /** Drops index \c name, returns false when there was none */
+      bool drop_index(const std::string& name) {
+        const auto found = std::find_if(_indexes.begin(), _indexes.end(), [&name](const Index& index) {
+          return index.name == name;
+        });
+        if (found == _indexes.end())
+          return false;
+        _indexes.erase(found);
+        return true;
+      }
+
+      /** Inserts or replaces row of \c key, index entries move only when their field changes */
+      void put(const key_t& key, value_t value) {
+        std::vector<std::string> fields;
+        fields.reserve(_indexes.size());
+        for (const auto& index : _indexes)
+          fields.push_back(index.extract(value));
+
+        if (const auto found = _primary.find(key)) {
+          const row_id id = *found;
+          auto& row = _rows[id];
+          for (size_t i = 0; i < _indexes.size(); i++) {
+            auto previous = _indexes[i].extract(row.value);
+            if (previous == fields[i])
+              continue;
+            _indexes[i].tree->erase(entry(std::move(previous), id));
+            _indexes[i].tree->insert(entry(std::move(fields[i]), id), id);
+          }
+          row.value = std::move(value);
+          return;
+        }
+
+        const row_id id = _rows.create(Row{key, std::move(value)});
+        _primary.try_emplace(key, id);
+        for (size_t i = 0; i < _indexes.size(); i++)
+          _indexes[i].tree->insert(entry(std::move(fields[i]), id), id);
+      }
+
+      /** Removes row of \c key, returns false when there was none */
+      bool erase(const key_t& key) {
+        const auto found = _primary.find(key);
+        if (!found)
+          return false;
+        const row_id id = *found;
+        for (auto& index : _indexes)
+          index.tree->erase(entry(index.extract(_rows[id].value), id));
+        _primary.erase(key);
+        _rows.destroy(id);
+        return true;
+      }
+
+      /** Value of \c key or nullptr */
+      const value_t* find(const key_t& key) const {
+        const auto found = _primary.find(key);
+        return found ? &_rows[*found].value : nullptr;
+      }
+
+      const value_t& at(const key_t& key) const {
+        if (auto value = find(key))
+          return *value;
+        throw std::out_of_range("Not found");
+      }
+
+      /** Calls \c fn(key, value) for rows with \c from <= field < \c to in field order */
+      template <typename Field, typename F>
+      void scan(const std::string& name, const Field& from, const Field& to, F&& fn) const {
+        visit(index(name), bptree::normalized_key(from), bptree::normalized_key(to), fn);
+      }
+
+      /** Calls \c fn(key, value) for rows with \c field */
+      template <typename Field, typename F>
+      void equal(const std::string& name, const Field& field, F&& fn) const {
+        const auto from = bptree::normalized_key(field);
+        // Any row id sorts below five 0xFF bytes
+        visit(index(name), from, from + std::string(sizeof(row_id) + 1, '\xFF'), fn);
+      }
+
+      /** Number of rows with \c field in index \c name */
+      template <typename Field>
+      size_t count(const std::string& name, const Field& field) const {
+        size_t result = 0;
+        equal(name, field, [&result](const key_t&, const value_t&) {
+          result++;
+        });
+        return result;
+      }
+
+      /** Calls \c fn(key, value) for every row in unspecified order */
+      template <typename F>
+      void for_each(F&& fn) const {
+        _primary.for_each([this, &fn](const key_t&, row_id id) {
+          const auto& row = _rows[id];
+          fn(row.key, row.value);
+        });
+      }
+
+      size_t size() const {
+        return _rows.size();
+      }
+
+      /** Names of indexes in order of creation */
+      std::vector<std::string> indexes() const {
+        std::vector<std::string> names;
+        for (const auto& index : _indexes)
+          names.push_back(index.name);
+        return names;
+      }
+    };
+  }
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+
+#include "algo/sketch.hpp"
+#include "structure/hashtable.hpp"
+
+namespace structure {
+  namespace hashtable {
+
+    /**
+     * Table observer sketching the keys it sees
+
+       Estimates how many distinct keys were written, to size a table
+       without scanning it, and tracks the most frequently written and
+       looked up keys to spot skew. Each key is hashed once per access by
+       \c hash_fn, independently of the table hash.
+
+       Like the table it's not thread-safe. Stats of tables on different
+       threads or shards are combined with \c merge.
+     */
+    template <typename key_t, auto hash_fn = algo::hash::highway64>
+    class KeyStats : public Observer<key_t> {
+      algo::sketch::HyperLogLog _distinct;
+      algo::sketch::TopK<key_t, hash_fn> _writes;
+      algo::sketch::TopK<key_t, hash_fn> _reads;
+
+    public:
+      explicit KeyStats(uint8_t precision = 14, size_t k = 16,
+                        const algo::sketch::CountMin& counts = algo::sketch::CountMin()) :
+        _distinct(precision), _writes(k, counts), _reads(k, counts) {}
+
+      void inserted(const key_t& key) override {
+        const auto hashed = algo::sketch::hash_key<key_t, hash_fn>(key);
+        _distinct.add(hashed);
+        _writes.add_hashed(key, hashed);
+      }
+
+      void looked_up(const key_t& key) override {
+        _reads.add_hashed(key, algo::sketch::hash_key<key_t, hash_fn>(key));
+      }
+
+      void merge(const KeyStats& other) {
+        _distinct.merge(other._distinct);
+        _writes.merge(other._writes);
+        _reads.merge(other._reads);
+      }
+
+      /** Estimated number of distinct keys written */
+      double distinct() const {
+        return _distinct.estimate();
+      }
+
+      const algo::sketch::HyperLogLog& distinct_sketch() const {
+        return _distinct;
+      }
+
+      const algo::sketch::TopK<key_t, hash_fn>& writes() const {
+        return _writes;
+      }
+
+      const algo::sketch::TopK<key_t, hash_fn>& reads() const {
+        return _reads;
+      }
+    };
+  }
+}
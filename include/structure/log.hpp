@@ -0,0 +1,18 @@
+#pragma once
+#include "logging.hpp"
+
+/**
+ * Logging of data structures
+
+   Structures log through these instead of the cslog macros, so a build
+   with CSDB_NO_STRUCTURE_LOGGING defined (cmake -DNO_STRUCTURE_LOGGING=True)
+   drops the calls: statements still compile but are never executed and
+   their arguments are never evaluated.
+ */
+#ifdef CSDB_NO_STRUCTURE_LOGGING
+#define STRUCTURE_TRACE while (false) TRACE
+#define STRUCTURE_DEBUG while (false) DEBUG
+#else
+#define STRUCTURE_TRACE TRACE
+#define STRUCTURE_DEBUG DEBUG
+#endif
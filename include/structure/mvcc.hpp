@@ -0,0 +1,375 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "algo/hash_append.hpp"
+#include "structure/log.hpp"
+#include "tools/tmpl.hpp"
+#include "structure/hashtable.hpp"
+#include "structure/write_batch.hpp"
+
+namespace structure {
+  namespace mvcc {
+
+    /**
+     * Hash table keeping multiple versions of every value
+
+       Each committed write gets the next timestamp and is prepended to
+       the version chain of its key, erase writes a tombstone. A snapshot
+       pins the last committed timestamp and sees for every key the newest
+       version not younger than that, so it reads a consistent state while
+       writers go on. Readers never wait for writers: pinning takes a short
+       registry lock, lookups none, as chains and the key index are
+       published with release stores and only ever grow at the head.
+       Writers are serialized among themselves.
+
+       Versions no snapshot can reach anymore, those older than the newest
+       version visible at the oldest pinned timestamp, are freed by the
+       background collector every \c gc_interval or on \c collect(). Keys
+       erased below that horizon are unlinked from the index, their chains
+       are freed once every snapshot that might still walk them is gone.
+     */
+    template <typename key_t, typename value_t, auto hash>
+    class Table {
+      struct Version {
+        uint64_t timestamp;
+        std::optional<value_t> value;       /**< Empty for a tombstone */
+        std::atomic<Version*> older{nullptr};
+      };
+
+      struct Chain {
+        key_t key;
+        std::atomic<Version*> head{nullptr};
+        std::atomic<Chain*> next{nullptr};
+      };
+
+      using registry_t = std::multiset<uint64_t>;
+
+      std::unique_ptr<std::array<std::atomic<Chain*>, hashtable::storage_len> > _buckets =
+        std::make_unique<std::array<std::atomic<Chain*>, hashtable::storage_len> >();
+      std::atomic<uint64_t> _committed{0};   /**< Timestamp of the last visible write */
+      std::atomic<size_t> _versions{0};
+      std::mutex _write_lock;
+      std::mutex _gc_lock;
+      std::vector<std::pair<uint64_t, Chain*> > _retired;  /**< Unlinked chains with timestamp of unlinking */
+
+      std::mutex _registry_lock;
+      registry_t _pinned;
+
+      std::chrono::milliseconds _gc_interval;
+      std::mutex _sleep_lock;
+      std::condition_variable _wake;
+      bool _stop = false;
+      std::thread _collector;
+
+      static size_t bucket(const key_t& key) {
+        return algo::hash::hash_value<hash>(key) % hashtable::storage_len;
+      }
+
+      static bool same(const key_t& a, const key_t& b) {
+        if constexpr (std::is_convertible_v<key_t, const char *> && !std::is_same_v<key_t, std::string>)
+          return strcmp(a, b) == 0;
+        else
+          return a == b;
+      }
+
+      Chain* find(const key_t& key) const {
+        for (auto chain = (*_buckets)[bucket(key)].load(std::memory_order_acquire); chain; chain = chain->next.load(std::memory_order_acquire))
+          if (same(chain->key, key))
+            return chain;
+        return nullptr;
+      }
+
+      static const Version* visible(const Chain* chain, uint64_t timestamp) {
+        auto version = chain ? chain->head.load(std::memory_order_acquire) : nullptr;
+        while (version && version->timestamp > timestamp)
+          version = version->older.load(std::memory_order_acquire);
+        return version;
+      }
+
+      /** Prepends version to the chain of \c key, under write lock */
+      void prepend(size_t idx, const key_t& key, uint64_t timestamp, std::optional<value_t> value) {
+        auto& head = (*_buckets)[idx];
+        auto chain = head.load(std::memory_order_relaxed);
+        while (chain && !same(chain->key, key))
+          chain = chain->next.load(std::memory_order_relaxed);
+        if (!chain) {
+          chain = new Chain{key};
+          chain->next.store(head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+          head.store(chain, std::memory_order_release);
+        }
+        auto version = new Version{timestamp, std::move(value)};
+        version->older.store(chain->head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        chain->head.store(version, std::memory_order_release);
+        _versions.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      uint64_t write(const key_t& key, std::optional<value_t> value) {
+        std::lock_guard<std::mutex> guard(_write_lock);
+        const auto timestamp = _committed.load(std::memory_order_relaxed) + 1;
+        prepend(bucket(key), key, timestamp, std::move(value));
+        _committed.store(timestamp, std::memory_order_release);
+        return timestamp;
+      }
+
+      registry_t::iterator pin(uint64_t& timestamp) {
+        std::lock_guard<std::mutex> guard(_registry_lock);
+        timestamp = _committed.load(std::memory_order_acquire);
+        return _pinned.insert(timestamp);
+      }
+
+      void unpin(registry_t::iterator position) {
+        std::lock_guard<std::mutex> guard(_registry_lock);
+        _pinned.erase(position);
+      }
+
+      static size_t release(Version* version) {
+        size_t freed = 0;
+        while (version) {
+          auto older = version->older.load(std::memory_order_relaxed);
+          delete version;
+          version = older;
+          freed++;
+        }
+        return freed;
+      }
+
+      static bool erased(const Chain* chain, uint64_t horizon) {
+        auto head = chain->head.load(std::memory_order_acquire);
+        return head && !head->value && head->timestamp <= horizon;
+      }
+
+      /** Unlinks chains of \c bucket erased at or below \c horizon, under write lock */
+      void unlink(std::atomic<Chain*>& bucket, uint64_t horizon) {
+        auto link = &bucket;
+        for (auto chain = link->load(std::memory_order_relaxed); chain; chain = link->load(std::memory_order_relaxed)) {
+          if (!erased(chain, horizon)) {
+            link = &chain->next;
+            continue;
+          }
+          // Readers already on the chain still find their way on through its next
+          link->store(chain->next.load(std::memory_order_relaxed), std::memory_order_release);
+          _retired.emplace_back(_committed.load(std::memory_order_relaxed), chain);
+        }
+      }
+
+      /**
+       * Frees retired chains, returns the number of versions they held
+
+         A reader pinned at or below the unlinking timestamp may have found
+         the chain before it was unlinked, later ones can't reach it.
+       */
+      size_t reclaim() {
+        std::optional<uint64_t> oldest;
+        {
+          std::lock_guard<std::mutex> guard(_registry_lock);
+          if (!_pinned.empty())
+            oldest = *_pinned.begin();
+        }
+
+        size_t freed = 0;
+        auto kept = _retired.begin();
+        for (auto& [timestamp, chain] : _retired) {
+          if (oldest && *oldest <= timestamp) {
+            *kept++ = {timestamp, chain};
+            continue;
+          }
+          freed += release(chain->head.load(std::memory_order_relaxed));
+          delete chain;
+        }
+        _retired.erase(kept, _retired.end());
+        return freed;
+      }
+
+      void collect_loop() {
+        std::unique_lock<std::mutex> lock(_sleep_lock);
+        while (!_wake.wait_for(lock, _gc_interval, [this] { return _stop; })) {
+          lock.unlock();
+          collect();
+          lock.lock();
+        }
+      }
+
+    public:
+      /**
+       * Consistent read-only view of the table
+
+         Values returned by \c get stay valid while the snapshot is alive.
+       */
+      class Snapshot {
+        const Table* _table;
+        uint64_t _timestamp;
+        registry_t::iterator _position;
+
+        friend class Table;
+
+        Snapshot(Table& table) :
+          _table(&table),
+          _position(table.pin(_timestamp)) {}
+
+      public:
+        Snapshot(Snapshot&& other) :
+          _table(std::exchange(other._table, nullptr)),
+          _timestamp(other._timestamp),
+          _position(other._position) {}
+
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+
+        ~Snapshot() {
+          if (_table)
+            const_cast<Table*>(_table)->unpin(_position);
+        }
+
+        uint64_t timestamp() const {
+          return _timestamp;
+        }
+
+        /** Value of \c key as of the snapshot, nullptr when absent */
+        const value_t* get(const key_t& key) const {
+          auto version = visible(_table->find(key), _timestamp);
+          return version && version->value ? &*version->value : nullptr;
+        }
+
+        /** Calls \c fn(key, value) for every key present in the snapshot */
+        template <typename F>
+        void for_each(F&& fn) const {
+          for (const auto& bucket : *_table->_buckets) {
+            for (auto chain = bucket.load(std::memory_order_acquire); chain;
+                 chain = chain->next.load(std::memory_order_acquire)) {
+              auto version = visible(chain, _timestamp);
+              if (version && version->value)
+                fn(chain->key, *version->value);
+            }
+          }
+        }
+      };
+
+      /** Table with background collection every \c gc_interval, zero disables it */
+      explicit Table(std::chrono::milliseconds gc_interval = std::chrono::milliseconds(100)) :
+        _gc_interval(gc_interval) {
+        if (_gc_interval.count())
+          _collector = std::thread([this] { collect_loop(); });
+      }
+
+      Table(const Table&) = delete;
+      Table& operator=(const Table&) = delete;
+
+      ~Table() {
+        if (_collector.joinable()) {
+          {
+            std::lock_guard<std::mutex> guard(_sleep_lock);
+            _stop = true;
+          }
+          _wake.notify_one();
+          _collector.join();
+        }
+        for (auto& bucket : *_buckets) {
+          auto chain = bucket.load(std::memory_order_relaxed);
+          while (chain) {
+            release(chain->head.load(std::memory_order_relaxed));
+            delete std::exchange(chain, chain->next.load(std::memory_order_relaxed));
+          }
+        }
+        for (auto& [timestamp, chain] : _retired) {
+          release(chain->head.load(std::memory_order_relaxed));
+          delete chain;
+        }
+        STRUCTURE_DEBUG << "Destroying versioned table";
+      }
+
+      /** Commits \c value for \c key, returns commit timestamp */
+      uint64_t set(const key_t& key, value_t value) {
+        return write(key, std::move(value));
+      }
+
+      /** Commits removal of \c key, returns commit timestamp */
+      uint64_t erase(const key_t& key) {
+        return write(key, std::nullopt);
+      }
+
+      /**
+       * Commits all updates of \c batch with one timestamp
+
+         Snapshots see either none or all of them. Returns commit timestamp.
+       */
+      uint64_t apply(WriteBatch<key_t, value_t> batch) {
+        auto& ops = batch.ops();
+        const auto order = batch.grouped(bucket);
+        std::lock_guard<std::mutex> guard(_write_lock);
+        const auto timestamp = _committed.load(std::memory_order_relaxed) + 1;
+        for (const auto& [idx, op] : order)
+          prepend(idx, ops[op].key, timestamp, std::move(ops[op].value));
+        _committed.store(timestamp, std::memory_order_release);
+        return timestamp;
+      }
+
+      /** Latest committed value of \c key */
+      std::optional<value_t> get(const key_t& key) {
+        // Pinned, so the collector can't free the version while it is copied
+        const auto pinned = snapshot();
+        if (auto value = pinned.get(key))
+          return *value;
+        return std::nullopt;
+      }
+
+      /** Pins the current state, writes committed later are invisible to it */
+      Snapshot snapshot() {
+        return Snapshot(*this);
+      }
+
+      uint64_t timestamp() const {
+        return _committed.load(std::memory_order_acquire);
+      }
+
+      /** Frees versions and erased keys no snapshot can see, returns the number of versions */
+      size_t collect() {
+        std::lock_guard<std::mutex> gc_guard(_gc_lock);
+        uint64_t horizon;
+        {
+          std::lock_guard<std::mutex> guard(_registry_lock);
+          horizon = _pinned.empty() ? _committed.load(std::memory_order_acquire) : *_pinned.begin();
+        }
+
+        size_t freed = 0;
+        for (auto& bucket : *_buckets) {
+          bool stale = false;
+          for (auto chain = bucket.load(std::memory_order_acquire); chain;
+               chain = chain->next.load(std::memory_order_acquire)) {
+            auto keep = const_cast<Version*>(visible(chain, horizon));
+            if (keep)
+              freed += release(keep->older.exchange(nullptr, std::memory_order_acq_rel));
+            stale = stale || erased(chain, horizon);
+          }
+          if (stale) {
+            std::lock_guard<std::mutex> guard(_write_lock);
+            unlink(bucket, horizon);
+          }
+        }
+        freed += reclaim();
+        _versions.fetch_sub(freed, std::memory_order_relaxed);
+        if (freed)
+          STRUCTURE_TRACE << "Collected " << freed << " versions below " << horizon;
+        return freed;
+      }
+
+      /** Versions held, including ones waiting for collection */
+      size_t versions() const {
+        return _versions.load(std::memory_order_relaxed);
+      }
+    };
+  }
+}
@@ -0,0 +1,474 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "tools/tmpl.hpp"
+
+namespace structure {
+  namespace shared {
+
+    /**
+     * Segment holding a HashTable shared between processes
+
+       The segment is either a POSIX shared memory object, when its name is
+       like "/name" without other slashes, or a file mapped from any other
+       path. It starts with \c Header, followed by stripe sequence numbers,
+       bucket heads and the heap nodes are carved from. Links are offsets
+       from the start of segment, so every process can map it anywhere.
+       Size of the segment is fixed at creation.
+     */
+    struct Header {
+      char magic[8];
+      uint32_t version;
+      uint32_t stripes;
+      uint64_t hash_check;              /**< Hash of \c hash_probe, catches opening with another hash */
+      uint32_t key_size;                /**< Size of fixed-size keys, 0 for strings */
+      uint32_t value_size;              /**< Size of fixed-size values, 0 for strings */
+      uint64_t buckets;
+      uint64_t size;                    /**< Bytes in segment */
+      uint64_t stripes_offset;
+      uint64_t buckets_offset;
+      uint64_t heap_offset;
+      std::atomic<uint64_t> top;        /**< First never allocated heap byte */
+      std::atomic<uint64_t> count;      /**< Entries in table */
+      std::atomic<uint64_t> updates;    /**< Published updates */
+      std::atomic<uint32_t> ready;      /**< Set by the writer once segment is laid out */
+      uint32_t padding;
+      uint64_t free[120];               /**< Lists of released blocks by size class, writer only */
+    };
+
+    /**
+     * Entry in a bucket chain, key and value bytes follow
+
+       Everything a reader looks at before validating its sequence is
+       atomic, so torn reads are only possible in key and value bytes.
+     */
+    struct Node {
+      std::atomic<uint64_t> next;       /**< Offset of next node, 0 ends the chain */
+      std::atomic<uint64_t> hash;
+      std::atomic<uint32_t> key_size;
+      std::atomic<uint32_t> value_size;
+
+      static constexpr size_t bytes(size_t key_size, size_t value_size) {
+        return sizeof(Node) + key_size + value_size;
+      }
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+                  "Atomics in shared memory must not need locks");
+
+    constexpr std::string_view hash_probe = "csdb shared";
+
+    /** Layout of a segment fixed at creation */
+    struct Options {
+      size_t bytes = 64 << 20;          /**< Segment size including header and buckets */
+      size_t expected = 0;              /**< Entries to size buckets for, 0 derives it from \c bytes */
+      size_t stripes = 1024;            /**< Sequence numbers buckets share, power of 2 */
+    };
+
+    /** Identity of key, value and hash types checked when a segment is opened */
+    struct Types {
+      uint64_t hash_check;
+      uint32_t key_size;
+      uint32_t value_size;
+    };
+
+    /** Mapping of a segment, see \c Header */
+    class Segment {
+      std::string _name;
+      char* _base = nullptr;
+      size_t _size = 0;
+      bool _writable = false;
+
+      void map(int fd, size_t size, bool writable);
+
+    public:
+      /** Creates segment \c name from scratch, replacing an existing one */
+      Segment(const std::string& name, const Options& options, const Types& types);
+
+      /**
+       * Maps existing segment \c name read-only
+
+         Throws std::system_error when it can't be mapped and
+         std::runtime_error when it was laid out for other types.
+       */
+      Segment(const std::string& name, const Types& types);
+      ~Segment();
+
+      Segment(const Segment&) = delete;
+      Segment& operator=(const Segment&) = delete;
+
+      /** Removes segment \c name, mappings of it stay valid until unmapped */
+      static void remove(const std::string& name);
+
+      const Header& header() const {
+        return *reinterpret_cast<const Header *>(_base);
+      }
+
+      Header& header() {
+        return *reinterpret_cast<Header *>(_base);
+      }
+
+      std::atomic<uint64_t>& stripe(uint64_t bucket) const {
+        const auto& h = header();
+        return reinterpret_cast<std::atomic<uint64_t> *>(_base + h.stripes_offset)[bucket & (h.stripes - 1)];
+      }
+
+      std::atomic<uint64_t>& head(uint64_t bucket) const {
+        return reinterpret_cast<std::atomic<uint64_t> *>(_base + header().buckets_offset)[bucket];
+      }
+
+      /** Node at \c offset or nullptr when \c offset can't hold one */
+      Node* node(uint64_t offset) const {
+        if (offset < header().heap_offset || offset > _size - sizeof(Node) || offset % alignof(Node))
+          return nullptr;
+        return reinterpret_cast<Node *>(_base + offset);
+      }
+
+      /** Bytes following \c node or nullptr when they run past the segment */
+      const char* payload(const Node* node, uint64_t size) const {
+        const auto data = reinterpret_cast<const char *>(node + 1);
+        return size <= size_t(_base + _size - data) ? data : nullptr;
+      }
+
+      char* payload(Node* node) {
+        return reinterpret_cast<char *>(node + 1);
+      }
+
+      /** Offset of a free block of at least \c bytes, throws std::bad_alloc when segment is full */
+      uint64_t allocate(size_t bytes);
+
+      /** Returns block allocated for \c bytes to its free list */
+      void release(uint64_t offset, size_t bytes);
+
+      const std::string& name() const {
+        return _name;
+      }
+
+      bool writable() const {
+        return _writable;
+      }
+    };
+
+    /** How keys and values are laid out in a segment */
+    template <typename T, typename = void>
+    struct Bytes {
+      static_assert(std::is_trivially_copyable_v<T> && !std::is_pointer_v<T>,
+                    "Only plain values and strings can be shared between processes");
+      static constexpr uint32_t fixed = sizeof(T);
+
+      static std::string_view view(const T& value) {
+        return {reinterpret_cast<const char *>(&value), sizeof(T)};
+      }
+
+      static T load(const char* data, size_t) {
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        return value;
+      }
+    };
+
+    template <>
+    struct Bytes<std::string> {
+      static constexpr uint32_t fixed = 0;
+
+      static std::string_view view(const std::string& value) {
+        return value;
+      }
+
+      static std::string load(const char* data, size_t size) {
+        return std::string(data, size);
+      }
+    };
+
+    /**
+     * Lookups in a shared table
+
+       Buckets are split between stripes of sequence numbers, odd while the
+       writer changes one of their buckets. A lookup reads the sequence of
+       its stripe, walks the chain copying out what it finds and starts over
+       when the sequence moved meanwhile, so readers never write to the
+       segment and never wait for each other. Nodes are released only after
+       they are unlinked under the sequence of their bucket, so a walk that
+       still reaches one after it was reused always fails validation.
+     */
+    template <typename key_t, typename value_t, auto hash>
+    class View {
+      static_assert(std::is_same_v<key_t, std::string> || std::has_unique_object_representations_v<key_t>,
+                    "Keys are compared byte-wise");
+
+    protected:
+      using Ret = decltype(tmpl::ret(hash));
+
+      Segment _segment;
+
+      static Types types() {
+        return {uint64_t(hash(reinterpret_cast<const uint8_t *>(hash_probe.data()), hash_probe.size(), 0)),
+                Bytes<key_t>::fixed, Bytes<value_t>::fixed};
+      }
+
+      static uint64_t hash_of(std::string_view bytes) {
+        return uint64_t(hash(reinterpret_cast<const uint8_t *>(bytes.data()), bytes.size(), 0));
+      }
+
+      uint64_t bucket(uint64_t hashed) const {
+        return hashed & (_segment.header().buckets - 1);
+      }
+
+      static uint64_t begin(const std::atomic<uint64_t>& stripe) {
+        uint64_t sequence;
+        while ((sequence = stripe.load(std::memory_order_acquire)) & 1)
+          std::this_thread::yield();
+        return sequence;
+      }
+
+      static bool moved(const std::atomic<uint64_t>& stripe, uint64_t sequence) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return stripe.load(std::memory_order_relaxed) != sequence;
+      }
+
+      /**
+       * Calls \c fn(node, key, value) for nodes of \c bucket until it returns true
+
+         \c key and \c value are views of unvalidated bytes, \c fn can be
+         called again after its result was thrown away. Returns false when
+         the chain changed under the walk and it has to start over.
+       */
+      template <typename F>
+      bool walk(uint64_t bucket, uint64_t sequence, F&& fn) const {
+        const auto& stripe = _segment.stripe(bucket);
+        uint64_t offset = _segment.head(bucket).load(std::memory_order_acquire);
+        while (offset) {
+          const Node* node = _segment.node(offset);
+          if (!node)
+            return false;
+          const uint32_t key_size = node->key_size.load(std::memory_order_relaxed);
+          const uint32_t value_size = node->value_size.load(std::memory_order_relaxed);
+          const char* data = _segment.payload(node, uint64_t(key_size) + value_size);
+          if (!data)
+            return false;
+          if (fn(node->hash.load(std::memory_order_relaxed), std::string_view(data, key_size),
+                 std::string_view(data + key_size, value_size)))
+            return true;
+          offset = node->next.load(std::memory_order_acquire);
+          // Bounds the walk through a chain being rewritten
+          if (moved(stripe, sequence))
+            return false;
+        }
+        return true;
+      }
+
+      template <typename ... Args>
+      explicit View(Args&& ... args) :
+        _segment(std::forward<Args>(args)..., types()) {}
+
+    public:
+      /** Copy of the value of \c key */
+      std::optional<value_t> find(const key_t& key) const {
+        const auto bytes = Bytes<key_t>::view(key);
+        const uint64_t hashed = hash_of(bytes);
+        const uint64_t idx = bucket(hashed);
+        const auto& stripe = _segment.stripe(idx);
+        for (;;) {
+          const uint64_t sequence = begin(stripe);
+          std::optional<value_t> found;
+          const bool complete = walk(idx, sequence, [&](uint64_t node_hash, std::string_view node_key,
+                                                        std::string_view value) {
+            if (node_hash != hashed || node_key != bytes)
+              return false;
+            if (Bytes<value_t>::fixed && value.size() != Bytes<value_t>::fixed)
+              return true;
+            found = Bytes<value_t>::load(value.data(), value.size());
+            return true;
+          });
+          if (complete && !moved(stripe, sequence))
+            return found;
+        }
+      }
+
+      bool contains(const key_t& key) const {
+        return find(key).has_value();
+      }
+
+      /** Calls \c fn(key, value) with copies of all entries, bucket by bucket consistent */
+      template <typename F>
+      void for_each(F&& fn) const {
+        std::vector<std::pair<key_t, value_t> > entries;
+        for (uint64_t idx = 0; idx < _segment.header().buckets; idx++) {
+          const auto& stripe = _segment.stripe(idx);
+          for (;;) {
+            entries.clear();
+            const uint64_t sequence = begin(stripe);
+            const bool complete = walk(idx, sequence, [&entries](uint64_t, std::string_view key, std::string_view value) {
+              if ((!Bytes<key_t>::fixed || key.size() == Bytes<key_t>::fixed) &&
+                  (!Bytes<value_t>::fixed || value.size() == Bytes<value_t>::fixed))
+                entries.emplace_back(Bytes<key_t>::load(key.data(), key.size()),
+                                     Bytes<value_t>::load(value.data(), value.size()));
+              return false;
+            });
+            if (complete && !moved(stripe, sequence))
+              break;
+          }
+          for (const auto& [key, value] : entries)
+            fn(key, value);
+        }
+      }
+
+      size_t size() const {
+        return _segment.header().count.load(std::memory_order_acquire);
+      }
+
+      /** Updates published so far, changes whenever the table does */
+      uint64_t updates() const {
+        return _segment.header().updates.load(std::memory_order_acquire);
+      }
+
+      /** Bytes in segment not handed out yet, released blocks aside */
+      size_t available() const {
+        const auto& header = _segment.header();
+        return header.size - header.top.load(std::memory_order_relaxed);
+      }
+
+      const std::string& name() const {
+        return _segment.name();
+      }
+    };
+
+    /**
+     * Read-only table in a segment published by a \c Writer of another process
+
+       Lookups are lock-free and copy values out, so nothing points into
+       the segment after a lookup returns.
+     */
+    template <typename key_t, typename value_t, auto hash>
+    class Reader : public View<key_t, value_t, hash> {
+    public:
+      /** Maps segment \c name, throws when there is none or it holds other types */
+      explicit Reader(const std::string& name) :
+        View<key_t, value_t, hash>(name) {}
+    };
+
+    /**
+     * The only process changing a shared table
+
+       Every change is made on a new node where possible and linked in
+       under the stripe sequence of its bucket, so readers retry only when
+       they hit the bucket being changed. The writer itself is not thread
+       safe. Readers of a stripe left odd by a writer dying mid-update spin,
+       such a segment has to be created anew.
+     */
+    template <typename key_t, typename value_t, auto hash>
+    class Writer : public View<key_t, value_t, hash> {
+      using View<key_t, value_t, hash>::_segment;
+      using View<key_t, value_t, hash>::hash_of;
+      using View<key_t, value_t, hash>::bucket;
+
+      /** Offsets of the link pointing to the node of \c key and of that node, 0 when there is none */
+      std::pair<std::atomic<uint64_t>*, uint64_t> locate(uint64_t idx, uint64_t hashed, std::string_view key) {
+        std::atomic<uint64_t>* link = &_segment.head(idx);
+        for (uint64_t offset = link->load(std::memory_order_relaxed); offset;
+             offset = link->load(std::memory_order_relaxed)) {
+          Node* node = _segment.node(offset);
+          if (node->hash.load(std::memory_order_relaxed) == hashed &&
+              std::string_view(_segment.payload(node), node->key_size.load(std::memory_order_relaxed)) == key)
+            return {link, offset};
+          link = &node->next;
+        }
+        return {link, 0};
+      }
+
+      static void open(std::atomic<uint64_t>& stripe) {
+        stripe.store(stripe.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+      }
+
+      void close(std::atomic<uint64_t>& stripe) {
+        stripe.store(stripe.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        _segment.header().updates.fetch_add(1, std::memory_order_release);
+      }
+
+      void release(uint64_t offset) {
+        const Node* node = _segment.node(offset);
+        _segment.release(offset, Node::bytes(node->key_size.load(std::memory_order_relaxed),
+                                             node->value_size.load(std::memory_order_relaxed)));
+      }
+
+    public:
+      /** Creates segment \c name, replacing an existing one for new readers */
+      Writer(const std::string& name, const Options& options = {}) :
+        View<key_t, value_t, hash>(name, options) {}
+
+      /**
+       * Inserts or replaces value of \c key, returns true when it was inserted
+
+         Throws std::bad_alloc without changing the table when the segment
+         has no room for the entry.
+       */
+      bool insert_or_assign(const key_t& key, const value_t& value) {
+        const auto key_bytes = Bytes<key_t>::view(key);
+        const auto value_bytes = Bytes<value_t>::view(value);
+        if (key_bytes.size() > UINT32_MAX || value_bytes.size() > UINT32_MAX)
+          throw std::length_error("Entry is too large for shared table");
+        const uint64_t hashed = hash_of(key_bytes);
+        const uint64_t idx = bucket(hashed);
+        const auto [link, existing] = locate(idx, hashed, key_bytes);
+
+        // Filled before it is reachable, so readers see it whole
+        const uint64_t offset = _segment.allocate(Node::bytes(key_bytes.size(), value_bytes.size()));
+        Node* node = _segment.node(offset);
+        node->hash.store(hashed, std::memory_order_relaxed);
+        node->key_size.store(key_bytes.size(), std::memory_order_relaxed);
+        node->value_size.store(value_bytes.size(), std::memory_order_relaxed);
+        std::memcpy(_segment.payload(node), key_bytes.data(), key_bytes.size());
+        std::memcpy(_segment.payload(node) + key_bytes.size(), value_bytes.data(), value_bytes.size());
+
+        auto& stripe = _segment.stripe(idx);
+        open(stripe);
+        if (existing) {
+          node->next.store(_segment.node(existing)->next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+          link->store(offset, std::memory_order_release);
+        } else {
+          node->next.store(_segment.head(idx).load(std::memory_order_relaxed), std::memory_order_relaxed);
+          _segment.head(idx).store(offset, std::memory_order_release);
+          _segment.header().count.fetch_add(1, std::memory_order_relaxed);
+        }
+        close(stripe);
+        if (existing)
+          release(existing);
+        return !existing;
+      }
+
+      /** Removes \c key, returns false when there was none */
+      bool erase(const key_t& key) {
+        const auto key_bytes = Bytes<key_t>::view(key);
+        const uint64_t hashed = hash_of(key_bytes);
+        const uint64_t idx = bucket(hashed);
+        const auto [link, existing] = locate(idx, hashed, key_bytes);
+        if (!existing)
+          return false;
+
+        auto& stripe = _segment.stripe(idx);
+        open(stripe);
+        link->store(_segment.node(existing)->next.load(std::memory_order_relaxed), std::memory_order_release);
+        _segment.header().count.fetch_sub(1, std::memory_order_relaxed);
+        close(stripe);
+        release(existing);
+        return true;
+      }
+
+      /** Removes the segment, mapped readers keep the last published table */
+      void remove() {
+        Segment::remove(_segment.name());
+      }
+    };
+  }
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+#include <algorithm>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace structure {
+
+  /**
+   * Puts and erases to be applied together
+
+     Tables apply a batch in one pass: hashes are computed once, updates
+     are grouped by bucket, and a logged table writes the whole batch as
+     a single WAL record. Updates of the same key keep their order.
+   */
+  template <typename key_t, typename value_t>
+  class WriteBatch {
+  public:
+    struct Op {
+      key_t key;
+      std::optional<value_t> value;         /**< Empty for erase */
+    };
+
+  private:
+    std::vector<Op> _ops;
+
+  public:
+    void put(key_t key, value_t value) {
+      _ops.push_back({std::move(key), std::move(value)});
+    }
+
+    void erase(key_t key) {
+      _ops.push_back({std::move(key), std::nullopt});
+    }
+
+    size_t size() const {
+      return _ops.size();
+    }
+
+    bool empty() const {
+      return _ops.empty();
+    }
+
+    void clear() {
+      _ops.clear();
+    }
+
+    void reserve(size_t size) {
+      _ops.reserve(size);
+    }
+
+    const std::vector<Op>& ops() const {
+      return _ops;
+    }
+
+    std::vector<Op>& ops() {
+      return _ops;
+    }
+
+    /**
+     * Order of ops grouped by \c bucket(key)
+
+       Returns pairs of bucket and op index sorted by bucket, ops of one
+       bucket stay in insertion order.
+     */
+    template <typename F>
+    std::vector<std::pair<size_t, uint32_t> > grouped(F&& bucket) const {
+      std::vector<std::pair<size_t, uint32_t> > order;
+      order.reserve(_ops.size());
+      for (uint32_t i = 0; i < _ops.size(); i++)
+        order.emplace_back(bucket(_ops[i].key), i);
+      std::sort(order.begin(), order.end());
+      return order;
+    }
+  };
+}
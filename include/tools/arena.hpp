@@ -0,0 +1,136 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <bit>
+#include <new>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "tools/memory.hpp"
+
+namespace tools {
+
+  /**
+   * Chunked object pool addressed by 32-bit ids
+
+     Objects are placed into large page-mapped chunks and referenced by
+     index, so links between them take 4 bytes instead of 8 and never
+     need relocation. Destroyed slots are kept on a free list for reuse.
+     Dropping the whole arena unmaps chunks without walking objects when
+     \c T is trivially destructible.
+   */
+  template <typename T>
+  class Arena {
+  public:
+    using id_t = uint32_t;
+    static constexpr id_t nil = std::numeric_limits<id_t>::max();
+
+  private:
+    static constexpr size_t chunk_bytes = 2 << 20;
+    static constexpr size_t chunk_slots = std::bit_floor(std::max<size_t>(1, chunk_bytes / sizeof(T)));
+    static constexpr unsigned shift = std::countr_zero(chunk_slots);
+    static constexpr id_t mask = chunk_slots - 1;
+
+    std::vector<T*> _chunks;
+    std::vector<id_t> _free;
+    std::vector<bool> _live;
+    id_t _used = 0;                     /**< Slots ever handed out */
+    size_t _count = 0;
+    memory::Pages _pages;
+
+    T* slot(id_t id) const {
+      return _chunks[id >> shift] + (id & mask);
+    }
+
+  public:
+    explicit Arena(memory::Pages pages = memory::Pages::Normal) :
+      _pages(pages) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena() {
+      clear();
+    }
+
+    /** Constructs new object, reusing a freed slot when there is one */
+    template <typename ... Args>
+    id_t create(Args&& ... args) {
+      id_t id;
+      if (!_free.empty()) {
+        id = _free.back();
+        _free.pop_back();
+      } else {
+        if (_used == nil)
+          throw std::length_error("Arena is out of ids");
+        if ((_used >> shift) == _chunks.size())
+          _chunks.push_back(static_cast<T*>(memory::map(chunk_slots * sizeof(T), _pages)));
+        id = _used++;
+        _live.push_back(false);
+      }
+      new (slot(id)) T(std::forward<Args>(args) ...);
+      _live[id] = true;
+      _count++;
+      return id;
+    }
+
+    void destroy(id_t id) {
+      slot(id)->~T();
+      _live[id] = false;
+      _free.push_back(id);
+      _count--;
+    }
+
+    T& operator[](id_t id) {
+      return *slot(id);
+    }
+
+    const T& operator[](id_t id) const {
+      return *slot(id);
+    }
+
+    bool live(id_t id) const {
+      return id < _used && _live[id];
+    }
+
+    /** Objects alive */
+    size_t size() const {
+      return _count;
+    }
+
+    /** Freed slots waiting for reuse */
+    size_t available() const {
+      return _free.size();
+    }
+
+    /** Memory mapped for chunks */
+    size_t bytes() const {
+      return _chunks.size() * memory::mapped_size(chunk_slots * sizeof(T), _pages);
+    }
+
+    /** Drops all objects at once */
+    void clear() {
+      if constexpr (!std::is_trivially_destructible_v<T>) {
+        for (id_t id = 0; id < _used; id++)
+          if (_live[id])
+            slot(id)->~T();
+      }
+      for (auto chunk : _chunks)
+        memory::unmap(chunk, chunk_slots * sizeof(T), _pages);
+      _chunks.clear();
+      _free.clear();
+      _live.clear();
+      _used = 0;
+      _count = 0;
+    }
+
+    /** Returns memory of freed slots when nothing is alive */
+    void shrink_to_fit() {
+      if (!_count)
+        clear();
+      _free.shrink_to_fit();
+    }
+  };
+}
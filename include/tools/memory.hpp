@@ -0,0 +1,143 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace tools {
+  namespace memory {
+
+    /** Kind of pages backing a mapping */
+    enum class Pages {
+      Normal,                 /**< Regular pages */
+      Transparent,            /**< Regular mapping advised for transparent huge pages */
+      Huge,                   /**< Explicit 2MB pages, falls back to Transparent when none reserved */
+      Gigantic                /**< Explicit 1GB pages, falls back to Huge */
+    };
+
+    /** Placement of mapped memory across NUMA nodes */
+    enum class Numa {
+      Local,                  /**< Kernel default, usually the node of the faulting thread */
+      Bind,                   /**< Only the nodes of the mask */
+      Interleave              /**< Pages spread round-robin over the nodes of the mask */
+    };
+
+    /** How memory of a table is mapped */
+    struct Policy {
+      Pages pages = Pages::Normal;
+      Numa numa = Numa::Local;
+      uint64_t nodes = 0;     /**< NUMA node mask for Bind and Interleave, 0 means all online nodes */
+      bool prefault = false;  /**< Fault pages in when mapping instead of on first access */
+    };
+
+    /** Mappings of at least this size are aligned to it */
+    constexpr size_t huge_page = 2 << 20;
+
+    /** Page size of \c pages */
+    size_t page_size(Pages pages);
+
+    /** Size \c map really reserves for \c size bytes of \c pages */
+    size_t mapped_size(size_t size, Pages pages);
+
+    /** Mask of online NUMA nodes */
+    uint64_t online_nodes();
+
+    /**
+     * Maps \c size zeroed bytes according to \c policy
+
+       Throws std::bad_alloc when no memory can be mapped and
+       std::system_error when NUMA placement is refused.
+     */
+    void* map(size_t size, const Policy& policy);
+
+    /** Maps \c size zeroed bytes, throws std::bad_alloc on failure */
+    void* map(size_t size, Pages pages);
+
+    /** Releases mapping obtained from \c map with the same size and pages */
+    void unmap(void* ptr, size_t size, Pages pages);
+
+    /**
+     * Fixed-size slot allocator over mapped memory
+
+       Memory is mapped by regions of at least one page of the policy and
+       carved into 2MB aligned segments, each starting with a pointer to
+       its pool. So \c release finds the owner of a slot from its address
+       alone and smart pointers to pooled objects need no state. Freed
+       slots are reused before new ones; regions are returned only when
+       the pool is destroyed, objects still in it aren't destroyed.
+     */
+    class Pool {
+      struct Segment {
+        Pool* owner;
+      };
+
+      size_t _slot;
+      size_t _offset;                       /**< First slot in a segment */
+      Policy _policy;
+      size_t _region;
+      std::vector<void*> _regions;
+      size_t _active = 0;                   /**< Region segments are taken from */
+      char* _segment = nullptr;             /**< Next segment to start */
+      char* _next = nullptr;                /**< Next never used slot */
+      char* _end = nullptr;
+      void* _free = nullptr;                /**< Intrusive list of freed slots */
+      size_t _count = 0;
+
+      bool advance();
+
+    public:
+      Pool(size_t slot_size, size_t slot_align, const Policy& policy = {});
+      ~Pool();
+
+      Pool(const Pool&) = delete;
+      Pool& operator=(const Pool&) = delete;
+
+      void* allocate();
+      void deallocate(void* ptr);
+
+      /** Returns \c ptr to the pool it came from */
+      static void release(void* ptr) {
+        auto segment = reinterpret_cast<Segment*>(reinterpret_cast<uintptr_t>(ptr) & ~(huge_page - 1));
+        segment->owner->deallocate(ptr);
+      }
+
+      template <typename T, typename ... Args>
+      T* create(Args&& ... args) {
+        void* ptr = allocate();
+        try {
+          return new (ptr) T(std::forward<Args>(args) ...);
+        } catch (...) {
+          deallocate(ptr);
+          throw;
+        }
+      }
+
+      /** Maps regions upfront so that \c slots more allocations don't map */
+      void reserve(size_t slots);
+
+      /** Slots in use */
+      size_t size() const {
+        return _count;
+      }
+
+      /** Memory mapped for regions */
+      size_t bytes() const {
+        return _regions.size() * _region;
+      }
+
+      const Policy& policy() const {
+        return _policy;
+      }
+    };
+
+    /** Deleter of objects created in a \c Pool */
+    template <typename T>
+    struct Pooled {
+      void operator()(T* ptr) const {
+        ptr->~T();
+        Pool::release(ptr);
+      }
+    };
+  }
+}
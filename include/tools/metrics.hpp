@@ -0,0 +1,340 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Operation metrics: latency histograms, counters and trace spans
+
+   Every thread writes its own shard of each metric with plain relaxed
+   stores, so recording is a few instructions without any shared cache
+   line. Readers merge all shards, shards of exited threads are kept
+   merged aside.
+
+   Data paths are instrumented through \c CSDB_SPAN and \c CSDB_COUNT,
+   which expand to nothing unless CSDB_METRICS is defined (cmake
+   -DMETRICS=True), so a default build carries no trace of them.
+ */
+namespace tools {
+  namespace metrics {
+
+    /**
+     * Histogram of values with bounded relative error, as HDR histograms
+
+       Values below 2^sub_bits are counted exactly, every power of two
+       above is split into 2^sub_bits buckets, so percentiles are off by
+       less than 1 / 2^sub_bits. Values from 2^max_bits on share the last
+       bucket. Counts have a single writer and may be read from any thread.
+     */
+    class Histogram {
+    public:
+      static constexpr unsigned sub_bits = 6;
+      static constexpr unsigned max_bits = 40;
+      static constexpr size_t buckets = size_t(max_bits - sub_bits + 1) << sub_bits;
+
+    private:
+      std::array<std::atomic<uint64_t>, buckets> _counts;
+      std::atomic<uint64_t> _count{0};
+      std::atomic<uint64_t> _sum{0};
+      std::atomic<uint64_t> _min{UINT64_MAX};
+      std::atomic<uint64_t> _max{0};
+
+      static uint64_t get(const std::atomic<uint64_t>& value) {
+        return value.load(std::memory_order_relaxed);
+      }
+
+      static void set(std::atomic<uint64_t>& value, uint64_t to) {
+        value.store(to, std::memory_order_relaxed);
+      }
+
+    public:
+      Histogram() {
+        reset();
+      }
+
+      Histogram(const Histogram& other) :
+        Histogram() {
+        merge(other);
+      }
+
+      Histogram& operator=(const Histogram& other) {
+        if (this != &other) {
+          reset();
+          merge(other);
+        }
+        return *this;
+      }
+
+      /** Bucket of \c value */
+      static size_t index(uint64_t value) {
+        if (value < (1ull << sub_bits))
+          return value;
+        const unsigned exponent = 63 - __builtin_clzll(value);
+        if (exponent >= max_bits)
+          return buckets - 1;
+        const size_t top = value >> (exponent - sub_bits);
+        return (size_t(exponent - sub_bits + 1) << sub_bits) + top - (1ull << sub_bits);
+      }
+
+      /** Smallest value counted in bucket \c index */
+      static uint64_t lowest(size_t index) {
+        if (index < (1ull << sub_bits))
+          return index;
+        const unsigned shift = (index >> sub_bits) - 1;
+        return ((1ull << sub_bits) + (index & ((1ull << sub_bits) - 1))) << shift;
+      }
+
+      /** Largest value counted in bucket \c index */
+      static uint64_t highest(size_t index) {
+        if (index == buckets - 1)
+          return UINT64_MAX;
+        return lowest(index + 1) - 1;
+      }
+
+      /** Counts \c value \c times, only from the thread owning the histogram */
+      void record(uint64_t value, uint64_t times = 1) {
+        auto& bucket = _counts[index(value)];
+        set(bucket, get(bucket) + times);
+        set(_count, get(_count) + times);
+        set(_sum, get(_sum) + value * times);
+        if (value < get(_min))
+          set(_min, value);
+        if (value > get(_max))
+          set(_max, value);
+      }
+
+      /** Adds counts of \c other, which may be written meanwhile */
+      void merge(const Histogram& other) {
+        uint64_t count = 0;
+        for (size_t i = 0; i < buckets; i++)
+          if (const auto times = get(other._counts[i])) {
+            set(_counts[i], get(_counts[i]) + times);
+            count += times;
+          }
+        if (!count)
+          return;
+        // Totals follow the buckets actually read, so percentiles stay consistent
+        set(_count, get(_count) + count);
+        set(_sum, get(_sum) + get(other._sum));
+        set(_min, std::min(get(_min), get(other._min)));
+        set(_max, std::max(get(_max), get(other._max)));
+      }
+
+      void reset() {
+        for (auto& count : _counts)
+          set(count, 0);
+        set(_count, 0);
+        set(_sum, 0);
+        set(_min, UINT64_MAX);
+        set(_max, 0);
+      }
+
+      uint64_t count() const {
+        return get(_count);
+      }
+
+      uint64_t sum() const {
+        return get(_sum);
+      }
+
+      uint64_t min() const {
+        return count() ? get(_min) : 0;
+      }
+
+      uint64_t max() const {
+        return get(_max);
+      }
+
+      double mean() const {
+        return count() ? double(sum()) / count() : 0;
+      }
+
+      /**
+       * Value not exceeded by \c p percent of the recorded ones
+
+         Reported as the top of its bucket, never above the largest value
+         recorded. Zero for an empty histogram.
+       */
+      uint64_t percentile(double p) const {
+        const uint64_t total = count();
+        if (!total)
+          return 0;
+        uint64_t rank = p <= 0 ? 1 : uint64_t(p / 100 * total + 0.5);
+        rank = std::clamp<uint64_t>(rank, 1, total);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets; i++) {
+          seen += get(_counts[i]);
+          if (seen >= rank)
+            return std::max(std::min(highest(i), max()), min());
+        }
+        return max();
+      }
+    };
+
+    namespace detail {
+      /** Metrics a process may register */
+      constexpr size_t max_metrics = 256;
+
+      /** Metrics of one thread, written by it only */
+      struct Shard {
+        std::array<std::atomic<uint64_t>, max_metrics> counters;
+        std::array<std::atomic<Histogram*>, max_metrics> histograms;
+
+        Shard();
+        ~Shard();
+
+        Shard(const Shard&) = delete;
+        Shard& operator=(const Shard&) = delete;
+
+        Histogram& histogram(size_t id) {
+          auto histogram = histograms[id].load(std::memory_order_relaxed);
+          return histogram ? *histogram : allocate(id);
+        }
+
+        Histogram& allocate(size_t id);
+      };
+
+      /** Shard of the calling thread, registered for readers while it lives */
+      struct Local {
+        Shard shard;
+
+        Local();
+        ~Local();
+      };
+
+      inline Shard& local() {
+        thread_local Local local;
+        return local.shard;
+      }
+
+      enum class Kind {
+        Counter,
+        Latency
+      };
+
+      /** Id of metric \c name, registered on first use */
+      size_t enroll(const std::string& name, Kind kind);
+
+      inline uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+      }
+    }
+
+    /** Count summed over all threads */
+    class Counter {
+      size_t _id;
+      std::string _name;
+
+    public:
+      /** Counters of the same name are the same counter */
+      explicit Counter(std::string name) :
+        _id(detail::enroll(name, detail::Kind::Counter)),
+        _name(std::move(name)) {}
+
+      void add(uint64_t n = 1) {
+        auto& count = detail::local().counters[_id];
+        count.store(count.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+      }
+
+      /** Sum of all threads so far */
+      uint64_t value() const;
+
+      const std::string& name() const {
+        return _name;
+      }
+    };
+
+    /** Latencies in nanoseconds, one histogram per thread */
+    class Latency {
+      size_t _id;
+      std::string _name;
+
+    public:
+      /** Latencies of the same name are the same metric */
+      explicit Latency(std::string name) :
+        _id(detail::enroll(name, detail::Kind::Latency)),
+        _name(std::move(name)) {}
+
+      void record(uint64_t ns) {
+        detail::local().histogram(_id).record(ns);
+      }
+
+      /** Histograms of all threads merged */
+      Histogram snapshot() const;
+
+      const std::string& name() const {
+        return _name;
+      }
+    };
+
+    /** Finished span as passed to a tracer */
+    struct SpanRecord {
+      const std::string& name;
+      uint64_t start;           /**< Steady clock nanoseconds */
+      uint64_t duration;
+      unsigned depth;           /**< Spans open around it in the same thread */
+    };
+
+    using tracer_fn = void (*)(const SpanRecord& span);
+
+    namespace detail {
+      inline std::atomic<tracer_fn> tracer{nullptr};
+      inline thread_local unsigned depth = 0;
+    }
+
+    /** Passes every finished span to \c fn from its thread, nullptr stops tracing */
+    inline void trace(tracer_fn fn) {
+      detail::tracer.store(fn, std::memory_order_release);
+    }
+
+    /** Times its scope into a latency and reports itself to the tracer, if any */
+    class Span {
+      Latency& _latency;
+      uint64_t _start;
+
+    public:
+      explicit Span(Latency& latency) :
+        _latency(latency),
+        _start(detail::now()) {
+        detail::depth++;
+      }
+
+      ~Span() {
+        const uint64_t duration = detail::now() - _start;
+        detail::depth--;
+        _latency.record(duration);
+        if (auto fn = detail::tracer.load(std::memory_order_acquire))
+          fn(SpanRecord{_latency.name(), _start, duration, detail::depth});
+      }
+
+      Span(const Span&) = delete;
+      Span& operator=(const Span&) = delete;
+    };
+
+    /** Merged values of all counters by name */
+    std::vector<std::pair<std::string, uint64_t> > counters();
+
+    /** Merged histograms of all latencies by name */
+    std::vector<std::pair<std::string, Histogram> > latencies();
+  }
+}
+
+#define CSDB_METRICS_CONCAT_(a, b) a ## b
+#define CSDB_METRICS_CONCAT(a, b) CSDB_METRICS_CONCAT_(a, b)
+
+#ifdef CSDB_METRICS
+/** Times rest of the enclosing scope into \c latency */
+#define CSDB_SPAN(latency) ::tools::metrics::Span CSDB_METRICS_CONCAT(csdb_span_, __LINE__)(latency)
+/** Adds \c n to \c counter */
+#define CSDB_COUNT(counter, n) (counter).add(n)
+#else
+#define CSDB_SPAN(latency) ((void) 0)
+#define CSDB_COUNT(counter, n) ((void) 0)
+#endif
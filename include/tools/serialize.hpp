@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace tools {
+  namespace serialize {
+
+    /**
+     * Binary encoding of keys and values for on-disk formats
+
+       \c write appends encoded value to \c out, \c read decodes value from
+       the front of \c in and advances it, returning false when \c in is
+       too short. Pointers are not serializable.
+     */
+    template <typename T, typename = void>
+    struct Codec;
+
+    template <typename T>
+    struct Codec<T, std::enable_if_t<std::is_trivially_copyable_v<T> && !std::is_pointer_v<T> > > {
+      static void write(std::string& out, const T& value) {
+        out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+      }
+
+      static bool read(std::string_view& in, T& value) {
+        if (in.size() < sizeof(T))
+          return false;
+        std::memcpy(&value, in.data(), sizeof(T));
+        in.remove_prefix(sizeof(T));
+        return true;
+      }
+    };
+
+    template <>
+    struct Codec<std::string> {
+      static void write(std::string& out, const std::string& value) {
+        Codec<uint32_t>::write(out, value.size());
+        out.append(value);
+      }
+
+      static bool read(std::string_view& in, std::string& value) {
+        uint32_t size;
+        if (!Codec<uint32_t>::read(in, size) || in.size() < size)
+          return false;
+        value.assign(in.data(), size);
+        in.remove_prefix(size);
+        return true;
+      }
+    };
+
+    template <typename T>
+    void write(std::string& out, const T& value) {
+      Codec<T>::write(out, value);
+    }
+
+    template <typename T>
+    bool read(std::string_view& in, T& value) {
+      return Codec<T>::read(in, value);
+    }
+  }
+}
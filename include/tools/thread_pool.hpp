@@ -0,0 +1,95 @@
+#pragma once
+#include <cstddef>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <exception>
+#include <condition_variable>
+
+namespace tools {
+
+  /** Set of tasks to wait for together */
+  class TaskGroup {
+    friend class ThreadPool;
+    std::atomic<size_t> _pending{0};
+    std::mutex _error_lock;
+    std::exception_ptr _error = nullptr;
+  };
+
+  /**
+   * Work-stealing thread pool
+
+     Every worker owns a task deque. Tasks spawned from a worker go to
+     its own deque and are taken back in LIFO order, idle workers steal
+     the oldest tasks from others, so big chunks of work are the ones
+     which migrate. Tasks from outside go to a shared injection queue.
+     Only workers run tasks, so \c worker() tells running tasks apart.
+   */
+  class ThreadPool {
+    using task_t = std::function<void()>;
+
+    struct Queue {
+      std::mutex lock;
+      std::deque<task_t> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue> > _queues;    /**< One per worker plus injection queue */
+    std::vector<std::thread> _threads;
+    std::mutex _sleep_lock;
+    std::condition_variable _wake;
+    std::condition_variable _done;                   /**< Some group finished, wakes outside waiters */
+    std::atomic<size_t> _queued{0};
+    std::atomic<size_t> _idle{0};
+    std::atomic<bool> _stop{false};
+
+    inline static thread_local const ThreadPool* _current = nullptr;
+    inline static thread_local size_t _index = 0;
+
+    void push(task_t task);
+    bool take(size_t index, task_t& task);
+    void work(size_t index);
+
+  public:
+    explicit ThreadPool(size_t threads = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /** Number of worker threads */
+    size_t size() const {
+      return _threads.size();
+    }
+
+    /** Index of calling worker, \c size() for threads outside the pool, which never run tasks */
+    size_t worker() const {
+      return _current == this ? _index : size();
+    }
+
+    /** Workers waiting for tasks right now */
+    size_t idle() const {
+      return _idle.load(std::memory_order_relaxed);
+    }
+
+    /** Tasks waiting in all queues */
+    size_t queued() const {
+      return _queued.load(std::memory_order_relaxed);
+    }
+
+    /** Schedules \c task as a part of \c group */
+    void run(TaskGroup& group, task_t task);
+
+    /**
+     * Waits for all tasks of \c group
+
+       A worker runs queued tasks meanwhile, a thread outside the pool
+       just blocks, so any number of them can wait at once. Rethrows the
+       first exception thrown by a task of the group.
+     */
+    void wait(TaskGroup& group);
+  };
+}
@@ -0,0 +1,209 @@
+#include "database.hpp"
+#include "algo/crc32.hpp"
+#include "algo/crc64.hpp"
+#include "algo/hash_append.hpp"
+#include "storage/logged_table.hpp"
+#include "storage/lsm.hpp"
+#include "structure/hashtable.hpp"
+#include "tools/thread_pool.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+#include <thread>
+
+#include "logging.hpp"
+
+namespace csdb {
+  namespace {
+    template <auto hash>
+    class MemoryTable : public Table {
+      structure::hashtable::HashTable<std::string, std::string, hash> _table;
+
+    public:
+      MemoryTable(const tools::memory::Policy& policy, size_t expected) :
+        _table(policy, expected) {}
+
+      std::optional<std::string> get(const std::string& key) const override {
+        if (auto value = _table.find(key))
+          return *value;
+        return std::nullopt;
+      }
+
+      void put(const std::string& key, const std::string& value) override {
+        _table.insert_or_assign(key, value);
+      }
+
+      void erase(const std::string& key) override {
+        _table.erase(key);
+      }
+
+      void flush() override {}
+    };
+
+    template <auto hash>
+    class LoggedTable : public Table {
+      storage::LoggedTable<std::string, std::string, hash> _table;
+
+    public:
+      LoggedTable(const std::string& path, storage::wal::Options options) :
+        _table(path, options) {}
+
+      std::optional<std::string> get(const std::string& key) const override {
+        return _table.get(key);
+      }
+
+      void put(const std::string& key, const std::string& value) override {
+        _table.set(key, value);
+      }
+
+      void erase(const std::string& key) override {
+        _table.erase(key);
+      }
+
+      void flush() override {
+        _table.flush();
+      }
+    };
+
+    class PersistentTable : public Table {
+      storage::lsm::Engine _engine;
+
+    public:
+      PersistentTable(const std::string& dir, storage::lsm::Options options) :
+        _engine(dir, options) {}
+
+      std::optional<std::string> get(const std::string& key) const override {
+        return _engine.get(key);
+      }
+
+      void put(const std::string& key, const std::string& value) override {
+        _engine.put(key, value);
+      }
+
+      void erase(const std::string& key) override {
+        _engine.erase(key);
+      }
+
+      void flush() override {
+        _engine.flush();
+      }
+    };
+
+    /** \c Kind instantiated with the hash function selected by \c hash */
+    template <template <auto> class Kind, typename... Args>
+    std::unique_ptr<Table> make(Hash hash, Args&&... args) {
+      switch (hash) {
+      case Hash::Crc32:
+        return std::make_unique<Kind<algo::hash::crc32> >(std::forward<Args>(args)...);
+      case Hash::Highway:
+        return std::make_unique<Kind<algo::hash::highway64> >(std::forward<Args>(args)...);
+      case Hash::Crc64:
+      default:
+        return std::make_unique<Kind<algo::hash::crc64> >(std::forward<Args>(args)...);
+      }
+    }
+  }
+
+  Database::Database(Options options) :
+    _options(std::move(options)) {
+    if (_options.durability != Durability::Memory && _options.dir.empty())
+      throw std::invalid_argument("Durable tables need a directory");
+    if (!_options.preload.empty())
+      warm(_options.preload);
+    DEBUG << "Database opened with " << _slots.size() << " tables preloaded";
+  }
+
+  Database::~Database() {
+    DEBUG << "Closing database";
+  }
+
+  std::unique_ptr<Table> Database::create(const std::string& name) const {
+    if (name.empty() || name.find('/') != std::string::npos || name == "." || name == "..")
+      throw std::invalid_argument("Bad table name '" + name + "'");
+
+    const size_t share = std::max<size_t>(_options.preload.size(), 1);
+    const auto path = (std::filesystem::path(_options.dir) / name).string();
+    switch (_options.durability) {
+    case Durability::Logged:
+    case Durability::Persistent: {
+      std::filesystem::create_directories(_options.dir);
+      storage::wal::Options wal;
+      wal.sync = _options.sync;
+      if (_options.durability == Durability::Logged)
+        return make<LoggedTable>(_options.hash, path + ".wal", wal);
+      storage::lsm::Options lsm;
+      lsm.wal = wal;
+      // Active and frozen memtable are both in memory
+      if (_options.memory_budget)
+        lsm.memtable_bytes = std::max<size_t>(_options.memory_budget / share / 2, 1);
+      return std::make_unique<PersistentTable>(path, lsm);
+    }
+    case Durability::Memory:
+    default: {
+      size_t expected = _options.expected;
+      if (_options.memory_budget) {
+        const size_t entry = sizeof(structure::hashtable::Node<std::string, std::string>);
+        expected = std::min(expected, _options.memory_budget / share / entry);
+      }
+      return make<MemoryTable>(_options.hash, _options.memory, expected);
+    }
+    }
+  }
+
+  Database::Slot& Database::slot(const std::string& name) {
+    std::lock_guard<std::mutex> guard(_lock);
+    auto& slot = _slots[name];
+    if (!slot)
+      slot = std::make_unique<Slot>();
+    return *slot;
+  }
+
+  Table& Database::table(const std::string& name) {
+    auto& found = slot(name);
+    std::call_once(found.opened, [this, &found, &name] {
+      found.table = create(name);
+      found.ready.store(true, std::memory_order_release);
+      TRACE << "Table " << name << " opened";
+    });
+    return *found.table;
+  }
+
+  void Database::warm(const std::vector<std::string>& names) {
+    std::vector<std::string> pending;
+    for (const auto& name : names)
+      if (!opened(name) && std::find(pending.begin(), pending.end(), name) == pending.end())
+        pending.push_back(name);
+    if (pending.empty())
+      return;
+    if (pending.size() == 1) {
+      table(pending.front());
+      return;
+    }
+
+    const size_t threads = _options.threads ? _options.threads : std::max(std::thread::hardware_concurrency(), 1u);
+    tools::ThreadPool pool(std::min(threads, pending.size()));
+    tools::TaskGroup group;
+    for (const auto& name : pending)
+      pool.run(group, [this, &name] { table(name); });
+    pool.wait(group);
+  }
+
+  bool Database::opened(const std::string& name) const {
+    std::lock_guard<std::mutex> guard(_lock);
+    const auto found = _slots.find(name);
+    return found != _slots.end() && found->second->ready.load(std::memory_order_acquire);
+  }
+
+  void Database::flush() {
+    std::vector<Table*> tables;
+    {
+      std::lock_guard<std::mutex> guard(_lock);
+      for (const auto& [name, slot] : _slots)
+        if (slot->ready.load(std::memory_order_acquire))
+          tables.push_back(slot->table.get());
+    }
+    for (auto table : tables)
+      table->flush();
+  }
+}
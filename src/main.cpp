@@ -1,28 +1,20 @@
-#include <iostream>
-#include <functional>
-#include <memory>
+#include "database.hpp"
 
 #include "logging.hpp"
-#include "structure/hashtable.hpp"
-#include "algo/crc64.hpp"
-
-using namespace structure::hashtable;
-using namespace algo::hash;
 
 namespace csdb {
   /**
-   * Initialization of database engine
+   * Initialization of logging
+
+     Called by programs before opening a \c Database, loading the library
+     runs no code. Sets up the default logger, unit test builds log
+     everything down to trace.
    */
-#ifndef _UNIT_TEST_BUILD
-  __attribute__((constructor))
-  static
-#endif
   void init() {
-#ifdef _UNIT_TEST_BUILD
     DEFAULT_LOGGING;
+#ifdef _UNIT_TEST_BUILD
     DEFAULT_LOGGER_SEVERITY(logging::Severity::trace);
 #endif
     DEBUG << "DB init called";
-    auto ht = std::unique_ptr<HashTable<std::string, int, crc64> >{};
   }
 }
@@ -0,0 +1,322 @@
+#include "storage/io.hpp"
+#include "tools/memory.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <system_error>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "logging.hpp"
+
+namespace storage {
+  namespace io {
+    /** User data of the eventfd read, operations are tagged with their address */
+    static constexpr uint64_t event_tag = 0;
+
+    template <typename T>
+    static T* at(void* base, uint32_t offset) {
+      return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+    }
+
+    Buffer::~Buffer() {
+      if (_ring)
+        _ring->_free_buffers.push_back(_index);
+    }
+
+    Ring::Ring(Options options) :
+      _options(options) {
+      _event = ::eventfd(0, EFD_CLOEXEC);
+      if (_event < 0)
+        throw std::system_error(errno, std::generic_category(), "Can't create eventfd");
+
+      if (_options.backend != Backend::Sync && !setup()) {
+        const int error = errno;
+        if (_options.backend == Backend::Uring) {
+          ::close(_event);
+          throw std::system_error(error, std::generic_category(), "Can't set up io_uring");
+        }
+        DEBUG << "io_uring is not available (" << error << "), falling back to blocking I/O";
+      }
+
+      if (_options.buffers && _options.buffer_size) {
+        _buffers_size = size_t(_options.buffers) * _options.buffer_size;
+        _buffers = static_cast<char*>(tools::memory::map(_buffers_size, tools::memory::Pages::Normal));
+        for (int index = _options.buffers - 1; index >= 0; index--)
+          _free_buffers.push_back(index);
+        if (uring()) {
+          std::vector<iovec> vectors(_options.buffers);
+          for (unsigned i = 0; i < _options.buffers; i++)
+            vectors[i] = {_buffers + i * _options.buffer_size, _options.buffer_size};
+          _registered = syscall(__NR_io_uring_register, _fd, IORING_REGISTER_BUFFERS, vectors.data(), vectors.size()) == 0;
+          if (!_registered)
+            DEBUG << "Can't register I/O buffers (" << errno << "), using them unregistered";
+        }
+      }
+      if (uring())
+        arm_event();
+    }
+
+    Ring::~Ring() {
+      teardown();
+      tools::memory::unmap(_buffers, _buffers_size, tools::memory::Pages::Normal);
+      ::close(_event);
+    }
+
+    bool Ring::setup() {
+      io_uring_params params = {};
+      const long fd = syscall(__NR_io_uring_setup, std::max(_options.entries, 2u), &params);
+      if (fd < 0)
+        return false;
+      _fd = fd;
+
+      _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+      _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+      if (single)
+        _sq_ring_size = _cq_ring_size = std::max(_sq_ring_size, _cq_ring_size);
+      _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+      const int prot = PROT_READ | PROT_WRITE;
+      const int flags = MAP_SHARED | MAP_POPULATE;
+      _sq_ring = mmap(nullptr, _sq_ring_size, prot, flags, _fd, IORING_OFF_SQ_RING);
+      _cq_ring = single ? _sq_ring : mmap(nullptr, _cq_ring_size, prot, flags, _fd, IORING_OFF_CQ_RING);
+      _sqes = mmap(nullptr, _sqes_size, prot, flags, _fd, IORING_OFF_SQES);
+      if (_sq_ring == MAP_FAILED || _cq_ring == MAP_FAILED || _sqes == MAP_FAILED) {
+        const int error = errno;
+        teardown();
+        errno = error;
+        return false;
+      }
+
+      _sq_head = at<unsigned>(_sq_ring, params.sq_off.head);
+      _sq_tail = at<unsigned>(_sq_ring, params.sq_off.tail);
+      _sq_array = at<unsigned>(_sq_ring, params.sq_off.array);
+      _sq_mask = *at<unsigned>(_sq_ring, params.sq_off.ring_mask);
+      _sq_entries = params.sq_entries;
+      _cq_head = at<unsigned>(_cq_ring, params.cq_off.head);
+      _cq_tail = at<unsigned>(_cq_ring, params.cq_off.tail);
+      _cq_mask = *at<unsigned>(_cq_ring, params.cq_off.ring_mask);
+      _cq_entries = params.cq_entries;
+      _cqes = at<io_uring_cqe>(_cq_ring, params.cq_off.cqes);
+      DEBUG << "io_uring with " << _sq_entries << " entries set up";
+      return true;
+    }
+
+    void Ring::teardown() {
+      const auto unmap = [](void* ptr, size_t size) {
+        if (ptr && ptr != MAP_FAILED)
+          munmap(ptr, size);
+      };
+      unmap(_sqes, _sqes_size);
+      if (_cq_ring != _sq_ring)
+        unmap(_cq_ring, _cq_ring_size);
+      unmap(_sq_ring, _sq_ring_size);
+      _sq_ring = _cq_ring = _sqes = nullptr;
+      if (_fd >= 0)
+        ::close(_fd);
+      _fd = -1;
+    }
+
+    void Ring::push(Op* op) {
+      if (*_sq_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) == _sq_entries)
+        enter(_queued, 0);
+      const unsigned tail = *_sq_tail;
+      const unsigned index = tail & _sq_mask;
+      auto sqe = static_cast<io_uring_sqe*>(_sqes) + index;
+      std::memset(sqe, 0, sizeof(*sqe));
+      if (op) {
+        sqe->opcode = op->_opcode;
+        sqe->fd = op->_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(op->_addr);
+        sqe->len = op->_len;
+        sqe->off = op->_offset;
+        sqe->fsync_flags = op->_flags;
+        if (op->_opcode == IORING_OP_READ_FIXED || op->_opcode == IORING_OP_WRITE_FIXED)
+          sqe->buf_index = op->_buffer;
+        sqe->user_data = reinterpret_cast<uint64_t>(op);
+      } else {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = _event;
+        sqe->addr = reinterpret_cast<uint64_t>(&_event_value);
+        sqe->len = sizeof(_event_value);
+        sqe->user_data = event_tag;
+      }
+      _sq_array[index] = index;
+      __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+      _queued++;
+    }
+
+    void Ring::arm_event() {
+      push(nullptr);
+    }
+
+    void Ring::queue(Op* op) {
+      _in_flight++;
+      // One completion slot stays for the eventfd read
+      if (_in_flight - _waiting.size() > _cq_entries - 1)
+        _waiting.push_back(op);
+      else
+        push(op);
+    }
+
+    void Ring::enter(unsigned submit, unsigned wait) {
+      while (true) {
+        const long submitted = syscall(__NR_io_uring_enter, _fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (submitted >= 0) {
+          _queued -= submitted;
+          return;
+        }
+        if (errno != EINTR)
+          throw std::system_error(errno, std::generic_category(), "io_uring_enter failed");
+      }
+    }
+
+    size_t Ring::reap() {
+      size_t resumed = 0;
+      unsigned head = *_cq_head;
+      while (head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE)) {
+        const auto& cqe = static_cast<io_uring_cqe*>(_cqes)[head & _cq_mask];
+        const uint64_t tag = cqe.user_data;
+        const int result = cqe.res;
+        __atomic_store_n(_cq_head, ++head, __ATOMIC_RELEASE);
+        if (tag == event_tag) {
+          arm_event();
+          continue;
+        }
+        auto op = reinterpret_cast<Op*>(tag);
+        op->_result = result;
+        _in_flight--;
+        op->_handle.resume();
+        resumed++;
+      }
+      return resumed;
+    }
+
+    void Ring::post(std::coroutine_handle<> handle) {
+      {
+        std::lock_guard<std::mutex> guard(_posted_lock);
+        _posted.push_back(handle);
+      }
+      const uint64_t one = 1;
+      while (::write(_event, &one, sizeof(one)) < 0 && errno == EINTR);
+    }
+
+    size_t Ring::resume_posted() {
+      std::vector<std::coroutine_handle<> > posted;
+      {
+        std::lock_guard<std::mutex> guard(_posted_lock);
+        posted.swap(_posted);
+      }
+      for (auto handle : posted)
+        handle.resume();
+      return posted.size();
+    }
+
+    size_t Ring::poll(bool wait) {
+      size_t resumed = resume_posted();
+      if (!uring()) {
+        if (!resumed && wait) {
+          uint64_t value;
+          while (::read(_event, &value, sizeof(value)) < 0 && errno == EINTR);
+          resumed += resume_posted();
+        }
+        return resumed;
+      }
+
+      while (!_waiting.empty() && _in_flight - _waiting.size() < _cq_entries - 1) {
+        push(_waiting.front());
+        _waiting.pop_front();
+      }
+      const bool ready = resumed || *_cq_head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+      if (_queued || (wait && !ready))
+        enter(_queued, wait && !ready ? 1 : 0);
+      resumed += reap();
+      return resumed + resume_posted();
+    }
+
+    void Ring::drain() {
+      while (_spawned)
+        poll(true);
+      if (auto error = std::exchange(_error, nullptr))
+        std::rethrow_exception(error);
+    }
+
+    Ring::Detached Ring::detach(Ring& ring, Task<void> task) {
+      try {
+        co_await task;
+      } catch (...) {
+        if (!ring._error)
+          ring._error = std::current_exception();
+      }
+      ring._spawned--;
+    }
+
+    std::optional<Buffer> Ring::buffer() {
+      if (_free_buffers.empty())
+        return std::nullopt;
+      const int index = _free_buffers.back();
+      _free_buffers.pop_back();
+      return Buffer(*this, index, _buffers + size_t(index) * _options.buffer_size, _options.buffer_size);
+    }
+
+    int Ring::perform(const Op& op) {
+      ssize_t result;
+      do {
+        switch (op._opcode) {
+        case IORING_OP_READ:
+        case IORING_OP_READ_FIXED:
+          result = ::pread(op._fd, op._addr, op._len, op._offset);
+          break;
+        case IORING_OP_WRITE:
+        case IORING_OP_WRITE_FIXED:
+          result = ::pwrite(op._fd, op._addr, op._len, op._offset);
+          break;
+        default:
+          result = op._flags & IORING_FSYNC_DATASYNC ? ::fdatasync(op._fd) : ::fsync(op._fd);
+        }
+      } while (result < 0 && errno == EINTR);
+      return result < 0 ? -errno : result;
+    }
+
+    bool Ring::Op::await_ready() {
+      if (_ring->uring())
+        return false;
+      _result = perform(*this);
+      return true;
+    }
+
+    void Ring::Op::await_suspend(std::coroutine_handle<> handle) {
+      _handle = handle;
+      _ring->queue(this);
+    }
+
+    Ring::Op Ring::read(int fd, void* data, uint32_t size, uint64_t offset) {
+      return Op(*this, IORING_OP_READ, fd, data, size, offset, -1, 0);
+    }
+
+    Ring::Op Ring::read(int fd, Buffer& buffer, uint32_t size, uint64_t offset, size_t at) {
+      at = std::min(at, buffer.size());
+      return Op(*this, _registered ? IORING_OP_READ_FIXED : IORING_OP_READ, fd, buffer.data() + at,
+                std::min<size_t>(size, buffer.size() - at), offset, buffer.index(), 0);
+    }
+
+    Ring::Op Ring::write(int fd, const void* data, uint32_t size, uint64_t offset) {
+      return Op(*this, IORING_OP_WRITE, fd, const_cast<void*>(data), size, offset, -1, 0);
+    }
+
+    Ring::Op Ring::write(int fd, Buffer& buffer, uint32_t size, uint64_t offset) {
+      return Op(*this, _registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, fd, buffer.data(),
+                std::min<size_t>(size, buffer.size()), offset, buffer.index(), 0);
+    }
+
+    Ring::Op Ring::fsync(int fd, bool datasync) {
+      return Op(*this, IORING_OP_FSYNC, fd, nullptr, 0, 0, -1, datasync ? IORING_FSYNC_DATASYNC : 0);
+    }
+  }
+}
@@ -0,0 +1,670 @@
+#include "storage/lsm.hpp"
+#include "algo/crc32.hpp"
+#include "tools/metrics.hpp"
+#include "tools/serialize.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <queue>
+#include <system_error>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "logging.hpp"
+
+namespace storage {
+  namespace lsm {
+    static constexpr size_t entry_overhead = 32;
+
+#ifdef CSDB_METRICS
+    static tools::metrics::Latency get_latency{"lsm.get"};
+    static tools::metrics::Latency put_latency{"lsm.put"};
+    static tools::metrics::Latency erase_latency{"lsm.erase"};
+    static tools::metrics::Latency flush_latency{"lsm.flush"};
+    static tools::metrics::Counter stalls{"lsm.write_stalls"};
+    static tools::metrics::Counter table_reads{"lsm.table_reads"};
+#endif
+
+    static uint32_t checksum(std::string_view data) {
+      return algo::hash::crc32(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+    }
+
+    static void sync_path(const std::string& path, int flags) {
+      const int fd = ::open(path.c_str(), flags | O_CLOEXEC);
+      if (fd < 0 || ::fsync(fd) != 0) {
+        const int error = errno;
+        if (fd >= 0)
+          ::close(fd);
+        throw std::system_error(error, std::generic_category(), "Can't sync " + path);
+      }
+      ::close(fd);
+    }
+
+    static bool overlaps(const sstable::Reader& table, const std::string& from, const std::string& to) {
+      return !(table.last() < from || table.first() > to);
+    }
+
+    /** Finds \c key in memtable, nullopt value is a tombstone */
+    template <typename Tree>
+    static bool lookup(const Tree& tree, const std::string& key, std::optional<std::string>& value) {
+      bool found = false;
+      tree.scan(key, key + '\0', [&](const std::string&, const std::optional<std::string>& stored) {
+        value = stored;
+        found = true;
+      });
+      return found;
+    }
+
+    Engine::Engine(const std::string& dir, Options options) :
+      _dir(dir),
+      _options(options) {
+      std::filesystem::create_directories(dir);
+      recover();
+      _worker = std::thread([this] { work(); });
+    }
+
+    Engine::~Engine() {
+      {
+        std::lock_guard<std::shared_mutex> guard(_lock);
+        _stop = true;
+      }
+      _work.notify_one();
+      _worker.join();
+    }
+
+    std::string Engine::file(uint64_t number, const char* extension) const {
+      char name[32];
+      snprintf(name, sizeof(name), "%06llu.%s", (unsigned long long) number, extension);
+      return _dir + "/" + name;
+    }
+
+    void Engine::check() const {
+      if (_error)
+        std::rethrow_exception(_error);
+    }
+
+    /*
+     * MANIFEST holds next file number and level of every live table,
+     * followed by crc32 of the content.
+     */
+    void Engine::save_manifest(const Version& version) const {
+      std::string content;
+      tools::serialize::write<uint64_t>(content, _next_number);
+      uint32_t count = 0;
+      for (const auto& level : version.levels)
+        count += level.size();
+      tools::serialize::write<uint32_t>(content, count);
+      for (uint32_t level = 0; level < version.levels.size(); level++) {
+        for (const auto& table : version.levels[level]) {
+          tools::serialize::write<uint32_t>(content, level);
+          tools::serialize::write<uint64_t>(content, table.number);
+        }
+      }
+      tools::serialize::write<uint32_t>(content, checksum(content));
+
+      const auto path = _dir + "/MANIFEST";
+      {
+        std::ofstream out(path + ".tmp", std::ios::binary | std::ios::trunc);
+        out.write(content.data(), content.size());
+        if (!out.flush())
+          throw std::runtime_error("Can't write " + path);
+      }
+      sync_path(path + ".tmp", O_RDONLY);
+      if (::rename((path + ".tmp").c_str(), path.c_str()) != 0)
+        throw std::system_error(errno, std::generic_category(), "Can't replace " + path);
+      sync_path(_dir, O_RDONLY | O_DIRECTORY);
+    }
+
+    void Engine::recover() {
+      auto version = std::make_shared<Version>();
+      version->levels.resize(1);
+      const auto manifest = _dir + "/MANIFEST";
+      if (std::filesystem::exists(manifest)) {
+        std::ifstream in(manifest, std::ios::binary);
+        const std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::string_view rest = content;
+        uint32_t stored = 0;
+        if (content.size() > sizeof(stored)) {
+          auto tail = rest.substr(content.size() - sizeof(stored));
+          tools::serialize::read(tail, stored);
+          rest.remove_suffix(sizeof(stored));
+        }
+        if (rest.size() == content.size() || stored != checksum(rest))
+          throw std::runtime_error("Storage " + _dir + " has corrupted MANIFEST");
+
+        uint64_t next = 0;
+        uint32_t count = 0;
+        tools::serialize::read(rest, next);
+        tools::serialize::read(rest, count);
+        _next_number = next;
+        for (uint32_t i = 0; i < count; i++) {
+          uint32_t level = 0;
+          uint64_t number = 0;
+          if (!tools::serialize::read(rest, level) || !tools::serialize::read(rest, number))
+            throw std::runtime_error("Storage " + _dir + " has corrupted MANIFEST");
+          if (version->levels.size() <= level)
+            version->levels.resize(level + 1);
+          version->levels[level].push_back({number, std::make_shared<const sstable::Reader>(file(number, "sst"))});
+        }
+      }
+
+      // Tables missing in MANIFEST are leftovers of interrupted flushes and compactions
+      std::vector<uint64_t> logs;
+      for (const auto& entry : std::filesystem::directory_iterator(_dir)) {
+        const auto& path = entry.path();
+        const auto extension = path.extension();
+        if (extension == ".tmp") {
+          std::filesystem::remove(path);
+          continue;
+        }
+        if (extension != ".log" && extension != ".sst")
+          continue;
+        const uint64_t number = std::stoull(path.stem().string());
+        _next_number = std::max<uint64_t>(_next_number, number + 1);
+        if (extension == ".log") {
+          logs.push_back(number);
+          continue;
+        }
+        bool live = false;
+        for (const auto& level : version->levels)
+          for (const auto& table : level)
+            live |= table.number == number;
+        if (!live) {
+          DEBUG << "Removing orphaned table " << path;
+          std::filesystem::remove(path);
+        }
+      }
+
+      std::sort(logs.begin(), logs.end());
+      auto memtable = std::make_unique<Memtable>();
+      for (const auto number : logs) {
+        wal::Log::replay(file(number, "log"), [&memtable](wal::Record type, std::string_view payload) {
+          std::string key, value;
+          if (!tools::serialize::read(payload, key))
+            throw std::runtime_error("Malformed WAL record");
+          if (type == wal::Record::Set && !tools::serialize::read(payload, value))
+            throw std::runtime_error("Malformed WAL record");
+          if (type == wal::Record::Set)
+            memtable->tree.insert(std::move(key), std::move(value));
+          else
+            memtable->tree.insert(std::move(key), std::nullopt);
+        });
+      }
+
+      if (memtable->tree.size()) {
+        auto& level = version->levels[0];
+        level.insert(level.begin(), write_table(memtable->tree, _next_number++));
+      }
+      save_manifest(*version);
+      for (const auto number : logs)
+        std::filesystem::remove(file(number, "log"));
+
+      _version = version;
+      _memtable = std::make_unique<Memtable>();
+      _memtable->log_number = _next_number++;
+      _log = std::make_shared<wal::Log>(file(_memtable->log_number, "log"), _options.wal);
+      DEBUG << "Storage " << _dir << " opened, " << logs.size() << " logs replayed";
+    }
+
+    Engine::Table Engine::write_table(const memtable_t& tree, uint64_t number) const {
+      const auto path = file(number, "sst");
+      sstable::Builder builder(path, _options.block_size, _options.bloom_bits);
+      tree.for_each([&builder](const std::string& key, const std::optional<std::string>& value) {
+        builder.add(key, value ? std::optional<std::string_view>(*value) : std::nullopt);
+      });
+      builder.finish();
+      return {number, std::make_shared<const sstable::Reader>(path)};
+    }
+
+    void Engine::rotate() {
+      _immutable = std::move(_memtable);
+      _memtable = std::make_unique<Memtable>();
+      _memtable->log_number = _next_number++;
+      _log = std::make_shared<wal::Log>(file(_memtable->log_number, "log"), _options.wal);
+      _work.notify_one();
+    }
+
+    static std::string encode(const std::string& key, const std::string* value) {
+      std::string payload;
+      tools::serialize::write(payload, key);
+      if (value)
+        tools::serialize::write(payload, *value);
+      return payload;
+    }
+
+    /**
+     * Logs and applies a write, called under exclusive lock
+
+       Does nothing and returns false when the memtable is full and the
+       previous one is still being flushed.
+     */
+    bool Engine::apply(wal::Record type, const std::string& key, const std::string* value, const std::string& payload,
+                       std::shared_ptr<wal::Log>& log, uint64_t& sequence) {
+      if (_memtable->bytes >= _options.memtable_bytes) {
+        if (_immutable)
+          return false;
+        rotate();
+      }
+      sequence = _log->submit(type, payload);
+      log = _log;
+      _memtable->bytes += payload.size() + entry_overhead;
+      if (value)
+        _memtable->tree.insert(key, *value);
+      else
+        _memtable->tree.insert(key, std::nullopt);
+      return true;
+    }
+
+    void Engine::write(wal::Record type, const std::string& key, const std::string* value) {
+      const auto payload = encode(key, value);
+      std::shared_ptr<wal::Log> log;
+      uint64_t sequence;
+      {
+        std::unique_lock<std::shared_mutex> lock(_lock);
+        check();
+        // Stall writers until the previous memtable is on disk
+        while (!apply(type, key, value, payload, log, sequence)) {
+          CSDB_COUNT(stalls, 1);
+          _done.wait(lock, [this] { return !_immutable || _error; });
+          check();
+        }
+      }
+      log->wait(sequence);
+    }
+
+    void Engine::put(const std::string& key, const std::string& value) {
+      CSDB_SPAN(put_latency);
+      write(wal::Record::Set, key, &value);
+    }
+
+    void Engine::erase(const std::string& key) {
+      CSDB_SPAN(erase_latency);
+      write(wal::Record::Erase, key, nullptr);
+    }
+
+    /** Tables that may hold \c key, in the order they are searched */
+    std::vector<const sstable::Reader*> Engine::candidates(const Version& version, const std::string& key) const {
+      std::vector<const sstable::Reader*> readers;
+      for (size_t level = 0; level < version.levels.size(); level++) {
+        const auto& tables = version.levels[level];
+        if (level == 0 || _options.compaction == Compaction::Tiered) {
+          for (const auto& table : tables)
+            readers.push_back(table.reader.get());
+          continue;
+        }
+        auto table = std::lower_bound(tables.begin(), tables.end(), key, [](const Table& table, const std::string& key) {
+          return table.reader->last() < key;
+        });
+        if (table != tables.end())
+          readers.push_back(table->reader.get());
+      }
+      return readers;
+    }
+
+    std::optional<std::string> Engine::get(const std::string& key) const {
+      CSDB_SPAN(get_latency);
+      std::optional<std::string> value;
+      std::shared_ptr<const Version> version;
+      {
+        std::shared_lock<std::shared_mutex> lock(_lock);
+        if (lookup(_memtable->tree, key, value) || (_immutable && lookup(_immutable->tree, key, value)))
+          return value;
+        version = _version;
+      }
+
+      const auto hash = algo::bloom::hash(key);
+      for (auto reader : candidates(*version, key)) {
+        CSDB_COUNT(table_reads, 1);
+        if (reader->get(key, hash, value))
+          return value;
+      }
+      return std::nullopt;
+    }
+
+    /** Wakes threads and coroutines waiting for background work, called under lock */
+    void Engine::finished() {
+      _done.notify_all();
+      for (auto& done : std::exchange(_waiters, {}))
+        done(0);
+    }
+
+    /** Completes once no memtable is being flushed */
+    io::Ring::Deferred Engine::settled(io::Ring& ring) {
+      return ring.defer([this](io::Ring::done_fn done) {
+        std::unique_lock<std::shared_mutex> lock(_lock);
+        if (_immutable && !_error) {
+          _waiters.push_back(std::move(done));
+          return;
+        }
+        lock.unlock();
+        done(0);
+      });
+    }
+
+    io::Task<void> Engine::async_write(io::Ring& ring, wal::Record type, std::string key, std::optional<std::string> value) {
+      const auto payload = encode(key, value ? &*value : nullptr);
+      std::shared_ptr<wal::Log> log;
+      uint64_t sequence;
+      while (true) {
+        {
+          std::unique_lock<std::shared_mutex> lock(_lock);
+          check();
+          if (apply(type, key, value ? &*value : nullptr, payload, log, sequence))
+            break;
+        }
+        co_await settled(ring);
+      }
+
+      // Lambda temporaries of a co_await expression are destroyed twice by GCC 12
+      auto synced = ring.defer([log, sequence](io::Ring::done_fn done) {
+        log->when_synced(sequence, std::move(done));
+      });
+      const int error = co_await synced;
+      if (error)
+        throw std::system_error(error, std::generic_category(), "Can't sync log of " + _dir);
+    }
+
+    io::Task<void> Engine::async_put(io::Ring& ring, std::string key, std::string value) {
+      return async_write(ring, wal::Record::Set, std::move(key), std::move(value));
+    }
+
+    io::Task<std::optional<std::string> > Engine::async_get(io::Ring& ring, std::string key) const {
+      std::optional<std::string> value;
+      std::shared_ptr<const Version> version;
+      {
+        std::shared_lock<std::shared_mutex> lock(_lock);
+        if (lookup(_memtable->tree, key, value) || (_immutable && lookup(_immutable->tree, key, value)))
+          co_return value;
+        version = _version;
+      }
+
+      const auto hash = algo::bloom::hash(key);
+      for (auto reader : candidates(*version, key)) {
+        const auto location = reader->locate(key, hash);
+        if (!location)
+          continue;
+
+        // Registered buffer when one is free and large enough
+        auto buffer = location->size <= ring.buffer_size() ? ring.buffer() : std::nullopt;
+        std::string heap;
+        if (!buffer)
+          heap.resize(location->size);
+        const char* data = buffer ? buffer->data() : heap.data();
+
+        for (uint32_t done = 0; done < location->size;) {
+          const uint32_t left = location->size - done;
+          const uint64_t offset = location->offset + done;
+          const int read = co_await (buffer ? ring.read(reader->fd(), *buffer, left, offset, done)
+                                            : ring.read(reader->fd(), heap.data() + done, left, offset));
+          if (read < 0)
+            throw std::system_error(-read, std::generic_category(), "Can't read table " + reader->path());
+          if (read == 0)
+            throw std::runtime_error("Table " + reader->path() + " is truncated");
+          done += read;
+        }
+        if (reader->search(*location, std::string_view(data, location->size), key, value))
+          co_return value;
+      }
+      co_return std::nullopt;
+    }
+
+    io::Task<void> Engine::async_flush(io::Ring& ring) {
+      while (true) {
+        {
+          std::unique_lock<std::shared_mutex> lock(_lock);
+          check();
+          if (!_immutable) {
+            if (_memtable->tree.size())
+              rotate();
+            break;
+          }
+        }
+        co_await settled(ring);
+      }
+      co_await settled(ring);
+      std::shared_lock<std::shared_mutex> lock(_lock);
+      check();
+    }
+
+    std::optional<size_t> Engine::due(const Version& version) const {
+      const auto& levels = version.levels;
+      if (_options.compaction == Compaction::Tiered) {
+        for (size_t level = 0; level < levels.size(); level++)
+          if (levels[level].size() >= _options.fanout)
+            return level;
+        return std::nullopt;
+      }
+
+      if (levels[0].size() >= _options.fanout)
+        return 0;
+      uint64_t limit = _options.level_bytes;
+      for (size_t level = 1; level < levels.size(); level++, limit *= _options.level_ratio) {
+        uint64_t bytes = 0;
+        for (const auto& table : levels[level])
+          bytes += table.reader->bytes();
+        if (bytes > limit)
+          return level;
+      }
+      return std::nullopt;
+    }
+
+    std::optional<Engine::Job> Engine::pick(const Version& version) {
+      const auto level = due(version);
+      if (!level)
+        return std::nullopt;
+      const auto& levels = version.levels;
+      Job job{*level, {}, *level + 1, true};
+
+      if (_options.compaction == Compaction::Tiered || *level == 0) {
+        job.inputs = levels[*level];
+      } else {
+        // Take the table after the previously compacted one to spread work over the key space
+        if (_cursors.size() <= *level)
+          _cursors.resize(*level + 1);
+        auto& cursor = _cursors[*level];
+        const auto& tables = levels[*level];
+        auto table = std::find_if(tables.begin(), tables.end(), [&cursor](const Table& table) {
+          return table.reader->first() > cursor;
+        });
+        if (table == tables.end())
+          table = tables.begin();
+        cursor = table->reader->last();
+        job.inputs.push_back(*table);
+      }
+
+      if (_options.compaction == Compaction::Leveled && job.output_level < levels.size()) {
+        std::string from = job.inputs.front().reader->first(), to = job.inputs.front().reader->last();
+        for (const auto& table : job.inputs) {
+          from = std::min(from, table.reader->first());
+          to = std::max(to, table.reader->last());
+        }
+        for (const auto& table : levels[job.output_level])
+          if (overlaps(*table.reader, from, to))
+            job.inputs.push_back(table);
+      }
+
+      // Tombstones are needed while older values may hide below the output
+      const size_t older = _options.compaction == Compaction::Tiered ? job.output_level : job.output_level + 1;
+      for (size_t below = older; below < levels.size(); below++)
+        job.drop_tombstones &= levels[below].empty();
+      return job;
+    }
+
+    std::vector<Engine::Table> Engine::merge(const Job& job) {
+      struct Source {
+        sstable::Reader::Iterator it;
+        size_t rank;
+      };
+      std::vector<Source> sources;
+      for (size_t rank = 0; rank < job.inputs.size(); rank++)
+        sources.push_back({job.inputs[rank].reader->begin(), rank});
+      // Smallest key on top, the newest table wins among equal keys
+      const auto later = [&sources](size_t a, size_t b) {
+        const int order = sources[a].it.key().compare(sources[b].it.key());
+        return order > 0 || (order == 0 && sources[a].rank > sources[b].rank);
+      };
+      std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heap(later);
+      for (size_t i = 0; i < sources.size(); i++)
+        if (sources[i].it.valid())
+          heap.push(i);
+
+      std::vector<Table> outputs;
+      std::unique_ptr<sstable::Builder> builder;
+      uint64_t number = 0;
+      const auto finish = [&] {
+        if (builder) {
+          builder->finish();
+          outputs.push_back({number, std::make_shared<const sstable::Reader>(file(number, "sst"))});
+        }
+        builder.reset();
+      };
+
+      std::string key;
+      while (!heap.empty()) {
+        const auto top = heap.top();
+        heap.pop();
+        auto& source = sources[top].it;
+        key = source.key();
+        const auto value = source.value();
+        if (value || !job.drop_tombstones) {
+          if (!builder) {
+            number = _next_number++;
+            builder = std::make_unique<sstable::Builder>(file(number, "sst"), _options.block_size,
+                                                               _options.bloom_bits);
+          }
+          builder->add(key, value);
+          if (_options.compaction == Compaction::Leveled && builder->bytes() >= _options.table_bytes)
+            finish();
+        }
+
+        source.next();
+        if (source.valid())
+          heap.push(top);
+        while (!heap.empty() && sources[heap.top()].it.key() == key) {
+          const auto shadowed = heap.top();
+          heap.pop();
+          sources[shadowed].it.next();
+          if (sources[shadowed].it.valid())
+            heap.push(shadowed);
+        }
+      }
+      finish();
+      return outputs;
+    }
+
+    std::shared_ptr<Engine::Version> Engine::install(const Job& job, const std::vector<Table>& outputs) const {
+      auto version = std::make_shared<Version>(*_version);
+      auto& levels = version->levels;
+      if (levels.size() <= job.output_level)
+        levels.resize(job.output_level + 1);
+      for (auto level : {job.level, job.output_level}) {
+        std::erase_if(levels[level], [&job](const Table& table) {
+          return std::any_of(job.inputs.begin(), job.inputs.end(), [&table](const Table& input) {
+            return input.number == table.number;
+          });
+        });
+      }
+
+      auto& level = levels[job.output_level];
+      if (_options.compaction == Compaction::Tiered) {
+        level.insert(level.begin(), outputs.begin(), outputs.end());
+      } else {
+        level.insert(level.end(), outputs.begin(), outputs.end());
+        std::sort(level.begin(), level.end(), [](const Table& a, const Table& b) {
+          return a.reader->first() < b.reader->first();
+        });
+      }
+      return version;
+    }
+
+    /*
+     * Background thread, flushes frozen memtable first and compacts when
+     * nothing else is to be done. Version is only replaced here, so it is
+     * safe to read without lock in between.
+     */
+    void Engine::work() {
+      std::unique_lock<std::shared_mutex> lock(_lock);
+      while (!_stop) {
+        std::optional<Job> job;
+        if (!_error && !_immutable)
+          job = pick(*_version);
+        if (_error || (!_immutable && !job)) {
+          _work.wait(lock);
+          continue;
+        }
+
+        _busy = true;
+        const auto memtable = _immutable.get();
+        lock.unlock();
+        std::shared_ptr<Version> version;
+        try {
+          if (memtable) {
+            version = std::make_shared<Version>(*_version);
+            auto& level = version->levels[0];
+            level.insert(level.begin(), write_table(memtable->tree, _next_number++));
+          } else {
+            version = install(*job, merge(*job));
+          }
+          save_manifest(*version);
+        } catch (...) {
+          ERROR << "Storage " << _dir << " background work failed";
+          lock.lock();
+          _error = std::current_exception();
+          _busy = false;
+          finished();
+          continue;
+        }
+
+        lock.lock();
+        _version = version;
+        if (memtable) {
+          std::filesystem::remove(file(memtable->log_number, "log"));
+          _immutable.reset();
+          _flushes++;
+        } else {
+          for (const auto& table : job->inputs)
+            table.reader->mark_obsolete();
+          _compactions++;
+        }
+        _busy = false;
+        finished();
+      }
+    }
+
+    void Engine::flush() {
+      CSDB_SPAN(flush_latency);
+      std::unique_lock<std::shared_mutex> lock(_lock);
+      const auto flushed = [this] { return !_immutable || _error; };
+      _done.wait(lock, flushed);
+      check();
+      if (_memtable->tree.size())
+        rotate();
+      _done.wait(lock, flushed);
+      check();
+    }
+
+    void Engine::compact() {
+      std::unique_lock<std::shared_mutex> lock(_lock);
+      _work.notify_one();
+      _done.wait(lock, [this] { return _error || (!_immutable && !_busy && !due(*_version)); });
+      check();
+    }
+
+    Stats Engine::stats() const {
+      std::shared_lock<std::shared_mutex> lock(_lock);
+      Stats stats = {{}, {}, _memtable->bytes + (_immutable ? _immutable->bytes : 0), _flushes, _compactions};
+      for (const auto& level : _version->levels) {
+        stats.tables.push_back(level.size());
+        stats.bytes.push_back(0);
+        for (const auto& table : level)
+          stats.bytes.back() += table.reader->bytes();
+      }
+      return stats;
+    }
+  }
+}
@@ -0,0 +1,206 @@
+#include "storage/snapshot.hpp"
+#include "algo/crc32.hpp"
+
+#include <cerrno>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logging.hpp"
+
+namespace storage {
+  namespace snapshot {
+    static constexpr char magic[8] = {'C', 'S', 'D', 'B', 'S', 'N', 'A', 'P'};
+    static constexpr uint32_t version = 1;
+
+    static_assert(sizeof(Header) <= header_size, "Header doesn't fit its slot");
+
+    static uint32_t checksum(const char* data, size_t size) {
+      return algo::hash::crc32(reinterpret_cast<const uint8_t *>(data), size);
+    }
+
+    static uint32_t header_checksum(Header header) {
+      header.header_crc = 0;
+      return checksum(reinterpret_cast<const char *>(&header), sizeof(header));
+    }
+
+    static void write_all(int fd, const char* data, size_t size) {
+      while (size) {
+        const auto written = ::write(fd, data, size);
+        if (written < 0) {
+          if (errno == EINTR)
+            continue;
+          throw std::system_error(errno, std::generic_category(), "Snapshot write failed");
+        }
+        data += written;
+        size -= written;
+      }
+    }
+
+    Writer::Writer(const std::string& path, uint32_t block_size) :
+      _path(path),
+      _temp(path + ".tmp"),
+      _block_size(block_size) {
+      _fd = ::open(_temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (_fd < 0)
+        throw std::system_error(errno, std::generic_category(), "Can't create snapshot " + _temp);
+      _buffer.assign(header_size, '\0');
+      _block.reserve(_block_size);
+    }
+
+    Writer::~Writer() {
+      if (_fd < 0)
+        return;
+      ::close(_fd);
+      ::unlink(_temp.c_str());
+    }
+
+    void Writer::write(const char* data, size_t size) {
+      _buffer.append(data, size);
+      if (_buffer.size() >= (1 << 20)) {
+        write_all(_fd, _buffer.data(), _buffer.size());
+        _buffer.clear();
+      }
+    }
+
+    void Writer::append(const void* data, size_t size) {
+      auto bytes = static_cast<const char *>(data);
+      _offset += size;
+      while (size) {
+        const size_t part = std::min<size_t>(size, _block_size - _block.size());
+        _block.append(bytes, part);
+        bytes += part;
+        size -= part;
+        if (_block.size() == _block_size) {
+          _checksums.push_back(checksum(_block.data(), _block.size()));
+          write(_block.data(), _block.size());
+          _block.clear();
+        }
+      }
+    }
+
+    void Writer::pad(size_t alignment) {
+      static constexpr char zeroes[64] = {};
+      while (_offset % alignment)
+        append(zeroes, std::min(alignment - _offset % alignment, sizeof(zeroes)));
+    }
+
+    void Writer::finish(Header header) {
+      if (!_block.empty()) {
+        _checksums.push_back(checksum(_block.data(), _block.size()));
+        write(_block.data(), _block.size());
+        _block.clear();
+      }
+      header.checksums_offset = _offset;
+      write(reinterpret_cast<const char *>(_checksums.data()), _checksums.size() * sizeof(uint32_t));
+      write_all(_fd, _buffer.data(), _buffer.size());
+      _buffer.clear();
+
+      std::memcpy(header.magic, magic, sizeof(magic));
+      header.version = version;
+      header.block_size = _block_size;
+      header.file_size = _offset + _checksums.size() * sizeof(uint32_t);
+      header.header_crc = header_checksum(header);
+      if (::pwrite(_fd, &header, sizeof(header), 0) != sizeof(header) || ::fsync(_fd) != 0)
+        throw std::system_error(errno, std::generic_category(), "Can't store snapshot " + _temp);
+      ::close(_fd);
+      _fd = -1;
+
+      if (::rename(_temp.c_str(), _path.c_str()) != 0) {
+        const int error = errno;
+        ::unlink(_temp.c_str());
+        throw std::system_error(error, std::generic_category(), "Can't publish snapshot " + _path);
+      }
+      const auto slash = _path.rfind('/');
+      const auto dir = slash == std::string::npos ? std::string(".") : _path.substr(0, slash + 1);
+      const int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (dir_fd >= 0) {
+        ::fsync(dir_fd);
+        ::close(dir_fd);
+      }
+      DEBUG << "Snapshot " << _path << " written, " << header.entries << " entries";
+    }
+
+    Mapping::Mapping(const std::string& path, Kind kind, uint64_t hash_check) {
+      const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "Can't open snapshot " + path);
+      struct stat st;
+      if (::fstat(fd, &st) != 0) {
+        const int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), "Can't stat snapshot " + path);
+      }
+      _size = st.st_size;
+      if (_size < header_size) {
+        ::close(fd);
+        throw std::runtime_error("Snapshot " + path + " is truncated");
+      }
+
+      // No MAP_POPULATE: pages are read by the first lookup touching them
+      void* base = ::mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+      const int error = errno;
+      ::close(fd);
+      if (base == MAP_FAILED)
+        throw std::system_error(error, std::generic_category(), "Can't map snapshot " + path);
+      _base = static_cast<const char *>(base);
+      ::madvise(base, _size, MADV_RANDOM);
+
+      std::memcpy(&_header, _base, sizeof(_header));
+      const char* problem = nullptr;
+      if (std::memcmp(_header.magic, magic, sizeof(magic)) != 0)
+        problem = "is not a snapshot";
+      else if (_header.header_crc != header_checksum(_header))
+        problem = "has corrupted header";
+      else if (_header.version != version)
+        problem = "has unsupported version";
+      else if (_header.kind != static_cast<uint32_t>(kind))
+        problem = "has another layout";
+      else if (_header.hash_check != hash_check)
+        problem = "was written with another hash function";
+      else if (_header.file_size != _size || _header.block_size == 0 ||
+               _header.checksums_offset < header_size || _header.checksums_offset > _size ||
+               _header.index_offset < header_size || _header.data_offset < _header.index_offset ||
+               _header.data_offset > _header.checksums_offset)
+        problem = "is truncated";
+      // Block size is only known to be nonzero once the header checks passed
+      const uint64_t blocks = problem ? 0 :
+                              (_header.checksums_offset - header_size + _header.block_size - 1) / _header.block_size;
+      if (!problem && _header.checksums_offset + blocks * sizeof(uint32_t) > _size)
+        problem = "is truncated";
+      if (problem) {
+        ::munmap(base, _size);
+        throw std::runtime_error("Snapshot " + path + " " + problem);
+      }
+      _verified = std::make_unique<std::atomic<bool>[]>(blocks);
+    }
+
+    Mapping::~Mapping() {
+      ::munmap(const_cast<char *>(_base), _size);
+    }
+
+    void Mapping::verify(uint64_t block) const {
+      const uint64_t begin = header_size + block * _header.block_size;
+      const uint64_t size = std::min<uint64_t>(_header.block_size, _header.checksums_offset - begin);
+      uint32_t expected;
+      std::memcpy(&expected, _base + _header.checksums_offset + block * sizeof(uint32_t), sizeof(expected));
+      if (checksum(_base + begin, size) != expected)
+        throw std::runtime_error("Snapshot block " + std::to_string(block) + " is corrupted");
+      _verified[block].store(true, std::memory_order_release);
+    }
+
+    const char* Mapping::data(uint64_t offset, uint64_t size) const {
+      if (offset < header_size || offset + size > _header.checksums_offset || offset + size < offset)
+        throw std::runtime_error("Snapshot offset is out of bounds");
+      if (size) {
+        const uint64_t last = (offset + size - 1 - header_size) / _header.block_size;
+        for (uint64_t block = (offset - header_size) / _header.block_size; block <= last; block++)
+          if (!_verified[block].load(std::memory_order_acquire))
+            verify(block);
+      }
+      return _base + offset;
+    }
+  }
+}
@@ -0,0 +1,308 @@
+#include "storage/sstable.hpp"
+#include "algo/crc32.hpp"
+#include "tools/serialize.hpp"
+
+#include <cerrno>
+#include <limits>
+#include <stdexcept>
+#include <system_error>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logging.hpp"
+
+namespace storage {
+  namespace sstable {
+    static constexpr uint64_t magic = 0x454c424154535343ull;  // "CSSTABLE"
+    static constexpr uint32_t version = 2;
+    static constexpr uint32_t tombstone = std::numeric_limits<uint32_t>::max();
+
+    /**
+     * Fixed size footer at the end of file
+
+       Index holds first key, offset, size and crc32 of every block,
+       followed by the last key of the table and optional Bloom filter.
+     */
+    struct Footer {
+      uint64_t index_offset;
+      uint64_t index_size;
+      uint64_t entries;
+      uint32_t index_checksum;
+      uint32_t version;
+      uint64_t magic;
+    };
+
+    static uint32_t checksum(std::string_view data) {
+      return algo::hash::crc32(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+    }
+
+    static void write_string(std::string& out, std::string_view value) {
+      tools::serialize::write<uint32_t>(out, value.size());
+      out.append(value);
+    }
+
+    static bool read_string(std::string_view& in, std::string_view& value) {
+      uint32_t size;
+      if (!tools::serialize::read(in, size) || in.size() < size)
+        return false;
+      value = in.substr(0, size);
+      in.remove_prefix(size);
+      return true;
+    }
+
+    /** Decodes entry from the front of \c in, false on malformed data */
+    static bool read_entry(std::string_view& in, std::string_view& key,
+                           std::optional<std::string_view>& value) {
+      uint32_t key_size, value_size;
+      if (!tools::serialize::read(in, key_size) || !tools::serialize::read(in, value_size))
+        return false;
+      const uint64_t size = key_size + uint64_t(value_size == tombstone ? 0 : value_size);
+      if (in.size() < size)
+        return false;
+      key = in.substr(0, key_size);
+      if (value_size == tombstone)
+        value = std::nullopt;
+      else
+        value = in.substr(key_size, value_size);
+      in.remove_prefix(size);
+      return true;
+    }
+
+    static void pread_all(int fd, char* data, size_t size, uint64_t offset, const std::string& path) {
+      while (size) {
+        const auto done = ::pread(fd, data, size, offset);
+        if (done < 0 && errno == EINTR)
+          continue;
+        if (done < 0)
+          throw std::system_error(errno, std::generic_category(), "Can't read table " + path);
+        if (done == 0)
+          throw std::runtime_error("Table " + path + " is truncated");
+        data += done;
+        size -= done;
+        offset += done;
+      }
+    }
+
+    Builder::Builder(const std::string& path, uint32_t block_size, double bloom_bits) :
+      _path(path),
+      _block_size(block_size),
+      _bloom_bits(bloom_bits) {
+      _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (_fd < 0)
+        throw std::system_error(errno, std::generic_category(), "Can't create table " + path);
+      _block.reserve(block_size);
+    }
+
+    Builder::~Builder() {
+      if (_fd >= 0)
+        ::close(_fd);
+      if (!_finished)
+        ::unlink(_path.c_str());
+    }
+
+    void Builder::write(const std::string& data) {
+      const char* rest = data.data();
+      size_t size = data.size();
+      while (size) {
+        const auto written = ::write(_fd, rest, size);
+        if (written < 0) {
+          if (errno == EINTR)
+            continue;
+          throw std::system_error(errno, std::generic_category(), "Can't write table " + _path);
+        }
+        rest += written;
+        size -= written;
+      }
+      _offset += data.size();
+    }
+
+    void Builder::flush_block() {
+      if (_block.empty())
+        return;
+      write_string(_index, _first);
+      tools::serialize::write<uint64_t>(_index, _offset);
+      tools::serialize::write<uint32_t>(_index, _block.size());
+      tools::serialize::write<uint32_t>(_index, checksum(_block));
+      write(_block);
+      _block.clear();
+      _blocks++;
+    }
+
+    void Builder::add(std::string_view key, std::optional<std::string_view> value) {
+      if (_entries && key <= _last)
+        throw std::logic_error("Table keys must be added in increasing order");
+      if (_block.empty())
+        _first = key;
+      tools::serialize::write<uint32_t>(_block, key.size());
+      tools::serialize::write<uint32_t>(_block, value ? value->size() : tombstone);
+      _block.append(key);
+      if (value)
+        _block.append(*value);
+      _last = key;
+      _entries++;
+      if (_bloom_bits > 0)
+        _hashes.push_back(algo::bloom::hash(key));
+      if (_block.size() >= _block_size)
+        flush_block();
+    }
+
+    void Builder::finish() {
+      if (!_entries)
+        throw std::logic_error("Table can't be empty");
+      flush_block();
+      std::string index;
+      tools::serialize::write<uint32_t>(index, _blocks);
+      index.append(_index);
+      write_string(index, _last);
+      tools::serialize::write<uint8_t>(index, _bloom_bits > 0);
+      if (_bloom_bits > 0) {
+        algo::bloom::Blocked filter(_hashes.size(), _bloom_bits);
+        for (const auto hash : _hashes)
+          filter.add(hash);
+        tools::serialize::write(index, filter);
+      }
+
+      Footer footer = {_offset, index.size(), _entries, checksum(index), version, magic};
+      write(index);
+      std::string tail;
+      tools::serialize::write(tail, footer);
+      write(tail);
+      if (::fsync(_fd) != 0)
+        throw std::system_error(errno, std::generic_category(), "Can't sync table " + _path);
+      ::close(_fd);
+      _fd = -1;
+      _finished = true;
+      DEBUG << "Table " << _path << " written, " << _entries << " entries in " << _blocks << " blocks";
+    }
+
+    Reader::Reader(const std::string& path) :
+      _path(path) {
+      _fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (_fd < 0)
+        throw std::system_error(errno, std::generic_category(), "Can't open table " + path);
+      try {
+        struct stat st;
+        if (::fstat(_fd, &st) != 0)
+          throw std::system_error(errno, std::generic_category(), "Can't stat table " + path);
+        _bytes = st.st_size;
+        if (_bytes < sizeof(Footer))
+          throw std::runtime_error("Table " + path + " is truncated");
+
+        Footer footer;
+        pread_all(_fd, reinterpret_cast<char *>(&footer), sizeof(footer), _bytes - sizeof(footer), path);
+        if (footer.magic != magic || footer.version != version ||
+            footer.index_offset + footer.index_size + sizeof(footer) != _bytes)
+          throw std::runtime_error("Table " + path + " has broken footer");
+
+        std::string index(footer.index_size, '\0');
+        pread_all(_fd, index.data(), index.size(), footer.index_offset, path);
+        if (checksum(index) != footer.index_checksum)
+          throw std::runtime_error("Table " + path + " has corrupted index");
+
+        std::string_view rest = index;
+        uint32_t blocks = 0;
+        tools::serialize::read(rest, blocks);
+        _index.resize(blocks);
+        for (auto& block : _index) {
+          std::string_view first;
+          if (!read_string(rest, first) || !tools::serialize::read(rest, block.offset) ||
+              !tools::serialize::read(rest, block.size) || !tools::serialize::read(rest, block.checksum))
+            throw std::runtime_error("Table " + path + " has corrupted index");
+          block.first = first;
+        }
+        std::string_view last;
+        uint8_t filtered = 0;
+        if (_index.empty() || !read_string(rest, last) || !tools::serialize::read(rest, filtered))
+          throw std::runtime_error("Table " + path + " has corrupted index");
+        _last = last;
+        if (filtered && !tools::serialize::read(rest, _filter.emplace()))
+          throw std::runtime_error("Table " + path + " has corrupted filter");
+        _entries = footer.entries;
+      } catch (...) {
+        ::close(_fd);
+        throw;
+      }
+    }
+
+    Reader::~Reader() {
+      ::close(_fd);
+      if (_obsolete) {
+        DEBUG << "Removing obsolete table " << _path;
+        ::unlink(_path.c_str());
+      }
+    }
+
+    std::string Reader::read_block(size_t block, bool verify) const {
+      const auto& info = _index[block];
+      std::string data(info.size, '\0');
+      pread_all(_fd, data.data(), data.size(), info.offset, _path);
+      if (verify && checksum(data) != info.checksum)
+        throw std::runtime_error("Table " + _path + " block " + std::to_string(block) + " is corrupted");
+      return data;
+    }
+
+    bool Reader::may_contain(std::string_view key, uint64_t hash) const {
+      return key >= first() && key <= _last && (!_filter || _filter->contains(hash));
+    }
+
+    std::optional<Reader::Location> Reader::locate(std::string_view key, uint64_t hash) const {
+      if (!may_contain(key, hash))
+        return std::nullopt;
+      auto block = std::upper_bound(_index.begin(), _index.end(), key, [](std::string_view key, const Block& block) {
+        return key < block.first;
+      }) - 1;
+      return Location{size_t(block - _index.begin()), block->offset, block->size};
+    }
+
+    bool Reader::search(const Location& location, std::string_view data, std::string_view key,
+                        std::optional<std::string>& value) const {
+      if (data.size() != location.size || checksum(data) != _index[location.block].checksum)
+        throw std::runtime_error("Table " + _path + " block " + std::to_string(location.block) + " is corrupted");
+      std::string_view rest = data;
+      std::string_view stored;
+      std::optional<std::string_view> found;
+      while (!rest.empty()) {
+        if (!read_entry(rest, stored, found))
+          throw std::runtime_error("Table " + _path + " has malformed block");
+        if (stored < key)
+          continue;
+        if (stored > key)
+          return false;
+        if (found)
+          value = std::string(*found);
+        else
+          value = std::nullopt;
+        return true;
+      }
+      return false;
+    }
+
+    bool Reader::get(std::string_view key, uint64_t hash, std::optional<std::string>& value) const {
+      const auto location = locate(key, hash);
+      if (!location)
+        return false;
+      // Search verifies the block
+      return search(*location, read_block(location->block, false), key, value);
+    }
+
+    Reader::Iterator::Iterator(const Reader& reader) :
+      _reader(&reader) {
+      next();
+    }
+
+    void Reader::Iterator::next() {
+      while (_rest.empty()) {
+        if (_block == _reader->_index.size()) {
+          _valid = false;
+          return;
+        }
+        _data = std::make_unique<std::string>(_reader->read_block(_block++));
+        _rest = *_data;
+      }
+      if (!read_entry(_rest, _key, _value))
+        throw std::runtime_error("Table " + _reader->_path + " has malformed block");
+    }
+  }
+}
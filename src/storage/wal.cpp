@@ -0,0 +1,231 @@
+#include "storage/wal.hpp"
+#include "algo/crc32.hpp"
+#include "tools/serialize.hpp"
+
+#include <cerrno>
+#include <algorithm>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "logging.hpp"
+
+namespace storage {
+  namespace wal {
+    static constexpr size_t header_size = 2 * sizeof(uint32_t);
+
+    static void write_all(int fd, const char* data, size_t size) {
+      while (size) {
+        const auto written = ::write(fd, data, size);
+        if (written < 0) {
+          if (errno == EINTR)
+            continue;
+          throw std::system_error(errno, std::generic_category(), "WAL write failed");
+        }
+        data += written;
+        size -= written;
+      }
+    }
+
+    Log::Log(const std::string& path, Options options) :
+      _options(options) {
+      _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+      if (_fd < 0)
+        throw std::system_error(errno, std::generic_category(), "Can't open WAL " + path);
+      _writer = std::thread([this] { write_loop(); });
+    }
+
+    Log::~Log() {
+      {
+        std::lock_guard<std::mutex> guard(_lock);
+        _stop = true;
+      }
+      _wake.notify_one();
+      _writer.join();
+      ::close(_fd);
+      for (auto& [sequence, done] : _callbacks)
+        done(_error ? _error : ECANCELED);
+    }
+
+    void Log::check() const {
+      if (_error)
+        throw std::system_error(_error, std::generic_category(), "WAL is broken");
+    }
+
+    void Log::write_loop() {
+      auto last_sync = std::chrono::steady_clock::now();
+      std::unique_lock<std::mutex> lock(_lock);
+      while (true) {
+        const bool dirty = _written > _synced;
+        const auto ready = [this] {
+          return !_pending.empty() || _stop || (_force && _written > _synced);
+        };
+        if (dirty && _options.sync == Sync::Periodic)
+          _wake.wait_until(lock, last_sync + _options.interval, ready);
+        else
+          _wake.wait(lock, ready);
+
+        const auto now = std::chrono::steady_clock::now();
+        const bool sync = _options.sync == Sync::Group || _force || _stop ||
+                          (_options.sync == Sync::Periodic && now - last_sync >= _options.interval);
+        if (_pending.empty() && !(sync && _written > _synced)) {
+          if (_stop)
+            return;
+          continue;
+        }
+
+        std::string batch;
+        batch.swap(_pending);
+        const auto last = _appended;
+        lock.unlock();
+
+        int error = 0;
+        try {
+          write_all(_fd, batch.data(), batch.size());
+          if (sync && ::fdatasync(_fd) != 0)
+            error = errno;
+        } catch (const std::system_error& e) {
+          error = e.code().value();
+        }
+
+        lock.lock();
+        if (error) {
+          DEBUG << "WAL failed: " << error;
+          _error = error;
+        }
+        _written = last;
+        if (sync) {
+          _synced = last;
+          _force = false;
+          last_sync = now;
+        }
+        _done.notify_all();
+
+        if (!_callbacks.empty()) {
+          std::vector<std::function<void(int)> > ready;
+          auto waiting = std::partition(_callbacks.begin(), _callbacks.end(), [this](const auto& callback) {
+            return callback.first > _synced && !_error;
+          });
+          for (auto callback = waiting; callback != _callbacks.end(); ++callback)
+            ready.push_back(std::move(callback->second));
+          _callbacks.erase(waiting, _callbacks.end());
+          const int status = _error;
+          lock.unlock();
+          for (auto& done : ready)
+            done(status);
+          lock.lock();
+        }
+      }
+    }
+
+    uint64_t Log::append(Record type, std::string_view payload) {
+      const auto sequence = submit(type, payload);
+      wait(sequence);
+      return sequence;
+    }
+
+    uint64_t Log::submit(Record type, std::string_view payload) {
+      std::string body;
+      body.reserve(1 + payload.size());
+      body.push_back(static_cast<char>(type));
+      body.append(payload);
+
+      std::lock_guard<std::mutex> guard(_lock);
+      check();
+      tools::serialize::write<uint32_t>(_pending, body.size());
+      tools::serialize::write<uint32_t>(_pending, algo::hash::crc32(reinterpret_cast<const uint8_t *>(body.data()), body.size()));
+      _pending.append(body);
+      _wake.notify_one();
+      return ++_appended;
+    }
+
+    void Log::wait(uint64_t sequence) {
+      if (_options.sync != Sync::Group)
+        return;
+      std::unique_lock<std::mutex> lock(_lock);
+      _done.wait(lock, [this, sequence] { return _synced >= sequence || _error; });
+      check();
+    }
+
+    void Log::when_synced(uint64_t sequence, std::function<void(int)> done) {
+      std::unique_lock<std::mutex> lock(_lock);
+      if (_options.sync == Sync::Group && _synced < sequence && !_error) {
+        _callbacks.emplace_back(sequence, std::move(done));
+        return;
+      }
+      const int status = _options.sync == Sync::Group ? _error : 0;
+      lock.unlock();
+      done(status);
+    }
+
+    void Log::flush() {
+      std::unique_lock<std::mutex> lock(_lock);
+      const auto target = _appended;
+      _force = true;
+      _wake.notify_one();
+      _done.wait(lock, [this, target] { return _synced >= target || _error; });
+      check();
+    }
+
+    void Log::reset() {
+      std::unique_lock<std::mutex> lock(_lock);
+      _done.wait(lock, [this] { return (_pending.empty() && _written == _appended) || _error; });
+      check();
+      if (::ftruncate(_fd, 0) != 0 || ::fdatasync(_fd) != 0)
+        throw std::system_error(errno, std::generic_category(), "Can't reset WAL");
+      _synced = _written;
+    }
+
+    size_t Log::replay(const std::string& path,
+                       const std::function<void(Record, std::string_view)>& apply) {
+      const int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+      if (fd < 0) {
+        if (errno == ENOENT)
+          return 0;
+        throw std::system_error(errno, std::generic_category(), "Can't open WAL " + path);
+      }
+
+      std::string content;
+      char buffer[1 << 16];
+      ssize_t size;
+      while ((size = ::read(fd, buffer, sizeof(buffer))) != 0) {
+        if (size < 0) {
+          if (errno == EINTR)
+            continue;
+          const int error = errno;
+          ::close(fd);
+          throw std::system_error(error, std::generic_category(), "Can't read WAL " + path);
+        }
+        content.append(buffer, size);
+      }
+
+      std::string_view rest = content;
+      size_t applied = 0;
+      while (rest.size() >= header_size) {
+        auto header = rest;
+        uint32_t length = 0, checksum = 0;
+        tools::serialize::read(header, length);
+        tools::serialize::read(header, checksum);
+        if (length == 0 || header.size() < length)
+          break;
+        const auto body = header.substr(0, length);
+        if (algo::hash::crc32(reinterpret_cast<const uint8_t *>(body.data()), body.size()) != checksum)
+          break;
+        apply(static_cast<Record>(body[0]), body.substr(1));
+        rest.remove_prefix(header_size + length);
+        applied++;
+      }
+
+      if (!rest.empty()) {
+        DEBUG << "Torn WAL record at " << content.size() - rest.size() << " in " << path;
+        if (::ftruncate(fd, content.size() - rest.size()) != 0 || ::fdatasync(fd) != 0) {
+          const int error = errno;
+          ::close(fd);
+          throw std::system_error(error, std::generic_category(), "Can't truncate WAL " + path);
+        }
+      }
+      ::close(fd);
+      return applied;
+    }
+  }
+}
@@ -0,0 +1,179 @@
+#include "structure/shared.hpp"
+
+#include <cerrno>
+#include <bit>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "structure/log.hpp"
+
+namespace structure {
+  namespace shared {
+    static constexpr char magic[8] = {'C', 'S', 'D', 'B', 'S', 'H', 'M', 'T'};
+    static constexpr uint32_t version = 1;
+    static constexpr size_t line = 64;
+    static constexpr size_t smallest = 32;
+
+    static size_t round_up(size_t size, size_t alignment) {
+      return (size + alignment - 1) / alignment * alignment;
+    }
+
+    /** Names like "/name" are shared memory objects, anything else is a file */
+    static bool is_shm(const std::string& name) {
+      return name.size() > 1 && name[0] == '/' && name.find('/', 1) == std::string::npos;
+    }
+
+    /**
+     * Size class of a block holding \c bytes and the size of its blocks
+
+       Every power of 2 is split into four classes, so a block wastes at
+       most a fifth of its size.
+     */
+    static size_t size_class(size_t bytes, size_t& block) {
+      if (bytes <= smallest) {
+        block = smallest;
+        return 0;
+      }
+      const size_t width = std::bit_width(bytes - 1);
+      const size_t base = size_t(1) << (width - 1);
+      const size_t step = base / 4;
+      const size_t sub = (bytes - base + step - 1) / step;
+      block = base + sub * step;
+      return (width - std::bit_width(smallest)) * 4 + sub;
+    }
+
+    void Segment::map(int fd, size_t size, bool writable) {
+      void* base = ::mmap(nullptr, size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+      const int error = errno;
+      ::close(fd);
+      if (base == MAP_FAILED)
+        throw std::system_error(error, std::generic_category(), "Can't map shared segment " + _name);
+      _base = static_cast<char *>(base);
+      _size = size;
+      _writable = writable;
+    }
+
+    Segment::Segment(const std::string& name, const Options& options, const Types& types) :
+      _name(name) {
+      if (!options.stripes || !std::has_single_bit(options.stripes))
+        throw std::invalid_argument("Stripes of a shared segment must be a power of 2");
+      const size_t buckets = std::bit_ceil(std::max<size_t>(options.expected ? options.expected : options.bytes / 256, 64));
+      const size_t stripes = std::min(options.stripes, buckets);
+      const size_t stripes_offset = round_up(sizeof(Header), line);
+      const size_t buckets_offset = round_up(stripes_offset + stripes * sizeof(uint64_t), line);
+      const size_t heap_offset = round_up(buckets_offset + buckets * sizeof(uint64_t), line);
+      if (heap_offset + smallest > options.bytes)
+        throw std::invalid_argument("Shared segment of " + std::to_string(options.bytes) + " bytes can't hold " +
+                                    std::to_string(buckets) + " buckets");
+
+      // New readers get the new segment, mapped ones keep the old one
+      remove(name);
+      const int fd = is_shm(name) ? ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644) :
+                     ::open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+      if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "Can't create shared segment " + name);
+      if (::ftruncate(fd, options.bytes) != 0) {
+        const int error = errno;
+        ::close(fd);
+        remove(name);
+        throw std::system_error(error, std::generic_category(), "Can't size shared segment " + name);
+      }
+      map(fd, options.bytes, true);
+
+      auto& header = *new (_base) Header{};
+      header.version = version;
+      header.stripes = stripes;
+      header.hash_check = types.hash_check;
+      header.key_size = types.key_size;
+      header.value_size = types.value_size;
+      header.buckets = buckets;
+      header.size = options.bytes;
+      header.stripes_offset = stripes_offset;
+      header.buckets_offset = buckets_offset;
+      header.heap_offset = heap_offset;
+      header.top.store(heap_offset, std::memory_order_relaxed);
+      std::memcpy(header.magic, magic, sizeof(magic));
+      header.ready.store(1, std::memory_order_release);
+      STRUCTURE_DEBUG << "Shared segment " << name << " created, " << options.bytes << " bytes, " << buckets << " buckets";
+    }
+
+    Segment::Segment(const std::string& name, const Types& types) :
+      _name(name) {
+      const int fd = is_shm(name) ? ::shm_open(name.c_str(), O_RDONLY, 0) : ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "Can't open shared segment " + name);
+      struct stat st;
+      if (::fstat(fd, &st) != 0) {
+        const int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), "Can't stat shared segment " + name);
+      }
+      if (size_t(st.st_size) < sizeof(Header)) {
+        ::close(fd);
+        throw std::runtime_error("Shared segment " + name + " is not ready");
+      }
+      map(fd, st.st_size, false);
+
+      const auto& h = header();
+      const char* problem = nullptr;
+      if (!h.ready.load(std::memory_order_acquire))
+        problem = "is not ready";
+      else if (std::memcmp(h.magic, magic, sizeof(magic)) != 0)
+        problem = "is not a shared table";
+      else if (h.version != version)
+        problem = "has unsupported version";
+      else if (h.hash_check != types.hash_check)
+        problem = "was created with another hash function";
+      else if (h.key_size != types.key_size || h.value_size != types.value_size)
+        problem = "holds other key or value types";
+      else if (h.size != _size || !std::has_single_bit(h.buckets) || !std::has_single_bit(h.stripes) ||
+               h.heap_offset > _size || h.buckets_offset + h.buckets * sizeof(uint64_t) > h.heap_offset ||
+               h.stripes_offset + h.stripes * sizeof(uint64_t) > h.buckets_offset)
+        problem = "is truncated";
+      if (problem) {
+        ::munmap(_base, _size);
+        throw std::runtime_error("Shared segment " + name + " " + problem);
+      }
+      STRUCTURE_TRACE << "Shared segment " << name << " opened, " << h.count.load() << " entries";
+    }
+
+    Segment::~Segment() {
+      ::munmap(_base, _size);
+    }
+
+    void Segment::remove(const std::string& name) {
+      const int result = is_shm(name) ? ::shm_unlink(name.c_str()) : ::unlink(name.c_str());
+      if (result != 0 && errno != ENOENT)
+        throw std::system_error(errno, std::generic_category(), "Can't remove shared segment " + name);
+    }
+
+    uint64_t Segment::allocate(size_t bytes) {
+      auto& h = header();
+      size_t block;
+      const size_t index = size_class(bytes, block);
+      if (index < std::size(h.free) && h.free[index]) {
+        const uint64_t offset = h.free[index];
+        h.free[index] = node(offset)->next.load(std::memory_order_relaxed);
+        return offset;
+      }
+      const uint64_t top = h.top.load(std::memory_order_relaxed);
+      if (index >= std::size(h.free) || block > _size - top)
+        throw std::bad_alloc();
+      h.top.store(top + block, std::memory_order_relaxed);
+      return top;
+    }
+
+    void Segment::release(uint64_t offset, size_t bytes) {
+      auto& h = header();
+      size_t block;
+      const size_t index = size_class(bytes, block);
+      node(offset)->next.store(h.free[index], std::memory_order_relaxed);
+      h.free[index] = offset;
+    }
+  }
+}
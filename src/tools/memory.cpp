@@ -0,0 +1,201 @@
+#include "tools/memory.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+namespace tools {
+  namespace memory {
+    static constexpr size_t gigantic_page = 1 << 30;
+
+    static size_t round_up(size_t size, size_t alignment) {
+      return (size + alignment - 1) / alignment * alignment;
+    }
+
+    size_t page_size(Pages pages) {
+      switch (pages) {
+      case Pages::Normal:
+        return sysconf(_SC_PAGESIZE);
+      case Pages::Gigantic:
+        return gigantic_page;
+      default:
+        return huge_page;
+      }
+    }
+
+    size_t mapped_size(size_t size, Pages pages) {
+      return round_up(size, page_size(pages));
+    }
+
+    uint64_t online_nodes() {
+      uint64_t mask = 0;
+      if (FILE* online = fopen("/sys/devices/system/node/online", "r")) {
+        // List of ranges like "0-1,3"
+        unsigned first, last;
+        int read;
+        while ((read = fscanf(online, "%u-%u", &first, &last)) >= 1) {
+          if (read == 1)
+            last = first;
+          for (unsigned node = first; node <= last && node < 64; node++)
+            mask |= uint64_t(1) << node;
+          if (fgetc(online) != ',')
+            break;
+        }
+        fclose(online);
+      }
+      return mask ? mask : 1;
+    }
+
+    static void* try_map(size_t length, int flags) {
+      void* ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+      return ptr == MAP_FAILED ? nullptr : ptr;
+    }
+
+    /** Regular mapping, aligned to a huge page when it's large enough to hold one */
+    static void* map_aligned(size_t length) {
+      if (length < huge_page) {
+        if (void* ptr = try_map(length, 0))
+          return ptr;
+        throw std::bad_alloc();
+      }
+      auto ptr = static_cast<char*>(try_map(length + huge_page, 0));
+      if (!ptr)
+        throw std::bad_alloc();
+      const auto start = reinterpret_cast<char*>(round_up(reinterpret_cast<uintptr_t>(ptr), huge_page));
+      if (start != ptr)
+        munmap(ptr, start - ptr);
+      munmap(start + length, ptr + huge_page - start);
+      return start;
+    }
+
+    static void place(void* ptr, size_t length, const Policy& policy) {
+      if (policy.numa == Numa::Local)
+        return;
+      const uint64_t mask = policy.nodes ? policy.nodes : online_nodes();
+      const int mode = policy.numa == Numa::Bind ? MPOL_BIND : MPOL_INTERLEAVE;
+      if (syscall(SYS_mbind, ptr, length, mode, &mask, sizeof(mask) * 8 + 1, 0)) {
+        const int error = errno;
+        munmap(ptr, length);
+        throw std::system_error(error, std::generic_category(), "Can't place memory on NUMA nodes");
+      }
+    }
+
+    void* map(size_t size, const Policy& policy) {
+      const size_t length = mapped_size(size, policy.pages);
+      void* ptr = nullptr;
+      if (policy.pages == Pages::Gigantic)
+        ptr = try_map(length, MAP_HUGETLB | MAP_HUGE_1GB);
+      if (!ptr && (policy.pages == Pages::Huge || policy.pages == Pages::Gigantic))
+        ptr = try_map(length, MAP_HUGETLB | MAP_HUGE_2MB);
+      if (!ptr) {
+        // Aligned for Pool segments, regular pages must not get THP backing anyway
+        ptr = map_aligned(length);
+        madvise(ptr, length, policy.pages == Pages::Normal ? MADV_NOHUGEPAGE : MADV_HUGEPAGE);
+      }
+
+      // Policy has to be set before the first touch places pages
+      place(ptr, length, policy);
+      if (policy.prefault) {
+        const size_t step = sysconf(_SC_PAGESIZE);
+        for (size_t offset = 0; offset < length; offset += step)
+          static_cast<volatile char*>(ptr)[offset] = 0;
+      }
+      return ptr;
+    }
+
+    void* map(size_t size, Pages pages) {
+      return map(size, Policy{pages});
+    }
+
+    void unmap(void* ptr, size_t size, Pages pages) {
+      if (ptr)
+        munmap(ptr, mapped_size(size, pages));
+    }
+
+    Pool::Pool(size_t slot_size, size_t slot_align, const Policy& policy) :
+      _policy(policy),
+      _region(mapped_size(huge_page, policy.pages)) {
+      const size_t align = std::max(slot_align, alignof(void*));
+      _slot = round_up(std::max(slot_size, sizeof(void*)), align);
+      _offset = round_up(sizeof(Segment), align);
+      if (_offset + _slot > huge_page)
+        throw std::invalid_argument("Pool slot doesn't fit a segment");
+    }
+
+    Pool::~Pool() {
+      for (auto region : _regions)
+        unmap(region, _region, _policy.pages);
+    }
+
+    bool Pool::advance() {
+      while (_active < _regions.size()) {
+        const auto region = static_cast<char*>(_regions[_active]);
+        if (!_segment)
+          _segment = region;
+        if (_segment < region + _region) {
+          reinterpret_cast<Segment*>(_segment)->owner = this;
+          _next = _segment + _offset;
+          _end = _segment + huge_page;
+          _segment += huge_page;
+          return true;
+        }
+        _active++;
+        _segment = nullptr;
+      }
+      return false;
+    }
+
+    void* Pool::allocate() {
+      void* ptr;
+      if (_free) {
+        ptr = _free;
+        _free = *static_cast<void**>(ptr);
+      } else {
+        if (size_t(_end - _next) < _slot && !advance()) {
+          _regions.push_back(map(_region, _policy));
+          advance();
+        }
+        ptr = _next;
+        _next += _slot;
+      }
+      _count++;
+      return ptr;
+    }
+
+    void Pool::deallocate(void* ptr) {
+      *static_cast<void**>(ptr) = _free;
+      _free = ptr;
+      _count--;
+    }
+
+    void Pool::reserve(size_t slots) {
+      const size_t per_segment = (huge_page - _offset) / _slot;
+      const size_t per_region = _region / huge_page;
+      size_t available = (_end - _next) / _slot;
+      if (_active < _regions.size()) {
+        const auto region = static_cast<char*>(_regions[_active]);
+        const size_t left = _segment ? (region + _region - _segment) / huge_page : per_region;
+        available += (left + (_regions.size() - _active - 1) * per_region) * per_segment;
+      }
+      for (; available < slots; available += per_region * per_segment)
+        _regions.push_back(map(_region, _policy));
+    }
+  }
+}
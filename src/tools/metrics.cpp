@@ -0,0 +1,133 @@
+#include "tools/metrics.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+namespace tools {
+  namespace metrics {
+    namespace {
+      struct Registry {
+        std::mutex lock;
+        std::vector<std::pair<std::string, detail::Kind> > metrics;
+        std::vector<detail::Shard*> shards;
+        detail::Shard retired;    /**< Shards of exited threads merged, written under lock */
+      };
+
+      Registry& registry() {
+        static Registry registry;
+        return registry;
+      }
+
+      /** Sum of counter \c id, called under registry lock */
+      uint64_t count(Registry& registry, size_t id) {
+        uint64_t sum = registry.retired.counters[id].load(std::memory_order_relaxed);
+        for (auto shard : registry.shards)
+          sum += shard->counters[id].load(std::memory_order_relaxed);
+        return sum;
+      }
+
+      /** Merged histogram of latency \c id, called under registry lock */
+      Histogram merged(Registry& registry, size_t id) {
+        Histogram result;
+        const auto add = [&result, id](const detail::Shard& shard) {
+          if (auto histogram = shard.histograms[id].load(std::memory_order_acquire))
+            result.merge(*histogram);
+        };
+        add(registry.retired);
+        for (auto shard : registry.shards)
+          add(*shard);
+        return result;
+      }
+    }
+
+    namespace detail {
+      Shard::Shard() {
+        for (auto& counter : counters)
+          counter.store(0, std::memory_order_relaxed);
+        for (auto& histogram : histograms)
+          histogram.store(nullptr, std::memory_order_relaxed);
+      }
+
+      Shard::~Shard() {
+        for (auto& histogram : histograms)
+          delete histogram.load(std::memory_order_relaxed);
+      }
+
+      Histogram& Shard::allocate(size_t id) {
+        auto histogram = new Histogram();
+        histograms[id].store(histogram, std::memory_order_release);
+        return *histogram;
+      }
+
+      Local::Local() {
+        auto& all = registry();
+        std::lock_guard<std::mutex> guard(all.lock);
+        all.shards.push_back(&shard);
+      }
+
+      Local::~Local() {
+        auto& all = registry();
+        std::lock_guard<std::mutex> guard(all.lock);
+        all.shards.erase(std::find(all.shards.begin(), all.shards.end(), &shard));
+        for (size_t id = 0; id < all.metrics.size(); id++) {
+          auto& counter = all.retired.counters[id];
+          counter.store(counter.load(std::memory_order_relaxed) + shard.counters[id].load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+          if (auto histogram = shard.histograms[id].load(std::memory_order_relaxed))
+            all.retired.histogram(id).merge(*histogram);
+        }
+      }
+
+      size_t enroll(const std::string& name, Kind kind) {
+        auto& all = registry();
+        std::lock_guard<std::mutex> guard(all.lock);
+        const auto found = std::find_if(all.metrics.begin(), all.metrics.end(), [&name](const auto& metric) {
+          return metric.first == name;
+        });
+        if (found != all.metrics.end()) {
+          if (found->second != kind)
+            throw std::invalid_argument("Metric " + name + " is registered with another kind");
+          return found - all.metrics.begin();
+        }
+        if (all.metrics.size() == max_metrics)
+          throw std::length_error("Too many metrics");
+        all.metrics.emplace_back(name, kind);
+        return all.metrics.size() - 1;
+      }
+    }
+
+    uint64_t Counter::value() const {
+      auto& all = registry();
+      std::lock_guard<std::mutex> guard(all.lock);
+      return count(all, _id);
+    }
+
+    Histogram Latency::snapshot() const {
+      auto& all = registry();
+      std::lock_guard<std::mutex> guard(all.lock);
+      return merged(all, _id);
+    }
+
+    std::vector<std::pair<std::string, uint64_t> > counters() {
+      auto& all = registry();
+      std::lock_guard<std::mutex> guard(all.lock);
+      std::vector<std::pair<std::string, uint64_t> > result;
+      for (size_t id = 0; id < all.metrics.size(); id++)
+        if (all.metrics[id].second == detail::Kind::Counter)
+          result.emplace_back(all.metrics[id].first, count(all, id));
+      return result;
+    }
+
+    std::vector<std::pair<std::string, Histogram> > latencies() {
+      auto& all = registry();
+      std::lock_guard<std::mutex> guard(all.lock);
+      std::vector<std::pair<std::string, Histogram> > result;
+      for (size_t id = 0; id < all.metrics.size(); id++)
+        if (all.metrics[id].second == detail::Kind::Latency)
+          result.emplace_back(all.metrics[id].first, merged(all, id));
+      return result;
+    }
+  }
+}
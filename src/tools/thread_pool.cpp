@@ -0,0 +1,120 @@
+#include "tools/thread_pool.hpp"
+
+#include <chrono>
+
+namespace tools {
+  ThreadPool::ThreadPool(size_t threads) {
+    if (!threads)
+      threads = 1;
+    for (size_t i = 0; i <= threads; i++)
+      _queues.push_back(std::make_unique<Queue>());
+    for (size_t i = 0; i < threads; i++)
+      _threads.emplace_back([this, i] { work(i); });
+  }
+
+  ThreadPool::~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> guard(_sleep_lock);
+      _stop = true;
+    }
+    _wake.notify_all();
+    for (auto& thread : _threads)
+      thread.join();
+  }
+
+  void ThreadPool::push(task_t task) {
+    auto& queue = *_queues[worker()];
+    {
+      std::lock_guard<std::mutex> guard(queue.lock);
+      queue.tasks.push_back(std::move(task));
+    }
+    _queued++;
+    if (_idle.load()) {
+      std::lock_guard<std::mutex> guard(_sleep_lock);
+      _wake.notify_one();
+    }
+  }
+
+  bool ThreadPool::take(size_t index, task_t& task) {
+    {
+      auto& own = *_queues[index];
+      std::lock_guard<std::mutex> guard(own.lock);
+      if (!own.tasks.empty()) {
+        task = std::move(own.tasks.back());
+        own.tasks.pop_back();
+        _queued--;
+        return true;
+      }
+    }
+    for (size_t i = 1; i < _queues.size(); i++) {
+      auto& victim = *_queues[(index + i) % _queues.size()];
+      std::lock_guard<std::mutex> guard(victim.lock);
+      if (!victim.tasks.empty()) {
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        _queued--;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void ThreadPool::work(size_t index) {
+    _current = this;
+    _index = index;
+    task_t task;
+    while (true) {
+      if (take(index, task)) {
+        task();
+        task = nullptr;
+        continue;
+      }
+      std::unique_lock<std::mutex> guard(_sleep_lock);
+      _idle++;
+      _wake.wait(guard, [this] { return _stop || _queued.load(); });
+      _idle--;
+      if (_stop)
+        return;
+    }
+  }
+
+  void ThreadPool::run(TaskGroup& group, task_t task) {
+    group._pending++;
+    push([this, &group, task = std::move(task)] {
+      try {
+        task();
+      } catch (...) {
+        std::lock_guard<std::mutex> guard(group._error_lock);
+        if (!group._error)
+          group._error = std::current_exception();
+      }
+      if (--group._pending == 0) {
+        std::lock_guard<std::mutex> guard(_sleep_lock);
+        _wake.notify_all();
+        _done.notify_all();
+      }
+    });
+  }
+
+  void ThreadPool::wait(TaskGroup& group) {
+    if (worker() == size()) {
+      // Outside threads would all run tasks as the same worker index
+      std::unique_lock<std::mutex> guard(_sleep_lock);
+      _done.wait(guard, [&group] { return !group._pending.load(); });
+    }
+    task_t task;
+    while (group._pending.load()) {
+      if (take(worker(), task)) {
+        task();
+        task = nullptr;
+        continue;
+      }
+      std::unique_lock<std::mutex> guard(_sleep_lock);
+      _wake.wait_for(guard, std::chrono::milliseconds(1), [&group, this] {
+        return !group._pending.load() || _queued.load();
+      });
+    }
+    if (group._error)
+      std::rethrow_exception(group._error);
+  }
+}
@@ -0,0 +1,68 @@
+#include "algo/bloom.hpp"
+
+#include <string>
+#include <gtest/gtest.h>
+
+namespace algo::bloom {
+  static std::string key(size_t n)
+  {
+    return "key" + std::to_string(n);
+  }
+
+  TEST(bloom, no_false_negatives)
+  {
+    Blocked filter(10000, 10);
+    ASSERT_EQ(filter.probes(), 7);
+    for (size_t i = 0; i < 10000; i++)
+      filter.add(key(i));
+    for (size_t i = 0; i < 10000; i++)
+      ASSERT_TRUE(filter.contains(key(i)));
+  }
+
+  TEST(bloom, false_positive_rate)
+  {
+    for (double bits : {4.0, 10.0, 16.0}) {
+      Blocked filter(100000, bits);
+      for (size_t i = 0; i < 100000; i++)
+        filter.add(key(i));
+      size_t positives = 0;
+      for (size_t i = 100000; i < 300000; i++)
+        positives += filter.contains(key(i));
+      // Blocking costs a bit over the classic 0.6185^bits
+      const double rate = positives / 200000.0;
+      ASSERT_LT(rate, std::pow(0.6185, bits) * 2 + 0.001) << bits << " bits per key";
+    }
+  }
+
+  TEST(bloom, empty)
+  {
+    Blocked filter;
+    ASSERT_FALSE(filter.contains(key(0)));
+    Blocked sized(0, 10);
+    ASSERT_FALSE(sized.contains(key(0)));
+    sized.add(key(0));
+    ASSERT_TRUE(sized.contains(key(0)));
+  }
+
+  TEST(bloom, serialize)
+  {
+    Blocked filter(1000, 12);
+    for (size_t i = 0; i < 1000; i++)
+      filter.add(key(i));
+    std::string out;
+    tools::serialize::write(out, filter);
+    out.append("tail");
+
+    std::string_view in = out;
+    Blocked loaded;
+    ASSERT_TRUE(tools::serialize::read(in, loaded));
+    ASSERT_EQ(in, "tail");
+    ASSERT_EQ(loaded.probes(), filter.probes());
+    ASSERT_EQ(loaded.bytes(), filter.bytes());
+    for (size_t i = 0; i < 2000; i++)
+      ASSERT_EQ(loaded.contains(key(i)), filter.contains(key(i)));
+
+    std::string_view truncated = std::string_view(out).substr(0, out.size() - 100);
+    ASSERT_FALSE(tools::serialize::read(truncated, loaded));
+  }
+}
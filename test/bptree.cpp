@@ -4,6 +4,9 @@
 #include "algo/crc64.hpp"
 
 #include <cstdint>
+#include <map>
+#include <random>
+#include <string>
 #include <gtest/gtest.h>
 #include <gtest/gtest-spi.h>
 
@@ -12,9 +15,365 @@ namespace structure::bptree {
   const char* key2 = "test2";
   const char* key3 = "test3";
 
+  template class BPTree<uint64_t, int, 3>;
+  template class BPTree<std::string, int, 4>;
+  template class KeyArray<std::string, 8>;
+
   TEST(bptree, construct)
   {
     BPTree<uint64_t, int, 3> bt{};
     bt.insert(42, 43);
+    ASSERT_EQ(bt.get(42), 43);
+    EXPECT_THROW(bt.get(41), std::out_of_range);
+  }
+
+  TEST(bptree, insert)
+  {
+    BPTree<uint64_t, uint64_t, 3> sequential{};
+    BPTree<uint64_t, uint64_t, 4> reversed{};
+    BPTree<uint64_t, uint64_t, 16> shuffled{};
+    std::vector<uint64_t> keys(2000);
+    for (size_t i = 0; i < keys.size(); i++)
+      keys[i] = i * 3;
+    for (auto k : keys)
+      sequential.insert(k, k + 1);
+    for (auto k = keys.rbegin(); k != keys.rend(); ++k)
+      reversed.insert(*k, *k + 1);
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64{42});
+    for (auto k : keys)
+      shuffled.insert(k, k + 1);
+
+    ASSERT_EQ(sequential.size(), keys.size());
+    for (auto k : keys) {
+      ASSERT_EQ(sequential.get(k), k + 1);
+      ASSERT_EQ(reversed.get(k), k + 1);
+      ASSERT_EQ(shuffled.get(k), k + 1);
+      EXPECT_THROW(shuffled.get(k + 1), std::out_of_range);
+    }
+
+    shuffled.insert(keys[0], 0);
+    ASSERT_EQ(shuffled.get(keys[0]), 0);
+    ASSERT_EQ(shuffled.size(), keys.size());
+  }
+
+  template <typename tree_t>
+  void erase_random(tree_t& bt, size_t count, bool compact)
+  {
+    std::mt19937_64 gen{count};
+    std::map<typename tree_t::key_type, int> expected;
+    for (size_t i = 0; i < count; i++) {
+      const auto k = gen() % (count * 2);
+      bt.insert(k, i);
+      expected[k] = i;
+    }
+    for (int round = 0; round < 3; round++) {
+      for (size_t i = 0; i < count; i++) {
+        const auto k = gen() % (count * 2);
+        ASSERT_EQ(bt.erase(k), expected.erase(k) == 1);
+      }
+      if (compact)
+        bt.compact();
+      ASSERT_EQ(bt.size(), expected.size());
+      for (const auto& [k, v] : expected)
+        ASSERT_EQ(bt.get(k), v);
+      for (size_t i = 0; i < count; i++) {
+        const auto k = gen() % (count * 2);
+        bt.insert(k, i);
+        expected[k] = i;
+      }
+    }
+    for (const auto& [k, v] : expected)
+      ASSERT_TRUE(bt.erase(k));
+    bt.compact();
+    ASSERT_EQ(bt.size(), 0);
+    const auto stats = bt.stats();
+    ASSERT_EQ(stats.leaves, 1);
+    ASSERT_EQ(stats.layers, 0);
+    ASSERT_EQ(stats.underfull, 0);
+    ASSERT_GT(stats.pooled, 0);
+  }
+
+  TEST(bptree, erase)
+  {
+    BPTree<uint64_t, int, 3> small{};
+    erase_random(small, 3000, false);
+    BPTree<uint64_t, int, 4> even{};
+    erase_random(even, 3000, false);
+    BPTree<uint64_t, int, 32> wide{};
+    erase_random(wide, 5000, false);
+
+    BPTree<uint64_t, int, 3> bt{};
+    ASSERT_FALSE(bt.erase(1));
+    bt.insert(1, 1);
+    ASSERT_TRUE(bt.erase(1));
+    EXPECT_THROW(bt.get(1), std::out_of_range);
+  }
+
+  TEST(bptree, erase_lazy)
+  {
+    BPTree<uint64_t, int, 3> small{Underflow::Lazy};
+    erase_random(small, 3000, true);
+    BPTree<uint64_t, int, 8> wide{Underflow::Lazy};
+    erase_random(wide, 5000, true);
+
+    BPTree<uint64_t, int, 4> bt{Underflow::Lazy};
+    for (int i = 0; i < 100; i++)
+      bt.insert(i, i);
+    const auto before = bt.stats();
+    for (int i = 0; i < 90; i++)
+      bt.erase(i);
+    ASSERT_EQ(bt.stats().leaves, before.leaves);
+    ASSERT_GT(bt.stats().underfull, 0);
+    bt.compact(1);
+    bt.compact();
+    ASSERT_EQ(bt.stats().underfull, 0);
+    ASSERT_LT(bt.stats().leaves, before.leaves);
+    for (int i = 90; i < 100; i++)
+      ASSERT_EQ(bt.get(i), i);
+
+    const auto pooled = bt.stats().pooled;
+    for (int i = 0; i < 90; i++)
+      bt.insert(i, i);
+    ASSERT_LT(bt.stats().pooled, pooled);
+  }
+
+  TEST(bptree, arena)
+  {
+    BPTree<uint64_t, uint64_t, 16> bt{Underflow::Eager, tools::memory::Pages::Huge};
+    for (uint64_t i = 0; i < 100000; i++)
+      bt.insert(i, i);
+    ASSERT_GT(bt.stats().bytes, 0);
+    ASSERT_EQ(bt.get(77777), 77777);
+
+    bt.clear();
+    ASSERT_EQ(bt.size(), 0);
+    ASSERT_EQ(bt.stats().leaves, 1);
+    EXPECT_THROW(bt.get(77777), std::out_of_range);
+    bt.insert(1, 2);
+    ASSERT_EQ(bt.get(1), 2);
+  }
+
+  TEST(bptree, scan)
+  {
+    BPTree<uint64_t, uint64_t, 5> bt{};
+    for (uint64_t i = 0; i < 1000; i++)
+      bt.insert(i * 2, i);
+
+    std::vector<uint64_t> seen;
+    bt.scan(11, 21, [&seen](uint64_t k, uint64_t v) {
+      ASSERT_EQ(k, v * 2);
+      seen.push_back(k);
+    });
+    ASSERT_EQ(seen, (std::vector<uint64_t>{12, 14, 16, 18, 20}));
+
+    seen.clear();
+    bt.scan_n(11, 3, [&seen](uint64_t k, uint64_t) {
+      seen.push_back(k);
+    });
+    ASSERT_EQ(seen, (std::vector<uint64_t>{12, 14, 16}));
+    seen.clear();
+    bt.scan_n(1995, 10, [&seen](uint64_t k, uint64_t) {
+      seen.push_back(k);
+    });
+    ASSERT_EQ(seen, (std::vector<uint64_t>{1996, 1998}));
+
+    uint64_t count = 0, previous = 0;
+    bt.for_each([&](uint64_t k, uint64_t) {
+      if (count++) {
+        ASSERT_LT(previous, k);
+      }
+      previous = k;
+    });
+    ASSERT_EQ(count, 1000);
+  }
+
+  TEST(bptree, parallel_scan)
+  {
+    tools::ThreadPool pool{4};
+    BPTree<uint64_t, uint64_t, 8> bt{};
+    std::mt19937_64 gen{3};
+    std::map<uint64_t, uint64_t> expected;
+    for (int i = 0; i < 50000; i++) {
+      const auto k = gen() % 1000000;
+      bt.insert(k, k % 7);
+      expected[k] = k % 7;
+    }
+
+    const auto sum = [](uint64_t a, uint64_t b) {
+      return a + b;
+    };
+    const auto add = [](uint64_t& acc, uint64_t, uint64_t v) {
+      acc += v;
+    };
+    uint64_t total = 0;
+    for (const auto& [k, v] : expected)
+      total += v;
+    ASSERT_EQ(bt.parallel_scan(pool, std::nullopt, std::nullopt, uint64_t(0), add, sum), total);
+
+    uint64_t part = 0;
+    for (auto it = expected.lower_bound(123456); it != expected.lower_bound(654321); ++it)
+      part += it->second;
+    ASSERT_EQ(bt.parallel_scan(pool, uint64_t(123456), uint64_t(654321), uint64_t(0), add, sum), part);
+    ASSERT_EQ(bt.parallel_scan(pool, uint64_t(5), uint64_t(5), uint64_t(0), add, sum), 0);
+
+    BPTree<std::string, int, 4> strings{};
+    for (int i = 0; i < 2000; i++)
+      strings.insert("/data/" + std::to_string(i), 1);
+    const auto count = strings.parallel_scan(pool, std::string("/data/1"), std::string("/data/2"), 0,
+                                             [](int& acc, const std::string&, int v) {
+      acc += v;
+    }, [](int a, int b) {
+      return a + b;
+    });
+    ASSERT_EQ(count, 1111);
+  }
+
+  TEST(bptree, string_keys)
+  {
+    BPTree<std::string, int, 4> bt{};
+    bt.insert(key, 1);
+    bt.insert(key2, 2);
+    bt.insert(key3, 3);
+    ASSERT_EQ(bt.get(key), 1);
+    ASSERT_EQ(bt.get(key2), 2);
+    ASSERT_EQ(bt.get(key3), 3);
+    EXPECT_THROW(bt.get("test1"), std::out_of_range);
+
+    std::mt19937_64 gen{7};
+    std::vector<std::string> urls;
+    for (int i = 0; i < 1500; i++)
+      urls.push_back("https://example.com/path/" + std::to_string(gen() % 100000) +
+                     (i % 3 ? std::string("/index.html") : std::string(1, '\0')));
+    for (size_t i = 0; i < urls.size(); i++)
+      bt.insert(urls[i], i);
+    std::map<std::string, int> expected;
+    for (size_t i = 0; i < urls.size(); i++)
+      expected[urls[i]] = i;
+    for (const auto& [k, v] : expected)
+      ASSERT_EQ(bt.get(k), v);
+    EXPECT_THROW(bt.get("https://example.com/path/"), std::out_of_range);
+  }
+
+  TEST(bptree, prefix_keys)
+  {
+    KeyArray<std::string, 8> keys{};
+    std::vector<std::string> sorted = {"/usr/lib/a", "/usr/lib/abcdefghijk", "/usr/lib/b"};
+    for (size_t i = 0; i < sorted.size(); i++)
+      keys.insert(i, i, sorted[i]);
+    ASSERT_EQ(keys.prefix(), "/usr/lib/");
+    for (size_t i = 0; i < sorted.size(); i++)
+      ASSERT_EQ(keys.key(i), sorted[i]);
+
+    for (const auto& probe : {"/usr", "/usr/lib/abcdefghij", "/usr/lib/abcdefghijl",
+                              "/usr/lib/a\xFF", "/usr/lib/b", "/x", ""}) {
+      const auto expected = std::lower_bound(sorted.begin(), sorted.end(), probe) - sorted.begin();
+      ASSERT_EQ(keys.lower_bound(sorted.size(), probe), expected) << probe;
+    }
+
+    keys.insert(3, 0, "/tmp");
+    ASSERT_EQ(keys.prefix(), "/");
+    ASSERT_EQ(keys.key(0), "/tmp");
+    ASSERT_EQ(keys.key(2), "/usr/lib/abcdefghijk");
+    keys.erase(4, 0);
+    ASSERT_EQ(keys.key(0), "/usr/lib/a");
+  }
+
+  template <typename tree_t>
+  void bulk_random(tree_t& bt, size_t count, double fill)
+  {
+    std::mt19937_64 gen{count};
+    std::map<uint64_t, int> expected;
+    for (size_t i = 0; i < count; i++)
+      expected[gen() % (count * 4)] = i;
+    bt.bulk_load(expected.begin(), expected.end(), fill);
+    ASSERT_EQ(bt.size(), expected.size());
+    for (const auto& [k, v] : expected)
+      ASSERT_EQ(bt.get(k), v);
+    auto next = expected.begin();
+    bt.for_each([&next](uint64_t k, int v) {
+      ASSERT_EQ(k, next->first);
+      ASSERT_EQ(v, next->second);
+      ++next;
+    });
+
+    // Built tree takes further updates as any other
+    for (size_t i = 0; i < count; i++) {
+      const auto k = gen() % (count * 4);
+      if (i % 2) {
+        bt.insert(k, -1);
+        expected[k] = -1;
+      } else {
+        ASSERT_EQ(bt.erase(k), expected.erase(k) == 1);
+      }
+    }
+    for (const auto& [k, v] : expected)
+      ASSERT_EQ(bt.get(k), v);
+    for (const auto& [k, v] : expected)
+      ASSERT_TRUE(bt.erase(k));
+    ASSERT_EQ(bt.size(), 0);
+    ASSERT_EQ(bt.stats().leaves, 1);
+    ASSERT_EQ(bt.stats().layers, 0);
+  }
+
+  TEST(bptree, bulk_load)
+  {
+    for (size_t count : {0, 1, 2, 3, 7, 100, 5000}) {
+      BPTree<uint64_t, int, 3> small{};
+      bulk_random(small, count, 1.0);
+      BPTree<uint64_t, int, 4> even{};
+      bulk_random(even, count, 0.5);
+      BPTree<uint64_t, int, 32> wide{};
+      bulk_random(wide, count, 0.7);
+    }
+
+    BPTree<uint64_t, int, 8> full{};
+    std::vector<std::pair<uint64_t, int> > pairs;
+    for (int i = 0; i < 8000; i++)
+      pairs.emplace_back(i, i);
+    full.bulk_load(pairs.begin(), pairs.end());
+    ASSERT_EQ(full.stats().leaves, 1000);
+    ASSERT_THROW(full.bulk_load(pairs.begin(), pairs.end()), std::logic_error);
+
+    BPTree<uint64_t, int, 8> unsorted{};
+    std::swap(pairs[500], pairs[501]);
+    ASSERT_THROW(unsorted.bulk_load(pairs.begin(), pairs.end()), std::logic_error);
+    ASSERT_EQ(unsorted.size(), 0);
+    unsorted.insert(1, 1);
+    ASSERT_EQ(unsorted.get(1), 1);
+
+    // Lazily emptied tree still has inner nodes and marked leaves
+    BPTree<uint64_t, int, 8> emptied{Underflow::Lazy};
+    for (int i = 0; i < 1000; i++)
+      emptied.insert(i, i);
+    for (int i = 0; i < 1000; i++)
+      emptied.erase(i);
+    pairs.resize(100);
+    emptied.bulk_load(pairs.begin(), pairs.end());
+    for (int i = 0; i < 100; i++)
+      ASSERT_EQ(emptied.get(i), i);
+    emptied.compact();
+    ASSERT_EQ(emptied.size(), 100);
+    ASSERT_EQ(emptied.get(99), 99);
+
+    BPTree<std::string, std::string, 4> strings{};
+    std::vector<std::pair<std::string, std::string> > named;
+    for (int i = 0; i < 1000; i++)
+      named.emplace_back(normalized_key(i), std::string(40, 'v'));
+    strings.bulk_load(std::make_move_iterator(named.begin()), std::make_move_iterator(named.end()));
+    ASSERT_TRUE(named[0].second.empty());
+    ASSERT_EQ(strings.get(normalized_key(999)), std::string(40, 'v'));
+    std::vector<std::string> seen;
+    strings.scan(normalized_key(10), normalized_key(13), [&seen](const std::string& k, const std::string&) {
+      seen.push_back(k);
+    });
+    ASSERT_EQ(seen, (std::vector<std::string>{normalized_key(10), normalized_key(11), normalized_key(12)}));
+  }
+
+  TEST(bptree, normalized_keys)
+  {
+    ASSERT_LT(normalized_key(-1), normalized_key(0));
+    ASSERT_LT(normalized_key(255), normalized_key(256));
+    ASSERT_LT(normalized_key(std::string_view("a"), 2), normalized_key(std::string_view("ab"), 1));
+    ASSERT_LT(normalized_key(std::string_view("a"), 2), normalized_key(std::string_view("a\0", 2), 1));
   }
 }
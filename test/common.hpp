@@ -0,0 +1,44 @@
+#pragma once
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+
+namespace test {
+
+  /**
+   * File or directory path in the temporary directory, unique to the process
+
+     Whatever is left there is removed on creation and again on
+     destruction, also when the test fails halfway.
+   */
+  class TempPath {
+    std::string _path;
+
+  public:
+    explicit TempPath(const std::string& name) :
+      _path(std::filesystem::temp_directory_path() / ("csdb_" + name + "_" + std::to_string(getpid()))) {
+      std::filesystem::remove_all(_path);
+    }
+
+    ~TempPath() {
+      std::error_code ignored;
+      std::filesystem::remove_all(_path, ignored);
+    }
+
+    TempPath(const TempPath&) = delete;
+    TempPath& operator=(const TempPath&) = delete;
+
+    const std::string& str() const {
+      return _path;
+    }
+
+    operator const std::string&() const {
+      return _path;
+    }
+
+    operator std::filesystem::path() const {
+      return _path;
+    }
+  };
+}
@@ -0,0 +1,105 @@
+#include "database.hpp"
+#include "common.hpp"
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+namespace csdb {
+  TEST(database, lazy)
+  {
+    Database db;
+    ASSERT_FALSE(db.opened("users"));
+    auto& users = db.table("users");
+    ASSERT_TRUE(db.opened("users"));
+    ASSERT_EQ(&users, &db.table("users"));
+
+    users.put("alice", "1");
+    users.put("bob", "2");
+    ASSERT_EQ(users.get("alice"), "1");
+    users.erase("alice");
+    ASSERT_EQ(users.get("alice"), std::nullopt);
+    ASSERT_EQ(db.table("other").get("bob"), std::nullopt);
+
+    ASSERT_THROW(db.table(""), std::invalid_argument);
+    ASSERT_THROW(db.table("a/b"), std::invalid_argument);
+    ASSERT_FALSE(db.opened("a/b"));
+  }
+
+  TEST(database, hashes)
+  {
+    for (auto hash : {Hash::Crc64, Hash::Crc32, Hash::Highway}) {
+      Options options;
+      options.hash = hash;
+      options.expected = 1000;
+      options.memory_budget = 1 << 20;
+      Database db(options);
+      auto& table = db.table("t");
+      for (int i = 0; i < 1000; i++)
+        table.put(std::to_string(i), std::to_string(i * 2));
+      for (int i = 0; i < 1000; i++)
+        ASSERT_EQ(table.get(std::to_string(i)), std::to_string(i * 2));
+    }
+  }
+
+  TEST(database, durable)
+  {
+    Options undirected;
+    undirected.durability = Durability::Logged;
+    ASSERT_THROW(Database{undirected}, std::invalid_argument);
+
+    for (auto durability : {Durability::Logged, Durability::Persistent}) {
+      const test::TempPath dir(durability == Durability::Logged ? "database_logged" : "database_persistent");
+      Options options;
+      options.dir = dir;
+      options.durability = durability;
+      options.sync = storage::wal::Sync::Never;
+      options.memory_budget = 64 << 10;
+      {
+        Database db(options);
+        auto& table = db.table("kv");
+        for (int i = 0; i < 2000; i++)
+          table.put("key" + std::to_string(i), "value" + std::to_string(i));
+        table.erase("key7");
+        db.flush();
+      }
+
+      Database db(options);
+      ASSERT_FALSE(db.opened("kv"));
+      auto& table = db.table("kv");
+      ASSERT_EQ(table.get("key1999"), "value1999");
+      ASSERT_EQ(table.get("key7"), std::nullopt);
+    }
+  }
+
+  TEST(database, preload)
+  {
+    const test::TempPath dir("database_preload");
+    std::vector<std::string> names;
+    for (int i = 0; i < 6; i++)
+      names.push_back("t" + std::to_string(i));
+
+    Options options;
+    options.dir = dir;
+    options.durability = Durability::Persistent;
+    options.sync = storage::wal::Sync::Never;
+    options.threads = 3;
+    {
+      Database db(options);
+      for (const auto& name : names)
+        db.table(name).put("name", name);
+    }
+
+    options.preload = names;
+    options.preload.push_back("t0");
+    Database db(options);
+    for (const auto& name : names) {
+      ASSERT_TRUE(db.opened(name));
+      ASSERT_EQ(db.table(name).get("name"), name);
+    }
+    ASSERT_FALSE(db.opened("t6"));
+    db.warm({"t6", "t7", "t0"});
+    ASSERT_TRUE(db.opened("t7"));
+  }
+}
@@ -0,0 +1,107 @@
+#include "structure/frozen.hpp"
+
+#include "algo/crc32.hpp"
+#include "algo/crc64.hpp"
+
+#include <random>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+namespace structure::frozen {
+  using namespace algo::hash;
+
+  TEST(frozen, strings)
+  {
+    Builder<std::string, std::string, crc64> builder;
+    for (int i = 0; i < 10000; i++)
+      builder.add("key" + std::to_string(i), std::to_string(i * 2));
+    builder.add("", "empty");
+    auto table = builder.build();
+    ASSERT_EQ(builder.size(), 0);
+    ASSERT_EQ(table.size(), 10001);
+    ASSERT_EQ(table.pilots().size(), 10001 / bucket_load + 1);
+    for (int i = 0; i < 10000; i++)
+      ASSERT_EQ(table["key" + std::to_string(i)], std::to_string(i * 2));
+    ASSERT_EQ(table.at(""), "empty");
+    for (int i = 10000; i < 20000; i++)
+      ASSERT_EQ(table.find("key" + std::to_string(i)), nullptr);
+    ASSERT_THROW(table.at("missing"), std::out_of_range);
+
+    size_t count = 0;
+    table.for_each([&count](const std::string&, const std::string&) {
+      count++;
+    });
+    ASSERT_EQ(count, 10001);
+  }
+
+  TEST(frozen, freeze)
+  {
+    hashtable::HashTable<uint64_t, uint64_t, crc64> source;
+    for (uint64_t i = 0; i < 100000; i++)
+      source[i * 7] = i;
+    const auto table = freeze(source);
+    ASSERT_EQ(table.size(), 100000);
+    for (uint64_t i = 0; i < 100000; i++) {
+      ASSERT_EQ(table.at(i * 7), i);
+      ASSERT_EQ(table.find(i * 7 + 1), nullptr);
+    }
+  }
+
+  TEST(frozen, narrow_hash)
+  {
+    // Equal-length keys colliding on crc32 would collide under every seed
+    std::mt19937_64 random(42);
+    Builder<uint64_t, uint64_t, crc32> numbers;
+    std::vector<uint64_t> keys(300000);
+    for (auto& key : keys) {
+      key = random();
+      numbers.add(key, ~key);
+    }
+    const auto by_number = numbers.build();
+    for (const auto key : keys)
+      ASSERT_EQ(by_number.at(key), ~key);
+
+    Builder<std::string, size_t, crc32> strings;
+    std::vector<std::string> words(100000);
+    for (size_t i = 0; i < words.size(); i++) {
+      words[i] = std::to_string(random());
+      words[i].resize(20, 'x');
+      strings.add(words[i], i);
+    }
+    const auto by_string = strings.build();
+    for (size_t i = 0; i < words.size(); i++)
+      ASSERT_EQ(by_string.at(words[i]), i);
+  }
+
+  TEST(frozen, composite)
+  {
+    Builder<std::pair<std::string, uint32_t>, uint32_t, crc32> builder;
+    for (uint32_t i = 0; i < 20000; i++)
+      builder.add({"key" + std::to_string(i % 100), i}, i);
+    const auto table = builder.build();
+    for (uint32_t i = 0; i < 20000; i++)
+      ASSERT_EQ(table.at({"key" + std::to_string(i % 100), i}), i);
+    ASSERT_EQ(table.find({"key1", 2}), nullptr);
+  }
+
+  TEST(frozen, edge_cases)
+  {
+    Builder<std::string, int, crc64> empty;
+    const auto none = empty.build();
+    ASSERT_EQ(none.size(), 0);
+    ASSERT_EQ(none.find("a"), nullptr);
+
+    Builder<std::string, int, crc64> single;
+    single.add("a", 1);
+    const auto one = single.build();
+    ASSERT_EQ(one.at("a"), 1);
+    ASSERT_EQ(one.find("b"), nullptr);
+
+    Builder<std::string, int, crc64> duplicates;
+    duplicates.add("a", 1);
+    duplicates.add("b", 2);
+    duplicates.add("a", 3);
+    ASSERT_THROW(duplicates.build(), std::invalid_argument);
+  }
+}
@@ -0,0 +1,93 @@
+#include "algo/hash_append.hpp"
+
+#include <string>
+#include <tuple>
+#include <vector>
+#include <gtest/gtest.h>
+
+namespace keys {
+  struct Composite {
+    std::string name;
+    uint32_t id;
+    std::vector<uint16_t> parts;
+  };
+
+  template <typename H>
+  void hash_append(H& h, const Composite& key) {
+    algo::hash::hash_append(h, key.name, key.id, key.parts);
+  }
+
+  /* Counts bytes fed to check nothing but the fields is hashed */
+  struct Counter {
+    size_t calls = 0;
+    size_t bytes = 0;
+
+    void operator()(const void*, size_t size) {
+      calls++;
+      bytes += size;
+    }
+  };
+}
+
+namespace algo::hash {
+  static std::string sample(size_t size)
+  {
+    std::string data(size, 0);
+    for (size_t i = 0; i < size; i++)
+      data[i] = char(i * 131 + 7);
+    return data;
+  }
+
+  template <auto hash>
+  static void check_stream()
+  {
+    const auto data = sample(1000);
+    const auto bytes = reinterpret_cast<const uint8_t *>(data.data());
+    for (size_t split : {0, 1, 31, 32, 33, 500, 1000}) {
+      Stream<hash> stream;
+      stream(bytes, split);
+      stream(bytes + split, data.size() - split);
+      ASSERT_EQ(stream.finish(), hash(bytes, data.size(), 0)) << split;
+    }
+  }
+
+  TEST(hash_append, stream)
+  {
+    check_stream<crc32>();
+    check_stream<crc64>();
+    check_stream<highway64>();
+  }
+
+  TEST(hash_append, composite)
+  {
+    using key_t = std::tuple<std::string, std::string>;
+    ASSERT_NE(streamed<crc64>(key_t{"ab", "c"}), streamed<crc64>(key_t{"a", "bc"}));
+    ASSERT_NE(streamed<crc64>(std::vector<std::string>{"a", "b"}), streamed<crc64>(std::vector<std::string>{"ab"}));
+    ASSERT_NE(streamed<crc64>(std::optional<int>()), streamed<crc64>(std::optional<int>(0)));
+    ASSERT_EQ(streamed<crc64>(std::make_pair(0.0, 1)), streamed<crc64>(std::make_pair(-0.0, 1)));
+    ASSERT_EQ(streamed<highway64>(std::make_pair(std::string("x"), 1u)),
+              streamed<highway64>(std::make_tuple(std::string("x"), 1u)));
+  }
+
+  TEST(hash_append, user_type)
+  {
+    static_assert(is_streamed_v<keys::Composite>);
+    static_assert(is_streamed_v<std::pair<int, int> >);
+    static_assert(!is_streamed_v<std::string>);
+    static_assert(!is_streamed_v<uint64_t>);
+    static_assert(!is_streamed_v<const char *>);
+
+    keys::Composite key{sample(4 << 20), 7, {1, 2, 3}};
+    keys::Counter counter;
+    hash_append(counter, key);
+    // Content and size of each field, the 4MB name is passed as is
+    ASSERT_EQ(counter.calls, 5);
+    ASSERT_EQ(counter.bytes, key.name.size() + sizeof(size_t) + sizeof(uint32_t) +
+              3 * sizeof(uint16_t) + sizeof(size_t));
+
+    const auto hash = streamed<highway64>(key);
+    ASSERT_EQ(hash, streamed<highway64>(key));
+    key.parts.back()++;
+    ASSERT_NE(hash, streamed<highway64>(key));
+  }
+}
@@ -1,9 +1,21 @@
 #include "structure/hashtable.hpp"
+#include "structure/cache.hpp"
 
 #include "algo/crc32.hpp"
 #include "algo/crc64.hpp"
+#include "algo/hash_append.hpp"
 
+#include <atomic>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <tuple>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
 #include <gtest/gtest.h>
 #include <gtest/gtest-spi.h>
 
@@ -60,6 +72,16 @@ namespace structure::hashtable {
     ASSERT_EQ(ht.at(key), 43);
   }
 
+  TEST (hashtable, integer_keys)
+  {
+    HashTable<uint64_t, int, crc64> ht{};
+    ht[42] = 1;
+    ht[43] = 2;
+    ASSERT_EQ(ht.at(42), 1);
+    ASSERT_EQ(ht.at(43), 2);
+    EXPECT_THROW(ht.at(44), std::out_of_range);
+  }
+
   uint64_t fake_hash(const uint8_t* s, size_t size, uint64_t init=0) {
     return 1;
   }
@@ -112,4 +134,388 @@ namespace structure::hashtable {
       ht.erase(key2);
     }));
   }
+
+  TEST(hashtable, find)
+  {
+    HashTable<std::string, int, crc64> ht{};
+    ASSERT_EQ(ht.find(key), nullptr);
+    ht[key] = 42;
+    ASSERT_EQ(*ht.find(key), 42);
+    *ht.find(key) = 43;
+    ASSERT_EQ(ht.at(key), 43);
+    const auto& reader = ht;
+    ASSERT_EQ(*reader.find(key), 43);
+    ASSERT_EQ(reader.find(key2), nullptr);
+  }
+
+  struct Counted {
+    static inline size_t copies = 0;
+    static inline size_t constructed = 0;
+    std::string data;
+
+    Counted() {
+      constructed++;
+    }
+    Counted(std::string data, size_t repeat) :
+      data(repeat, data[0]) {
+      constructed++;
+    }
+    Counted(const Counted& other) :
+      data(other.data) {
+      copies++;
+    }
+    Counted(Counted&&) = default;
+    Counted& operator=(const Counted& other) {
+      data = other.data;
+      copies++;
+      return *this;
+    }
+    Counted& operator=(Counted&&) = default;
+  };
+
+  struct Point {
+    std::string space;
+    int64_t x, y;
+
+    bool operator==(const Point& other) const {
+      return space == other.space && x == other.x && y == other.y;
+    }
+  };
+
+  template <typename H>
+  void hash_append(H& h, const Point& point) {
+    algo::hash::hash_append(h, point.space, point.x, point.y);
+  }
+
+  TEST(hashtable, composite)
+  {
+    HashTable<std::tuple<std::string, int>, int, crc32> tuples{};
+    for (int i = 0; i < 1000; i++)
+      tuples[{"key" + std::to_string(i % 10), i}] = i;
+    for (int i = 0; i < 1000; i++)
+      ASSERT_EQ(tuples.at({"key" + std::to_string(i % 10), i}), i);
+    ASSERT_EQ(tuples.find({"key1", 2}), nullptr);
+
+    HashTable<Point, std::string, highway64> points{};
+    points.try_emplace(Point{"a", 1, 2}, "first");
+    points.try_emplace(Point{"a", 2, 1}, "second");
+    ASSERT_EQ(points.at(Point{"a", 1, 2}), "first");
+    ASSERT_EQ(points.at(Point{"a", 2, 1}), "second");
+    ASSERT_THROW(points.at(Point{"b", 1, 2}), std::out_of_range);
+  }
+
+  TEST(hashtable, emplace)
+  {
+    HashTable<std::string, Counted, crc64> ht{};
+    std::string long_key(1000, 'k');
+    auto [value, inserted] = ht.try_emplace(std::move(long_key), "v", 1000);
+    ASSERT_TRUE(inserted);
+    ASSERT_TRUE(long_key.empty());
+    ASSERT_EQ(value->data.size(), 1000);
+    ASSERT_EQ(Counted::constructed, 1);
+
+    // Present key leaves both the key and the value alone
+    std::string same(1000, 'k');
+    auto [existing, again] = ht.emplace(std::move(same), "w", 10);
+    ASSERT_FALSE(again);
+    ASSERT_EQ(existing, value);
+    ASSERT_EQ(same.size(), 1000);
+    ASSERT_EQ(Counted::constructed, 1);
+
+    auto [assigned, fresh] = ht.insert_or_assign(same, Counted("a", 10));
+    ASSERT_FALSE(fresh);
+    ASSERT_EQ(assigned->data, std::string(10, 'a'));
+    std::tie(assigned, fresh) = ht.insert_or_assign(std::string(100, 'x'), Counted("b", 5));
+    ASSERT_TRUE(fresh);
+    ASSERT_EQ(ht.at(std::string(100, 'x')).data, "bbbbb");
+
+    ht[std::string(50, 'y')].data = "moved";
+    ASSERT_EQ(ht.at(std::string(50, 'y')).data, "moved");
+    ASSERT_EQ(Counted::copies, 0);
+
+    HashTable<uint64_t, int, crc64> numbers{};
+    ASSERT_TRUE(numbers.try_emplace(1, 10).second);
+    ASSERT_FALSE(numbers.try_emplace(1, 20).second);
+    ASSERT_EQ(numbers.at(1), 10);
+    numbers.insert_or_assign(1, 30);
+    ASSERT_EQ(numbers.at(1), 30);
+  }
+
+  /** Flags of the mapping holding \c ptr as /proc/self/smaps lists them */
+  static std::string vm_flags(const void* ptr) {
+    std::ifstream smaps("/proc/self/smaps");
+    const auto address = reinterpret_cast<uintptr_t>(ptr);
+    bool inside = false;
+    for (std::string line; std::getline(smaps, line);) {
+      uintptr_t start, end;
+      if (sscanf(line.c_str(), "%lx-%lx ", &start, &end) == 2)
+        inside = start <= address && address < end;
+      else if (inside && line.rfind("VmFlags:", 0) == 0)
+        return line;
+    }
+    return {};
+  }
+
+  TEST(hashtable, pool)
+  {
+    using namespace tools::memory;
+    Pool pool(24, 8);
+    ASSERT_EQ(pool.bytes(), 0);
+    std::vector<void*> slots;
+    for (size_t i = 0; i < 200000; i++) {
+      slots.push_back(pool.allocate());
+      memset(slots.back(), 0xff, 24);
+    }
+    ASSERT_EQ(pool.size(), 200000);
+    ASSERT_EQ(pool.bytes(), 3 * huge_page);
+    for (auto slot : slots)
+      Pool::release(slot);
+    ASSERT_EQ(pool.size(), 0);
+    ASSERT_EQ(pool.allocate(), slots.back());
+    // Huge page aligned, but a small table mustn't fault in a whole huge page
+    const auto flags = vm_flags(slots.back());
+    if (!flags.empty()) {
+      ASSERT_NE(flags.find(" nh"), std::string::npos) << flags;
+    }
+
+    Pool reserved(24, 8, {Pages::Transparent, Numa::Local, 0, true});
+    reserved.reserve(200000);
+    const auto bytes = reserved.bytes();
+    for (size_t i = 0; i < 200000; i++)
+      reserved.allocate();
+    ASSERT_EQ(reserved.bytes(), bytes);
+  }
+
+  TEST(hashtable, policy)
+  {
+    using namespace tools::memory;
+    for (auto pages : {Pages::Normal, Pages::Transparent, Pages::Huge}) {
+      HashTable<uint64_t, uint64_t, crc64> table({pages, Numa::Local, 0, true}, 100000);
+      const auto reserved = table.node_bytes();
+      ASSERT_GT(reserved, 0);
+      for (uint64_t i = 0; i < 100000; i++)
+        table[i] = i;
+      for (uint64_t i = 0; i < 100000; i += 7)
+        table.erase(i);
+      for (uint64_t i = 0; i < 100000; i++)
+        ASSERT_EQ(table.find(i) != nullptr, i % 7 != 0);
+      ASSERT_EQ(table.node_bytes(), reserved);
+    }
+
+    // Placement may be refused in containers, the table itself must not care
+    for (auto numa : {Numa::Bind, Numa::Interleave}) {
+      try {
+        HashTable<std::string, int, crc64> table({Pages::Normal, numa, online_nodes(), false});
+        table[key] = 1;
+        ASSERT_EQ(table.at(key), 1);
+      } catch (const std::system_error& e) {
+        ASSERT_TRUE(e.code().value() == EPERM || e.code().value() == ENOSYS) << e.what();
+      }
+    }
+  }
+
+  TEST(hashtable, batch)
+  {
+    HashTable<std::string, int, crc64> ht{};
+    ht[key] = 1;
+    ht[key2] = 2;
+    WriteBatch<std::string, int> batch;
+    batch.put(key3, 3);
+    batch.erase(key2);
+    batch.put(key, 10);
+    batch.put(key2, 20);
+    batch.erase(key3);
+    batch.erase("missing");
+    batch.put(key, 11);
+    ASSERT_EQ(batch.size(), 7);
+    ht.apply(std::move(batch));
+    ASSERT_EQ(ht.at(key), 11);
+    ASSERT_EQ(ht.at(key2), 20);
+    ASSERT_EQ(ht.find(key3), nullptr);
+
+    WriteBatch<uint64_t, uint64_t> numbers;
+    for (uint64_t i = 0; i < 10000; i++)
+      numbers.put(i, i * 2);
+    HashTable<uint64_t, uint64_t, crc64> table{};
+    table.apply(std::move(numbers));
+    for (uint64_t i = 0; i < 10000; i++)
+      ASSERT_EQ(table.at(i), i * 2);
+  }
+
+  TEST(hashtable, bulk_load)
+  {
+    tools::ThreadPool workers{3};
+    std::vector<std::pair<std::string, int> > pairs;
+    for (int i = 0; i < 100000; i++)
+      pairs.emplace_back("key" + std::to_string(i), i);
+    // Repeated keys get their last value
+    pairs.emplace_back("key7", -7);
+    pairs.emplace_back("key7", -70);
+
+    HashTable<std::string, int, crc64> ht{};
+    ht["key1"] = 100;
+    ht["existing"] = 5;
+    ht.bulk_load(workers, pairs);
+    ASSERT_EQ(ht.at("existing"), 5);
+    ASSERT_EQ(ht.at("key1"), 1);
+    ASSERT_EQ(ht.at("key7"), -70);
+    size_t count = 0;
+    ht.for_each([&count](const std::string&, int) { count++; });
+    ASSERT_EQ(count, 100001);
+    for (int i = 0; i < 100000; i += 7) {
+      if (i == 7)
+        continue;
+      ASSERT_EQ(ht.at("key" + std::to_string(i)), i);
+    }
+
+    // Keys are moved out of move iterators
+    std::vector<std::pair<std::string, int> > moved = {{std::string(64, 'm'), 1}};
+    ht.bulk_load(workers, std::make_move_iterator(moved.begin()), std::make_move_iterator(moved.end()));
+    ASSERT_EQ(ht.at(std::string(64, 'm')), 1);
+    ASSERT_TRUE(moved[0].first.empty());
+
+    ht.erase("existing");
+    ASSERT_EQ(ht.find("existing"), nullptr);
+    ht.bulk_load(workers, pairs.begin(), pairs.begin());
+  }
+
+  TEST(hashtable, rebuild)
+  {
+    tools::ThreadPool workers{2};
+    HashTable<uint64_t, std::string, crc64> ht{};
+    for (uint64_t i = 0; i < 200000; i++)
+      ht[i] = std::to_string(i);
+    for (uint64_t i = 0; i < 200000; i++)
+      if (i % 10)
+        ht.erase(i);
+    const auto before = ht.node_bytes();
+
+    ht.rebuild(workers);
+    ASSERT_LT(ht.node_bytes(), before);
+    size_t count = 0;
+    ht.for_each([&count](uint64_t key, const std::string& value) {
+      ASSERT_EQ(key % 10, 0);
+      ASSERT_EQ(value, std::to_string(key));
+      count++;
+    });
+    ASSERT_EQ(count, 20000);
+
+    // Nodes from worker pools are freed and reused as any other
+    ht.erase(0);
+    ht[1] = "one";
+    ASSERT_EQ(ht.find(0), nullptr);
+    ASSERT_EQ(ht.at(1), "one");
+    ASSERT_EQ(ht.at(10), "10");
+  }
+
+  /** Value whose copy fails once \c copies_left runs out */
+  struct Fragile {
+    inline static std::atomic<int> copies_left{-1};
+    uint64_t value = 0;
+
+    Fragile() = default;
+    explicit Fragile(uint64_t v) :
+      value(v) {}
+
+    Fragile(const Fragile& other) :
+      value(other.value) {
+      if (copies_left.fetch_sub(1) == 0)
+        throw std::runtime_error("Copy failed");
+    }
+
+    Fragile& operator=(const Fragile&) = default;
+  };
+
+  TEST(hashtable, rebuild_failure)
+  {
+    tools::ThreadPool workers{2};
+    HashTable<uint64_t, Fragile, crc64> ht{};
+    for (uint64_t i = 0; i < 10000; i++)
+      ht.try_emplace(i, i);
+
+    // Table is left whole when a copy throws midway
+    Fragile::copies_left = 5000;
+    ASSERT_THROW(ht.rebuild(workers), std::runtime_error);
+    Fragile::copies_left = -1;
+    for (uint64_t i = 0; i < 10000; i++)
+      ASSERT_EQ(ht.at(i).value, i);
+
+    ht.rebuild(workers);
+    for (uint64_t i = 0; i < 10000; i++)
+      ASSERT_EQ(ht.at(i).value, i);
+  }
+
+  TEST(hashtable, cache_entries)
+  {
+    Cache<uint64_t, uint64_t, crc64> cache({.entries = 100});
+    for (uint64_t i = 0; i < 100; i++)
+      cache.put(i, i);
+    // Hot half is referenced, new keys push out the cold one
+    for (uint64_t i = 0; i < 50; i++)
+      ASSERT_EQ(*cache.find(i), i);
+    for (uint64_t i = 100; i < 150; i++)
+      cache.put(i, i);
+    ASSERT_EQ(cache.size(), 100);
+    for (uint64_t i = 0; i < 50; i++)
+      ASSERT_NE(cache.find(i), nullptr);
+    for (uint64_t i = 50; i < 100; i++)
+      ASSERT_EQ(cache.find(i), nullptr);
+
+    const auto counters = cache.counters();
+    ASSERT_EQ(counters.hits, 100);
+    ASSERT_EQ(counters.misses, 50);
+    ASSERT_EQ(counters.evictions, 50);
+
+    ASSERT_TRUE(cache.erase(0));
+    ASSERT_FALSE(cache.erase(0));
+    ASSERT_EQ(cache.size(), 99);
+    cache.put(1000, 1);
+    ASSERT_EQ(cache.counters().evictions, 50);
+  }
+
+  TEST(hashtable, cache_bytes)
+  {
+    Cache<std::string, std::string, crc64> cache({.bytes = 64 << 10});
+    for (size_t i = 0; i < 1000; i++) {
+      cache.put("key" + std::to_string(i), std::string(1000, 'x'));
+      ASSERT_LE(cache.bytes(), 64 << 10);
+    }
+    ASSERT_GT(cache.size(), 40);
+    ASSERT_LT(cache.size(), 64);
+    ASSERT_EQ(*cache.find("key999"), std::string(1000, 'x'));
+
+    // Growing an entry evicts others, never itself
+    cache.put("key999", std::string(32 << 10, 'y'));
+    ASSERT_LE(cache.bytes(), 64 << 10);
+    ASSERT_EQ(cache.find("key999")->size(), 32 << 10);
+  }
+
+  TEST(hashtable, cache_weight)
+  {
+    ASSERT_THROW((Cache<uint64_t, uint64_t, crc64>({.entries = 0})), std::invalid_argument);
+
+    // Past the inline buffer but smaller than the string object
+    Cache<uint64_t, std::string, crc64> cache({});
+    cache.put(0, "short");
+    const auto inline_bytes = cache.bytes();
+    cache.put(0, std::string(20, 'x'));
+    ASSERT_GT(cache.bytes(), inline_bytes + 20);
+    cache.put(0, "short");
+    ASSERT_EQ(cache.bytes(), inline_bytes);
+  }
+
+  TEST(hashtable, cache_write_back)
+  {
+    std::map<std::string, int> written;
+    Cache<std::string, int, crc64> cache({.entries = 10}, [&written](const std::string& key, int& value) {
+      written[key] = value;
+    });
+    for (int i = 0; i < 30; i++)
+      cache.put("key" + std::to_string(i), i);
+    ASSERT_EQ(written.size(), 20);
+    for (const auto& [key, value] : written) {
+      ASSERT_EQ(key, "key" + std::to_string(value));
+      ASSERT_EQ(cache.find(key), nullptr);
+    }
+  }
 }
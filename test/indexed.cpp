@@ -0,0 +1,137 @@
+#include "structure/indexed.hpp"
+
+#include "algo/crc64.hpp"
+
+#include <cstdint>
+#include <map>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <gtest/gtest.h>
+
+namespace structure::indexed {
+  struct User {
+    std::string name;
+    int32_t age;
+    std::string city;
+  };
+
+  using Users = IndexedTable<uint64_t, User, algo::hash::crc64, 4>;
+
+  static std::string city(const User& user) {
+    return user.city;
+  }
+
+  static int32_t age(const User& user) {
+    return user.age;
+  }
+
+  TEST(indexed, write_path)
+  {
+    Users users;
+    users.add_index("age", age);
+    users.put(1, {"alice", 30, "paris"});
+    users.put(2, {"bob", 25, "berlin"});
+    users.put(3, {"carol", 30, "rome"});
+    users.add_index("city", city);
+    ASSERT_THROW(users.add_index("city", city), std::invalid_argument);
+    ASSERT_EQ(users.size(), 3);
+    ASSERT_EQ(users.at(2).name, "bob");
+    ASSERT_EQ(users.find(4), nullptr);
+    ASSERT_THROW(users.at(4), std::out_of_range);
+
+    ASSERT_EQ(users.count("age", 30), 2);
+    ASSERT_EQ(users.count("city", std::string("berlin")), 1);
+
+    // Only the changed field moves
+    users.put(1, {"alice", 31, "paris"});
+    ASSERT_EQ(users.count("age", 30), 1);
+    ASSERT_EQ(users.count("age", 31), 1);
+    ASSERT_EQ(users.count("city", std::string("paris")), 1);
+    ASSERT_EQ(users.size(), 3);
+
+    ASSERT_TRUE(users.erase(3));
+    ASSERT_FALSE(users.erase(3));
+    ASSERT_EQ(users.count("age", 30), 0);
+    ASSERT_EQ(users.count("city", std::string("rome")), 0);
+
+    std::vector<std::string> names;
+    users.scan("age", 0, 100, [&names](uint64_t, const User& user) {
+      names.push_back(user.name);
+    });
+    ASSERT_EQ(names, std::vector<std::string>({"bob", "alice"}));
+    ASSERT_THROW(users.count("name", 1), std::out_of_range);
+
+    ASSERT_TRUE(users.drop_index("age"));
+    ASSERT_FALSE(users.drop_index("age"));
+    ASSERT_EQ(users.indexes(), std::vector<std::string>({"city"}));
+    users.put(5, {"dave", 40, "berlin"});
+    ASSERT_EQ(users.count("city", std::string("berlin")), 2);
+  }
+
+  TEST(indexed, scan)
+  {
+    Users users;
+    users.add_index("age", age);
+    std::mt19937 random(11);
+    std::multimap<int32_t, uint64_t> expected;
+    for (uint64_t key = 0; key < 2000; key++) {
+      const int32_t value = int32_t(random() % 200) - 100;
+      users.put(key, {std::to_string(key), value, ""});
+      expected.emplace(value, key);
+    }
+    for (uint64_t key = 0; key < 2000; key += 3) {
+      const auto range = expected.equal_range(users.at(key).age);
+      for (auto it = range.first; it != range.second; ++it)
+        if (it->second == key) {
+          expected.erase(it);
+          break;
+        }
+      users.erase(key);
+    }
+
+    // Negative fields sort before positive ones
+    std::vector<int32_t> ages;
+    std::set<uint64_t> keys;
+    users.scan("age", -50, 50, [&](uint64_t key, const User& user) {
+      ages.push_back(user.age);
+      keys.insert(key);
+    });
+    ASSERT_TRUE(std::is_sorted(ages.begin(), ages.end()));
+    std::set<uint64_t> wanted;
+    for (auto it = expected.lower_bound(-50); it != expected.lower_bound(50); ++it)
+      wanted.insert(it->second);
+    ASSERT_EQ(keys, wanted);
+  }
+
+  TEST(indexed, parallel_build)
+  {
+    Users serial, parallel;
+    for (uint64_t key = 0; key < 50000; key++) {
+      const User user{std::to_string(key), int32_t(key % 97), "city" + std::to_string(key % 13)};
+      serial.put(key, user);
+      parallel.put(key, user);
+    }
+    serial.add_index("city", city);
+    tools::ThreadPool workers(3);
+    parallel.add_index("city", city, workers);
+    parallel.add_index("age", age, workers);
+
+    const auto keys = [](const Users& users, const std::string& from, const std::string& to) {
+      std::vector<uint64_t> result;
+      users.scan("city", from, to, [&result](uint64_t key, const User&) {
+        result.push_back(key);
+      });
+      return result;
+    };
+    ASSERT_EQ(keys(serial, "", "z"), keys(parallel, "", "z"));
+    ASSERT_EQ(keys(parallel, "", "z").size(), 50000);
+    ASSERT_EQ(parallel.count("age", 5), 50000 / 97 + 1);
+
+    // Built index keeps working for writes
+    parallel.put(5, {"five", 96, "city0"});
+    ASSERT_EQ(parallel.count("age", 5), 50000 / 97);
+    ASSERT_EQ(parallel.count("city", std::string("city5")), serial.count("city", std::string("city5")) - 1);
+  }
+}
@@ -0,0 +1,179 @@
+#include "storage/io.hpp"
+#include "common.hpp"
+
+#include <atomic>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+
+namespace storage::io {
+  class io_backend : public ::testing::TestWithParam<Backend> {
+  protected:
+    const test::TempPath path{"io"};
+    int fd = -1;
+
+    void SetUp() override
+    {
+      if (GetParam() == Backend::Uring) {
+        try {
+          Ring probe({2, Backend::Uring});
+        } catch (const std::system_error& e) {
+          GTEST_SKIP() << e.what();
+        }
+      }
+      fd = ::open(path.str().c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      ASSERT_GE(fd, 0);
+    }
+
+    void TearDown() override
+    {
+      ::close(fd);
+    }
+  };
+
+  static Task<int> write_read(Ring& ring, int fd)
+  {
+    const std::string data = "hello, ring";
+    int result = co_await ring.write(fd, data.data(), data.size(), 100);
+    if (result != int(data.size()))
+      co_return -1;
+    result = co_await ring.fsync(fd, true);
+    if (result)
+      co_return result;
+
+    std::string back(data.size(), 0);
+    result = co_await ring.read(fd, back.data(), back.size(), 100);
+    co_return back == data ? result : -1;
+  }
+
+  TEST_P(io_backend, read_write)
+  {
+    Ring ring({8, GetParam()});
+    ASSERT_EQ(ring.uring(), GetParam() == Backend::Uring);
+    ASSERT_EQ(ring.run(write_read(ring, fd)), 11);
+    ASSERT_EQ(ring.in_flight(), 0);
+
+    // Errors come back as negative errno
+    char byte;
+    auto bad = [&ring, &byte]() -> Task<int> {
+      co_return co_await ring.read(-1, &byte, 1, 0);
+    };
+    ASSERT_EQ(ring.run(bad()), -EBADF);
+  }
+
+  static Task<void> check_block(Ring& ring, int fd, size_t block, size_t& matched)
+  {
+    auto buffer = ring.buffer();
+    std::string heap;
+    char* data;
+    if (buffer) {
+      data = buffer->data();
+    } else {
+      heap.resize(512);
+      data = heap.data();
+    }
+    const int read = co_await (buffer ? ring.read(fd, *buffer, 512, block * 512)
+                                      : ring.read(fd, data, 512, block * 512));
+    if (read == 512 && data[0] == char(block) && data[511] == char(block))
+      matched++;
+  }
+
+  TEST_P(io_backend, many_in_flight)
+  {
+    const size_t blocks = 1000;
+    {
+      std::vector<char> content(blocks * 512);
+      for (size_t i = 0; i < content.size(); i++)
+        content[i] = char(i / 512);
+      ASSERT_EQ(::pwrite(fd, content.data(), content.size(), 0), ssize_t(content.size()));
+    }
+
+    // Fewer entries and buffers than reads: the rest waits in line or uses heap
+    Ring ring({32, GetParam(), 64, 512});
+    ASSERT_EQ(ring.buffer_size(), 512);
+    size_t matched = 0;
+    for (size_t block = 0; block < blocks; block++)
+      ring.spawn(check_block(ring, fd, block, matched));
+    if (ring.uring()) {
+      ASSERT_EQ(ring.in_flight(), blocks);
+      ASSERT_TRUE(ring.registered());
+    }
+    ring.drain();
+    ASSERT_EQ(matched, blocks);
+    ASSERT_EQ(ring.in_flight(), 0);
+  }
+
+  TEST_P(io_backend, buffers)
+  {
+    Ring ring({8, GetParam(), 2, 4096});
+    auto first = ring.buffer();
+    auto second = ring.buffer();
+    ASSERT_TRUE(first && second);
+    ASSERT_FALSE(ring.buffer());
+    ASSERT_NE(first->data(), second->data());
+    ASSERT_EQ(first->size(), 4096);
+
+    memset(first->data(), 'x', 4096);
+    auto copy = [&]() -> Task<int> {
+      const int written = co_await ring.write(fd, *first, 4096, 0);
+      if (written != 4096)
+        co_return -1;
+      co_return co_await ring.read(fd, *second, 4096, 0);
+    };
+    ASSERT_EQ(ring.run(copy()), 4096);
+    ASSERT_EQ(std::string(second->data(), 4096), std::string(4096, 'x'));
+
+    first.reset();
+    ASSERT_TRUE(ring.buffer());
+  }
+
+  TEST_P(io_backend, defer)
+  {
+    Ring ring({8, GetParam()});
+    std::vector<std::thread> threads;
+    std::atomic<size_t> resumed = 0;
+    auto wait = [&](int n) -> Task<void> {
+      auto later = ring.defer([&threads, n](Ring::done_fn done) {
+        threads.emplace_back([done, n] {
+          std::this_thread::sleep_for(std::chrono::milliseconds(n));
+          done(n);
+        });
+      });
+      if (co_await later == n)
+        resumed++;
+    };
+    for (int n = 0; n < 20; n++)
+      ring.spawn(wait(n));
+    ring.drain();
+    ASSERT_EQ(resumed, 20);
+    for (auto& thread : threads)
+      thread.join();
+
+    // Completed before suspending
+    auto immediate = [&]() -> Task<int> {
+      auto now = ring.defer([](Ring::done_fn done) { done(5); });
+      co_return co_await now;
+    };
+    ASSERT_EQ(ring.run(immediate()), 5);
+  }
+
+  TEST_P(io_backend, exceptions)
+  {
+    Ring ring({8, GetParam()});
+    auto fail = [&]() -> Task<void> {
+      co_await ring.fsync(fd);
+      throw std::runtime_error("failed");
+    };
+    ASSERT_THROW(ring.run(fail()), std::runtime_error);
+    ring.spawn(fail());
+    ring.spawn(fail());
+    ASSERT_THROW(ring.drain(), std::runtime_error);
+    ring.drain();
+  }
+
+  INSTANTIATE_TEST_SUITE_P(backends, io_backend, ::testing::Values(Backend::Uring, Backend::Sync));
+}
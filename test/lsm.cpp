@@ -0,0 +1,240 @@
+#include "storage/lsm.hpp"
+#include "storage/sstable.hpp"
+#include "common.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+
+namespace storage::lsm {
+  static std::string key(size_t n)
+  {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "key%08zu", n);
+    return buffer;
+  }
+
+  /* Small memtables and tables to get many levels out of few keys */
+  static Options small(Compaction compaction)
+  {
+    Options options;
+    options.memtable_bytes = 16 << 10;
+    options.block_size = 512;
+    options.compaction = compaction;
+    options.table_bytes = 16 << 10;
+    options.level_bytes = 32 << 10;
+    options.wal.sync = wal::Sync::Never;
+    return options;
+  }
+
+  TEST(lsm, sstable)
+  {
+    const test::TempPath path("sstable");
+    {
+      sstable::Builder builder(path, 256);
+      for (size_t i = 0; i < 1000; i += 2) {
+        if (i % 10 == 0)
+          builder.add(key(i), std::nullopt);
+        else
+          builder.add(key(i), "value" + std::to_string(i));
+      }
+      ASSERT_THROW(builder.add(key(0), "late"), std::logic_error);
+      builder.finish();
+    }
+
+    sstable::Reader reader(path);
+    ASSERT_EQ(reader.entries(), 500);
+    ASSERT_EQ(reader.first(), key(0));
+    ASSERT_EQ(reader.last(), key(998));
+    std::optional<std::string> value;
+    for (size_t i = 0; i < 1000; i++) {
+      const bool found = reader.get(key(i), value);
+      ASSERT_EQ(found, i % 2 == 0);
+      if (found && i % 10 == 0) {
+        ASSERT_FALSE(value);
+      } else if (found) {
+        ASSERT_EQ(*value, "value" + std::to_string(i));
+      }
+    }
+    ASSERT_FALSE(reader.get("a", value));
+    ASSERT_FALSE(reader.get("z", value));
+
+    // Bloom filter answers for most absent keys without reading blocks
+    size_t maybe = 0;
+    for (size_t i = 1; i < 1000; i += 2)
+      maybe += reader.may_contain(key(i), algo::bloom::hash(key(i)));
+    ASSERT_LT(maybe, 25);
+
+    size_t count = 0;
+    for (auto it = reader.begin(); it.valid(); it.next()) {
+      ASSERT_EQ(it.key(), key(count * 2));
+      ASSERT_EQ(bool(it.value()), count % 5 != 0);
+      count++;
+    }
+    ASSERT_EQ(count, 500);
+
+    {
+      std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+      file.seekp(10);
+      file.put('x');
+    }
+    sstable::Reader corrupted(path);
+    ASSERT_THROW(corrupted.get(key(0), value), std::runtime_error);
+    ASSERT_TRUE(corrupted.get(key(998), value));
+    reader.mark_obsolete();
+  }
+
+  TEST(lsm, basic)
+  {
+    const test::TempPath path("lsm_basic");
+    Engine engine(path);
+    ASSERT_FALSE(engine.get("a"));
+    engine.put("a", "1");
+    engine.put("b", "2");
+    ASSERT_EQ(engine.get("a"), "1");
+    engine.put("a", "3");
+    ASSERT_EQ(engine.get("a"), "3");
+    engine.erase("b");
+    ASSERT_FALSE(engine.get("b"));
+
+    engine.flush();
+    ASSERT_EQ(engine.stats().tables[0], 1);
+    ASSERT_EQ(engine.get("a"), "3");
+    ASSERT_FALSE(engine.get("b"));
+    engine.put("b", "4");
+    ASSERT_EQ(engine.get("b"), "4");
+  }
+
+  TEST(lsm, recovery)
+  {
+    const test::TempPath path("lsm_recovery");
+    for (size_t round = 0; round < 3; round++) {
+      Engine engine(path, small(Compaction::Leveled));
+      for (size_t i = 0; i < 1000; i++)
+        ASSERT_EQ(engine.get(key(i)), round ? std::optional<std::string>(key(i + round - 1)) : std::nullopt);
+      for (size_t i = 0; i < 1000; i++)
+        engine.put(key(i), key(i + round));
+    }
+    // Nothing but tables, logs and MANIFEST is left behind
+    for (const auto& entry : std::filesystem::directory_iterator(path)) {
+      const auto extension = entry.path().extension();
+      ASSERT_TRUE(extension == ".sst" || extension == ".log" || entry.path().filename() == "MANIFEST");
+    }
+  }
+
+  class lsm_compaction : public ::testing::TestWithParam<Compaction> {};
+
+  TEST_P(lsm_compaction, merges)
+  {
+    const test::TempPath path("lsm_compaction");
+    const size_t count = 20000;
+    std::map<std::string, std::string> expected;
+    {
+      Engine engine(path, small(GetParam()));
+      for (size_t i = 0; i < count; i++) {
+        const auto k = key((i * 7919) % count);
+        engine.put(k, std::to_string(i));
+        expected[k] = std::to_string(i);
+        if (i % 3 == 0) {
+          const auto victim = key((i * 31) % count);
+          engine.erase(victim);
+          expected.erase(victim);
+        }
+      }
+      engine.flush();
+      engine.compact();
+
+      const auto stats = engine.stats();
+      ASSERT_GT(stats.flushes, 10);
+      ASSERT_GT(stats.compactions, 0);
+      ASSERT_GT(stats.tables.size(), 1);
+      ASSERT_LT(stats.tables[0], small(GetParam()).fanout);
+      for (size_t i = 0; i < count; i++) {
+        auto found = expected.find(key(i));
+        ASSERT_EQ(engine.get(key(i)), found == expected.end() ? std::nullopt :
+                  std::optional<std::string>(found->second));
+      }
+    }
+
+    Engine reopened(path, small(GetParam()));
+    for (size_t i = 0; i < count; i += 7) {
+      auto found = expected.find(key(i));
+      ASSERT_EQ(reopened.get(key(i)), found == expected.end() ? std::nullopt :
+                std::optional<std::string>(found->second));
+    }
+  }
+
+  INSTANTIATE_TEST_SUITE_P(styles, lsm_compaction,
+                           ::testing::Values(Compaction::Leveled, Compaction::Tiered));
+
+  TEST(lsm, concurrent)
+  {
+    const test::TempPath path("lsm_concurrent");
+    Engine engine(path, small(Compaction::Leveled));
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 4; t++) {
+      threads.emplace_back([&engine, t] {
+        for (size_t i = t; i < 8000; i += 4) {
+          engine.put(key(i), key(i));
+          ASSERT_EQ(engine.get(key(i)), key(i));
+        }
+      });
+    }
+    for (auto& thread : threads)
+      thread.join();
+    for (size_t i = 0; i < 8000; i++)
+      ASSERT_EQ(engine.get(key(i)), key(i));
+  }
+
+  class lsm_async : public ::testing::TestWithParam<io::Backend> {};
+
+  static io::Task<void> put_all(Engine& engine, io::Ring& ring, size_t first, size_t step, size_t count)
+  {
+    for (size_t i = first; i < count; i += step)
+      co_await engine.async_put(ring, key(i), "value" + std::to_string(i));
+  }
+
+  static io::Task<void> check_one(Engine& engine, io::Ring& ring, size_t i, size_t& found)
+  {
+    auto value = co_await engine.async_get(ring, key(i));
+    if (value == "value" + std::to_string(i))
+      found++;
+  }
+
+  TEST_P(lsm_async, get_put)
+  {
+    const test::TempPath path("lsm_async");
+    auto options = small(Compaction::Leveled);
+    options.wal.sync = wal::Sync::Group;
+    Engine engine(path, options);
+    io::Ring ring({64, GetParam(), 8, 4096});
+
+    const size_t count = 4000;
+    for (size_t t = 0; t < 8; t++)
+      ring.spawn(put_all(engine, ring, t, 8, count));
+    ring.drain();
+    ring.run(engine.async_flush(ring));
+    ASSERT_GT(engine.stats().flushes, 1);
+    ASSERT_FALSE(ring.run(engine.async_get(ring, "missing")));
+
+    // All lookups in flight at once, most from tables
+    size_t found = 0;
+    for (size_t i = 0; i < count; i++)
+      ring.spawn(check_one(engine, ring, i, found));
+    ring.drain();
+    ASSERT_EQ(found, count);
+    ASSERT_EQ(ring.in_flight(), 0);
+
+    // Same answers as the blocking calls
+    engine.erase(key(7));
+    ASSERT_FALSE(ring.run(engine.async_get(ring, key(7))));
+    engine.put(key(8), "new");
+    ASSERT_EQ(ring.run(engine.async_get(ring, key(8))), "new");
+  }
+
+  INSTANTIATE_TEST_SUITE_P(backends, lsm_async,
+                           ::testing::Values(io::Backend::Auto, io::Backend::Sync));
+}
@@ -0,0 +1,157 @@
+// Spans are checked here whether the build enables them or not
+#ifndef CSDB_METRICS
+#define CSDB_METRICS
+#endif
+#include "tools/metrics.hpp"
+
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+
+namespace tools {
+  namespace metrics {
+    TEST(metrics, buckets)
+    {
+      for (uint64_t value : {0ull, 1ull, 63ull, 64ull, 65ull, 127ull, 128ull, 1000ull, 123456789ull, 1ull << 39}) {
+        const auto index = Histogram::index(value);
+        ASSERT_LT(index, Histogram::buckets);
+        ASSERT_LE(Histogram::lowest(index), value);
+        ASSERT_GE(Histogram::highest(index), value);
+        // Bucket is narrower than the value by the precision
+        ASSERT_LE(Histogram::highest(index) - Histogram::lowest(index), value >> Histogram::sub_bits);
+      }
+      for (size_t index = 1; index < Histogram::buckets; index++)
+        ASSERT_EQ(Histogram::lowest(index), Histogram::highest(index - 1) + 1);
+      ASSERT_EQ(Histogram::index((1ull << 40) - 1), Histogram::buckets - 1);
+      ASSERT_EQ(Histogram::index(UINT64_MAX), Histogram::buckets - 1);
+    }
+
+    TEST(metrics, percentiles)
+    {
+      Histogram histogram;
+      ASSERT_EQ(histogram.percentile(99), 0);
+      for (uint64_t value = 1; value <= 100000; value++)
+        histogram.record(value);
+      ASSERT_EQ(histogram.count(), 100000);
+      ASSERT_EQ(histogram.min(), 1);
+      ASSERT_EQ(histogram.max(), 100000);
+      ASSERT_DOUBLE_EQ(histogram.mean(), 50000.5);
+      for (double p : {50.0, 90.0, 99.0, 99.9}) {
+        const double exact = p * 1000;
+        ASSERT_NEAR(histogram.percentile(p), exact, exact / (1 << Histogram::sub_bits)) << p;
+      }
+      ASSERT_EQ(histogram.percentile(100), 100000);
+      ASSERT_EQ(histogram.percentile(0), 1);
+    }
+
+    TEST(metrics, merge)
+    {
+      std::mt19937_64 random(7);
+      Histogram all, first, second;
+      for (int i = 0; i < 10000; i++) {
+        const uint64_t value = random() % 1000000;
+        all.record(value);
+        (i % 2 ? first : second).record(value);
+      }
+      first.merge(second);
+      ASSERT_EQ(first.count(), all.count());
+      ASSERT_EQ(first.sum(), all.sum());
+      for (double p : {1.0, 50.0, 99.0, 99.9})
+        ASSERT_EQ(first.percentile(p), all.percentile(p));
+
+      Histogram copy = first;
+      ASSERT_EQ(copy.percentile(99), all.percentile(99));
+      copy.reset();
+      ASSERT_EQ(copy.count(), 0);
+    }
+
+    TEST(metrics, threads)
+    {
+      Counter counter("test.threads.counter");
+      Latency latency("test.threads.latency");
+      ASSERT_EQ(counter.value(), 0);
+
+      std::vector<std::thread> threads;
+      for (int t = 0; t < 4; t++)
+        threads.emplace_back([&counter, &latency, t] {
+          for (int i = 0; i < 1000; i++) {
+            counter.add();
+            latency.record(t * 1000 + i);
+          }
+        });
+      // Read while shards are written
+      counter.value();
+      latency.snapshot();
+      for (auto& thread : threads)
+        thread.join();
+
+      // Shards of exited threads are kept
+      ASSERT_EQ(counter.value(), 4000);
+      const auto histogram = latency.snapshot();
+      ASSERT_EQ(histogram.count(), 4000);
+      ASSERT_EQ(histogram.max(), 3999);
+
+      counter.add(5);
+      ASSERT_EQ(counter.value(), 4005);
+    }
+
+    TEST(metrics, registry)
+    {
+      Counter first("test.registry.counter");
+      Counter second("test.registry.counter");
+      first.add(2);
+      second.add(3);
+      ASSERT_EQ(first.value(), 5);
+      ASSERT_THROW(Latency("test.registry.counter"), std::invalid_argument);
+
+      Latency latency("test.registry.latency");
+      latency.record(10);
+      bool found = false;
+      for (const auto& [name, value] : counters())
+        if (name == "test.registry.counter") {
+          found = true;
+          ASSERT_EQ(value, 5);
+        }
+      ASSERT_TRUE(found);
+      found = false;
+      for (const auto& [name, histogram] : latencies())
+        if (name == "test.registry.latency") {
+          found = true;
+          ASSERT_EQ(histogram.count(), 1);
+        }
+      ASSERT_TRUE(found);
+    }
+
+    static std::vector<std::pair<std::string, unsigned> > traced;
+
+    static void tracer(const SpanRecord& span) {
+      traced.emplace_back(span.name, span.depth);
+    }
+
+    TEST(metrics, spans)
+    {
+      Latency outer("test.spans.outer");
+      Latency inner("test.spans.inner");
+      trace(tracer);
+      {
+        CSDB_SPAN(outer);
+        for (int i = 0; i < 3; i++) {
+          CSDB_SPAN(inner);
+        }
+      }
+      trace(nullptr);
+      {
+        CSDB_SPAN(outer);
+      }
+
+      ASSERT_EQ(outer.snapshot().count(), 2);
+      ASSERT_EQ(inner.snapshot().count(), 3);
+      ASSERT_LE(inner.snapshot().max(), outer.snapshot().max());
+      ASSERT_EQ(traced.size(), 4);
+      ASSERT_EQ(traced[0], std::make_pair(std::string("test.spans.inner"), 1u));
+      ASSERT_EQ(traced[3], std::make_pair(std::string("test.spans.outer"), 0u));
+    }
+  }
+}
@@ -0,0 +1,249 @@
+#include "structure/mvcc.hpp"
+
+#include "algo/crc64.hpp"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+
+namespace structure::mvcc {
+  using namespace algo::hash;
+  using namespace std::chrono_literals;
+
+  TEST(mvcc, snapshot)
+  {
+    Table<std::string, int, crc64> table(0ms);
+    ASSERT_FALSE(table.get("a"));
+    table.set("a", 1);
+    table.set("b", 2);
+    auto first = table.snapshot();
+    table.set("a", 3);
+    table.erase("b");
+    table.set("c", 4);
+
+    ASSERT_EQ(*first.get("a"), 1);
+    ASSERT_EQ(*first.get("b"), 2);
+    ASSERT_EQ(first.get("c"), nullptr);
+    ASSERT_EQ(table.get("a"), 3);
+    ASSERT_FALSE(table.get("b"));
+    ASSERT_EQ(table.get("c"), 4);
+
+    auto second = table.snapshot();
+    ASSERT_GT(second.timestamp(), first.timestamp());
+    ASSERT_EQ(second.get("b"), nullptr);
+    table.set("b", 5);
+    ASSERT_EQ(second.get("b"), nullptr);
+    ASSERT_EQ(table.get("b"), 5);
+
+    size_t count = 0, sum = 0;
+    first.for_each([&](const std::string&, int value) {
+      count++;
+      sum += value;
+    });
+    ASSERT_EQ(count, 2);
+    ASSERT_EQ(sum, 3);
+  }
+
+  TEST(mvcc, collect)
+  {
+    Table<uint64_t, uint64_t, crc64> table(0ms);
+    for (uint64_t round = 0; round < 10; round++)
+      for (uint64_t key = 0; key < 100; key++)
+        table.set(key, round);
+    ASSERT_EQ(table.versions(), 1000);
+
+    {
+      auto pinned = table.snapshot();
+      for (uint64_t key = 0; key < 100; key++)
+        table.set(key, 10);
+      // Versions visible to the snapshot survive
+      ASSERT_EQ(table.collect(), 900);
+      ASSERT_EQ(table.versions(), 200);
+      for (uint64_t key = 0; key < 100; key++)
+        ASSERT_EQ(*pinned.get(key), 9);
+    }
+    ASSERT_EQ(table.collect(), 100);
+    ASSERT_EQ(table.versions(), 100);
+
+    for (uint64_t key = 0; key < 100; key++)
+      table.erase(key);
+    table.collect();
+    ASSERT_EQ(table.versions(), 0);
+    ASSERT_FALSE(table.get(0));
+  }
+
+  TEST(mvcc, reclaim)
+  {
+    Table<std::string, int, crc64> table(0ms);
+    for (int i = 0; i < 10000; i++) {
+      table.set(std::to_string(i), i);
+      table.erase(std::to_string(i));
+      if (i % 1000 == 999) {
+        ASSERT_EQ(table.collect(), 2000);
+        ASSERT_EQ(table.versions(), 0);
+      }
+    }
+
+    table.set("a", 1);
+    {
+      // Erased after the snapshot, the value stays visible
+      auto pinned = table.snapshot();
+      table.erase("a");
+      table.collect();
+      ASSERT_EQ(table.versions(), 2);
+      ASSERT_EQ(*pinned.get("a"), 1);
+    }
+    {
+      // Unlinked, but freed only once the snapshot is gone
+      auto pinned = table.snapshot();
+      ASSERT_EQ(table.collect(), 1);
+      ASSERT_EQ(table.versions(), 1);
+      ASSERT_FALSE(pinned.get("a"));
+    }
+    ASSERT_EQ(table.collect(), 1);
+    ASSERT_EQ(table.versions(), 0);
+    ASSERT_FALSE(table.get("a"));
+
+    table.set("a", 2);
+    ASSERT_EQ(table.get("a"), 2);
+    ASSERT_EQ(table.versions(), 1);
+  }
+
+  TEST(mvcc, concurrent_reclaim)
+  {
+    constexpr uint64_t keys = 100;
+    Table<uint64_t, uint64_t, crc64> table(1ms);
+    for (uint64_t key = 0; key < keys; key++)
+      table.set(key, key);
+
+    // Keys above the stable ones come and go while readers walk the same buckets
+    std::atomic<bool> stop{false};
+    std::thread writer([&] {
+      for (uint64_t key = keys; key < keys + 20000; key++) {
+        table.set(key, key);
+        table.erase(key);
+      }
+      stop = true;
+    });
+
+    size_t checked = 0;
+    do {
+      auto snapshot = table.snapshot();
+      size_t present = 0;
+      snapshot.for_each([&present](uint64_t key, uint64_t value) {
+        ASSERT_EQ(key, value);
+        present++;
+      });
+      ASSERT_GE(present, keys);
+      ASSERT_LE(present, keys + 1);
+      for (uint64_t key = 0; key < keys; key++)
+        ASSERT_EQ(*snapshot.get(key), key);
+      checked++;
+    } while (!stop);
+    writer.join();
+    ASSERT_GT(checked, 0);
+    table.collect();
+    ASSERT_EQ(table.versions(), keys);
+  }
+
+  TEST(mvcc, batch)
+  {
+    Table<std::string, int, crc64> table(0ms);
+    table.set("a", 1);
+    table.set("b", 2);
+    auto before = table.snapshot();
+
+    WriteBatch<std::string, int> batch;
+    batch.put("a", 10);
+    batch.erase("b");
+    batch.put("c", 30);
+    batch.put("a", 11);
+    const auto timestamp = table.apply(std::move(batch));
+    ASSERT_EQ(timestamp, before.timestamp() + 1);
+    ASSERT_EQ(table.timestamp(), timestamp);
+
+    ASSERT_EQ(*before.get("a"), 1);
+    ASSERT_EQ(*before.get("b"), 2);
+    ASSERT_EQ(before.get("c"), nullptr);
+    ASSERT_EQ(table.get("a"), 11);
+    ASSERT_FALSE(table.get("b"));
+    ASSERT_EQ(table.get("c"), 30);
+  }
+
+  TEST(mvcc, concurrent_batch)
+  {
+    constexpr uint64_t keys = 100;
+    Table<uint64_t, uint64_t, crc64> table(1ms);
+    std::atomic<bool> stop{false};
+    std::thread writer([&] {
+      for (uint64_t round = 1; round < 500; round++) {
+        WriteBatch<uint64_t, uint64_t> batch;
+        for (uint64_t key = 0; key < keys; key++)
+          batch.put(key, round);
+        table.apply(std::move(batch));
+      }
+      stop = true;
+    });
+
+    // Every snapshot sees all keys of one batch
+    size_t checked = 0;
+    do {
+      auto snapshot = table.snapshot();
+      auto first = snapshot.get(0);
+      for (uint64_t key = 1; key < keys; key++) {
+        auto value = snapshot.get(key);
+        ASSERT_EQ(!first, !value);
+        if (first) {
+          ASSERT_EQ(*value, *first);
+        }
+      }
+      checked++;
+    } while (!stop);
+    writer.join();
+    ASSERT_GT(checked, 0);
+    ASSERT_EQ(table.get(keys - 1), 499);
+  }
+
+  TEST(mvcc, concurrent)
+  {
+    constexpr uint64_t keys = 1000;
+    Table<uint64_t, uint64_t, crc64> table(1ms);
+    for (uint64_t key = 0; key < keys; key++)
+      table.set(key, 0);
+
+    std::atomic<bool> stop{false};
+    std::thread writer([&] {
+      for (uint64_t round = 1; round < 200; round++)
+        for (uint64_t key = 0; key < keys; key++)
+          table.set(key, round);
+      stop = true;
+    });
+
+    // Keys are written in order, so a consistent view never sees a later key ahead
+    std::vector<std::thread> readers;
+    std::atomic<size_t> checked{0};
+    for (size_t i = 0; i < 2; i++) {
+      readers.emplace_back([&] {
+        do {
+          auto snapshot = table.snapshot();
+          uint64_t previous = *snapshot.get(0);
+          for (uint64_t key = 1; key < keys; key++) {
+            const uint64_t value = *snapshot.get(key);
+            ASSERT_LE(value, previous);
+            previous = value;
+          }
+          ASSERT_LE(*snapshot.get(0) - previous, 1);
+          checked++;
+        } while (!stop);
+      });
+    }
+    writer.join();
+    for (auto& reader : readers)
+      reader.join();
+    ASSERT_GT(checked, 0);
+    ASSERT_EQ(table.get(keys - 1), 199);
+    table.collect();
+    ASSERT_EQ(table.versions(), keys);
+  }
+}
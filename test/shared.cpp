@@ -0,0 +1,182 @@
+#include "structure/shared.hpp"
+
+#include "algo/crc32.hpp"
+#include "algo/crc64.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+
+namespace structure::shared {
+  static std::string shm_name(const std::string& name)
+  {
+    return "/csdb_shared_" + name + "_" + std::to_string(getpid());
+  }
+
+  /** Runs \c fn in a child process, returns its exit code */
+  template <typename F>
+  static int in_child(F&& fn)
+  {
+    const pid_t pid = fork();
+    if (pid == 0) {
+      int code = 1;
+      try {
+        code = fn();
+      } catch (...) {}
+      _exit(code);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+  }
+
+  TEST(shared, write_read)
+  {
+    const auto name = shm_name("write_read");
+    Writer<std::string, std::string, algo::hash::crc64> writer(name);
+    ASSERT_TRUE(writer.insert_or_assign("alice", "1"));
+    ASSERT_TRUE(writer.insert_or_assign("bob", "2"));
+    ASSERT_FALSE(writer.insert_or_assign("alice", std::string(100, 'a')));
+    ASSERT_EQ(writer.find("alice"), std::string(100, 'a'));
+    ASSERT_EQ(writer.size(), 2);
+
+    Reader<std::string, std::string, algo::hash::crc64> reader(name);
+    ASSERT_EQ(reader.find("bob"), "2");
+    ASSERT_EQ(reader.find("carol"), std::nullopt);
+    ASSERT_TRUE(writer.erase("bob"));
+    ASSERT_FALSE(writer.erase("bob"));
+    ASSERT_FALSE(reader.contains("bob"));
+    ASSERT_EQ(reader.size(), 1);
+
+    std::map<std::string, std::string> all;
+    reader.for_each([&all](const std::string& key, const std::string& value) {
+      all.emplace(key, value);
+    });
+    ASSERT_EQ(all, (std::map<std::string, std::string>{{"alice", std::string(100, 'a')}}));
+
+    // Another process sees the same table
+    ASSERT_EQ(in_child([&name] {
+      Reader<std::string, std::string, algo::hash::crc64> child(name);
+      return child.find("alice") == std::string(100, 'a') && !child.contains("bob") ? 0 : 1;
+    }), 0);
+    writer.remove();
+  }
+
+  TEST(shared, open)
+  {
+    const auto name = shm_name("open");
+    using Table = Reader<uint64_t, uint64_t, algo::hash::crc64>;
+    ASSERT_THROW(Table{name}, std::system_error);
+    Options tiny;
+    tiny.bytes = 1024;
+    ASSERT_THROW((Writer<uint64_t, uint64_t, algo::hash::crc64>(name, tiny)), std::invalid_argument);
+
+    Writer<uint64_t, uint64_t, algo::hash::crc64> writer(name);
+    ASSERT_THROW((Reader<uint64_t, uint64_t, algo::hash::crc32>(name)), std::runtime_error);
+    ASSERT_THROW((Reader<uint64_t, uint32_t, algo::hash::crc64>(name)), std::runtime_error);
+    ASSERT_THROW((Reader<std::string, uint64_t, algo::hash::crc64>(name)), std::runtime_error);
+    Table reader(name);
+    writer.remove();
+    ASSERT_THROW(Table{name}, std::system_error);
+
+    // Files work the same way
+    const auto path = (std::filesystem::temp_directory_path() / ("csdb_shared_" + std::to_string(getpid()))).string();
+    Writer<uint64_t, uint64_t, algo::hash::crc64> file(path);
+    file.insert_or_assign(1, 2);
+    ASSERT_EQ(Table(path).find(1), 2);
+    file.remove();
+  }
+
+  TEST(shared, reuse)
+  {
+    const auto name = shm_name("reuse");
+    Options options;
+    options.bytes = 1 << 20;
+    options.expected = 1024;
+    Writer<uint64_t, std::string, algo::hash::crc64> writer(name, options);
+    std::map<uint64_t, std::string> expected;
+    std::mt19937_64 random(5);
+    for (int i = 0; i < 200000; i++) {
+      const uint64_t key = random() % 2000;
+      if (random() % 3 == 0) {
+        ASSERT_EQ(writer.erase(key), expected.erase(key) == 1);
+      } else {
+        const std::string value(random() % 300, char('a' + key % 26));
+        writer.insert_or_assign(key, value);
+        expected[key] = value;
+      }
+    }
+    // Released blocks are reused, the heap doesn't grow with updates
+    ASSERT_GT(writer.available(), 0);
+    ASSERT_EQ(writer.size(), expected.size());
+    for (const auto& [key, value] : expected)
+      ASSERT_EQ(writer.find(key), value);
+
+    ASSERT_THROW(writer.insert_or_assign(1, std::string(2 << 20, 'x')), std::bad_alloc);
+    ASSERT_EQ(writer.find(1), expected.count(1) ? std::optional(expected[1]) : std::nullopt);
+    writer.remove();
+  }
+
+  TEST(shared, concurrent)
+  {
+    const auto name = shm_name("concurrent");
+    Options options;
+    options.bytes = 8 << 20;
+    options.expected = 256;
+    options.stripes = 16;
+    Writer<uint64_t, std::string, algo::hash::crc64> writer(name, options);
+    for (uint64_t key = 0; key < 1000; key++)
+      writer.insert_or_assign(key, std::to_string(key) + ":0");
+
+    // Readers must see a whole value of their key or nothing while the writer churns
+    int pipes[2];
+    ASSERT_EQ(pipe(pipes), 0);
+    const pid_t pid = fork();
+    if (pid == 0) {
+      close(pipes[0]);
+      int code = 0;
+      try {
+        Reader<uint64_t, std::string, algo::hash::crc64> reader(name);
+        char ready = 1;
+        if (write(pipes[1], &ready, 1) != 1)
+          _exit(3);
+        std::mt19937_64 random(9);
+        uint64_t seen = reader.updates();
+        while (reader.updates() < seen + 100000 && !code) {
+          const uint64_t key = random() % 1000;
+          const auto value = reader.find(key);
+          const auto prefix = std::to_string(key) + ":";
+          if (value && value->compare(0, prefix.size(), prefix) != 0)
+            code = 2;
+        }
+      } catch (...) {
+        code = 1;
+      }
+      _exit(code);
+    }
+    close(pipes[1]);
+    char ready;
+    ASSERT_EQ(read(pipes[0], &ready, 1), 1);
+    close(pipes[0]);
+
+    std::mt19937_64 random(3);
+    for (int i = 0; i < 200000; i++) {
+      const uint64_t key = random() % 1000;
+      if (random() % 4 == 0)
+        writer.erase(key);
+      else
+        writer.insert_or_assign(key, std::to_string(key) + ":" + std::string(random() % 64, 'v'));
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+    writer.remove();
+  }
+}
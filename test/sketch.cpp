@@ -0,0 +1,170 @@
+#include "algo/sketch.hpp"
+#include "structure/key_stats.hpp"
+#include "algo/crc64.hpp"
+
+#include <cmath>
+#include <map>
+#include <random>
+#include <string>
+#include <gtest/gtest.h>
+
+namespace algo::sketch {
+  TEST(sketch, hyperloglog)
+  {
+    HyperLogLog small;
+    for (uint64_t i = 0; i < 1000; i++)
+      for (int repeat = 0; repeat < 3; repeat++)
+        small.add(hash_key(i));
+    ASSERT_FALSE(small.dense());
+    ASSERT_NEAR(small.estimate(), 1000, 20);
+
+    HyperLogLog large;
+    for (uint64_t i = 0; i < 1000000; i++)
+      large.add(hash_key(i));
+    ASSERT_TRUE(large.dense());
+    ASSERT_EQ(large.bytes(), 1 << 14);
+    // Three standard errors
+    ASSERT_NEAR(large.estimate(), 1000000, 1000000 * 3 * 1.04 / 128);
+
+    HyperLogLog strings(10);
+    for (int i = 0; i < 5000; i++)
+      strings.add("key" + std::to_string(i % 2500));
+    ASSERT_NEAR(strings.estimate(), 2500, 2500 * 3 * 1.04 / 32);
+    ASSERT_THROW(HyperLogLog(3), std::invalid_argument);
+  }
+
+  TEST(sketch, hyperloglog_merge)
+  {
+    // Union of overlapping shards in all combinations of representations
+    for (auto [left, right] : {std::pair{100, 200}, std::pair{100, 200000}, std::pair{200000, 300000}}) {
+      HyperLogLog a, b, all;
+      for (uint64_t i = 0; i < uint64_t(left); i++) {
+        a.add(hash_key(i));
+        all.add(hash_key(i));
+      }
+      for (uint64_t i = left / 2; i < uint64_t(left / 2 + right); i++) {
+        b.add(hash_key(i));
+        all.add(hash_key(i));
+      }
+      a.merge(b);
+      ASSERT_EQ(a.dense(), all.dense());
+      ASSERT_DOUBLE_EQ(a.estimate(), all.estimate());
+    }
+    HyperLogLog a(12), b(13);
+    ASSERT_THROW(a.merge(b), std::invalid_argument);
+  }
+
+  TEST(sketch, count_min)
+  {
+    auto counts = CountMin::with_error(0.001, 0.01);
+    ASSERT_EQ(counts.width(), 2719);
+    ASSERT_EQ(counts.depth(), 5);
+
+    std::mt19937_64 gen{1};
+    std::map<uint64_t, uint64_t> truth;
+    for (int i = 0; i < 100000; i++) {
+      const uint64_t key = gen() % 10000;
+      counts.add(hash_key(key));
+      truth[key]++;
+    }
+    ASSERT_EQ(counts.total(), 100000);
+    size_t over = 0;
+    for (auto [key, count] : truth) {
+      const auto estimate = counts.estimate(hash_key(key));
+      ASSERT_GE(estimate, count);
+      over += estimate > count + 0.001 * counts.total();
+    }
+    ASSERT_LT(over, truth.size() / 100 + 1);
+
+    CountMin other(counts.width(), counts.depth());
+    other.add(hash_key(uint64_t(1)), 1000);
+    const auto before = counts.estimate(hash_key(uint64_t(1)));
+    counts.merge(other);
+    ASSERT_EQ(counts.estimate(hash_key(uint64_t(1))), before + 1000);
+    ASSERT_THROW(counts.merge(CountMin(10, 2)), std::invalid_argument);
+  }
+
+  TEST(sketch, top_k)
+  {
+    // Zipf-like stream: key i shows up about 100000 / (i + 1) times
+    TopK<std::string> first(5), second(5);
+    for (int i = 0; i < 2000; i++)
+      for (int n = 0; n < 100000 / (i + 1) / 2 + 1; n++) {
+        first.add("key" + std::to_string(i));
+        second.add("key" + std::to_string(i));
+      }
+    const auto top = first.top();
+    ASSERT_EQ(top.size(), 5);
+    for (int i = 0; i < 5; i++)
+      ASSERT_EQ(top[i].key, "key" + std::to_string(i));
+
+    first.merge(second);
+    const auto merged = first.top();
+    ASSERT_EQ(merged[0].key, "key0");
+    ASSERT_GE(merged[0].count, 100000);
+    ASSERT_EQ(first.estimate("key0"), merged[0].count);
+  }
+
+  TEST(sketch, serialize)
+  {
+    HyperLogLog sparse, dense;
+    for (uint64_t i = 0; i < 100; i++)
+      sparse.add(hash_key(i));
+    for (uint64_t i = 0; i < 100000; i++)
+      dense.add(hash_key(i));
+    TopK<uint64_t> top(3);
+    for (uint64_t i = 0; i < 1000; i++)
+      top.add(i % 10 ? i : 0);
+
+    std::string out;
+    tools::serialize::write(out, sparse);
+    const size_t sparse_size = out.size();
+    tools::serialize::write(out, dense);
+    const size_t dense_size = out.size() - sparse_size;
+    tools::serialize::write(out, top);
+
+    std::string_view in = out;
+    HyperLogLog sparse_copy, dense_copy;
+    TopK<uint64_t> top_copy;
+    ASSERT_TRUE(tools::serialize::read(in, sparse_copy));
+    ASSERT_TRUE(tools::serialize::read(in, dense_copy));
+    ASSERT_TRUE(tools::serialize::read(in, top_copy));
+    ASSERT_TRUE(in.empty());
+    ASSERT_EQ(sparse_copy.estimate(), sparse.estimate());
+    ASSERT_EQ(dense_copy.estimate(), dense.estimate());
+    ASSERT_EQ(top_copy.top()[0].key, 0);
+    ASSERT_EQ(top_copy.top()[0].count, top.top()[0].count);
+    ASSERT_EQ(top_copy.k(), 3);
+
+    std::string_view truncated(out.data(), sparse_size + dense_size / 2);
+    ASSERT_TRUE(tools::serialize::read(truncated, sparse_copy));
+    ASSERT_FALSE(tools::serialize::read(truncated, dense_copy));
+  }
+}
+
+namespace structure::hashtable {
+  TEST(sketch, key_stats)
+  {
+    HashTable<uint64_t, uint64_t, algo::hash::crc64> table;
+    KeyStats<uint64_t> stats(12, 4);
+    table.observe(&stats);
+    for (uint64_t i = 0; i < 50000; i++)
+      table[i % 20000] = i;
+    for (int i = 0; i < 1000; i++)
+      table.find(7);
+    table.at(8);
+    table.observe(nullptr);
+    table.find(9);
+
+    ASSERT_NEAR(stats.distinct(), 20000, 20000 * 3 * 1.04 / 64);
+    ASSERT_EQ(stats.reads().top()[0].key, 7);
+    ASSERT_EQ(stats.reads().top()[0].count, 1000);
+    ASSERT_EQ(stats.reads().counts().total(), 1001);
+    ASSERT_EQ(stats.writes().counts().total(), 50000);
+
+    KeyStats<uint64_t> other(12, 4);
+    other.inserted(100000);
+    stats.merge(other);
+    ASSERT_EQ(stats.writes().counts().total(), 50001);
+  }
+}
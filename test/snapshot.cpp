@@ -0,0 +1,159 @@
+#include "storage/snapshot.hpp"
+
+#include "algo/crc32.hpp"
+#include "algo/crc64.hpp"
+#include "common.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <gtest/gtest.h>
+
+namespace storage::snapshot {
+  using namespace algo::hash;
+  using structure::hashtable::HashTable;
+
+  TEST(snapshot, strings)
+  {
+    const test::TempPath path("snapshot_strings");
+    HashTable<std::string, std::string, crc64> table;
+    for (int i = 0; i < 1000; i++)
+      table["key" + std::to_string(i)] = std::string(i % 50, 'a' + i % 26);
+    table[""] = "empty";
+    save(table, path);
+    ASSERT_FALSE(std::filesystem::exists(path.str() + ".tmp"));
+
+    Table<std::string, std::string, crc64> loaded(path);
+    ASSERT_EQ(loaded.size(), 1001);
+    for (int i = 0; i < 1000; i++)
+      ASSERT_EQ(loaded["key" + std::to_string(i)], std::string(i % 50, 'a' + i % 26));
+    ASSERT_EQ(loaded.at(""), "empty");
+    ASSERT_FALSE(loaded.find("key1000"));
+    ASSERT_THROW(loaded.at("missing"), std::out_of_range);
+  }
+
+  TEST(snapshot, values)
+  {
+    struct Point {
+      double x;
+      int32_t y;
+    };
+    const test::TempPath path("snapshot_values");
+    HashTable<uint64_t, Point, crc64> table;
+    for (uint64_t i = 0; i < 5000; i++)
+      table[i * 3] = {i / 2.0, int32_t(i)};
+    save(table, path);
+
+    Table<uint64_t, Point, crc64> loaded(path);
+    ASSERT_EQ(loaded.size(), 5000);
+    for (uint64_t i = 0; i < 5000; i++) {
+      const Point& point = loaded[i * 3];
+      ASSERT_EQ(point.x, i / 2.0);
+      ASSERT_EQ(point.y, int32_t(i));
+      ASSERT_EQ(reinterpret_cast<uintptr_t>(&point) % alignof(Point), 0);
+      ASSERT_FALSE(loaded.find(i * 3 + 1));
+    }
+  }
+
+  TEST(snapshot, empty)
+  {
+    const test::TempPath path("snapshot_empty");
+    HashTable<std::string, uint64_t, crc64> table;
+    save(table, path);
+    Table<std::string, uint64_t, crc64> loaded(path);
+    ASSERT_EQ(loaded.size(), 0);
+    ASSERT_FALSE(loaded.find("a"));
+  }
+
+  TEST(snapshot, corrupted_block)
+  {
+    const test::TempPath path("snapshot_corrupted");
+    HashTable<std::string, std::string, crc64> table;
+    for (int i = 0; i < 10000; i++)
+      table["key" + std::to_string(i)] = std::string(100, 'v');
+    table["victim"] = std::string(100, 'v');
+    save(table, path);
+
+    {
+      std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+      std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+      const auto offset = content.find("victim");
+      ASSERT_NE(offset, std::string::npos);
+      file.seekp(offset + 16);
+      file.put('x');
+    }
+
+    // Only lookups touching the damaged block fail
+    Table<std::string, std::string, crc64> loaded(path);
+    ASSERT_THROW(loaded.find("victim"), std::runtime_error);
+    ASSERT_THROW(loaded.find("victim"), std::runtime_error);
+    size_t failed = 0;
+    for (int i = 0; i < 10000; i++) {
+      try {
+        ASSERT_EQ(loaded["key" + std::to_string(i)], std::string(100, 'v'));
+      } catch (const std::runtime_error&) {
+        failed++;
+      }
+    }
+    ASSERT_GT(failed, 0);
+    ASSERT_LT(failed, 1000);
+  }
+
+  TEST(snapshot, format_checks)
+  {
+    const test::TempPath path("snapshot_checks");
+    HashTable<std::string, std::string, crc64> table;
+    table["a"] = "b";
+    save(table, path);
+
+    ASSERT_THROW((Table<std::string, std::string, crc32>(path)), std::runtime_error);
+    ASSERT_NO_THROW((Table<std::string, std::string, crc64>(path)));
+
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+    ASSERT_THROW((Table<std::string, std::string, crc64>(path)), std::runtime_error);
+
+    {
+      std::ofstream file(path, std::ios::trunc);
+      file << std::string(200, 'x');
+    }
+    ASSERT_THROW((Table<std::string, std::string, crc64>(path)), std::runtime_error);
+    // Zeroed header has no block size to divide by
+    {
+      std::ofstream file(path, std::ios::trunc | std::ios::binary);
+      file << std::string(4096, '\0');
+    }
+    ASSERT_THROW((Table<std::string, std::string, crc64>(path)), std::runtime_error);
+    ASSERT_THROW((Table<std::string, std::string, crc64>(path.str() + ".missing")), std::system_error);
+  }
+
+  TEST(snapshot, frozen)
+  {
+    const test::TempPath path("snapshot_frozen");
+    HashTable<std::string, std::string, crc64> table;
+    for (int i = 0; i < 5000; i++)
+      table["key" + std::to_string(i)] = std::string(i % 40, 'a' + i % 26);
+    save(structure::frozen::freeze(table), path);
+
+    Frozen<std::string, std::string, crc64> loaded(path);
+    ASSERT_EQ(loaded.size(), 5000);
+    for (int i = 0; i < 5000; i++)
+      ASSERT_EQ(loaded["key" + std::to_string(i)], std::string(i % 40, 'a' + i % 26));
+    ASSERT_FALSE(loaded.find("key5000"));
+    ASSERT_THROW(loaded.at("missing"), std::out_of_range);
+    ASSERT_THROW((Table<std::string, std::string, crc64>(path)), std::runtime_error);
+
+    structure::frozen::Builder<uint64_t, double, crc64> builder;
+    for (uint64_t i = 0; i < 1000; i++)
+      builder.add(i, i / 4.0);
+    save(builder.build(), path);
+    Frozen<uint64_t, double, crc64> values(path);
+    for (uint64_t i = 0; i < 1000; i++)
+      ASSERT_EQ(values[i], i / 4.0);
+    ASSERT_FALSE(values.find(1000));
+
+    save(structure::frozen::Table<uint64_t, double, crc64>{}, path);
+    Frozen<uint64_t, double, crc64> empty(path);
+    ASSERT_EQ(empty.size(), 0);
+    ASSERT_FALSE(empty.find(1));
+  }
+}
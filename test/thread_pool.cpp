@@ -0,0 +1,76 @@
+#include "tools/thread_pool.hpp"
+
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+
+namespace tools {
+  TEST(thread_pool, run)
+  {
+    ThreadPool pool{4};
+    ASSERT_EQ(pool.size(), 4);
+    ASSERT_EQ(pool.worker(), pool.size());
+
+    std::atomic<int> done{0};
+    TaskGroup group;
+    for (int i = 0; i < 1000; i++)
+      pool.run(group, [&done] { done++; });
+    pool.wait(group);
+    ASSERT_EQ(done, 1000);
+  }
+
+  TEST(thread_pool, nested)
+  {
+    ThreadPool pool{3};
+    std::atomic<int> leaves{0};
+    TaskGroup group;
+    std::function<void(int)> spawn = [&](int depth) {
+      ASSERT_LT(pool.worker(), pool.size() + 1);
+      if (!depth) {
+        leaves++;
+        return;
+      }
+      for (int i = 0; i < 4; i++)
+        pool.run(group, [&spawn, depth] { spawn(depth - 1); });
+    };
+    pool.run(group, [&spawn] { spawn(5); });
+    pool.wait(group);
+    ASSERT_EQ(leaves, 1024);
+  }
+
+  TEST(thread_pool, exception)
+  {
+    ThreadPool pool{2};
+    TaskGroup group;
+    pool.run(group, [] { throw std::runtime_error("task failed"); });
+    pool.run(group, [] {});
+    EXPECT_THROW(pool.wait(group), std::runtime_error);
+  }
+
+  TEST(thread_pool, outside_waiters)
+  {
+    ThreadPool pool{2};
+    std::vector<std::atomic<int> > running(pool.size() + 1);
+    std::atomic<bool> shared{false};
+    const auto waiter = [&] {
+      for (int round = 0; round < 50; round++) {
+        TaskGroup group;
+        for (int i = 0; i < 20; i++)
+          pool.run(group, [&] {
+            // No two tasks may run as the same worker
+            if (running[pool.worker()]++)
+              shared = true;
+            std::this_thread::yield();
+            running[pool.worker()]--;
+          });
+        pool.wait(group);
+      }
+    };
+    std::thread first(waiter), second(waiter);
+    first.join();
+    second.join();
+    ASSERT_FALSE(shared);
+  }
+}
@@ -0,0 +1,222 @@
+#include "storage/wal.hpp"
+#include "storage/logged_table.hpp"
+
+#include "algo/crc64.hpp"
+#include "common.hpp"
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+
+namespace storage::wal {
+  using namespace algo::hash;
+
+  static std::vector<std::string> read_all(const std::string& path)
+  {
+    std::vector<std::string> records;
+    Log::replay(path, [&records](Record type, std::string_view payload) {
+      records.push_back(std::to_string(int(type)) + std::string(payload));
+    });
+    return records;
+  }
+
+  TEST(wal, replay)
+  {
+    const test::TempPath path("wal_replay");
+    for (auto sync : {Sync::Group, Sync::Periodic, Sync::Never}) {
+      std::filesystem::remove(path);
+      {
+        Log log{path, {sync, std::chrono::milliseconds(1)}};
+        ASSERT_EQ(log.append(Record::Set, "a"), 1);
+        ASSERT_EQ(log.append(Record::Erase, "b"), 2);
+        log.append(Record::Set, std::string(100000, 'c'));
+      }
+      const auto records = read_all(path);
+      ASSERT_EQ(records.size(), 3);
+      ASSERT_EQ(records[0], "1a");
+      ASSERT_EQ(records[1], "2b");
+      ASSERT_EQ(records[2].size(), 100001);
+    }
+  }
+
+  TEST(wal, torn)
+  {
+    const test::TempPath path("wal_torn");
+    {
+      Log log{path};
+      log.append(Record::Set, "first");
+      log.append(Record::Set, "second");
+    }
+    const auto size = std::filesystem::file_size(path);
+    std::filesystem::resize_file(path, size - 3);
+    {
+      std::ofstream garbage(path, std::ios::app | std::ios::binary);
+      garbage << "garbage";
+    }
+
+    auto records = read_all(path);
+    ASSERT_EQ(records.size(), 1);
+    ASSERT_EQ(records[0], "1first");
+    ASSERT_LT(std::filesystem::file_size(path), size);
+
+    {
+      Log log{path};
+      log.append(Record::Erase, "third");
+    }
+    records = read_all(path);
+    ASSERT_EQ(records.size(), 2);
+    ASSERT_EQ(records[1], "2third");
+
+    {
+      Log log{path};
+      log.reset();
+      log.append(Record::Set, "fourth");
+    }
+    records = read_all(path);
+    ASSERT_EQ(records.size(), 1);
+    ASSERT_EQ(records[0], "1fourth");
+  }
+
+  TEST(wal, group_commit)
+  {
+    const test::TempPath path("wal_group");
+    {
+      Log log{path};
+      std::vector<std::thread> threads;
+      for (int t = 0; t < 4; t++)
+        threads.emplace_back([&log, t] {
+          for (int i = 0; i < 200; i++)
+            log.append(Record::Set, std::to_string(t));
+        });
+      for (auto& thread : threads)
+        thread.join();
+      log.flush();
+    }
+    ASSERT_EQ(read_all(path).size(), 800);
+  }
+
+  TEST(wal, when_synced)
+  {
+    const test::TempPath path("wal_when_synced");
+    std::atomic<int> called = 0;
+    std::atomic<int> failed = 0;
+    const auto count = [&called, &failed](int error) {
+      called++;
+      if (error)
+        failed++;
+    };
+    {
+      Log log{path};
+      for (int i = 0; i < 100; i++)
+        log.when_synced(log.submit(Record::Set, std::to_string(i)), count);
+      log.flush();
+      // Callbacks run on the writer thread right after the sync
+      for (int i = 0; i < 1000 && called < 100; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      ASSERT_EQ(called, 100);
+      // Already synced records complete at once
+      log.when_synced(1, count);
+      ASSERT_EQ(called, 101);
+    }
+    {
+      Log log{path, {Sync::Never}};
+      log.when_synced(log.submit(Record::Set, "a"), count);
+      ASSERT_EQ(called, 102);
+    }
+    ASSERT_EQ(failed, 0);
+  }
+
+  TEST(wal, logged_table)
+  {
+    const test::TempPath path("wal_table");
+    {
+      LoggedTable<std::string, int, crc64> table{path};
+      table["one"] = 1;
+      table["two"] = 2;
+      table.set("three", 3);
+      table.erase("two");
+      table.erase("missing");
+      ASSERT_EQ(table.at("one"), 1);
+      ASSERT_EQ(int(table["three"]), 3);
+    }
+    {
+      LoggedTable<std::string, int, crc64> table{path, {Sync::Periodic}};
+      ASSERT_EQ(table.at("one"), 1);
+      ASSERT_EQ(table.at("three"), 3);
+      EXPECT_THROW(table.at("two"), std::out_of_range);
+      table["one"] = 11;
+    }
+    {
+      LoggedTable<std::string, int, crc64> table{path, {Sync::Never}};
+      ASSERT_EQ(table.at("one"), 11);
+    }
+  }
+
+  TEST(wal, logged_batch)
+  {
+    const test::TempPath path("wal_batch");
+    {
+      LoggedTable<std::string, int, crc64> table{path};
+      table["one"] = 1;
+      structure::WriteBatch<std::string, int> batch;
+      batch.put("two", 2);
+      batch.erase("one");
+      batch.put("three", 3);
+      table.apply(std::move(batch));
+      ASSERT_EQ(table.at("two"), 2);
+      EXPECT_THROW(table.at("one"), std::out_of_range);
+    }
+    ASSERT_EQ(read_all(path).size(), 2);
+    {
+      LoggedTable<std::string, int, crc64> table{path};
+      ASSERT_EQ(table.at("two"), 2);
+      ASSERT_EQ(table.at("three"), 3);
+      EXPECT_THROW(table.at("one"), std::out_of_range);
+
+      structure::WriteBatch<std::string, int> batch;
+      batch.put("four", 4);
+      batch.put("five", 5);
+      table.apply(std::move(batch));
+    }
+
+    // Torn batch record is dropped as a whole
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 2);
+    {
+      LoggedTable<std::string, int, crc64> table{path};
+      ASSERT_EQ(table.at("three"), 3);
+      EXPECT_THROW(table.at("four"), std::out_of_range);
+      EXPECT_THROW(table.at("five"), std::out_of_range);
+    }
+  }
+
+  TEST(wal, logged_concurrent)
+  {
+    const test::TempPath path("wal_concurrent");
+    {
+      // Writers wait for their syncs outside the table lock and share them
+      LoggedTable<std::string, int, crc64> table{path};
+      std::vector<std::thread> writers;
+      for (int t = 0; t < 8; t++)
+        writers.emplace_back([&table, t] {
+          for (int i = 0; i < 50; i++) {
+            table.set(std::to_string(t) + ":" + std::to_string(i), i);
+            if (i % 5 == 0)
+              table.erase(std::to_string(t) + ":" + std::to_string(i));
+            table.get("0:1");
+          }
+        });
+      for (auto& writer : writers)
+        writer.join();
+      ASSERT_EQ(table.get("7:49"), 49);
+      ASSERT_EQ(table.get("7:45"), std::nullopt);
+    }
+    LoggedTable<std::string, int, crc64> table{path};
+    for (int t = 0; t < 8; t++)
+      for (int i = 0; i < 50; i++)
+        ASSERT_EQ(table.get(std::to_string(t) + ":" + std::to_string(i)),
+                  i % 5 ? std::optional<int>(i) : std::nullopt);
+  }
+}